@@ -11,7 +11,9 @@
 #include <gromox/util.hpp>
 #include "attachment_object.hpp"
 #include "common_util.hpp"
+#include "exmdb_client.hpp"
 #include "folder_object.hpp"
+#include "logon_object.hpp"
 #include "message_object.hpp"
 #include "rop_processor.hpp"
 #include "stream_object.hpp"
@@ -36,6 +38,11 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 	pstream->open_flags = open_flags;
 	pstream->proptag = proptag;
 	pstream->max_length = max_length;
+	if (open_flags == MAPI_READONLY && pstream->init_ranged()) {
+		if (pstream->content_bin.cb >= g_max_mail_len)
+			return NULL;
+		return pstream;
+	}
 	switch (object_type) {
 	case ems_objtype::message: {
 		proptags.count = 2;
@@ -128,12 +135,99 @@ std::unique_ptr<stream_object> stream_object::create(void *pparent,
 	}
 }
 
+bool stream_object::ranged_source(const char **dir, uint32_t *instance_id) const
+{
+	if (object_type == ems_objtype::attach) {
+		auto at = static_cast<const attachment_object *>(pparent);
+		*dir = at->pparent->plogon->get_dir();
+		*instance_id = at->get_instance_id();
+		return true;
+	} else if (object_type == ems_objtype::message) {
+		auto msg = static_cast<const message_object *>(pparent);
+		*dir = msg->plogon->get_dir();
+		*instance_id = msg->get_instance_id();
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Large binary properties (attachment data, PR_HTML, PR_RTF_COMPRESSED)
+ * opened read-only are served piecewise by exmdb, so that a
+ * RopReadStream loop does not need the whole value in memory.
+ */
+bool stream_object::init_ranged()
+{
+	if (PROP_TYPE(proptag) != PT_BINARY && PROP_TYPE(proptag) != PT_OBJECT)
+		return false;
+	const char *dir = nullptr;
+	uint32_t instance_id = 0;
+	if (!ranged_source(&dir, &instance_id))
+		return false;
+	/* Uncommitted data from another stream on the same property wins */
+	auto &list = object_type == ems_objtype::attach ?
+	             static_cast<const attachment_object *>(pparent)->stream_list :
+	             static_cast<const message_object *>(pparent)->stream_list;
+	if (std::any_of(list.cbegin(), list.cend(),
+	    [&](const stream_object *so) { return so->proptag == proptag; }))
+		return false;
+	BINARY bin{};
+	uint32_t total = 0;
+	if (!exmdb_client::read_instance_range(dir, instance_id, proptag,
+	    0, 0, &bin, &total) || total == 0)
+		return false;
+	b_ranged = true;
+	content_bin.cb = total;
+	return true;
+}
+
+/**
+ * Refill the read-ahead window of a ranged stream from the seek position.
+ * Clients read in small pieces (RopReadStream is limited by the ROP buffer),
+ * so at least one content-file frame's worth is fetched per exmdb call.
+ */
+bool stream_object::fetch_ranged(uint32_t want) try
+{
+	static constexpr uint32_t STREAM_READAHEAD = 256 * 1024;
+	const char *dir = nullptr;
+	uint32_t instance_id = 0, total = 0;
+	BINARY bin{};
+	want = std::min(std::max(want, STREAM_READAHEAD), content_bin.cb - seek_ptr);
+	if (!ranged_source(&dir, &instance_id) ||
+	    !exmdb_client::read_instance_range(dir, instance_id, proptag,
+	    seek_ptr, want, &bin, &total) || bin.cb == 0)
+		return false;
+	ra_buf.assign(bin.pb, bin.pb + std::min(bin.cb, want));
+	ra_off = seek_ptr;
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1371: ENOMEM");
+	return false;
+}
+
 uint32_t stream_object::read(void *pbuff, uint32_t buf_len)
 {
 	auto pstream = this;
 	if (pstream->content_bin.cb <= pstream->seek_ptr)
 		return 0;
 	auto length = std::min(buf_len, pstream->content_bin.cb - pstream->seek_ptr);
+	if (pstream->b_ranged) {
+		auto out = static_cast<uint8_t *>(pbuff);
+		uint32_t done = 0;
+		while (done < length) {
+			if (seek_ptr < ra_off || seek_ptr - ra_off >= ra_buf.size()) {
+				ra_buf.clear();
+				if (!fetch_ranged(length - done))
+					break;
+			}
+			auto part = std::min(length - done,
+			            static_cast<uint32_t>(ra_buf.size() - (seek_ptr - ra_off)));
+			memcpy(&out[done], &ra_buf[seek_ptr - ra_off], part);
+			done += part;
+			seek_ptr += part;
+		}
+		return done;
+	}
 	memcpy(pbuff, pstream->content_bin.pb + pstream->seek_ptr, length);
 	pstream->seek_ptr += length;
 	return length;
@@ -261,6 +355,14 @@ BOOL stream_object::copy(stream_object *pstream_src, uint32_t *plength)
 	if (pstream_dst->seek_ptr + *plength > pstream_dst->content_bin.cb &&
 	    !pstream_dst->set_length(pstream_dst->seek_ptr + *plength))
 		return FALSE;
+	if (pstream_dst->b_ranged)
+		return FALSE;
+	if (pstream_src->b_ranged) {
+		*plength = pstream_src->read(pstream_dst->content_bin.pb +
+		           pstream_dst->seek_ptr, *plength);
+		pstream_dst->seek_ptr += *plength;
+		return TRUE;
+	}
 	memcpy(pstream_dst->content_bin.pb +
 		pstream_dst->seek_ptr,
 		pstream_src->content_bin.pb +
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <memory>
 #include <utility>
+#include <vector>
 #include <gromox/mapi_types.hpp>
 #include "rop_processor.hpp"
 #define MAX_LENGTH_FOR_FOLDER						64*1024
@@ -14,7 +15,7 @@ struct stream_object {
 	public:
 	~stream_object();
 	static std::unique_ptr<stream_object> create(void *parent, ems_objtype, uint32_t open_flags, uint32_t proptag, uint32_t max_length);
-	BOOL check() const { return content_bin.pb != nullptr ? TRUE : false; }
+	BOOL check() const { return content_bin.pb != nullptr || b_ranged ? TRUE : false; }
 	uint32_t get_max_length() const { return max_length; }
 	uint32_t read(void *buf, uint32_t len);
 	std::pair<uint16_t, ec_error_t> write(void *buf, uint16_t len);
@@ -29,11 +30,25 @@ struct stream_object {
 	BOOL copy(stream_object *src, uint32_t *len);
 	BOOL commit();
 
+	private:
+	bool ranged_source(const char **dir, uint32_t *instance_id) const;
+	bool init_ranged();
+	bool fetch_ranged(uint32_t want);
+
+	public:
 	void *pparent = nullptr;
 	ems_objtype object_type = ems_objtype::none;
 	uint8_t open_flags = 0;
 	uint32_t proptag = 0, seek_ptr = 0;
 	BINARY content_bin{};
 	BOOL b_touched = false;
+	/*
+	 * Read-only binary stream whose data is fetched from exmdb on demand;
+	 * content_bin.pb stays nullptr and content_bin.cb holds the length.
+	 */
+	bool b_ranged = false;
 	uint32_t max_length = 0;
+	/* b_ranged: data fetched ahead, starting at offset @ra_off */
+	std::vector<uint8_t> ra_buf;
+	uint32_t ra_off = 0;
 };
@@ -1024,13 +1024,22 @@ void EWSContext::impersonate(const char* addrtype, const char* addr)
 sAttachment EWSContext::loadAttachment(const std::string& dir, const sAttachmentId& aid) const
 {
 	auto aInst = m_plugin.loadAttachmentInstance(dir, aid.folderId(), aid.messageId(), aid.attachment_num);
-	static uint32_t tagIDs[] = {PR_ATTACH_METHOD, PR_DISPLAY_NAME, PR_ATTACH_MIME_TAG, PR_ATTACH_DATA_BIN,
-	                            PR_ATTACH_CONTENT_ID, PR_ATTACH_LONG_FILENAME, PR_ATTACHMENT_FLAGS};
+	// PR_ATTACH_DATA_BIN must stay last so it can be left out when read piecewise
+	static uint32_t tagIDs[] = {PR_ATTACH_METHOD, PR_DISPLAY_NAME, PR_ATTACH_MIME_TAG, PR_ATTACH_CONTENT_ID,
+	                            PR_ATTACH_LONG_FILENAME, PR_ATTACHMENT_FLAGS, PR_ATTACH_DATA_BIN};
+	std::string data;
+	bool ranged = readInstanceRange(dir, aInst->instanceId, PR_ATTACH_DATA_BIN, 0, 0, data);
 	TPROPVAL_ARRAY props;
-	PROPTAG_ARRAY tags{std::size(tagIDs), tagIDs};
+	PROPTAG_ARRAY tags{std::size(tagIDs) - (ranged ? 1 : 0), tagIDs};
 	if(!m_plugin.exmdb.get_instance_properties(dir.c_str(), 0, aInst->instanceId, &tags, &props))
 		throw DispatchError(E3083);
-	return tAttachment::create(aid, props);
+	sAttachment attachment = tAttachment::create(aid, props);
+	if(ranged)
+		if(auto file = std::get_if<tFileAttachment>(&attachment)) {
+			file->Content.emplace(std::move(data));
+			file->Size = file->Content->size();
+		}
+	return attachment;
 }
 
 /**
@@ -1553,6 +1562,49 @@ uint32_t EWSContext::permissions(const std::string& maildir, uint64_t folderId)
 	return permissions;
 }
 
+/**
+ * @brief     Read a range of a binary instance property
+ *
+ * The range is fetched in pieces, so exmdb only ever inflates and transfers
+ * the content-file frames covering one piece at a time.
+ *
+ * @param     dir         Store directory
+ * @param     instanceId  Instance to read from
+ * @param     tag         Property tag
+ * @param     offset      Offset of the first byte to read
+ * @param     length      Number of bytes to read, 0 to read up to the end
+ * @param     data        Buffer to receive the data
+ *
+ * @return    true if successful, false if the property must be read regularly
+ */
+bool EWSContext::readInstanceRange(const std::string& dir, uint32_t instanceId, uint32_t tag, uint32_t offset,
+                                   uint32_t length, std::string& data) const
+{
+	static constexpr uint32_t chunkSize = 1 << 20;
+	uint32_t total = 0, end = 0, pos = offset;
+	data.clear();
+	do {
+		uint32_t want = end == 0 ? (length == 0 ? chunkSize : std::min(length, chunkSize)) :
+		                std::min(end - pos, chunkSize);
+		BINARY chunk{};
+		if(!m_plugin.exmdb.read_instance_range(dir.c_str(), instanceId, tag, pos, want, &chunk, &total) ||
+		   total == 0)
+			return false;
+		if(end == 0) {
+			if(offset >= total)
+				return true;
+			end = length == 0 || length > total - offset ? total : offset + length;
+			data.resize(end - offset);
+		}
+		if(chunk.cb == 0)
+			return false;
+		uint32_t got = std::min(chunk.cb, end - pos);
+		memcpy(&data[pos - offset], chunk.pb, got);
+		pos += got;
+	} while(pos < end);
+	return true;
+}
+
 /**
  * @brief     Get folder specification from distinguished folder ID
  *
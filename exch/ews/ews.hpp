@@ -281,6 +281,7 @@ public:
 	void normalize(Structures::tMailbox&) const;
 	int notify();
 	uint32_t permissions(const std::string&, uint64_t) const;
+	bool readInstanceRange(const std::string&, uint32_t, uint32_t, uint32_t, uint32_t, std::string&) const;
 	Structures::sFolderSpec resolveFolder(const Structures::tDistinguishedFolderId&) const;
 	Structures::sFolderSpec resolveFolder(const Structures::tFolderId&) const;
 	Structures::sFolderSpec resolveFolder(const Structures::sFolderId&) const;
@@ -20,6 +20,7 @@ static void buildenv(const remote_svr &s)
 
 int exmdb_client_run_front(const char *dir)
 {
+	exmdb_client_local_multi_call = exmdb_client_local::multi_call;
 	return exmdb_client_run(dir, EXMDB_CLIENT_ALLOW_DIRECT | EXMDB_CLIENT_ASYNC_CONNECT,
 	       buildenv, exmdb_server::free_env, exmdb_server::event_proc);
 }
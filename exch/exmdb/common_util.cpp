@@ -9,18 +9,23 @@
 #include <cassert>
 #include <cerrno>
 #include <climits>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <cwctype>
+#include <list>
+#include <mutex>
 #include <fcntl.h>
 #include <iconv.h>
 #include <memory>
 #include <new>
 #include <pthread.h>
+#include <shared_mutex>
 #include <string>
 #include <string_view>
 #include <unistd.h>
+#include <unordered_map>
 #ifdef HAVE_XXHASH
 	/* xxh3 must come first in 0.7.0, or everything breaks apart */
 #	include <xxh3.h>
@@ -71,11 +76,42 @@ class fhash {
 	std::string cid;
 };
 
+/*
+ * Decompressed content files, shared by all stores. Entries are immutable
+ * and handed out by reference count, so eviction never pulls data out from
+ * under a reader.
+ */
+struct cid_cache {
+	using blob = std::shared_ptr<const std::string>;
+	struct entry {
+		blob data;
+		std::list<std::string>::iterator lru;
+	};
+
+	blob find(const std::string &key);
+	void insert(std::string &&key, blob &&);
+	void shrink(size_t budget);
+
+	std::mutex lock;
+	std::list<std::string> lru; /* front: most recently used */
+	std::unordered_map<std::string, entry> map;
+	size_t used = 0;
+	std::atomic<uint64_t> hits{}, misses{}, saved{};
+};
+
 }
 
 static unsigned int g_max_msg, g_cid_use_xxhash = 1;
+static cid_cache g_cid_cache;
 static thread_local prepared_statements *g_opt_key;
 static std::atomic<unsigned int> g_sequence_id;
+/* write handle -> its store's reservation; also the hooks' argument */
+struct id_handle {
+	sqlite3 *db;
+	id_reserve *r;
+};
+static std::unordered_map<sqlite3 *, id_handle> g_id_reserves;
+static std::shared_mutex g_id_reserves_lock;
 
 namespace exmdb {
 
@@ -84,6 +120,7 @@ thread_local unsigned int g_inside_flush_instance;
 thread_local sqlite3 *g_sqlite_for_oxcmail;
 unsigned int g_max_rule_num, g_max_extrule_num;
 unsigned int g_cid_compression = 0; /* disabled(0), specific_level(n) */
+size_t g_cid_cache_size;
 
 #define E(s) decltype(common_util_ ## s) common_util_ ## s;
 E(get_username_from_id)
@@ -261,50 +298,174 @@ STRING_ARRAY *common_util_convert_copy_string_array(BOOL to_utf8,
 	return parray1;
 }
 
+static BOOL cu_eid_newrange(sqlite3 *psqlite, uint64_t &cur_eid, uint64_t &max_eid)
+{
+	auto pstmt = gx_sql_prep(psqlite, "SELECT MAX(range_end) FROM allocated_eids");
+	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+		return FALSE;
+	cur_eid = pstmt.col_uint64(0); /* e.g. 0x1ffff */
+	pstmt.finalize();
+	max_eid = cur_eid + ALLOCATED_EID_RANGE; /* becomes 0x2ffff */
+	cur_eid++; /* becomes 0x20000 */
+	char sql_string[128];
+	snprintf(sql_string, std::size(sql_string), "INSERT INTO allocated_eids"
+		" VALUES (%llu, %llu, %lld, 1)",
+	        LLU{cur_eid + 1}, LLU{max_eid}, LLD{time(nullptr)});
+	if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
+		return FALSE;
+	snprintf(sql_string, std::size(sql_string), "UPDATE configurations SET"
+		" config_value=%llu WHERE config_id=%u",
+		LLU{max_eid}, CONFIG_ID_MAXIMUM_EID);
+	if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
+		return FALSE;
+	return TRUE;
+}
+
+static bool cu_get_config(sqlite3 *psqlite, unsigned int id, uint64_t &v)
+{
+	char sql_string[80];
+	snprintf(sql_string, std::size(sql_string), "SELECT config_value "
+	         "FROM configurations WHERE config_id=%u", id);
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	if (pstmt == nullptr)
+		return false;
+	v = pstmt.step() == SQLITE_ROW ? pstmt.col_uint64(0) : 0;
+	return true;
+}
+
+static bool cu_set_config(sqlite3 *psqlite, unsigned int id, uint64_t v)
+{
+	char sql_string[80];
+	snprintf(sql_string, std::size(sql_string), "REPLACE INTO "
+	         "configurations VALUES (%u, %llu)", id, LLU{v});
+	return gx_sql_exec(psqlite, sql_string) == SQLITE_OK;
+}
+
+/* Only the transaction of the handle that wrote the mark decides its fate */
+static void cu_id_resolve(const id_handle &h, id_reserve::state_t st)
+{
+	auto db = h.db;
+	if (h.r->pending.compare_exchange_strong(db, nullptr))
+		h.r->state = st;
+}
+
+static int cu_id_commit_hook(void *arg)
+{
+	cu_id_resolve(*static_cast<const id_handle *>(arg), id_reserve::committed);
+	return 0;
+}
+
+static void cu_id_rollback_hook(void *arg)
+{
+	cu_id_resolve(*static_cast<const id_handle *>(arg), id_reserve::rolled_back);
+}
+
+void cu_id_reserve_attach(sqlite3 *db, id_reserve *r) try
+{
+	std::unique_lock hold(g_id_reserves_lock);
+	auto &h = g_id_reserves.insert_or_assign(db, id_handle{db, r}).first->second;
+	hold.unlock();
+	/* map nodes do not move, so &h stays valid until detach */
+	sqlite3_commit_hook(db, cu_id_commit_hook, &h);
+	sqlite3_rollback_hook(db, cu_id_rollback_hook, &h);
+} catch (const std::bad_alloc &) {
+	/* allocations on this handle just take the unreserved path */
+}
+
+void cu_id_reserve_detach(sqlite3 *db)
+{
+	sqlite3_commit_hook(db, nullptr, nullptr);
+	sqlite3_rollback_hook(db, nullptr, nullptr);
+	std::unique_lock hold(g_id_reserves_lock);
+	auto it = g_id_reserves.find(db);
+	if (it == g_id_reserves.end())
+		return;
+	/* a mark left open by this handle dies with it */
+	cu_id_resolve(it->second, id_reserve::rolled_back);
+	g_id_reserves.erase(it);
+}
+
+static id_reserve *cu_id_reserve_get(sqlite3 *db)
+{
+	std::shared_lock hold(g_id_reserves_lock);
+	auto it = g_id_reserves.find(db);
+	return it != g_id_reserves.end() ? it->second.r : nullptr;
+}
+
+/**
+ * Find out what became of the last reservation mark before building on the
+ * ranges. A commit hook only says a COMMIT was attempted (it can still fail
+ * afterwards), so the marks are compared with the table once. Returns false
+ * if reservation is off for the store, or if a transaction on another handle
+ * still has a mark outstanding, in which case the caller should not touch
+ * the ranges.
+ */
+static bool cu_id_settle(sqlite3 *psqlite, id_reserve &r)
+{
+	/*
+	 * A store sticks with the block size it started with; switching
+	 * between reserved and unreserved allocation would have to reread the
+	 * marks each time.
+	 */
+	if (r.step == 0)
+		r.step = std::max(g_exmdb_id_reserve, 1U);
+	if (r.step == 1)
+		return false;
+	switch (r.state) {
+	case id_reserve::idle:
+		return true;
+	case id_reserve::open:
+		return r.pending == psqlite;
+	case id_reserve::rolled_back:
+		r.cn_valid = r.eid_valid = false;
+		break;
+	case id_reserve::committed: {
+		uint64_t v = 0, w = 0;
+		if (r.cn_dirty && (!cu_get_config(psqlite, CONFIG_ID_LAST_CHANGE_NUMBER, v) ||
+		    v != r.cn_end - 1))
+			r.cn_valid = false;
+		if (r.eid_dirty && (!cu_get_config(psqlite, CONFIG_ID_CURRENT_EID, v) ||
+		    !cu_get_config(psqlite, CONFIG_ID_MAXIMUM_EID, w) ||
+		    v != r.eid_end || w != r.eid_max))
+			r.eid_valid = false;
+		break;
+	}
+	}
+	r.cn_dirty = r.eid_dirty = false;
+	r.state = id_reserve::idle;
+	return true;
+}
+
+/* The next statement writes a mark; its transaction decides its fate. */
+static void cu_id_open(sqlite3 *psqlite, id_reserve &r)
+{
+	r.pending = psqlite;
+	r.state = id_reserve::open;
+}
+
+static void cu_id_failed(sqlite3 *psqlite, id_reserve &r)
+{
+	/* Inside a transaction, the rollback hook takes care of it */
+	auto db = psqlite;
+	if (sqlite3_get_autocommit(psqlite) && r.pending.compare_exchange_strong(db, nullptr))
+		r.state = id_reserve::rolled_back;
+}
+
 /**
  * Note the different semantics between CN and EIDs. For CN, we record the
  * last assigned cn, whereas for EIDs, the next usable EID is recorded.
  * This is the reason for ++g_last_cn but cur_eid++.
  */
-BOOL common_util_allocate_eid(sqlite3 *psqlite, uint64_t *peid)
+static BOOL cu_allocate_eid_1(sqlite3 *psqlite, uint64_t *peid)
 {
 	char sql_string[128];
+	uint64_t cur_eid = 0, max_eid = 0;
 	
-	snprintf(sql_string, std::size(sql_string), "SELECT config_value "
-				"FROM configurations WHERE config_id=%u",
-				CONFIG_ID_CURRENT_EID);
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	if (!cu_get_config(psqlite, CONFIG_ID_CURRENT_EID, cur_eid) ||
+	    !cu_get_config(psqlite, CONFIG_ID_MAXIMUM_EID, max_eid))
 		return FALSE;
-	auto cur_eid = pstmt.col_uint64(0);
-	pstmt.finalize();
-	snprintf(sql_string, std::size(sql_string), "SELECT config_value "
-				"FROM configurations WHERE config_id=%u",
-				CONFIG_ID_MAXIMUM_EID);
-	pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	if (cur_eid >= max_eid && !cu_eid_newrange(psqlite, cur_eid, max_eid))
 		return FALSE;
-	auto max_eid = pstmt.col_uint64(0);
-	pstmt.finalize();
-	if (cur_eid >= max_eid) {
-		pstmt = gx_sql_prep(psqlite, "SELECT MAX(range_end) FROM allocated_eids");
-		if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
-			return FALSE;
-		cur_eid = pstmt.col_uint64(0); /* e.g. 0x1ffff */
-		pstmt.finalize();
-		max_eid = cur_eid + ALLOCATED_EID_RANGE; /* becomes 0x2ffff */
-		cur_eid++; /* becomes 0x20000 */
-		snprintf(sql_string, std::size(sql_string), "INSERT INTO allocated_eids"
-			" VALUES (%llu, %llu, %lld, 1)",
-		        LLU{cur_eid + 1}, LLU{max_eid}, LLD{time(nullptr)});
-		if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
-			return FALSE;
-		snprintf(sql_string, std::size(sql_string), "UPDATE configurations SET"
-			" config_value=%llu WHERE config_id=%u",
-			LLU{max_eid}, CONFIG_ID_MAXIMUM_EID);
-		if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
-			return FALSE;
-	}
 	/* hand out e.g. 0x20000, set db to indicate nextid=0x20001 */
 	*peid = cur_eid++;
 	snprintf(sql_string, std::size(sql_string), "UPDATE configurations SET"
@@ -315,6 +476,45 @@ BOOL common_util_allocate_eid(sqlite3 *psqlite, uint64_t *peid)
 	return TRUE;
 }
 
+/**
+ * Hands out EIDs from the range reserved in db_base::ids. The table records
+ * the end of the range as the next usable EID, so after a crash, allocation
+ * resumes behind anything that might have been handed out.
+ */
+BOOL common_util_allocate_eid(sqlite3 *psqlite, uint64_t *peid)
+{
+	auto r = cu_id_reserve_get(psqlite);
+	if (r == nullptr)
+		return cu_allocate_eid_1(psqlite, peid);
+	std::lock_guard hold(r->lock);
+	if (!cu_id_settle(psqlite, *r))
+		return cu_allocate_eid_1(psqlite, peid);
+	if (!r->eid_valid || r->eid_next >= r->eid_end) {
+		uint64_t cur_eid = r->eid_end, max_eid = r->eid_max;
+		if (!r->eid_valid &&
+		    (!cu_get_config(psqlite, CONFIG_ID_CURRENT_EID, cur_eid) ||
+		    !cu_get_config(psqlite, CONFIG_ID_MAXIMUM_EID, max_eid)))
+			return FALSE;
+		r->eid_valid = false;
+		cu_id_open(psqlite, *r);
+		if (cur_eid >= max_eid && !cu_eid_newrange(psqlite, cur_eid, max_eid)) {
+			cu_id_failed(psqlite, *r);
+			return FALSE;
+		}
+		auto end = std::min(cur_eid + r->step, max_eid);
+		if (!cu_set_config(psqlite, CONFIG_ID_CURRENT_EID, end)) {
+			cu_id_failed(psqlite, *r);
+			return FALSE;
+		}
+		r->eid_next  = cur_eid;
+		r->eid_end   = end;
+		r->eid_max   = max_eid;
+		r->eid_valid = r->eid_dirty = true;
+	}
+	*peid = r->eid_next++;
+	return TRUE;
+}
+
 /**
  * See common_util_allocate_eid() for notes!
  */
@@ -355,36 +555,50 @@ BOOL common_util_allocate_eid_from_folder(sqlite3 *psqlite,
 	return TRUE;
 }
 
-/**
- * See common_util_allocate_eid() for notes!
- */
-ec_error_t cu_allocate_cn(sqlite3 *psqlite, uint64_t *pcn)
+static ec_error_t cu_allocate_cn_1(sqlite3 *psqlite, uint64_t *pcn)
 {
-	char sql_string[128];
-	
-	snprintf(sql_string, std::size(sql_string), "SELECT config_value FROM "
-				"configurations WHERE config_id=%u",
-				CONFIG_ID_LAST_CHANGE_NUMBER);
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr)
+	uint64_t last_cn = 0;
+	if (!cu_get_config(psqlite, CONFIG_ID_LAST_CHANGE_NUMBER, last_cn))
 		return ecJetError;
-	uint64_t last_cn = pstmt.step() == SQLITE_ROW ?
-	                   sqlite3_column_int64(pstmt, 0) : 0;
-	pstmt.finalize();
 	last_cn ++;
-	snprintf(sql_string, std::size(sql_string), "REPLACE INTO "
-				"configurations VALUES (%u, ?)",
-				CONFIG_ID_LAST_CHANGE_NUMBER);
-	pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr)
-		return ecJetError;
-	sqlite3_bind_int64(pstmt, 1, last_cn);
-	if (pstmt.step() != SQLITE_DONE)
+	if (!cu_set_config(psqlite, CONFIG_ID_LAST_CHANGE_NUMBER, last_cn))
 		return ecJetError;
 	*pcn = last_cn;
 	return ecSuccess;
 }
 
+/**
+ * See common_util_allocate_eid() for notes! The table records the last CN
+ * of the reserved range.
+ */
+ec_error_t cu_allocate_cn(sqlite3 *psqlite, uint64_t *pcn)
+{
+	auto r = cu_id_reserve_get(psqlite);
+	if (r == nullptr)
+		return cu_allocate_cn_1(psqlite, pcn);
+	std::lock_guard hold(r->lock);
+	if (!cu_id_settle(psqlite, *r))
+		return cu_allocate_cn_1(psqlite, pcn);
+	if (!r->cn_valid || r->cn_next >= r->cn_end) {
+		uint64_t last_cn = r->cn_end - 1;
+		if (!r->cn_valid &&
+		    !cu_get_config(psqlite, CONFIG_ID_LAST_CHANGE_NUMBER, last_cn))
+			return ecJetError;
+		r->cn_valid = false;
+		cu_id_open(psqlite, *r);
+		if (!cu_set_config(psqlite, CONFIG_ID_LAST_CHANGE_NUMBER,
+		    last_cn + r->step)) {
+			cu_id_failed(psqlite, *r);
+			return ecJetError;
+		}
+		r->cn_next  = last_cn + 1;
+		r->cn_end   = last_cn + 1 + r->step;
+		r->cn_valid = r->cn_dirty = true;
+	}
+	*pcn = r->cn_next++;
+	return ecSuccess;
+}
+
 BOOL common_util_allocate_folder_art(sqlite3 *psqlite, uint32_t *part)
 {
 	char sql_string[128];
@@ -795,7 +1009,12 @@ BOOL common_util_check_msgcnt_overflow(sqlite3 *psqlite)
 	return c >= g_max_msg ? TRUE : false;
 }
 
-BOOL cu_check_msgsize_overflow(sqlite3 *psqlite, uint32_t qtag)
+/**
+ * Get the store size and the quota @qtag, both in bytes. Without the quota
+ * being set, @limit is UINT64_MAX.
+ */
+bool cu_get_store_quota(sqlite3 *psqlite, uint32_t qtag, uint64_t *used,
+    uint64_t *limit)
 {
 	const proptag_t proptag_buff[] = {qtag, PR_MESSAGE_SIZE_EXTENDED};
 	const PROPTAG_ARRAY proptags =
@@ -804,17 +1023,25 @@ BOOL cu_check_msgsize_overflow(sqlite3 *psqlite, uint32_t qtag)
 	
 	if (!cu_get_properties(MAPI_STORE, 0, CP_ACP, psqlite,
 	    &proptags, &propvals))
-		return FALSE;
-	/* Another checking point is in midb, CKFL */
+		return false;
 	auto ptotal = propvals.get<uint64_t>(PR_MESSAGE_SIZE_EXTENDED);
 	auto qv_kb = propvals.get<uint32_t>(qtag);
-	if (ptotal == nullptr || qv_kb == nullptr)
-		return false;
-	auto qvbytes = static_cast<uint64_t>(*qv_kb) * 1024;
-	if (*ptotal >= qvbytes)
+	*used = ptotal != nullptr ? *ptotal : 0;
+	*limit = ptotal != nullptr && qv_kb != nullptr ?
+	         static_cast<uint64_t>(*qv_kb) * 1024 : UINT64_MAX;
+	return true;
+}
+
+BOOL cu_check_msgsize_overflow(sqlite3 *psqlite, uint32_t qtag)
+{
+	uint64_t used = 0, qvbytes = 0;
+	/* Another checking point is in midb, CKFL */
+	if (!cu_get_store_quota(psqlite, qtag, &used, &qvbytes))
+		return FALSE;
+	if (used >= qvbytes)
 		mlog(LV_DEBUG, "D-1680: storesize %llu <=> quota(%xh) %llu bytes",
-			LLU{*ptotal}, XUI{qtag}, LLU{qvbytes});
-	return *ptotal >= qvbytes;
+			LLU{used}, XUI{qtag}, LLU{qvbytes});
+	return used >= qvbytes;
 }
 
 static uint32_t cu_get_store_msgcount(sqlite3 *psqlite, unsigned int flags)
@@ -1495,14 +1722,73 @@ std::string cu_cid_path(const char *dir, const char *id, unsigned int type) try
 	return {};
 }
 
+/**
+ * Same as gx_decompress_file on cu_cid_path(@dir, @cid, @type), with
+ * @outbin allocated from the RPC context, but served from the shared
+ * cache when possible.
+ *
+ * Entries are keyed by full path, i.e. per store. Only SHA3-256 CIDs (S-)
+ * are shared between stores: an XXH3 digest (Y-) is not collision-resistant,
+ * and a user could otherwise plant data that is then served for another
+ * store's content with the same CID.
+ */
+errno_t cu_read_cid(const char *dir, const char *cid, unsigned int type,
+    BINARY &outbin) try
+{
+	auto cu_realloc = [](void *, size_t z) { return common_util_alloc(z); };
+	auto path = cu_cid_path(dir, cid, type);
+	if (path.empty())
+		return ENOMEM;
+	if (g_cid_cache_size == 0)
+		return gx_decompress_file(path.c_str(), outbin, common_util_alloc, cu_realloc);
+	auto key = strncmp(cid, "S-", 2) == 0 && type == 0 ? std::string(cid) : path;
+	auto &cc = g_cid_cache;
+	auto data = cc.find(key);
+	if (data != nullptr) {
+		outbin.cb = data->size();
+		outbin.pv = common_util_alloc(data->size() + 1);
+		if (outbin.pv == nullptr)
+			return ENOMEM;
+		memcpy(outbin.pv, data->c_str(), data->size() + 1);
+		++cc.hits;
+		cc.saved += data->size();
+		return 0;
+	}
+	auto err = gx_decompress_file(path.c_str(), outbin, common_util_alloc, cu_realloc);
+	if (err != 0)
+		return err;
+	++cc.misses;
+	/* Do not let a single large object flush everything else */
+	if (outbin.pv != nullptr && outbin.cb <= g_cid_cache_size / 8)
+		cc.insert(std::move(key), std::make_shared<const std::string>(outbin.pc, outbin.cb));
+	return 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1315: ENOMEM");
+	return ENOMEM;
+}
+
+void cu_cid_cache_stats(cid_cache_stats &st)
+{
+	auto &cc = g_cid_cache;
+	{
+		std::lock_guard hold(cc.lock);
+		cc.shrink(g_cid_cache_size);
+		st.items = cc.map.size();
+		st.bytes_used = cc.used;
+	}
+	st.budget = g_cid_cache_size;
+	st.hits = cc.hits;
+	st.misses = cc.misses;
+	st.bytes_saved = cc.saved;
+}
+
 static void *cu_get_object_text_v0(const char *dir, const char *cid, uint32_t, uint32_t, cpid_t);
 
 static void *cu_get_object_text_vx(const char *dir, const char *cid,
     uint32_t proptag, uint32_t db_proptag, cpid_t cpid, unsigned int type)
 {
 	BINARY dxbin{};
-	errno = gx_decompress_file(cu_cid_path(dir, cid, type).c_str(), dxbin,
-	        common_util_alloc, [](void *, size_t z) { return common_util_alloc(z); });
+	errno = cu_read_cid(dir, cid, type, dxbin);
 	if (errno != 0)
 		return nullptr;
 
@@ -1658,6 +1944,59 @@ BOOL cu_get_property(mapi_object_type table_type, uint64_t id,
 	return TRUE;
 }
 
+/* Column order must match the SELECT in hotprop_reader::hotprop_reader. */
+static constexpr uint32_t hotprop_tags[] = {
+	PR_MESSAGE_DELIVERY_TIME, PR_CLIENT_SUBMIT_TIME, PR_CREATION_TIME,
+	PR_LAST_MODIFICATION_TIME, PR_MESSAGE_CLASS, PR_SENT_REPRESENTING_NAME,
+	PR_SENDER_NAME, PR_IMPORTANCE, PR_FLAG_STATUS, PR_SUBJECT,
+};
+
+hotprop_reader::hotprop_reader(sqlite3 *db)
+{
+	auto stm = gx_sql_prep(db, "SELECT 1 FROM sqlite_master "
+	           "WHERE type='table' AND name='message_hotprops'");
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
+		return;
+	stm.finalize();
+	m_stmt = gx_sql_prep(db, "SELECT delivery_time, submit_time,"
+	         " creation_time, lastmod_time, message_class, sent_repr_name,"
+	         " sender_name, importance, flag_status, subject"
+	         " FROM message_hotprops WHERE message_id=?");
+}
+
+int hotprop_reader::get(uint64_t msgid, uint32_t proptag, void **out)
+{
+	if (m_stmt == nullptr)
+		return 0;
+	auto it = std::find(std::begin(hotprop_tags), std::end(hotprop_tags), proptag);
+	if (it == std::end(hotprop_tags))
+		return 0;
+	if (msgid != m_mid) {
+		sqlite3_reset(m_stmt);
+		sqlite3_bind_int64(m_stmt, 1, msgid);
+		m_row = m_stmt.step() == SQLITE_ROW;
+		m_mid = msgid;
+	}
+	int col = it - std::begin(hotprop_tags);
+	if (!m_row || sqlite3_column_type(m_stmt, col) == SQLITE_NULL)
+		/* NULL: not denormalized (e.g. stored in 8-bit form); use EAV */
+		return 0;
+	*out = common_util_column_sqlite_statement(m_stmt, col, PROP_TYPE(proptag));
+	return *out != nullptr ? 1 : -1;
+}
+
+BOOL cu_get_msg_property(hotprop_reader *hot, uint64_t message_id,
+    cpid_t cpid, sqlite3 *psqlite, uint32_t proptag, void **ppvalue)
+{
+	if (hot != nullptr) {
+		auto ret = hot->get(message_id, proptag, ppvalue);
+		if (ret != 0)
+			return ret > 0 ? TRUE : false;
+	}
+	return cu_get_property(MAPI_MESSAGE, message_id, cpid, psqlite,
+	       proptag, ppvalue);
+}
+
 namespace {
 enum GP_RESULT { GP_ADV, GP_UNHANDLED, GP_SKIP, GP_ERR };
 }
@@ -2891,6 +3230,44 @@ void fhash::hexify(const unsigned char *digest, unsigned int bytes)
 	}
 }
 
+/* Accounting size of a cache entry, including key and bookkeeping */
+static size_t cid_cache_cost(const std::string &key, const std::string &data)
+{
+	return key.size() + data.size() + 128;
+}
+
+cid_cache::blob cid_cache::find(const std::string &key)
+{
+	std::lock_guard hold(lock);
+	auto it = map.find(key);
+	if (it == map.end())
+		return nullptr;
+	lru.splice(lru.begin(), lru, it->second.lru);
+	return it->second.data;
+}
+
+void cid_cache::shrink(size_t budget)
+{
+	while (used > budget && !lru.empty()) {
+		auto it = map.find(lru.back());
+		used -= cid_cache_cost(it->first, *it->second.data);
+		map.erase(it);
+		lru.pop_back();
+	}
+}
+
+void cid_cache::insert(std::string &&key, blob &&data)
+{
+	auto cost = cid_cache_cost(key, *data);
+	std::lock_guard hold(lock);
+	if (map.find(key) != map.end())
+		return;
+	shrink(g_cid_cache_size > cost ? g_cid_cache_size - cost : 0);
+	lru.push_front(key);
+	map.emplace(std::move(key), entry{std::move(data), lru.begin()});
+	used += cost;
+}
+
 namespace exmdb {
 
 /**
@@ -2917,12 +3294,18 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 		return -ret;
 	}
 
-	/* See if the object already exists. (Skip compression.) */
+	/*
+	 * See if the object already exists. (Skip compression.) The mtime is
+	 * refreshed so that purge_datafiles does not collect the file while
+	 * the new reference is still on its way into the database.
+	 */
 	wrapfd check_fd = open(path.c_str(), O_RDONLY);
 	struct stat sb;
 	if (check_fd.get() >= 0 && fstat(check_fd.get(), &sb) == 0 &&
-	    sb.st_size > 0)
+	    sb.st_size > 0) {
+		futimens(check_fd.get(), nullptr);
 		return 0;
+	}
 	check_fd.close_rd();
 
 	gromox::tmpfile tmf;
@@ -4395,7 +4778,8 @@ bool cu_eval_folder_restriction(sqlite3 *psqlite,
 }
 
 bool cu_eval_msg_restriction(sqlite3 *psqlite,
-    cpid_t cpid, uint64_t message_id, const RESTRICTION *pres)
+    cpid_t cpid, uint64_t message_id, const RESTRICTION *pres,
+    hotprop_reader *hot)
 {
 	void *pvalue;
 	void *pvalue1;
@@ -4404,24 +4788,24 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	case RES_OR:
 		for (size_t i = 0; i < pres->andor->count; ++i)
 			if (cu_eval_msg_restriction(psqlite,
-			    cpid, message_id, &pres->andor->pres[i]))
+			    cpid, message_id, &pres->andor->pres[i], hot))
 				return TRUE;
 		return FALSE;
 	case RES_AND:
 		for (size_t i = 0; i < pres->andor->count; ++i)
 			if (!cu_eval_msg_restriction(psqlite,
-			    cpid, message_id, &pres->andor->pres[i]))
+			    cpid, message_id, &pres->andor->pres[i], hot))
 				return FALSE;
 		return TRUE;
 	case RES_NOT:
 		return !cu_eval_msg_restriction(psqlite,
-		       cpid, message_id, &pres->xnot->res);
+		       cpid, message_id, &pres->xnot->res, hot);
 	case RES_CONTENT: {
 		auto rcon = pres->cont;
 		if (!rcon->comparable())
 			return FALSE;
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, rcon->proptag, &pvalue))
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, rcon->proptag, &pvalue))
 			return FALSE;
 		return rcon->eval(pvalue);
 	}
@@ -4437,8 +4821,8 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 			pvalue = cu_get_msg_parent_entryid(psqlite, message_id);
 			break;
 		case PR_ANR: {
-			if (!cu_get_property(MAPI_MESSAGE,
-			    message_id, cpid, psqlite, rprop->proptag, &pvalue))
+			if (!cu_get_msg_property(hot, message_id,
+			    cpid, psqlite, rprop->proptag, &pvalue))
 				return FALSE;
 			if (pvalue == nullptr)
 				break;
@@ -4446,8 +4830,8 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 			       static_cast<char *>(rprop->propval.pvalue)) != nullptr;
 		}
 		default:
-			if (!cu_get_property(MAPI_MESSAGE,
-			    message_id, cpid, psqlite, rprop->proptag, &pvalue))
+			if (!cu_get_msg_property(hot, message_id,
+			    cpid, psqlite, rprop->proptag, &pvalue))
 				return FALSE;
 			break;
 		}
@@ -4457,11 +4841,11 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 		auto rprop = pres->pcmp;
 		if (!rprop->comparable())
 			return FALSE;
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, rprop->proptag1, &pvalue))
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, rprop->proptag1, &pvalue))
 			return FALSE;
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, rprop->proptag2, &pvalue1))
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, rprop->proptag2, &pvalue1))
 			return FALSE;
 		return propval_compare_relop_nullok(rprop->relop,
 		       PROP_TYPE(rprop->proptag1), pvalue, pvalue1);
@@ -4470,21 +4854,21 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 		auto rbm = pres->bm;
 		if (!rbm->comparable())
 			return FALSE;
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, rbm->proptag, &pvalue))
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, rbm->proptag, &pvalue))
 			return FALSE;
 		return rbm->eval(pvalue);
 	}
 	case RES_SIZE: {
 		auto rsize = pres->size;
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, rsize->proptag, &pvalue))
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, rsize->proptag, &pvalue))
 			return FALSE;
 		return rsize->eval(pvalue);
 	}
 	case RES_EXIST:
-		if (!cu_get_property(MAPI_MESSAGE,
-		    message_id, cpid, psqlite, pres->exist->proptag, &pvalue) ||
+		if (!cu_get_msg_property(hot, message_id,
+		    cpid, psqlite, pres->exist->proptag, &pvalue) ||
 		    pvalue == nullptr)
 			return FALSE;
 		return TRUE;
@@ -4502,13 +4886,13 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 		if (pres->comment->pres == nullptr)
 			return TRUE;
 		return cu_eval_msg_restriction(psqlite, cpid,
-		       message_id, pres->comment->pres);
+		       message_id, pres->comment->pres, hot);
 	case RES_COUNT: {
 		auto rcnt = pres->count;
 		if (rcnt->count == 0)
 			return FALSE;
 		if (!cu_eval_msg_restriction(psqlite,
-		    cpid, message_id, &rcnt->sub_res))
+		    cpid, message_id, &rcnt->sub_res, hot))
 			return false;
 		--rcnt->count;
 		return TRUE;
@@ -4519,6 +4903,498 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	return FALSE;
 }
 
+namespace {
+struct msgprog_ctx {
+	sqlite3 *db;
+	cpid_t cpid;
+	uint64_t message_id;
+};
+}
+
+/* Property access for res_program, matching cu_eval_msg_restriction */
+static bool cu_msgprog_fetch(void *p, uint32_t proptag, unsigned int flags,
+    void **out)
+{
+	auto &c = *static_cast<const msgprog_ctx *>(p);
+	if (flags & res_program::F_RELOP) {
+		if (proptag == PR_PARENT_SVREID) {
+			*out = cu_get_msg_parent_svreid(c.db, c.message_id);
+			return true;
+		} else if (proptag == PR_PARENT_ENTRYID) {
+			*out = cu_get_msg_parent_entryid(c.db, c.message_id);
+			return true;
+		}
+	}
+	return cu_get_property(MAPI_MESSAGE, c.message_id, c.cpid, c.db,
+	       proptag, out);
+}
+
+bool cu_eval_msg_program(sqlite3 *psqlite, cpid_t cpid, uint64_t message_id,
+    const res_program &prog)
+{
+	msgprog_ctx ctx{psqlite, cpid, message_id};
+	return prog.eval(cu_msgprog_fetch, &ctx);
+}
+
+/*
+ * Restriction → SQL translation. The produced condition refers to the
+ * "messages" table of the surrounding query and evaluates the same way
+ * cu_eval_msg_restriction would for every leaf it accepts.
+ */
+static bool rsql_computed(uint32_t tag)
+{
+	if (PROP_TYPE(tag) == PT_STRING8)
+		tag = CHANGE_PROP_TYPE(tag, PT_UNICODE);
+	switch (tag) {
+	/* synthesized by gp_spectableprop / gp_msgprop_synth */
+	case PR_ENTRYID:
+	case PR_PARENT_ENTRYID:
+	case PidTagFolderId:
+	case PidTagParentFolderId:
+	case PR_INSTANCE_SVREID:
+	case PR_PARENT_DISPLAY:
+	case PidTagChangeNumber:
+	case PR_READ:
+	case PR_HAS_NAMED_PROPERTIES:
+	case PR_HASATTACH:
+	case PidTagMid:
+	case PR_MESSAGE_FLAGS:
+	case PR_SUBJECT:
+	case PR_DISPLAY_TO:
+	case PR_DISPLAY_CC:
+	case PR_DISPLAY_BCC:
+	case PR_BODY:
+	case PR_TRANSPORT_MESSAGE_HEADERS:
+	case PR_HTML:
+	case PR_RTF_COMPRESSED:
+	case PidTagMidString:
+	case PR_STORE_RECORD_KEY:
+	case PR_SENDER_ADDRTYPE:
+	case PR_SENT_REPRESENTING_ADDRTYPE:
+	/* special-cased by cu_eval_msg_restriction */
+	case PR_PARENT_SVREID:
+	case PR_ANR:
+		return true;
+	}
+	return false;
+}
+
+/*
+ * SQL expression yielding the value of @tag as cu_get_msg_property would
+ * see it, or NULL when the property is absent.
+ */
+static bool rsql_value(uint32_t tag, std::string &out)
+{
+	auto type = PROP_TYPE(tag);
+	if (type == PT_UNSPECIFIED || type == PT_OBJECT || rsql_computed(tag))
+		return false;
+	if (tag == PR_MESSAGE_SIZE) {
+		out = "messages.message_size";
+		return true;
+	} else if (tag == PR_ASSOCIATED) {
+		out = "messages.is_associated";
+		return true;
+	}
+	if (type == PT_STRING8 || type == PT_UNICODE)
+		out = fmt::format("(SELECT propval FROM message_properties"
+		      " WHERE message_id=messages.message_id AND proptag IN ({},{}))",
+		      CHANGE_PROP_TYPE(tag, PT_UNICODE), CHANGE_PROP_TYPE(tag, PT_STRING8));
+	else
+		out = fmt::format("(SELECT propval FROM message_properties"
+		      " WHERE message_id=messages.message_id AND proptag={})",
+		      type == PT_MV_STRING8 ? CHANGE_PROP_TYPE(tag, PT_MV_UNICODE) : tag);
+	if (CHANGE_PROP_TYPE(tag, PT_UNICODE) == PR_MESSAGE_CLASS)
+		/* gp_msgprop_synth */
+		out = "IFNULL(" + out + ",'IPM.Note')";
+	return true;
+}
+
+static const char *rsql_relop(enum relop r)
+{
+	switch (r) {
+	case RELOP_LT: return "<";
+	case RELOP_LE: return "<=";
+	case RELOP_GT: return ">";
+	case RELOP_GE: return ">=";
+	case RELOP_EQ: return "=";
+	case RELOP_NE: return "<>";
+	default: return nullptr;
+	}
+}
+
+static std::string rsql_quote(const char *s)
+{
+	std::string q = "'";
+	for (; *s != '\0'; ++s) {
+		if (*s == '\'')
+			q += '\'';
+		q += *s;
+	}
+	return q += '\'';
+}
+
+/*
+ * Stored strings may get transcoded by gp_fetch before the interpreter
+ * looks at them; comparisons are only byte-exact when the operand is plain
+ * ASCII or no transcoding takes place.
+ */
+static bool rsql_str_ok(const char *s, cpid_t cpid)
+{
+	return cpid == CP_UTF8 || str_isascii(s);
+}
+
+static bool rsql_literal(uint16_t type, const void *v, cpid_t cpid,
+    std::string &out)
+{
+	switch (type) {
+	case PT_SHORT:
+		out = std::to_string(*static_cast<const uint16_t *>(v));
+		return true;
+	case PT_LONG:
+		out = std::to_string(*static_cast<const uint32_t *>(v));
+		return true;
+	case PT_BOOLEAN:
+		out = *static_cast<const uint8_t *>(v) ? "1" : "0";
+		return true;
+	case PT_CURRENCY:
+	case PT_I8:
+	case PT_SYSTIME:
+		out = std::to_string(static_cast<int64_t>(*static_cast<const uint64_t *>(v)));
+		return true;
+	case PT_FLOAT:
+	case PT_DOUBLE:
+	case PT_APPTIME: {
+		double d = type == PT_FLOAT ? *static_cast<const float *>(v) :
+		           *static_cast<const double *>(v);
+		if (!std::isfinite(d))
+			return false;
+		out = fmt::format("{:.17g}", d);
+		return true;
+	}
+	case PT_STRING8:
+	case PT_UNICODE: {
+		auto s = static_cast<const char *>(v);
+		if (!rsql_str_ok(s, cpid))
+			return false;
+		out = rsql_quote(s);
+		return true;
+	}
+	case PT_BINARY: {
+		auto b = static_cast<const BINARY *>(v);
+		if (b->cb == 0)
+			return false;
+		out = "X'" + bin2hex(b->pv, b->cb) + "'";
+		return true;
+	}
+	}
+	return false;
+}
+
+static res_sql rsql_property(const RESTRICTION_PROPERTY &r, cpid_t cpid,
+    std::string &out)
+{
+	std::string val, lit;
+	auto op = rsql_relop(r.relop);
+	auto type = PROP_TYPE(r.proptag);
+	if (op == nullptr || !r.comparable() || r.propval.pvalue == nullptr ||
+	    !rsql_value(r.proptag, val) ||
+	    !rsql_literal(type, r.propval.pvalue, cpid, lit))
+		return res_sql::none;
+	/*
+	 * SQLite stores uint64 as int64, which only orders the same way for
+	 * values below 2^63 - a given for timestamps, not for PT_I8.
+	 */
+	if ((type == PT_I8 || type == PT_CURRENCY || type == PT_BINARY) &&
+	    r.relop != RELOP_EQ && r.relop != RELOP_NE)
+		return res_sql::none;
+	if (type == PT_BOOLEAN)
+		val = "(" + val + "<>0)";
+	else if (type == PT_STRING8 || type == PT_UNICODE)
+		lit += " COLLATE NOCASE";
+	/* absent values sort before anything (propval_compare_relop_nullok) */
+	out = fmt::format("IFNULL({}{}{},{})", val, op, lit,
+	      three_way_eval(r.relop, -1) ? 1 : 0);
+	return res_sql::exact;
+}
+
+static res_sql rsql_content_exact(const RESTRICTION_CONTENT &r, cpid_t cpid,
+    std::string &out)
+{
+	std::string val;
+	if (!r.comparable() || r.propval.pvalue == nullptr ||
+	    !rsql_value(r.proptag, val))
+		return res_sql::none;
+	auto level = r.fuzzy_level & 0xFFFF;
+	if (PROP_TYPE(r.proptag) == PT_BINARY) {
+		auto &b = *static_cast<const BINARY *>(r.propval.pvalue);
+		if (b.cb == 0)
+			return res_sql::none;
+		auto hex = "X'" + bin2hex(b.pv, b.cb) + "'";
+		switch (level) {
+		case FL_FULLSTRING: out = val + "=" + hex; break;
+		case FL_SUBSTRING: out = "instr(" + val + "," + hex + ")>0"; break;
+		case FL_PREFIX: out = fmt::format("substr({},1,{})={}", val, b.cb, hex); break;
+		default: return res_sql::none;
+		}
+		out = "IFNULL(" + out + ",0)";
+		return res_sql::exact;
+	}
+	auto s = static_cast<const char *>(r.propval.pvalue);
+	if (!rsql_str_ok(s, cpid))
+		return res_sql::none;
+	bool icase = r.fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+	if (icase && level != FL_FULLSTRING) {
+		/* LIKE folds ASCII only, the same as strcasestr/strncasecmp */
+		std::string pat = level == FL_SUBSTRING ? "%" : "";
+		for (; *s != '\0'; ++s) {
+			if (*s == '%' || *s == '_' || *s == '\\')
+				pat += '\\';
+			pat += *s;
+		}
+		pat += '%';
+		out = val + " LIKE " + rsql_quote(pat.c_str()) + " ESCAPE '\\'";
+	} else if (level == FL_FULLSTRING) {
+		out = val + "=" + rsql_quote(s) + (icase ? " COLLATE NOCASE" : "");
+	} else if (*s == '\0') {
+		/* strstr/strncmp with an empty needle always match */
+		out = val + " IS NOT NULL";
+	} else {
+		auto hex = "X'" + bin2hex(s, strlen(s)) + "'";
+		if (level == FL_SUBSTRING)
+			out = "instr(CAST(" + val + " AS BLOB)," + hex + ")>0";
+		else if (level == FL_PREFIX)
+			out = fmt::format("substr(CAST({} AS BLOB),1,{})={}",
+			      val, strlen(s), hex);
+		else
+			return res_sql::none;
+	}
+	out = "IFNULL(" + out + ",0)";
+	return res_sql::exact;
+}
+
+/*
+ * Candidate filter from the full-text index (fulltext.cpp). Trigram matching
+ * is case-insensitive and ignores the fuzzy level, so this yields a superset
+ * of what the interpreter accepts. Messages without a current index entry
+ * are always let through.
+ */
+static bool rsql_fts(const RESTRICTION_CONTENT &r, cpid_t cpid,
+    bool attachment, std::string &out)
+{
+	auto col = cu_fts_column(r.proptag);
+	auto type = PROP_TYPE(r.proptag);
+	if (col == nullptr || (strcmp(col, "attachments") == 0) != attachment ||
+	    (type != PT_UNICODE && type != PT_STRING8) ||
+	    !r.comparable() || r.propval.pvalue == nullptr)
+		return false;
+	auto s = static_cast<const char *>(r.propval.pvalue);
+	if (!rsql_str_ok(s, cpid))
+		return false;
+	/* The trigram tokenizer cannot look up anything shorter */
+	size_t nchars = 0;
+	for (auto p = s; *p != '\0'; ++p)
+		if ((static_cast<unsigned char>(*p) & 0xC0) != 0x80)
+			++nchars;
+	if (nchars < 3)
+		return false;
+	std::string query = std::string(col) + " : \"";
+	for (; *s != '\0'; ++s) {
+		if (*s == '"')
+			query += '"';
+		query += *s;
+	}
+	query += '"';
+	out = "(messages.message_id IN (SELECT rowid FROM fts.msgtext"
+	      " WHERE msgtext MATCH " + rsql_quote(query.c_str()) + ") OR"
+	      " NOT EXISTS (SELECT 1 FROM fts.msgindexed AS x"
+	      " WHERE x.message_id=messages.message_id"
+	      " AND x.change_number=messages.change_number))";
+	return true;
+}
+
+static res_sql rsql_content(const RESTRICTION_CONTENT &r, cpid_t cpid,
+    bool fts, std::string &out)
+{
+	std::string pre;
+	if (fts && !rsql_fts(r, cpid, false, pre))
+		pre.clear();
+	auto k = rsql_content_exact(r, cpid, out);
+	if (pre.empty())
+		return k;
+	if (k == res_sql::none) {
+		out = std::move(pre);
+		return res_sql::partial;
+	}
+	/* Let the index narrow down the rows before the subquery runs */
+	out = "(" + pre + " AND " + out + ")";
+	return k;
+}
+
+static res_sql rsql_size(const RESTRICTION_SIZE &r, cpid_t cpid,
+    std::string &out)
+{
+	std::string val;
+	unsigned int fixed = 0;
+	auto op = rsql_relop(r.relop);
+	auto type = PROP_TYPE(r.proptag);
+	if (op == nullptr || !rsql_value(r.proptag, val))
+		return res_sql::none;
+	switch (type) {
+	case PT_BOOLEAN: fixed = sizeof(uint8_t); break;
+	case PT_SHORT: fixed = sizeof(uint16_t); break;
+	case PT_LONG: fixed = sizeof(uint32_t); break;
+	case PT_FLOAT: fixed = sizeof(float); break;
+	case PT_DOUBLE:
+	case PT_APPTIME: fixed = sizeof(double); break;
+	case PT_CURRENCY:
+	case PT_I8:
+	case PT_SYSTIME: fixed = sizeof(uint64_t); break;
+	case PT_STRING8:
+	case PT_UNICODE:
+		if (cpid != CP_UTF8)
+			return res_sql::none;
+		break;
+	case PT_BINARY:
+		break;
+	default:
+		return res_sql::none;
+	}
+	/* absent values have size 0 (RESTRICTION_SIZE::eval) */
+	if (fixed != 0)
+		val = fmt::format("({} IS NOT NULL)*{}", val, fixed);
+	else
+		val = "IFNULL(length(CAST(" + val + " AS BLOB)),0)";
+	out = fmt::format("{}{}{}", val, op, r.size);
+	return res_sql::exact;
+}
+
+static bool rsql_has_count(const RESTRICTION *r)
+{
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < r->andor->count; ++i)
+			if (rsql_has_count(&r->andor->pres[i]))
+				return true;
+		return false;
+	case RES_NOT:
+		return rsql_has_count(&r->xnot->res);
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		return r->comment->pres != nullptr && rsql_has_count(r->comment->pres);
+	case RES_COUNT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static res_sql rsql_compile(const RESTRICTION *r, cpid_t cpid, bool fts,
+    std::string &out)
+{
+	switch (r->rt) {
+	case RES_AND:
+	case RES_OR: {
+		bool is_and = r->rt == RES_AND, exact = true;
+		out.clear();
+		for (size_t i = 0; i < r->andor->count; ++i) {
+			std::string sub;
+			auto k = rsql_compile(&r->andor->pres[i], cpid, fts, sub);
+			if (k == res_sql::none && !is_and)
+				return res_sql::none;
+			if (k != res_sql::exact)
+				/* an AND with leaves left out still narrows the set */
+				exact = false;
+			if (k == res_sql::none)
+				continue;
+			if (!out.empty())
+				out += is_and ? " AND " : " OR ";
+			out += sub;
+		}
+		if (r->andor->count == 0) {
+			out = is_and ? "1" : "0";
+			return res_sql::exact;
+		} else if (out.empty()) {
+			return res_sql::none;
+		}
+		out = "(" + out + ")";
+		return exact ? res_sql::exact : res_sql::partial;
+	}
+	case RES_NOT:
+		if (rsql_compile(&r->xnot->res, cpid, fts, out) != res_sql::exact)
+			return res_sql::none;
+		out = "(NOT " + out + ")";
+		return res_sql::exact;
+	case RES_CONTENT:
+		return rsql_content(*r->cont, cpid, fts, out);
+	case RES_PROPERTY:
+		return rsql_property(*r->prop, cpid, out);
+	case RES_BITMASK: {
+		auto &b = *r->bm;
+		std::string val;
+		if (!b.comparable() || !rsql_value(b.proptag, val))
+			return res_sql::none;
+		/* absent values count as 0 (RESTRICTION_BITMASK::eval) */
+		out = fmt::format("(IFNULL({},0)&{}){}0", val, b.mask,
+		      b.bitmask_relop == BMR_EQZ ? "=" : "<>");
+		return res_sql::exact;
+	}
+	case RES_SIZE:
+		return rsql_size(*r->size, cpid, out);
+	case RES_EXIST: {
+		std::string val;
+		if (!rsql_value(r->exist->proptag, val))
+			return res_sql::none;
+		out = val + " IS NOT NULL";
+		return res_sql::exact;
+	}
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (r->comment->pres != nullptr)
+			return rsql_compile(r->comment->pres, cpid, fts, out);
+		[[fallthrough]];
+	case RES_NULL:
+		out = "1";
+		return res_sql::exact;
+	case RES_SUBRESTRICTION:
+		/* attachment file names are in the index as well */
+		if (fts && r->sub->subobject == PR_MESSAGE_ATTACHMENTS &&
+		    r->sub->res.rt == RES_CONTENT &&
+		    rsql_fts(*r->sub->res.cont, cpid, true, out))
+			return res_sql::partial;
+		return res_sql::none;
+	default:
+		return res_sql::none;
+	}
+}
+
+/**
+ * Translate @res into an SQL condition on the "messages" table.
+ *
+ * Returns res_sql::exact if @where alone decides the restriction,
+ * res_sql::partial if @where only narrows the candidate set and
+ * cu_eval_msg_restriction still needs to run on the rows it yields, or
+ * res_sql::none if nothing could be translated. With @db given and its
+ * full-text index attached, content searches may also be narrowed down by
+ * the index.
+ */
+res_sql cu_msg_restriction_to_sql(const RESTRICTION *res, cpid_t cpid,
+    sqlite3 *db, std::string &where) try
+{
+	where.clear();
+	/* RES_COUNT is stateful and must see every message the interpreter sees */
+	if (rsql_has_count(res))
+		return res_sql::none;
+	auto k = rsql_compile(res, cpid, db != nullptr && cu_fts_active(db), where);
+	if (k == res_sql::none)
+		where.clear();
+	return k;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1316: ENOMEM");
+	where.clear();
+	return res_sql::none;
+}
+
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist)
 {
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2021-2024 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <climits>
@@ -12,12 +13,14 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <future>
 #include <list>
 #include <mutex>
 #include <optional>
 #include <pthread.h>
 #include <semaphore>
+#include <shared_mutex>
 #include <string>
 #include <thread>
 #include <unistd.h>
@@ -67,8 +70,18 @@ struct POPULATING_NODE {
 	uint64_t folder_id = 0;
 	cpid_t cpid = CP_ACP;
 	BOOL b_recursive = false;
+	/* continue from search_progress rather than start afresh */
+	bool b_resume = false;
 	RESTRICTION *prestriction = nullptr;
 	LONGLONG_ARRAY folder_ids{};
+	/* The fields below are protected by g_list_lock. */
+	bool b_planned = false;
+	/* scope folders (and resume point) not yet handed to a thread */
+	std::deque<std::pair<uint64_t, uint64_t>> pending;
+	/* number of threads working on this search */
+	unsigned int running = 0;
+	/* superseded by new search criteria */
+	std::atomic<bool> cancelled{false};
 };
 
 struct ROWINFO_NODE {
@@ -89,27 +102,48 @@ struct ROWDEL_NODE {
 	BOOL b_read;
 };
 
+/* Connection held by this thread's db_conn_pin, if any */
+struct conn_pin {
+	std::string dir;
+	db_conn_ptr conn;
+	bool lent = false;
+};
+
 }
 
-static size_t g_table_size; /* hash table size */
+static size_t g_table_size; /* expected number of stores, sizes g_hash_table */
 static unsigned int g_threads_num;
 static gromox::atomic_bool g_notify_stop; /* stop signal for scanning thread */
 static pthread_t g_scan_tid;
 static gromox::time_duration g_cache_interval; /* maximum living interval in table */
 static std::vector<pthread_t> g_thread_ids;
-static std::mutex g_list_lock, g_hash_lock, g_cond_mutex;
+static std::mutex g_list_lock, g_hash_lock;
 static std::condition_variable g_waken_cond;
 static std::unordered_map<std::string, db_base> g_hash_table;
-/* List of queued searchcriteria, and list of searchcriteria evaluated right now */
-static std::list<POPULATING_NODE> g_populating_list, g_populating_list_active;
+/*
+ * Searches being populated. Threads take one scope folder at a time, and the
+ * list is rotated so that all searches make progress.
+ */
+static std::list<POPULATING_NODE> g_populating_list;
 static std::optional<std::counting_semaphore<1>> g_autoupg_limiter;
+static thread_local conn_pin g_pin;
 unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
 unsigned long long g_exmdb_search_pacing_time = 2000000000;
 unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
 unsigned int g_exmdb_pvt_folder_softdel, g_exmdb_max_sqlite_spares;
+unsigned int g_exmdb_sqlite_reader_spares;
+unsigned int g_exmdb_stmt_cache_size, g_exmdb_bulk_pacing = 1000;
+unsigned int g_exmdb_id_reserve = 1024;
+cttbl_counters g_cttbl_counters;
+db_cache_counters g_db_cache_counters;
 unsigned long long g_sqlite_busy_timeout_ns;
+uint64_t g_exmdb_cache_budget;
 
 static bool remove_from_hash(const db_base &, time_point);
+static void dbeng_account(db_base &);
+static void dbeng_erase(decltype(g_hash_table)::iterator);
+static void dbeng_evict(uint64_t target);
+static void db_engine_resume_populating(const char *dir, sqlite3 *);
 static void dbeng_notify_cttbl_modify_row(db_conn *, uint64_t folder_id, uint64_t message_id, db_base &) __attribute__((nonnull(1)));
 
 static void db_engine_load_dynamic_list(db_base *dbase, sqlite3* psqlite) try
@@ -142,6 +176,7 @@ static void db_engine_load_dynamic_list(db_base *dbase, sqlite3* psqlite) try
 		pdynamic->prestriction = tmp_restriction.dup();
 		if (pdynamic->prestriction == nullptr)
 			break;
+		pdynamic->prog.compile(*pdynamic->prestriction);
 		if (!common_util_load_search_scopes(psqlite,
 		    pdynamic->folder_id, &tmp_fids))
 			continue;
@@ -209,29 +244,46 @@ db_conn_ptr db_engine_get_db(const char *path)
 	
 	if (*path == '\0')
 		return std::nullopt;
+	if (g_pin.conn.has_value() && !g_pin.lent &&
+	    strcmp(path, g_pin.dir.c_str()) == 0) {
+		g_pin.lent = true;
+		return db_conn_ptr(std::in_place, *g_pin.conn, db_conn::borrow_tag{});
+	}
+	/*
+	 * Writers still serialize on BEGIN IMMEDIATE and giant_lock; readers
+	 * (which need no more than a shared giant_lock) get a read-only
+	 * connection so that they cannot trip over that.
+	 */
+	bool ro = g_exmdb_sqlite_reader_spares > 0 && !gx_force_write_txn &&
+	          exmdb_server::is_readonly();
 	std::unique_lock hhold(g_hash_lock);
 	auto it = g_hash_table.find(path);
 	if (it != g_hash_table.end()) {
 		pdb = &it->second;
 		db_conn_ptr conn(*pdb);
 		hhold.unlock();
-		if (!conn->open(path))
+		if (!conn->open(path, ro))
 			return std::nullopt;
 		return conn;
 	}
-	if (g_hash_table.size() >= g_table_size) {
-		hhold.unlock();
-		mlog(LV_ERR, "E-1297: Reached the maximum number of concurrently active users/mailboxes (exmdb_provider.cfg:table_size=%zu)", g_table_size);
-		return std::nullopt;
-	}
+	if (g_exmdb_cache_budget != 0 &&
+	    g_db_cache_counters.bytes >= g_exmdb_cache_budget)
+		/* Evict down to 7/8 so that not every admission has to do it */
+		dbeng_evict(g_exmdb_cache_budget - g_exmdb_cache_budget / 8);
 	try {
 		auto xp = g_hash_table.try_emplace(path);
 		pdb = &xp.first->second;
+		++g_db_cache_counters.stores;
 	} catch (const std::bad_alloc &) {
 		hhold.unlock();
 		mlog(LV_ERR, "E-1296: ENOMEM");
 		return std::nullopt;
 	}
+	/*
+	 * Take our reference before open() drops the constructor's, so that
+	 * eviction cannot pull the object away in between.
+	 */
+	db_conn_ptr conn(*pdb);
 
 	/*
 	 * Release central map lock (g_hash_lock) early to unblock map read
@@ -244,10 +296,15 @@ db_conn_ptr db_engine_get_db(const char *path)
 		mlog(LV_ERR, "%s", err.what());
 		return std::nullopt;
 	}
+	{
+		/* Others may already be at it; db_expiry_thread will catch up then. */
+		std::shared_lock dhold(pdb->giant_lock, std::try_to_lock);
+		if (dhold.owns_lock())
+			dbeng_account(*pdb);
+	}
 
 	/* Wait for another thread's costly postconstruct_init (or any EXRPC) to finish. */
-	db_conn_ptr conn(*pdb);
-	if (!conn->open(path)) {
+	if (!conn->open(path, ro)) {
 		return std::nullopt;
 	}
 	return conn;
@@ -278,7 +335,8 @@ BOOL db_engine_unload_db(const char *path)
 		auto &dbase = it->second;
 		std::unique_lock dhold(dbase.giant_lock);
 		if (remove_from_hash(dbase, now + g_cache_interval)) {
-			g_hash_table.erase(it);
+			dhold.unlock();
+			dbeng_erase(it);
 			return TRUE;
 		}
 		dhold.unlock();
@@ -290,7 +348,8 @@ BOOL db_engine_unload_db(const char *path)
 
 dynamic_node::dynamic_node(dynamic_node &&o) noexcept :
 	folder_id(o.folder_id), search_flags(o.search_flags),
-	prestriction(o.prestriction), folder_ids(o.folder_ids)
+	prestriction(o.prestriction), prog(std::move(o.prog)),
+	folder_ids(o.folder_ids)
 {
 	o.prestriction = nullptr;
 	o.folder_ids = {};
@@ -309,6 +368,7 @@ dynamic_node &dynamic_node::operator=(dynamic_node &&o) noexcept
 	folder_id = o.folder_id;
 	search_flags = o.search_flags;
 	std::swap(prestriction, o.prestriction);
+	std::swap(prog, o.prog);
 	folder_ids.count = o.folder_ids.count;
 	o.folder_ids.count = 0;
 	std::swap(folder_ids.pll, o.folder_ids.pll);
@@ -321,7 +381,8 @@ table_node::table_node(const table_node &o, clone_t) :
 	folder_id(o.folder_id), handle_guid(o.handle_guid),
 	prestriction(o.prestriction), psorts(o.psorts),
 	instance_tag(o.instance_tag), extremum_tag(o.extremum_tag),
-	header_id(o.header_id), b_search(o.b_search), b_hint(o.b_hint)
+	header_id(o.header_id), b_search(o.b_search), b_hint(o.b_hint),
+	shared_id(o.shared_id), b_private(o.b_private), share_key(o.share_key)
 {}
 
 table_node::~table_node()
@@ -356,18 +417,20 @@ db_base::db_base() :
  */
 db_handle db_base::get_db(const char* dir, DB_TYPE type)
 {
-	auto& spares = type == DB_MAIN? mx_sqlite : mx_sqlite_eph;
+	auto &spares = type == DB_MAIN ? mx_sqlite :
+	               type == DB_MAIN_RO ? mx_sqlite_ro : mx_sqlite_eph;
 	if(!spares.empty()) {
 		db_handle handle = std::move(spares.back());
 		spares.pop_back();
 		return handle;
 	}
-	const auto &path = type == DB_MAIN ? fmt::format("{}/exmdb/exchange.sqlite3", dir) :
+	const auto &path = type != DB_EPH ? fmt::format("{}/exmdb/exchange.sqlite3", dir) :
 	                   fmt::format("{}/tables.sqlite3", dir);
-	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX;
-	flags |= type == DB_MAIN? 0 : SQLITE_OPEN_CREATE;
+	int flags = SQLITE_OPEN_NOMUTEX;
+	flags |= type == DB_MAIN_RO ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+	flags |= type == DB_EPH ? SQLITE_OPEN_CREATE : 0;
 	sqlite3 *db = nullptr;
-	if (access(path.c_str(), W_OK) != 0 && errno != ENOENT)
+	if (type != DB_MAIN_RO && access(path.c_str(), W_OK) != 0 && errno != ENOENT)
 		mlog(LV_ERR, "E-1734: %s is not writable (%s), there may be more errors later",
 			path.c_str(), strerror(errno));
 	int ret = sqlite3_open_v2(path.c_str(), &db, flags, nullptr);
@@ -381,21 +444,30 @@ db_handle db_base::get_db(const char* dir, DB_TYPE type)
 		mlog(LV_ERR, "E-2101: enable foreign keys %s: %s (%d)", dir, sqlite3_errstr(ret), ret);
 		return nullptr;
 	}
-	gx_sql_exec(db, "PRAGMA journal_mode=WAL");
+	/* The journal mode is persistent; a read-only handle just follows it */
+	if (type != DB_MAIN_RO)
+		gx_sql_exec(db, "PRAGMA journal_mode=WAL");
 	sqlite3_busy_timeout(db, int(g_sqlite_busy_timeout_ns / 1000000)); // ns -> ms
 	if(type == DB_EPH)
 		gx_sql_exec(db, "PRAGMA	synchronous=OFF"); /* completely disable disk synchronization for eph db */
+	gx_sql_cache_attach(db, g_exmdb_stmt_cache_size);
+	if (type == DB_MAIN)
+		cu_id_reserve_attach(db, &ids);
 	return hdb;
 }
 
 /**
  * Get cached database handles or open new ones.
  */
-void db_base::get_dbs(const char* dir, sqlite3 *&main, sqlite3 *&eph)
+void db_base::get_dbs(const char* dir, sqlite3 *&main, sqlite3 *&eph,
+    bool readonly)
 {
 	std::unique_lock lock(sqlite_lock);
-	main = get_db(dir, db_base::DB_MAIN).release();
+	main = get_db(dir, readonly ? DB_MAIN_RO : DB_MAIN).release();
 	eph  = get_db(dir, db_base::DB_EPH).release();
+	/* Spares opened before the index was created get it attached here */
+	if (main != nullptr && fts_present && !cu_fts_active(main))
+		cu_fts_attach(main, dir, false);
 }
 
 /**
@@ -420,15 +492,20 @@ void db_base::open(const char* dir)
 	db_handle hdb(get_db(dir, DB_MAIN));
 	if (!hdb)
 		throw std::runtime_error(fmt::format("E-1434: get_db({}) failed", dir));
+	fts_present = access(fmt::format("{}/exmdb/fulltext.sqlite3", dir).c_str(), F_OK) == 0;
 	ret = db_engine_autoupgrade(hdb.get(), dir);
 	if(ret != 0)
 		throw std::runtime_error(fmt::format("E-2105: autoupgrade {}: {}", dir, ret));
-	if (exmdb_server::is_private())
+	/* Statements prepared against the old schema are of no further use */
+	gx_sql_cache_flush(hdb.get());
+	if (exmdb_server::is_private()) {
 		db_engine_load_dynamic_list(this, hdb.get());
+		db_engine_resume_populating(dir, hdb.get());
+	}
 	mx_sqlite.emplace_back(std::move(hdb));
 }
 
-void db_base::handle_spares(sqlite3 *main, sqlite3 *eph)
+void db_base::handle_spares(sqlite3 *main, sqlite3 *eph, bool readonly)
 {
 	static constexpr size_t unlimited = 0;
 	std::unique_lock lock(sqlite_lock);
@@ -438,7 +515,12 @@ void db_base::handle_spares(sqlite3 *main, sqlite3 *eph)
 			mx_sqlite_eph.emplace_back(std::move(eph));
 			eph = nullptr;
 		}
-		if (main != nullptr && g_exmdb_max_sqlite_spares != unlimited &&
+		if (main != nullptr && readonly) {
+			if (mx_sqlite_ro.size() < g_exmdb_sqlite_reader_spares) {
+				mx_sqlite_ro.emplace_back(std::move(main));
+				main = nullptr;
+			}
+		} else if (main != nullptr && g_exmdb_max_sqlite_spares != unlimited &&
 		    mx_sqlite.size() < g_exmdb_max_sqlite_spares) {
 			mx_sqlite.emplace_back(std::move(main));
 			main = nullptr;
@@ -446,10 +528,16 @@ void db_base::handle_spares(sqlite3 *main, sqlite3 *eph)
 	} catch (const std::bad_alloc &) {
 	}
 	lock.unlock();
-	if (eph != nullptr)
-		sqlite3_close(eph);
-	if (main != nullptr)
-		sqlite3_close(main);
+	/* close_v2: statements still held by an xstmt keep the handle alive */
+	if (eph != nullptr) {
+		gx_sql_cache_detach(eph);
+		sqlite3_close_v2(eph);
+	}
+	if (main != nullptr) {
+		gx_sql_cache_detach(main);
+		cu_id_reserve_detach(main);
+		sqlite3_close_v2(main);
+	}
 }
 
 db_conn::db_conn(db_base &base) :
@@ -458,20 +546,33 @@ db_conn::db_conn(db_base &base) :
 	++base.reference;
 }
 
+db_conn::db_conn(const db_conn &o, borrow_tag) :
+	psqlite(o.psqlite), m_sqlite_eph(o.m_sqlite_eph), m_base(o.m_base),
+	m_borrowed(true)
+{}
+
 db_conn::db_conn(db_conn &&o) :
 	psqlite(std::move(o.psqlite)),
 	m_sqlite_eph(std::move(o.m_sqlite_eph)),
-	m_base(std::move(o.m_base))
+	m_base(std::move(o.m_base)), m_borrowed(o.m_borrowed),
+	m_readonly(o.m_readonly)
 {
 	o.psqlite = o.m_sqlite_eph = nullptr;
 	o.m_base = nullptr;
+	o.m_borrowed = o.m_readonly = false;
 }
 
 db_conn::~db_conn()
 {
 	if (m_base == nullptr)
 		return;
-	m_base->handle_spares(std::move(psqlite), std::move(m_sqlite_eph));
+	if (m_borrowed) {
+		/* Handles stay with the pin; just make them available again. */
+		g_pin.lent = false;
+		return;
+	}
+	m_base->handle_spares(std::move(psqlite), std::move(m_sqlite_eph), m_readonly);
+	m_base->last_time = tp_now();
 	--m_base->reference;
 }
 
@@ -482,19 +583,46 @@ db_conn &db_conn::operator=(db_conn &&o)
 	o.psqlite = o.m_sqlite_eph = nullptr;
 	m_base = std::move(o.m_base);
 	o.m_base = nullptr;
+	m_borrowed = o.m_borrowed;
+	o.m_borrowed = false;
+	m_readonly = o.m_readonly;
+	o.m_readonly = false;
 	return *this;
 }
 
+db_conn_pin::db_conn_pin(const char *dir)
+{
+	if (g_pin.conn.has_value())
+		return;
+	g_pin.conn = db_engine_get_db(dir);
+	if (!g_pin.conn.has_value())
+		return;
+	g_pin.dir  = dir;
+	g_pin.lent = false;
+	m_active   = true;
+}
+
+db_conn_pin::~db_conn_pin()
+{
+	if (!m_active)
+		return;
+	g_pin.conn.reset();
+	g_pin.dir.clear();
+	g_pin.lent = false;
+}
+
 /**
  * Create a new database connection (handle)
  *
  * Should be called exactly once after creation and before first usage.
  *
- * @dir:  Store directory
+ * @dir:      Store directory
+ * @readonly: open exchange.sqlite3 read-only
  */
-bool db_conn::open(const char *dir) try
+bool db_conn::open(const char *dir, bool readonly) try
 {
-	m_base->get_dbs(dir, psqlite, m_sqlite_eph);
+	m_readonly = readonly;
+	m_base->get_dbs(dir, psqlite, m_sqlite_eph, readonly);
 	return psqlite && m_sqlite_eph;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1349: ENOMEM");
@@ -532,19 +660,119 @@ db_base::~db_base()
 	tables.table_list.clear();
 }
 
+static size_t dbeng_sqlite_mem(sqlite3 *db)
+{
+	size_t z = 0;
+	for (auto op : {SQLITE_DBSTATUS_CACHE_USED, SQLITE_DBSTATUS_SCHEMA_USED,
+	    SQLITE_DBSTATUS_STMT_USED}) {
+		int cur = 0, hi = 0;
+		if (sqlite3_db_status(db, op, &cur, &hi, 0) == SQLITE_OK)
+			z += cur;
+	}
+	return z;
+}
+
+static size_t dbeng_propvals_mem(const TPROPVAL_ARRAY &a)
+{
+	size_t z = a.count * sizeof(TAGGED_PROPVAL);
+	for (size_t i = 0; i < a.count; ++i)
+		if (a.ppropval[i].pvalue != nullptr)
+			z += propval_size(PROP_TYPE(a.ppropval[i].proptag), a.ppropval[i].pvalue);
+	return z;
+}
+
+static size_t dbeng_msgctnt_mem(const MESSAGE_CONTENT &);
+
+static size_t dbeng_atxctnt_mem(const ATTACHMENT_CONTENT &a)
+{
+	size_t z = sizeof(a) + dbeng_propvals_mem(a.proplist);
+	if (a.pembedded != nullptr)
+		z += dbeng_msgctnt_mem(*a.pembedded);
+	return z;
+}
+
+static size_t dbeng_msgctnt_mem(const MESSAGE_CONTENT &m)
+{
+	size_t z = sizeof(m) + dbeng_propvals_mem(m.proplist);
+	if (m.children.prcpts != nullptr)
+		for (const auto &rcpt : *m.children.prcpts)
+			z += sizeof(rcpt) + dbeng_propvals_mem(rcpt);
+	if (m.children.pattachments != nullptr)
+		for (const auto &at : *m.children.pattachments)
+			z += dbeng_atxctnt_mem(at);
+	return z;
+}
+
+/**
+ * Estimate the memory held on behalf of this store: the spare sqlite
+ * handles (page cache, schema, prepared statements) and the in-memory
+ * tables, instances and dynamic search criteria. Handles currently lent to
+ * a db_conn are not seen, but such a store is not evictable anyway.
+ *
+ * Caller must hold giant_lock.
+ */
+size_t db_base::mem_usage()
+{
+	size_t z = sizeof(*this);
+	std::unique_lock lk(sqlite_lock, std::try_to_lock);
+	if (!lk.owns_lock())
+		/* Still in open(), or busy handing out handles */
+		return mem_bytes;
+	for (const auto &h : mx_sqlite)
+		z += dbeng_sqlite_mem(h.get());
+	for (const auto &h : mx_sqlite_ro)
+		z += dbeng_sqlite_mem(h.get());
+	for (const auto &h : mx_sqlite_eph)
+		z += dbeng_sqlite_mem(h.get());
+	lk.unlock();
+	for (const auto &t : tables.table_list) {
+		z += sizeof(t) + t.share_key.capacity();
+		if (t.prestriction != nullptr)
+			z += restriction_size(t.prestriction);
+		if (t.psorts != nullptr)
+			z += t.psorts->count * sizeof(SORT_ORDER);
+	}
+	for (const auto &d : dynamic_list) {
+		z += sizeof(d) + d.folder_ids.count * sizeof(uint64_t) + d.prog.mem_usage();
+		if (d.prestriction != nullptr)
+			z += restriction_size(d.prestriction);
+	}
+	for (const auto &i : instance_list) {
+		z += sizeof(i) + i.username.capacity();
+		if (i.pcontent == nullptr)
+			continue;
+		if (i.type == instance_type::message)
+			z += dbeng_msgctnt_mem(*static_cast<const MESSAGE_CONTENT *>(i.pcontent));
+		else
+			z += dbeng_atxctnt_mem(*static_cast<const ATTACHMENT_CONTENT *>(i.pcontent));
+	}
+	z += nsub_list.size() * sizeof(nsub_node);
+	return z;
+}
+
+size_t db_base::spare_count()
+{
+	std::unique_lock lk(sqlite_lock, std::try_to_lock);
+	return lk.owns_lock() ? mx_sqlite.size() + mx_sqlite_ro.size() +
+	       mx_sqlite_eph.size() : 0;
+}
+
 void db_base::drop_all()
 {
 	instance_list.clear();
 	dynamic_list.clear();
 	tables.table_list.clear();
+	/* Closing the handles also drops their statement caches */
 	mx_sqlite_eph.clear();
+	mx_sqlite_ro.clear();
 	mx_sqlite.clear();
 }
 
 /**
- * Check if this db_base object is ripe for deletion.
+ * Check if this db_base object could be dropped without anyone noticing
+ * (other than having to reopen the sqlite files).
  */
-static bool remove_from_hash(const db_base &pdb, time_point now)
+static bool db_unused(const db_base &pdb)
 {
 	if (pdb.tables.table_list.size() > 0)
 		/* emsmdb still references in-memory tables */
@@ -552,9 +780,81 @@ static bool remove_from_hash(const db_base &pdb, time_point now)
 	if (pdb.nsub_list.size() > 0)
 		/* there is still a client wanting notifications */
 		return false;
-	if (pdb.reference != 0 || now - pdb.last_time <= g_cache_interval)
-		return false;
-	return true;
+	return pdb.reference == 0;
+}
+
+/**
+ * Check if this db_base object is ripe for deletion.
+ */
+static bool remove_from_hash(const db_base &pdb, time_point now)
+{
+	return db_unused(pdb) && now - pdb.last_time.load() > g_cache_interval;
+}
+
+/**
+ * Refresh the memory estimate of @b and the cache total. Caller must hold
+ * giant_lock.
+ */
+static void dbeng_account(db_base &b)
+{
+	auto now = b.mem_usage();
+	auto old = b.mem_bytes.exchange(now);
+	g_db_cache_counters.bytes += now - old;
+}
+
+/* Caller must hold g_hash_lock and no lock of @it. */
+static void dbeng_erase(decltype(g_hash_table)::iterator it)
+{
+	g_db_cache_counters.bytes -= it->second.mem_bytes;
+	--g_db_cache_counters.stores;
+	g_hash_table.erase(it);
+}
+
+/**
+ * Drop unused stores, least recently used first, until the cache total is
+ * at or below @target. Stores whose giant_lock is taken are skipped rather
+ * than waited for. Caller must hold g_hash_lock.
+ */
+static void dbeng_evict(uint64_t target) try
+{
+	static std::atomic<time_point> last_warn;
+	std::vector<decltype(g_hash_table)::iterator> cand;
+	for (auto it = g_hash_table.begin(); it != g_hash_table.end(); ++it)
+		if (it->second.reference == 0)
+			cand.push_back(it);
+	std::sort(cand.begin(), cand.end(), [](const auto &a, const auto &b) {
+		return a->second.last_time.load() < b->second.last_time.load();
+	});
+	for (auto it : cand) {
+		if (g_db_cache_counters.bytes <= target)
+			return;
+		std::unique_lock dhold(it->second.giant_lock, std::try_to_lock);
+		/*
+		 * Unlike expiry, this can hit a store within seconds of its last
+		 * use, while a client is still holding message/attachment
+		 * instances that it cannot recreate.
+		 */
+		if (!dhold.owns_lock() || !db_unused(it->second) ||
+		    !it->second.instance_list.empty())
+			continue;
+		dhold.unlock();
+		dbeng_erase(it);
+		++g_db_cache_counters.evicted;
+	}
+	if (g_db_cache_counters.bytes <= g_exmdb_cache_budget)
+		return;
+	auto now = tp_now();
+	if (now - last_warn.load() < std::chrono::minutes(1))
+		return;
+	last_warn = now;
+	mlog(LV_WARN, "W-1330: exmdb store cache is at %llu MB with %zu stores, "
+	        "over exmdb_cache_budget=%llu MB, and not enough of them are "
+	        "idle to evict",
+	        static_cast<unsigned long long>(g_db_cache_counters.bytes >> 20),
+	        g_hash_table.size(),
+	        static_cast<unsigned long long>(g_exmdb_cache_budget >> 20));
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1331: ENOMEM");
 }
 
 static void *db_expiry_thread(void *param)
@@ -579,11 +879,18 @@ static void *db_expiry_thread(void *param)
 			 * Hence another lock.
 			 */
 			std::unique_lock dhold(dbase.giant_lock);
-			if (remove_from_hash(dbase, now_time))
-				it = g_hash_table.erase(it);
-			else
-				++it;
+			if (remove_from_hash(dbase, now_time)) {
+				dhold.unlock();
+				auto victim = it++;
+				dbeng_erase(victim);
+				continue;
+			}
+			dbeng_account(dbase);
+			++it;
 		}
+		if (g_exmdb_cache_budget != 0 &&
+		    g_db_cache_counters.bytes > g_exmdb_cache_budget)
+			dbeng_evict(g_exmdb_cache_budget - g_exmdb_cache_budget / 8);
 	}
 	return nullptr;
 }
@@ -599,10 +906,66 @@ void dg_notify(db_conn::NOTIFQ &&notifq)
 	notifq.clear();
 }
 
-static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
-    uint64_t search_fid, uint64_t scope_fid, const RESTRICTION *prestriction,
-    db_conn_ptr &pdb)
+/**
+ * Number of messages in scope folder @scope_fid whose message_id is at most
+ * @upto.
+ */
+static uint32_t sf_scope_count(sqlite3 *db, uint64_t scope_fid, uint64_t upto)
+{
+	char sql_string[128];
+	snprintf(sql_string, std::size(sql_string), "SELECT is_search "
+	          "FROM folders WHERE folder_id=%llu", LLU{scope_fid});
+	auto pstmt = gx_sql_prep(db, sql_string);
+	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+		return 0;
+	if (pstmt.col_uint64(0) == 0)
+		snprintf(sql_string, std::size(sql_string), "SELECT COUNT(*) FROM"
+		          " messages WHERE parent_fid=%llu AND message_id<=%lld",
+		          LLU{scope_fid}, LLD(std::min<uint64_t>(upto, INT64_MAX)));
+	else
+		snprintf(sql_string, std::size(sql_string), "SELECT COUNT(*) FROM"
+		          " search_result WHERE folder_id=%llu AND message_id<=%lld",
+		          LLU{scope_fid}, LLD(std::min<uint64_t>(upto, INT64_MAX)));
+	pstmt = gx_sql_prep(db, sql_string);
+	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+		return 0;
+	return pstmt.col_uint64(0);
+}
+
+static bool sf_checkpoint(db_conn_ptr &pdb, const POPULATING_NODE &psearch,
+    uint64_t scope_fid, uint64_t last_mid, bool done)
+{
+	char sql_string[192];
+	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	/*
+	 * A search is flagged as cancelled before its successor is queued,
+	 * and the successor's sf_plan rewrites search_progress in a write
+	 * transaction of its own. Checking only now that the write lock is
+	 * held ensures those new rows are never touched from here.
+	 */
+	if (psearch.cancelled)
+		return true;
+	snprintf(sql_string, std::size(sql_string), "UPDATE search_progress"
+	         " SET last_mid=%llu, done=%u WHERE folder_id=%llu AND scope_fid=%llu",
+	         LLU{last_mid}, !!done, LLU{psearch.folder_id}, LLU{scope_fid});
+	if (pdb->exec(sql_string) != SQLITE_OK)
+		return false;
+	return sql_transact.commit() == SQLITE_OK;
+}
+
+/**
+ * Evaluate the messages of one scope folder with a message_id above
+ * @last_mid, in ascending order, persisting the position every so often.
+ */
+static BOOL db_engine_search_folder(const POPULATING_NODE &psearch,
+    uint64_t scope_fid, uint64_t last_mid, db_conn_ptr &pdb)
 {
+	static constexpr size_t checkpoint_interval = 256;
+	auto cpid = psearch.cpid;
+	auto search_fid = psearch.folder_id;
+	auto prestriction = psearch.prestriction;
 	char sql_string[128];
 	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read); // ends before writes take place
 	if (!sql_transact)
@@ -614,16 +977,28 @@ static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
 		return FALSE;
 	if (pstmt.step() != SQLITE_ROW)
 		return TRUE;
+	std::string query;
 	if (sqlite3_column_int64(pstmt, 0) == 0)
-		snprintf(sql_string, std::size(sql_string), "SELECT message_id FROM"
-		          " messages WHERE parent_fid=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		query = fmt::format("SELECT message_id FROM messages"
+		        " WHERE parent_fid={} AND message_id>{}",
+		        scope_fid, last_mid);
 	else
-		snprintf(sql_string, std::size(sql_string), "SELECT message_id FROM"
-		          " search_result WHERE folder_id=%llu",
-		          static_cast<unsigned long long>(scope_fid));
+		query = fmt::format("SELECT messages.message_id FROM"
+		        " search_result JOIN messages ON"
+		        " search_result.message_id=messages.message_id"
+		        " WHERE search_result.folder_id={} AND messages.message_id>{}",
+		        scope_fid, last_mid);
+	/*
+	 * Let SQLite do as much of the matching as it can; whatever the
+	 * compiler could not express is left to the interpreter below.
+	 */
+	std::string where;
+	auto res_kind = cu_msg_restriction_to_sql(prestriction, cpid, pdb->psqlite, where);
+	if (res_kind != res_sql::none)
+		query += " AND " + where;
+	query += " ORDER BY messages.message_id";
 	pstmt.finalize();
-	pstmt = pdb->prep(sql_string);
+	pstmt = pdb->prep(query.c_str());
 	if (pstmt == nullptr)
 		return FALSE;
 	auto pmessage_ids = eid_array_init();
@@ -640,17 +1015,24 @@ static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
 		auto t_end = tp_now();
 		auto t_diff = std::chrono::duration<double>(t_end - t_start).count();
 		if (pmessage_ids->count > 0 && t_diff >= 1)
-			mlog(LV_DEBUG, "db_eng_sf: %u messages in %.2f seconds",
-				pmessage_ids->count, t_diff);
+			mlog(LV_DEBUG, "db_eng_sf: %u messages in %.2f seconds (sql filter: %s)",
+				pmessage_ids->count, t_diff,
+				res_kind == res_sql::exact ? "exact" :
+				res_kind == res_sql::partial ? "partial" : "none");
 	});
 	sql_transact = xtransaction();
 	for (size_t i = 0, count = 0; i < pmessage_ids->count; ++i, ++count) {
-		if (g_notify_stop)
+		if (g_notify_stop || psearch.cancelled)
 			break;
+		if (i > 0 && i % checkpoint_interval == 0 &&
+		    !sf_checkpoint(pdb, psearch, scope_fid,
+		    pmessage_ids->pids[i-1], false))
+			return false;
 		auto sql_transact1 = gx_sql_begin(pdb->psqlite, txn_mode::write);
 		if (!sql_transact1)
 			return false;
-		if (!cu_eval_msg_restriction(pdb->psqlite,
+		if (res_kind != res_sql::exact &&
+		    !cu_eval_msg_restriction(pdb->psqlite,
 		    cpid, pmessage_ids->pids[i], prestriction))
 			continue;
 		snprintf(sql_string, std::size(sql_string), "REPLACE INTO search_result "
@@ -683,7 +1065,10 @@ static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
 		dg_notify(std::move(notifq));
 		dbase.reset();
 	}
-	return TRUE;
+	if (g_notify_stop || psearch.cancelled)
+		return TRUE;
+	return sf_checkpoint(pdb, psearch, scope_fid, pmessage_ids->count > 0 ?
+	       pmessage_ids->pids[pmessage_ids->count-1] : last_mid, true);
 }
 
 static BOOL db_engine_load_folder_descendant(const char *dir,
@@ -750,89 +1135,179 @@ static void dbeng_notify_search_completion(const db_base &dbase,
 	mlog(LV_ERR, "E-2118: ENOMEM");
 }
 
+/**
+ * Turn the search scope into the list of folders to evaluate, and record them
+ * in search_progress (or, when resuming, read back what is left to do).
+ */
+static bool sf_plan(POPULATING_NODE &psearch,
+    std::deque<std::pair<uint64_t, uint64_t>> &todo)
+{
+	char sql_string[192];
+	if (psearch.b_resume) {
+		auto pdb = db_engine_get_db(psearch.dir.c_str());
+		if (!pdb)
+			return false;
+		snprintf(sql_string, std::size(sql_string), "SELECT scope_fid, last_mid"
+		         " FROM search_progress WHERE folder_id=%llu AND done=0",
+		         LLU{psearch.folder_id});
+		auto pstmt = pdb->prep(sql_string);
+		if (pstmt == nullptr)
+			return false;
+		while (pstmt.step() == SQLITE_ROW)
+			todo.emplace_back(pstmt.col_uint64(0), pstmt.col_uint64(1));
+		return true;
+	}
+	auto pfolder_ids = eid_array_init();
+	if (pfolder_ids == nullptr)
+		return false;
+	auto cl_0 = make_scope_exit([&]() { eid_array_free(pfolder_ids); });
+	for (size_t i = 0; i < psearch.folder_ids.count; ++i) {
+		if (!eid_array_append(pfolder_ids, psearch.folder_ids.pll[i]))
+			return false;
+		if (psearch.b_recursive &&
+		    !db_engine_load_folder_descendant(psearch.dir.c_str(),
+		    psearch.b_recursive, psearch.folder_ids.pll[i], pfolder_ids))
+			return false;
+	}
+	auto pdb = db_engine_get_db(psearch.dir.c_str());
+	if (!pdb)
+		return false;
+	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	snprintf(sql_string, std::size(sql_string), "DELETE FROM search_progress"
+	         " WHERE folder_id=%llu", LLU{psearch.folder_id});
+	if (pdb->exec(sql_string) != SQLITE_OK)
+		return false;
+	auto pstmt = pdb->prep("INSERT OR IGNORE INTO search_progress"
+	             " (folder_id, scope_fid, cpid, total) VALUES (?,?,?,?)");
+	if (pstmt == nullptr)
+		return false;
+	for (size_t i = 0; i < pfolder_ids->count; ++i) {
+		auto scope_fid = pfolder_ids->pids[i];
+		sqlite3_bind_int64(pstmt, 1, psearch.folder_id);
+		sqlite3_bind_int64(pstmt, 2, scope_fid);
+		sqlite3_bind_int64(pstmt, 3, static_cast<uint32_t>(psearch.cpid));
+		sqlite3_bind_int64(pstmt, 4, sf_scope_count(pdb->psqlite,
+			scope_fid, UINT64_MAX));
+		if (pstmt.step() != SQLITE_DONE)
+			return false;
+		sqlite3_reset(pstmt);
+		todo.emplace_back(scope_fid, 0);
+	}
+	pstmt.finalize();
+	return sql_transact.commit() == SQLITE_OK;
+}
+
+/**
+ * Signal the end of a population. With @keep_progress, search_progress is
+ * left alone so that the population is tried again later.
+ */
+static void sf_complete(const POPULATING_NODE &psearch, bool keep_progress)
+{
+	char sql_string[128];
+	auto pdb = db_engine_get_db(psearch.dir.c_str());
+	if (!pdb)
+		return;
+	snprintf(sql_string, std::size(sql_string), "DELETE FROM search_progress"
+	         " WHERE folder_id=%llu", LLU{psearch.folder_id});
+	if (!keep_progress && pdb->exec(sql_string) != SQLITE_OK)
+		/* ignore; leftovers are resumed (and found complete) later */;
+	db_conn::NOTIFQ notifq;
+	auto dbase = pdb->lock_base_wr();
+	/* Stop animation (does nothing else in OL really) */
+	dbeng_notify_search_completion(*dbase, psearch.folder_id, notifq);
+	pdb->notify_folder_modification(common_util_get_folder_parent_fid(
+		pdb->psqlite, psearch.folder_id),
+		psearch.folder_id, *dbase, notifq);
+	/*
+	 * Open tables already received every hit as it was linked
+	 * (notify_link_creation); a table_change notification lets
+	 * the client learn of the new message count.
+	 */
+	for (const auto &t : dbase->tables.table_list)
+		if (t.type == table_type::content &&
+		    psearch.folder_id == t.folder_id)
+			pdb->notify_cttbl_reload(t.table_id, *dbase, notifq);
+	dg_notify(std::move(notifq));
+}
+
 /**
  * Background task which is responsible for the initial filling of search
  * folders (e.g. when they are created, or the search criteria has been reset).
+ *
+ * The first thread to pick up a search expands its scope into folders; after
+ * that, every populating thread may take one of those folders, so that a
+ * large recursive search is spread out and does not hold up other searches.
+ * The last thread to finish a folder of a search sends the completion
+ * notification.
  */
 static void *sf_popul_thread(void *param)
 {
 	if (nice(g_exmdb_search_nice) < 0)
 		/* ignore */;
 	
+	std::unique_lock lhold(g_list_lock);
 	while (!g_notify_stop) {
-		std::unique_lock chold(g_cond_mutex);
-		g_waken_cond.wait(chold);
-		chold.unlock();
- NEXT_SEARCH:
-		if (g_notify_stop)
-			break;
-		std::unique_lock lhold(g_list_lock);
-		if (g_populating_list.size() == 0)
+		auto psearch = std::find_if(g_populating_list.begin(),
+		               g_populating_list.end(), [](const POPULATING_NODE &e) {
+		               	return (!e.b_planned && e.running == 0) ||
+		               	       !e.pending.empty();
+		               });
+		if (psearch == g_populating_list.end()) {
+			g_waken_cond.wait(lhold);
 			continue;
-		g_populating_list_active.splice(g_populating_list_active.end(), g_populating_list, g_populating_list.begin());
-		auto psearch = std::prev(g_populating_list_active.end());
-		lhold.unlock();
-		auto cl_0 = make_scope_exit([&]() { g_populating_list_active.erase(psearch); });
-		auto pfolder_ids = eid_array_init();
-		if (pfolder_ids == nullptr)
-			goto NEXT_SEARCH;	
-		auto cl_1 = make_scope_exit([&]() { eid_array_free(pfolder_ids); });
-		exmdb_server::build_env(EM_PRIVATE, psearch->dir.c_str());
-		auto cl_2 = make_scope_exit(exmdb_server::free_env);
-		for (size_t i = 0; i < psearch->folder_ids.count; ++i) {
-			if (!eid_array_append(pfolder_ids,
-			    psearch->folder_ids.pll[i]))
-				goto NEXT_SEARCH;	
-			if (!psearch->b_recursive)
-				continue;
-			if (!db_engine_load_folder_descendant(psearch->dir.c_str(),
-			    psearch->b_recursive, psearch->folder_ids.pll[i], pfolder_ids))
-				goto NEXT_SEARCH;
-		}
-		auto pdb = db_engine_get_db(psearch->dir.c_str());
-		if (!pdb)
-			goto NEXT_SEARCH;
-		for (size_t i = 0; i < pfolder_ids->count; ++i) {
-			if (g_notify_stop)
-				break;
-			if (!db_engine_search_folder(psearch->dir.c_str(),
-			    psearch->cpid, psearch->folder_id,
-			    pfolder_ids->pids[i], psearch->prestriction, pdb))
-				break;
 		}
-		if (g_notify_stop)
-			break;
-		db_conn::NOTIFQ notifq;
-		auto dbase = pdb->lock_base_wr();
-		/* Stop animation (does nothing else in OL really) */
-		dbeng_notify_search_completion(*dbase, psearch->folder_id, notifq);
-		pdb->notify_folder_modification(common_util_get_folder_parent_fid(
-			pdb->psqlite, psearch->folder_id),
-			psearch->folder_id, *dbase, notifq);
-		dg_notify(std::move(notifq));
-		std::vector<uint32_t> table_ids;
-		try {
-			table_ids.reserve(dbase->tables.table_list.size());
-		} catch (const std::bad_alloc &) {
-			mlog(LV_ERR, "E-1649: ENOMEM");
-			sleep(60);
-			goto NEXT_SEARCH;
-		}
-		for (const auto &t : dbase->tables.table_list)
-			if (t.type == table_type::content &&
-			    psearch->folder_id == t.folder_id)
-				table_ids.push_back(t.table_id);
-		dbase.reset();
-		pdb.reset();
+		++psearch->running;
+		bool plan_failed = false;
+		if (!psearch->b_planned) {
+			lhold.unlock();
+			std::deque<std::pair<uint64_t, uint64_t>> todo;
+			exmdb_server::build_env(EM_PRIVATE, psearch->dir.c_str());
+			if (!sf_plan(*psearch, todo)) {
+				mlog(LV_ERR, "E-1317: search folder %s:%llxh: could not set up population",
+					psearch->dir.c_str(), LLU{psearch->folder_id});
+				todo.clear();
+				plan_failed = true;
+			}
+			exmdb_server::free_env();
+			lhold.lock();
+			psearch->b_planned = true;
+			if (!psearch->cancelled)
+				psearch->pending = std::move(todo);
+			if (psearch->pending.size() > 1)
+				g_waken_cond.notify_all();
+		} else {
+			auto [scope_fid, last_mid] = psearch->pending.front();
+			psearch->pending.pop_front();
+			/* Rotate, so that the next thread serves another search */
+			g_populating_list.splice(g_populating_list.end(),
+				g_populating_list, psearch);
+			lhold.unlock();
+			exmdb_server::build_env(EM_PRIVATE, psearch->dir.c_str());
+			auto pdb = db_engine_get_db(psearch->dir.c_str());
+			if (pdb)
+				db_engine_search_folder(*psearch, scope_fid, last_mid, pdb);
+			pdb.reset();
+			exmdb_server::free_env();
+			lhold.lock();
+		}
+		if (--psearch->running > 0 || !psearch->pending.empty())
+			continue;
 		/*
-		 * reload_ct triggers a table_change notification, and the
-		 * client eventually learns of the new message count.
+		 * Last one out. After a failed plan, search_progress is left as
+		 * it was, so that db_engine_resume_populating retries the next
+		 * time the store is loaded; clients are still told that this
+		 * run is over, lest they wait for it forever.
 		 */
-		while (table_ids.size() > 0) {
-			exmdb_server::reload_content_table(psearch->dir.c_str(), table_ids.back());
-			table_ids.pop_back();
+		if (!g_notify_stop && !psearch->cancelled) {
+			lhold.unlock();
+			exmdb_server::build_env(EM_PRIVATE, psearch->dir.c_str());
+			sf_complete(*psearch, plan_failed);
+			exmdb_server::free_env();
+			lhold.lock();
 		}
-		goto NEXT_SEARCH;
+		g_populating_list.erase(psearch);
 	}
 	return nullptr;
 }
@@ -841,6 +1316,7 @@ void db_engine_init(size_t table_size, int cache_interval, unsigned int threads_
 {
 	g_notify_stop = true;
 	g_table_size = table_size;
+	g_hash_table.reserve(g_table_size);
 	g_cache_interval = std::chrono::seconds{cache_interval};
 	g_threads_num = threads_num;
 	g_thread_ids.reserve(g_threads_num);
@@ -917,6 +1393,8 @@ void db_engine_stop()
 		}
 		futs.clear();
 		g_hash_table.clear();
+		g_db_cache_counters.bytes = 0;
+		g_db_cache_counters.stores = 0;
 		mlog(LV_INFO, "Database shutdown took %llu ms",
 			LLU(std::chrono::duration_cast<std::chrono::milliseconds>(tp_now() - t_start).count()));
 	}
@@ -948,6 +1426,18 @@ BOOL db_engine_enqueue_populating_criteria(const char *dir, cpid_t cpid,
 	psearch->b_recursive = b_recursive;
 	psearch->folder_ids.count = pfolder_ids->count;
 	std::unique_lock lhold(g_list_lock);
+	/* New criteria supersede a population still underway */
+	for (auto it = g_populating_list.begin(); it != g_populating_list.end(); ) {
+		if (it->dir != dir || it->folder_id != folder_id) {
+			++it;
+		} else if (it->running == 0) {
+			it = g_populating_list.erase(it);
+		} else {
+			it->cancelled = true;
+			it->pending.clear();
+			++it;
+		}
+	}
 	g_populating_list.splice(g_populating_list.end(), std::move(holder));
 	lhold.unlock();
 	g_waken_cond.notify_one();
@@ -961,14 +1451,104 @@ bool db_engine_check_populating(const char *dir, uint64_t folder_id)
 {
 	std::lock_guard lhold(g_list_lock);
 	for (const auto &e : g_populating_list)
-		if (e.dir == dir && e.folder_id == folder_id)
-			return true;
-	for (const auto &e : g_populating_list_active)
-		if (e.dir == dir && e.folder_id == folder_id)
+		if (e.dir == dir && e.folder_id == folder_id && !e.cancelled)
 			return true;
 	return false;
 }
 
+/**
+ * Requeue the searches that were still being populated when the mailbox was
+ * last closed (e.g. by a restart).
+ */
+static void db_engine_resume_populating(const char *dir, sqlite3 *psqlite) try
+{
+	EXT_PULL ext_pull;
+	RESTRICTION tmp_restriction;
+	auto pstmt = gx_sql_prep(psqlite, "SELECT p.folder_id, p.cpid,"
+	             " f.search_criteria FROM search_progress AS p"
+	             " JOIN folders AS f ON p.folder_id=f.folder_id"
+	             " WHERE p.done=0 GROUP BY p.folder_id");
+	if (pstmt == nullptr)
+		return;
+	while (pstmt.step() == SQLITE_ROW) {
+		uint64_t folder_id = pstmt.col_uint64(0);
+		if (db_engine_check_populating(dir, folder_id))
+			continue;
+		ext_pull.init(sqlite3_column_blob(pstmt, 2),
+			sqlite3_column_bytes(pstmt, 2), common_util_alloc, 0);
+		if (ext_pull.g_restriction(&tmp_restriction) != EXT_ERR_SUCCESS)
+			continue;
+		std::list<POPULATING_NODE> holder;
+		auto &node = holder.emplace_back();
+		node.dir = dir;
+		node.folder_id = folder_id;
+		node.cpid = static_cast<cpid_t>(pstmt.col_uint64(1));
+		node.b_resume = true;
+		node.prestriction = tmp_restriction.dup();
+		if (node.prestriction == nullptr)
+			break;
+		mlog(LV_INFO, "I-1318: %s: resuming population of search folder %llxh",
+			dir, LLU{folder_id});
+		std::unique_lock lhold(g_list_lock);
+		g_populating_list.splice(g_populating_list.end(), std::move(holder));
+		lhold.unlock();
+		g_waken_cond.notify_one();
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1363: ENOMEM");
+}
+
+/**
+ * Progress of a search folder population, in messages. Both figures are 0
+ * when nothing is pending.
+ */
+bool db_engine_search_progress(sqlite3 *psqlite, uint64_t folder_id,
+    uint32_t *pscanned, uint32_t *ptotal)
+{
+	char sql_string[128];
+	*pscanned = *ptotal = 0;
+	snprintf(sql_string, std::size(sql_string), "SELECT scope_fid, last_mid,"
+	         " total, done FROM search_progress WHERE folder_id=%llu",
+	         LLU{folder_id});
+	auto pstmt = gx_sql_prep(psqlite, sql_string);
+	if (pstmt == nullptr)
+		return false;
+	while (pstmt.step() == SQLITE_ROW) {
+		uint32_t total = pstmt.col_uint64(2);
+		uint32_t scanned = pstmt.col_uint64(3) != 0 ? total :
+		                   sf_scope_count(psqlite, pstmt.col_uint64(0),
+		                   pstmt.col_uint64(1));
+		*ptotal += total;
+		*pscanned += std::min(scanned, total);
+	}
+	return true;
+}
+
+/**
+ * Snapshot of the store cache for diagnostics. Stores that are locked at
+ * this time are reported with their last known memory figure only.
+ */
+void db_engine_cache_stats(std::vector<exmdb_cache_entry> &out)
+{
+	std::lock_guard hhold(g_hash_lock);
+	auto now = tp_now();
+	out.reserve(g_hash_table.size());
+	for (auto &[dir, b] : g_hash_table) {
+		auto &e = out.emplace_back();
+		e.dir = dir;
+		e.mem_bytes = b.mem_bytes;
+		e.references = std::max(b.reference.load(), 0);
+		e.idle_secs = std::chrono::duration_cast<std::chrono::seconds>(now - b.last_time.load()).count();
+		std::shared_lock dhold(b.giant_lock, std::try_to_lock);
+		if (!dhold.owns_lock())
+			continue;
+		e.handles   = b.spare_count();
+		e.tables    = b.tables.table_list.size();
+		e.instances = b.instance_list.size();
+		e.dynamics  = b.dynamic_list.size();
+	}
+}
+
 void db_conn::update_dynamic(uint64_t folder_id, uint32_t search_flags,
     const RESTRICTION *prestriction, const LONGLONG_ARRAY *pfolder_ids,
     db_base &dbase) try
@@ -980,6 +1560,7 @@ void db_conn::update_dynamic(uint64_t folder_id, uint32_t search_flags,
 	dn.prestriction = prestriction->dup();
 	if (dn.prestriction == nullptr)
 		return;
+	dn.prog.compile(*dn.prestriction);
 	dn.folder_ids.count = pfolder_ids->count;
 	dn.folder_ids.pll   = me_alloc<uint64_t>(pfolder_ids->count);
 	if (dn.folder_ids.pll == nullptr)
@@ -1001,6 +1582,15 @@ void db_conn::delete_dynamic(uint64_t folder_id, db_base *dbase)
 		[=](const dynamic_node &n) { return n.folder_id == folder_id; });
 }
 
+/* Whether message @mid (still) belongs into dynamic search folder @dn */
+static bool dbeng_dyn_match(db_conn *pdb, cpid_t cpid, uint64_t mid,
+    const dynamic_node &dn)
+{
+	if (dn.prog.compiled())
+		return cu_eval_msg_program(pdb->psqlite, cpid, mid, dn.prog);
+	return cu_eval_msg_restriction(pdb->psqlite, cpid, mid, dn.prestriction);
+}
+
 static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
     uint64_t id2, uint64_t id3, uint32_t folder_type,
     const dynamic_node *pdynamic, size_t i, db_base &dbase, db_conn::NOTIFQ &notifq)
@@ -1047,8 +1637,7 @@ static void dbeng_dynevt_1(db_conn *pdb, cpid_t cpid, uint64_t id1,
 				mlog(LV_DEBUG, "db_engine: failed to delete from search_result");
 			continue;
 		}
-		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, message_id, pdynamic->prestriction))
+		if (!dbeng_dyn_match(pdb, cpid, message_id, *pdynamic))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
 			"(folder_id, message_id) VALUES (%llu, %llu)",
@@ -1090,8 +1679,7 @@ static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
 		}
 		if (b_exist)
 			return;
-		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, id2, pdynamic->prestriction))
+		if (!dbeng_dyn_match(pdb, cpid, id2, *pdynamic))
 			return;
 		snprintf(sql_string, std::size(sql_string), "INSERT INTO search_result "
 			"(folder_id, message_id) VALUES (%llu, %llu)",
@@ -1127,8 +1715,7 @@ static void dbeng_dynevt_2(db_conn *pdb, cpid_t cpid, dynamic_event event_type,
 			mlog(LV_DEBUG, "db_engine: failed to check item in search_result");
 			return;
 		}
-		if (cu_eval_msg_restriction(
-			pdb->psqlite, cpid, id2, pdynamic->prestriction)) {
+		if (dbeng_dyn_match(pdb, cpid, id2, *pdynamic)) {
 			if (b_exist) {
 				dbeng_notify_cttbl_modify_row(
 					pdb, pdynamic->folder_id, id2, dbase);
@@ -1429,6 +2016,24 @@ static inline void *pick_single_val(uint16_t type, void *mv, size_t j)
 	return mv;
 }
 
+/**
+ * Send a row notification to a content table and to all tables that share
+ * its rows (see table_node::shared_id). Only the owner is maintained by the
+ * dbeng_notify_cttbl_* handlers.
+ */
+static void dbeng_notify_cttbl(const db_base &dbase, const table_node &ptable,
+    DB_NOTIFY_DATAGRAM &datagram)
+{
+	notification_agent_backward_notify(ptable.remote_id, &datagram);
+	for (const auto &t : dbase.tables.table_list) {
+		if (t.shared_id != ptable.table_id)
+			continue;
+		datagram.id_array[0] = t.table_id;
+		notification_agent_backward_notify(t.remote_id, &datagram);
+	}
+	datagram.id_array[0] = ptable.table_id;
+}
+
 static void dbeng_notify_cttbl_add_row(db_conn *pdb,
     uint64_t folder_id, uint64_t message_id, db_base &dbase) try
 {
@@ -1453,20 +2058,37 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 	for (auto &tnode : dbase.tables.table_list) {
 		auto ptable = &tnode;
 		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
+		    folder_id != ptable->folder_id || ptable->shared_id != 0)
 			continue;
 		if (!!(ptable->table_flags & TABLE_FLAG_ASSOCIATED) == !b_fai)
 			continue;
-		if (dbase.tables.b_batch && ptable->b_hint)
-			continue;
 		if (ptable->prestriction != nullptr &&
 		    !cu_eval_msg_restriction(pdb->psqlite,
 		    ptable->cpid, message_id, ptable->prestriction))
 			continue;
-		if (dbase.tables.b_batch) {
-			ptable->b_hint = TRUE;
-			continue;
+		{
+			/*
+			 * The table may have been loaded between the message
+			 * becoming visible in the store and this notification
+			 * (search folder population does that).
+			 */
+			char sql_string[128];
+			snprintf(sql_string, std::size(sql_string), "SELECT 1 FROM t%u"
+			         " WHERE inst_id=%llu AND row_type=%u LIMIT 1",
+			         ptable->table_id, LLU{message_id}, CONTENT_ROW_MESSAGE);
+			auto pstmt = pdb->eph_prep(sql_string);
+			if (pstmt == nullptr || pstmt.step() != SQLITE_DONE)
+				continue;
 		}
+		/*
+		 * In batch mode, rows are still maintained, but clients get a
+		 * single table-changed notification at the end of the batch.
+		 */
+		if (dbase.tables.b_batch)
+			ptable->b_hint = TRUE;
+		bool b_quiet = dbase.tables.b_batch ||
+		               (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS);
+		++g_cttbl_counters.added;
 		if (NULL == padded_row) {
 			padded_row = cu_alloc<DB_NOTIFY_CONTENT_TABLE_ROW_ADDED>(2);
 			if (padded_row == nullptr)
@@ -1517,7 +2139,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			}
 			if (pdb->eph_exec(sql_string) != SQLITE_OK)
 				continue;
-			if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
+			if (b_quiet)
 				continue;
 			padded_row->row_instance = 0;
 			padded_row->after_row_id = inst_id;
@@ -1530,8 +2152,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_added :
 			                          db_notify_type::cttbl_row_added;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			continue;
 		} else if (0 == ptable->psorts->ccategories) {
 			for (size_t i = 0; i < ptable->psorts->count; ++i) {
@@ -1623,7 +2244,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 					continue;
 				padded_row->after_row_id = inst_id;
 			}
-			if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
+			if (b_quiet)
 				continue;
 			if (padded_row->after_row_id == 0)
 				padded_row->after_folder_id = 0;
@@ -1635,8 +2256,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_added :
 			                          db_notify_type::cttbl_row_added;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			continue;
 		}
 		if (NULL == pread_byte) {
@@ -1955,14 +2575,13 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 		pstmt1.finalize();
 		if (sql_savepoint.commit() != SQLITE_OK)
 			continue;
-		if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
+		if (b_quiet)
 			continue;
 		if (b_resorted) {
 			datagram1.db_notify.type = ptable->b_search ?
 						   db_notify_type::srchtbl_changed :
 						   db_notify_type::cttbl_changed;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			dbeng_notify_cttbl(dbase, *ptable, datagram1);
 			continue;
 		}
 
@@ -2011,8 +2630,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram1.db_notify.type = ptable->b_search ?
 							   db_notify_type::srchtbl_row_modified :
 							   db_notify_type::cttbl_row_modified;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram1);
+				dbeng_notify_cttbl(dbase, *ptable, datagram1);
 			} else if (stm_sel_tx.col_int64(4) == CONTENT_ROW_HEADER) {
 				padded_row1->row_message_id = stm_sel_tx.col_int64(3);
 				padded_row1->after_row_id = inst_id;
@@ -2021,8 +2639,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram1.db_notify.type = ptable->b_search ?
 				                           db_notify_type::srchtbl_row_added :
 				                           db_notify_type::cttbl_row_added;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram1);
+				dbeng_notify_cttbl(dbase, *ptable, datagram1);
 			} else {
 				padded_row->row_instance = stm_sel_tx.col_int64(10);
 				padded_row->after_row_id = inst_id;
@@ -2031,8 +2648,7 @@ static void dbeng_notify_cttbl_add_row(db_conn *pdb,
 				datagram.db_notify.type = ptable->b_search ?
 				                          db_notify_type::srchtbl_row_added :
 				                          db_notify_type::cttbl_row_added;
-				notification_agent_backward_notify(
-					ptable->remote_id, &datagram);
+				dbeng_notify_cttbl(dbase, *ptable, datagram);
 			}
 			stm_sel_tx.reset();
 		}
@@ -2440,9 +3056,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 	for (auto &tnode : dbase.tables.table_list) {
 		auto ptable = &tnode;
 		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
-			continue;
-		if (dbase.tables.b_batch && ptable->b_hint)
+		    folder_id != ptable->folder_id || ptable->shared_id != 0)
 			continue;
 		if (ptable->instance_tag == 0)
 			snprintf(sql_string, std::size(sql_string), "SELECT row_id "
@@ -2456,10 +3070,11 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
 			continue;
 		pstmt.finalize();
-		if (dbase.tables.b_batch) {
+		if (dbase.tables.b_batch)
 			ptable->b_hint = TRUE;
-			continue;
-		}
+		bool b_quiet = dbase.tables.b_batch ||
+		               (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS);
+		++g_cttbl_counters.deleted;
 		if (NULL == pdeleted_row) {
 			pdeleted_row = cu_alloc<DB_NOTIFY_CONTENT_TABLE_ROW_DELETED>();
 			if (pdeleted_row == nullptr)
@@ -2509,7 +3124,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 				continue;
 			if (sql_savepoint.commit() != SQLITE_OK)
 				continue;
-			if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
+			if (b_quiet)
 				continue;
 			if (!common_util_get_message_parent_folder(pdb->psqlite,
 			    message_id, &pdeleted_row->row_folder_id))
@@ -2519,8 +3134,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_deleted :
 			                          db_notify_type::cttbl_row_deleted;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			continue;
 		}
 		b_index = FALSE;
@@ -2771,14 +3385,13 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 		}
 		if (sql_savepoint.commit() != SQLITE_OK)
 			continue;
-		if (ptable->table_flags & TABLE_FLAG_NONOTIFICATIONS)
+		if (b_quiet)
 			continue;
 		if (b_resorted) {
 			datagram1.db_notify.type = ptable->b_search ?
 			                           db_notify_type::srchtbl_changed :
 			                           db_notify_type::cttbl_changed;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			dbeng_notify_cttbl(dbase, *ptable, datagram1);
 			continue;
 		}
 		for (pnode1 = double_list_get_head(&tmp_list); NULL != pnode1;
@@ -2801,8 +3414,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_deleted :
 			                          db_notify_type::cttbl_row_deleted;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 		}
 		if (double_list_get_nodes_num(&notify_list) == 0)
 			continue;
@@ -2849,8 +3461,7 @@ static void dbeng_notify_cttbl_delete_row(db_conn *pdb,
 			datagram1.db_notify.type = ptable->b_search ?
 			                           db_notify_type::srchtbl_row_modified :
 			                           db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram1);
+			dbeng_notify_cttbl(dbase, *ptable, datagram1);
 			sqlite3_reset(pstmt1);
 		}
 	}
@@ -3051,7 +3662,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 	for (const auto &tnode : dbase.tables.table_list) {
 		auto ptable = &tnode;
 		if (ptable->type != table_type::content ||
-		    folder_id != ptable->folder_id)
+		    folder_id != ptable->folder_id || ptable->shared_id != 0)
 			continue;
 		if (ptable->instance_tag == 0)
 			snprintf(sql_string, std::size(sql_string), "SELECT count(*) "
@@ -3066,6 +3677,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 		    sqlite3_column_int64(pstmt, 0) == 0)
 			continue;
 		pstmt.finalize();
+		++g_cttbl_counters.modified;
 		if (NULL == pmodified_row) {
 			pmodified_row = cu_alloc<DB_NOTIFY_CONTENT_TABLE_ROW_MODIFIED>();
 			if (pmodified_row == nullptr)
@@ -3110,8 +3722,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			continue;
 		} else if (0 == ptable->psorts->ccategories) {
 			size_t i;
@@ -3204,8 +3815,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			continue;
 		}
 		{
@@ -3560,16 +4170,31 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptable->b_search ?
 			                          db_notify_type::srchtbl_row_modified :
 			                          db_notify_type::cttbl_row_modified;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			sqlite3_reset(pstmt1);
 		}
 		continue;
 		}
  REFRESH_TABLE:
+		/*
+		 * The row(s) cannot be updated in place. They are deleted and
+		 * re-added below. For categorized tables, this happens without
+		 * row notifications (headers may appear or vanish, which
+		 * clients cannot be told about row by row), and a
+		 * table-changed notification is sent instead. Known limitation,
+		 * see exmdb_provider(4gx).
+		 */
+		++g_cttbl_counters.resorted;
 		auto &stor = tmp_list.emplace_back(*ptable, table_node::clone_t{});
 		if (ptable->psorts->ccategories != 0)
 			stor.table_flags |= TABLE_FLAG_NONOTIFICATIONS;
+		/* Sharers only need to be present for notifications */
+		for (const auto &o : dbase.tables.table_list) {
+			if (o.shared_id != ptable->table_id)
+				continue;
+			auto &f = tmp_list.emplace_back(o, table_node::clone_t{});
+			f.table_flags = stor.table_flags;
+		}
 
 		/* Else, some methods will need to be written */
 		static_assert(!std::is_copy_constructible_v<table_node>);
@@ -3587,6 +4212,8 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 	std::swap(dbase.tables.table_list, tmp_list);
 	for (const auto &tnode : tmp_list) {
 		auto ptable = &tnode;
+		if (ptable->shared_id != 0)
+			continue;
 		datagram.id_array[0] = ptable->table_id; // reserved earlier
 		for (auto &tnode1 : dbase.tables.table_list) {
 			auto ptnode = &tnode1;
@@ -3599,8 +4226,7 @@ static void dbeng_notify_cttbl_modify_row(db_conn *pdb,
 			datagram.db_notify.type = ptnode->b_search ?
 			                          db_notify_type::srchtbl_changed :
 			                          db_notify_type::cttbl_changed;
-			notification_agent_backward_notify(
-				ptable->remote_id, &datagram);
+			dbeng_notify_cttbl(dbase, *ptable, datagram);
 			break;
 		}
 	}
@@ -3955,24 +4581,23 @@ void db_conn::begin_batch_mode(db_base &dbase)
 
 void db_conn::commit_batch_mode_release(db_conn_ptr &&pdb, db_base_wr_ptr &&dbase)
 {
-	auto table_num = dbase->tables.table_list.size();
-	auto ptable_ids = table_num > 0 ? cu_alloc<uint32_t>(table_num) : nullptr;
-	table_num = 0;
-	if (ptable_ids != nullptr) {
-		for (auto &tnode : dbase->tables.table_list) {
-			auto ptable = &tnode;
-			if (ptable->b_hint) {
-				ptable_ids[table_num++] = ptable->table_id;
-				ptable->b_hint = FALSE;
-			}
-		}
+	/*
+	 * Touched tables have been kept up to date row by row, only the
+	 * per-row notifications were held back.
+	 */
+	NOTIFQ notifq;
+	for (auto &t : dbase->tables.table_list) {
+		if (!t.b_hint)
+			continue;
+		t.b_hint = false;
+		for (const auto &o : dbase->tables.table_list)
+			if (o.table_id == t.table_id || o.shared_id == t.table_id)
+				pdb->notify_cttbl_reload(o.table_id, *dbase, notifq);
 	}
 	dbase->tables.b_batch = false;
 	dbase.reset();
 	pdb.reset();
-	auto dir = exmdb_server::get_dir();
-	while (table_num-- > 0)
-		exmdb_server::reload_content_table(dir, ptable_ids[table_num]);
+	dg_notify(std::move(notifq));
 }
 
 void db_conn::cancel_batch_mode(db_base &dbase)
@@ -3987,5 +4612,7 @@ void db_close::operator()(sqlite3 *x) const
 	auto z = sqlite3_db_filename(x, nullptr);
 	if (z != nullptr)
 		mlog(LV_INFO, "I-1762: exmdb: closing %s", z);
+	gx_sql_cache_detach(x);
+	cu_id_reserve_detach(x);
 	sqlite3_close_v2(x);
 }
@@ -8,10 +8,12 @@
 #include <shared_mutex>
 #include <sqlite3.h>
 #include <string>
+#include <vector>
 #include <gromox/clock.hpp>
 #include <gromox/database.h>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
+#include <gromox/restriction.hpp>
 #define CONTENT_ROW_HEADER						1
 #define CONTENT_ROW_MESSAGE						2
 
@@ -34,6 +36,7 @@ struct dynamic_node {
 	uint64_t folder_id = 0; /* search folder ID */
 	uint32_t search_flags = 0;
 	RESTRICTION *prestriction = nullptr;
+	gromox::res_program prog; /* compiled prestriction, if possible */
 	LONGLONG_ARRAY folder_ids{}; /* source folder IDs */
 };
 
@@ -65,6 +68,14 @@ struct table_node {
 	uint32_t instance_tag = 0, extremum_tag = 0, header_id = 0;
 	BOOL b_search = false;
 	BOOL b_hint = false; /* is table touched in batch-mode */
+	/*
+	 * Content tables with equal @share_key use one row table. The first
+	 * owns t<table_id>; the others have @shared_id set to the owner's id
+	 * and t<table_id> is a view of the owner's rows.
+	 */
+	uint32_t shared_id = 0;
+	bool b_private = false; /* rows diverged from a fresh load (expand/collapse) */
+	std::string share_key;
 };
 
 struct nsub_node {
@@ -101,6 +112,38 @@ struct prepared_statements {
 	gromox::xstmt msg_norm, msg_str, rcpt_norm, rcpt_str;
 };
 
+/**
+ * Change numbers and EIDs of one store, reserved ahead in the configurations
+ * table, so that not every allocation has to write there. A reservation mark
+ * is written before any ID from the new range is handed out. Whoever wrote
+ * it keeps the store write lock until the transaction ends; the commit and
+ * rollback hooks of the handle then tell the next allocation whether the
+ * range still stands.
+ *
+ * @step:     block size, g_exmdb_id_reserve as of the first allocation
+ * @state:    idle, open (mark written, transaction still running), committed
+ *            (to be checked against the table once) or rolled_back
+ * @pending:  handle whose running transaction wrote the mark (state open)
+ * @cn_next:  next CN to hand out; cn_end-1 is what the table has
+ * @eid_next: next EID to hand out; eid_end is what the table has
+ * @eid_max:  CONFIG_ID_MAXIMUM_EID
+ */
+struct id_reserve {
+	enum state_t : uint8_t { idle, open, committed, rolled_back };
+
+	std::mutex lock;
+	unsigned int step = 0;
+	std::atomic<state_t> state{idle};
+	std::atomic<sqlite3 *> pending{nullptr};
+	bool cn_valid = false, cn_dirty = false;
+	bool eid_valid = false, eid_dirty = false;
+	uint64_t cn_next = 0, cn_end = 0;
+	uint64_t eid_next = 0, eid_end = 0, eid_max = 0;
+};
+
+extern void cu_id_reserve_attach(sqlite3 *, id_reserve *);
+extern void cu_id_reserve_detach(sqlite3 *);
+
 struct db_close;
 using db_handle = std::unique_ptr<sqlite3, db_close>;
 
@@ -109,18 +152,24 @@ using db_handle = std::unique_ptr<sqlite3, db_close>;
  * db_conn.
  *
  * @reference: client reference count, db_base can be destroyed when count is 0
+ * @last_time: when the last db_conn was released (LRU order for eviction)
+ * @mem_bytes: last mem_usage() figure, as included in the cache total
  * @mx_sqlite: cached sqlite handles for exchange.sqlite3
+ * @mx_sqlite_ro: cached read-only handles for exchange.sqlite3, used by RPCs
+ *                classified in exmdb_rpc_readonly
  * @mx_sqlite_eph: cached sqlite handles for tables.sqlite3
+ * @ids: CN/EID ranges, attached to every exchange.sqlite3 write handle
  */
 struct db_base {
-	enum DB_TYPE : uint8_t {DB_MAIN = 0, DB_EPH = 1};
+	enum DB_TYPE : uint8_t {DB_MAIN = 0, DB_EPH = 1, DB_MAIN_RO = 2};
 
 	db_base();
 	~db_base();
 
 	mutable std::shared_mutex giant_lock;
 	std::atomic<int> reference;
-	gromox::time_point last_time{};
+	std::atomic<gromox::time_point> last_time{};
+	std::atomic<size_t> mem_bytes{0};
 	/* memory database for holding rop table objects instance */
 	struct {
 		std::atomic<uint32_t> last_id = 0;
@@ -130,22 +179,27 @@ struct db_base {
 	std::vector<nsub_node> nsub_list;
 	std::vector<dynamic_node> dynamic_list; /* dynamic searches */
 	std::vector<instance_node> instance_list;
+	std::atomic<bool> fts_present{false}; /* exmdb/fulltext.sqlite3 exists */
+	id_reserve ids;
 
 	uint32_t next_instance_id() const;
 	instance_node *get_instance(uint32_t);
 	inline const instance_node *get_instance_c(uint32_t id) const { return const_cast<db_base *>(this)->get_instance(id); }
 	const table_node *find_table(uint32_t) const;
-	void handle_spares(sqlite3 *, sqlite3 *);
+	table_node *find_table(uint32_t);
+	void handle_spares(sqlite3 *, sqlite3 *, bool readonly);
+	size_t mem_usage();
+	size_t spare_count();
 
 	void open(const char* dir);
 	void drop_all();
-	void get_dbs(const char *dir, sqlite3 *&main, sqlite3 *&eph);
+	void get_dbs(const char *dir, sqlite3 *&main, sqlite3 *&eph, bool readonly);
 
 private:
 	db_handle get_db(const char *dir, DB_TYPE);
 
 	std::mutex sqlite_lock;
-	std::vector<db_handle> mx_sqlite, mx_sqlite_eph;
+	std::vector<db_handle> mx_sqlite, mx_sqlite_ro, mx_sqlite_eph;
 };
 
 struct db_base_unlock_rd {
@@ -171,12 +225,15 @@ struct db_conn {
 	/* As long as any NOTIFQ object is alive, dbase should be held at least read-locked. */
 	using NOTIFQ = std::vector<std::pair<DB_NOTIFY_DATAGRAM, ID_ARRAYS>>;
 
+	struct borrow_tag {};
+
 	db_conn(db_base &);
+	db_conn(const db_conn &, borrow_tag);
 	~db_conn();
 	db_conn(db_conn &&);
 	db_conn &operator=(db_conn &&);
 
-	bool open(const char *dir);
+	bool open(const char *dir, bool readonly = false);
 	db_base_rd_ptr lock_base_rd() const;
 	db_base_wr_ptr lock_base_wr();
 	void update_dynamic(uint64_t folder_id, uint32_t search_flags, const RESTRICTION *prestriction, const LONGLONG_ARRAY *pfolder_ids, db_base &);
@@ -211,9 +268,37 @@ struct db_conn {
 
 	private:
 	db_base *m_base = nullptr;
+	bool m_borrowed = false; /* handles belong to a db_conn_pin */
+	bool m_readonly = false; /* psqlite is from db_base::mx_sqlite_ro */
 };
 using db_conn_ptr = std::optional<db_conn>;
 
+/**
+ * While a db_conn_pin object exists, db_engine_get_db calls from the same
+ * thread for the same @dir hand out the pinned sqlite handles instead of
+ * (re)acquiring them from the spares list. Used to run a batch of RPCs
+ * against one store with a single connection. Nested pins are no-ops.
+ */
+struct db_conn_pin {
+	db_conn_pin(const char *dir);
+	~db_conn_pin();
+	NOMOVE(db_conn_pin);
+
+	private:
+	bool m_active = false;
+};
+
+/* How content tables followed message changes (since startup) */
+struct cttbl_counters {
+	std::atomic<uint64_t> added{}, deleted{}, modified{}, resorted{}, reloaded{};
+	std::atomic<uint64_t> shared{}, copied{};
+};
+
+/* Store cache (g_hash_table) accounting */
+struct db_cache_counters {
+	std::atomic<uint64_t> bytes{}, stores{}, evicted{};
+};
+
 extern void db_engine_init(size_t table_size, int cache_interval, unsigned int threads_num);
 extern int db_engine_run();
 extern void db_engine_stop();
@@ -223,6 +308,8 @@ extern BOOL db_engine_vacuum(const char *path);
 BOOL db_engine_unload_db(const char *path);
 extern BOOL db_engine_enqueue_populating_criteria(const char *dir, cpid_t, uint64_t folder_id, BOOL recursive, const RESTRICTION *, const LONGLONG_ARRAY *folder_ids);
 extern bool db_engine_check_populating(const char *dir, uint64_t folder_id);
+extern bool db_engine_search_progress(sqlite3 *, uint64_t folder_id, uint32_t *scanned, uint32_t *total);
+extern void db_engine_cache_stats(std::vector<exmdb_cache_entry> &);
 extern void dg_notify(db_conn::NOTIFQ &&);
 
 extern unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
@@ -232,4 +319,16 @@ extern unsigned int g_exmdb_pvt_folder_softdel;
 extern std::string g_exmdb_ics_log_file;
 /* Max number of cached DB connections per store, 0 = unlimited */
 extern unsigned int g_exmdb_max_sqlite_spares;
+/* Max number of cached read-only connections per store, 0 = no read-only connections */
+extern unsigned int g_exmdb_sqlite_reader_spares;
+/* Max number of prepared statements kept per sqlite handle, 0 = off */
+extern unsigned int g_exmdb_stmt_cache_size;
+/* Messages per transaction in move/copy/delete_messages, 0 = unlimited */
+extern unsigned int g_exmdb_bulk_pacing;
+/* CNs/EIDs reserved per write of the high-water mark, 0/1 = no reservation */
+extern unsigned int g_exmdb_id_reserve;
 extern unsigned long long g_sqlite_busy_timeout_ns;
+/* Memory budget for the store cache, 0 = unlimited */
+extern uint64_t g_exmdb_cache_budget;
+extern cttbl_counters g_cttbl_counters;
+extern db_cache_counters g_db_cache_counters;
@@ -1824,6 +1824,27 @@ BOOL exmdb_server::get_search_criteria(const char *dir, uint64_t folder_id,
 	return TRUE;
 }
 
+/**
+ * Report how far the population of search folder @folder_id has got, so that
+ * clients can show a percentage. @scanned and @total are message counts over
+ * the whole (expanded) scope; both are 0 when no population is pending.
+ */
+BOOL exmdb_server::get_search_progress(const char *dir, uint64_t folder_id,
+    uint32_t *pscanned, uint32_t *ptotal)
+{
+	*pscanned = *ptotal = 0;
+	if (!exmdb_server::is_private())
+		return TRUE;
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return FALSE;
+	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
+	if (!sql_transact)
+		return false;
+	return db_engine_search_progress(pdb->psqlite,
+	       rop_util_get_gc_value(folder_id), pscanned, ptotal);
+}
+
 static BOOL folder_clear_search_folder(db_conn_ptr &pdb,
     cpid_t cpid, uint64_t folder_id, db_base *dbase, db_conn::NOTIFQ &notifq)
 {
@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Optional per-mailbox full-text index.
+ *
+ * The index lives in exmdb/fulltext.sqlite3 and is ATTACHed as schema "fts"
+ * to every exchange.sqlite3 connection once it exists. msgtext is an FTS5
+ * table with the trigram tokenizer (rowid = message_id), which answers
+ * substring queries of three or more characters, case-insensitively.
+ * msgindexed records the change number each message had when it was
+ * indexed; a message whose change number moved on since is treated as
+ * unindexed, so paths that modify messages without going through
+ * cu_fts_index_message only cost speed, never correctness. Rows of messages
+ * that get deleted, by whatever path, are removed by a trigger.
+ */
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <fmt/core.h>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mail_func.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/util.hpp>
+#include "db_engine.hpp"
+
+using namespace gromox;
+
+namespace exmdb {
+
+static constexpr unsigned int FTS_REBUILD_BATCH = 256;
+
+bool cu_fts_active(sqlite3 *db)
+{
+	return sqlite3_db_filename(db, "fts") != nullptr;
+}
+
+/**
+ * Attach the full-text index of @dir to @db. Unless @create is set, nothing
+ * happens when the index file does not exist yet.
+ */
+bool cu_fts_attach(sqlite3 *db, const char *dir, bool create) try
+{
+	if (cu_fts_active(db))
+		return true;
+	auto path = fmt::format("{}/exmdb/fulltext.sqlite3", dir);
+	if (!create && access(path.c_str(), F_OK) != 0)
+		return false;
+	auto stm = gx_sql_prep(db, "ATTACH DATABASE ? AS fts");
+	if (stm == nullptr)
+		return false;
+	stm.bind_text(1, path.c_str());
+	if (stm.step() != SQLITE_DONE) {
+		mlog(LV_ERR, "E-1320: cannot attach %s: %s", path.c_str(), sqlite3_errmsg(db));
+		return false;
+	}
+	stm.finalize();
+	gx_sql_exec(db, "PRAGMA fts.journal_mode=WAL");
+	if (create && (gx_sql_exec(db, "CREATE VIRTUAL TABLE IF NOT EXISTS fts.msgtext USING "
+	    "fts5(subject, body, names, attachments, tokenize='trigram')") != SQLITE_OK ||
+	    gx_sql_exec(db, "CREATE TABLE IF NOT EXISTS fts.msgindexed ("
+	    "message_id INTEGER PRIMARY KEY, change_number INTEGER NOT NULL)") != SQLITE_OK)) {
+		mlog(LV_ERR, "E-1323: %s: cannot set up the full-text index "
+		        "(SQLite without FTS5/trigram?)", dir);
+		gx_sql_exec(db, "DETACH DATABASE fts");
+		return false;
+	}
+	/*
+	 * Only TEMP triggers may reach into another schema, so this is set up
+	 * per connection. It covers hard deletion, emptying/deleting folders,
+	 * purging soft-deleted messages and the source side of moves alike.
+	 */
+	if (gx_sql_exec(db, "CREATE TEMP TRIGGER IF NOT EXISTS fts_forget"
+	    " AFTER DELETE ON main.messages BEGIN"
+	    " DELETE FROM fts.msgindexed WHERE message_id=OLD.message_id;"
+	    " DELETE FROM fts.msgtext WHERE rowid=OLD.message_id; END") != SQLITE_OK) {
+		mlog(LV_ERR, "E-1368: %s: cannot set up the full-text index trigger", dir);
+		gx_sql_exec(db, "DETACH DATABASE fts");
+		return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1326: ENOMEM");
+	return false;
+}
+
+/**
+ * Name of the msgtext column that holds (a superset of) the text the
+ * restriction interpreter sees for @tag, or nullptr.
+ */
+const char *cu_fts_column(uint32_t tag)
+{
+	if (PROP_TYPE(tag) == PT_STRING8)
+		tag = CHANGE_PROP_TYPE(tag, PT_UNICODE);
+	switch (tag) {
+	case PR_SUBJECT:
+		return "subject";
+	case PR_BODY:
+		return "body";
+	case PR_SENDER_NAME:
+	case PR_SENT_REPRESENTING_NAME:
+	case PR_DISPLAY_TO:
+	case PR_DISPLAY_CC:
+	case PR_DISPLAY_BCC:
+		return "names";
+	case PR_ATTACH_LONG_FILENAME:
+	case PR_ATTACH_FILENAME:
+		return "attachments";
+	default:
+		return nullptr;
+	}
+}
+
+/* Whether changing message property @tag affects the indexed text */
+bool cu_fts_indexed_tag(uint32_t tag)
+{
+	if (PROP_TYPE(tag) == PT_STRING8)
+		tag = CHANGE_PROP_TYPE(tag, PT_UNICODE);
+	switch (tag) {
+	case PR_SUBJECT:
+	case PR_SUBJECT_PREFIX:
+	case PR_NORMALIZED_SUBJECT:
+	case PR_BODY:
+	case PR_HTML:
+	case PR_SENDER_NAME:
+	case PR_SENT_REPRESENTING_NAME:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool fts_append(sqlite3 *db, mapi_object_type type, uint64_t id,
+    uint32_t tag, std::string &out)
+{
+	void *v = nullptr;
+	if (!cu_get_property(type, id, CP_UTF8, db, tag, &v))
+		return false;
+	if (v == nullptr || *static_cast<const char *>(v) == '\0')
+		return true;
+	if (!out.empty())
+		out += '\n';
+	out += static_cast<const char *>(v);
+	return true;
+}
+
+/**
+ * (Re)index one top-level message. Values are fetched the same way
+ * cu_eval_msg_restriction fetches them, so whatever the interpreter would
+ * find with a substring search is also in the index.
+ */
+bool cu_fts_index_message(sqlite3 *db, uint64_t mid) try
+{
+	if (!cu_fts_active(db))
+		return true;
+	std::string subject, body, names, atx;
+	if (!fts_append(db, MAPI_MESSAGE, mid, PR_SUBJECT, subject) ||
+	    !fts_append(db, MAPI_MESSAGE, mid, PR_BODY, body))
+		return false;
+	if (body.empty()) {
+		void *v = nullptr;
+		if (!cu_get_property(MAPI_MESSAGE, mid, CP_UTF8, db, PR_HTML, &v))
+			return false;
+		auto bin = static_cast<const BINARY *>(v);
+		if (bin != nullptr && bin->cb > 0 &&
+		    (html_to_plain(bin->pc, bin->cb, body) < 0 ||
+		    !utf8_valid(body.c_str())))
+			body.clear();
+	}
+	static constexpr uint32_t name_tags[] = {PR_SENDER_NAME,
+		PR_SENT_REPRESENTING_NAME, PR_DISPLAY_TO, PR_DISPLAY_CC,
+		PR_DISPLAY_BCC};
+	for (auto tag : name_tags)
+		if (!fts_append(db, MAPI_MESSAGE, mid, tag, names))
+			return false;
+	auto stm = gx_sql_prep(db, "SELECT attachment_id FROM attachments WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, mid);
+	while (stm.step() == SQLITE_ROW) {
+		auto atid = stm.col_uint64(0);
+		if (!fts_append(db, MAPI_ATTACH, atid, PR_ATTACH_LONG_FILENAME, atx) ||
+		    !fts_append(db, MAPI_ATTACH, atid, PR_ATTACH_FILENAME, atx))
+			return false;
+	}
+	stm.finalize();
+
+	if (!cu_fts_forget(db, mid))
+		return false;
+	stm = gx_sql_prep(db, "INSERT INTO fts.msgtext (rowid, subject, body,"
+	      " names, attachments) VALUES (?,?,?,?,?)");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, mid);
+	stm.bind_text(2, subject.c_str());
+	stm.bind_text(3, body.c_str());
+	stm.bind_text(4, names.c_str());
+	stm.bind_text(5, atx.c_str());
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	stm = gx_sql_prep(db, "INSERT INTO fts.msgindexed (message_id, change_number)"
+	      " SELECT message_id, change_number FROM messages WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, mid);
+	return stm.step() == SQLITE_DONE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1327: ENOMEM");
+	return false;
+}
+
+bool cu_fts_forget(sqlite3 *db, uint64_t mid)
+{
+	if (!cu_fts_active(db))
+		return true;
+	auto stm = gx_sql_prep(db, "DELETE FROM fts.msgindexed WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, mid);
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	stm = gx_sql_prep(db, "DELETE FROM fts.msgtext WHERE rowid=?");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, mid);
+	return stm.step() == SQLITE_DONE;
+}
+
+/**
+ * Best-effort index maintenance for write paths: a message that could not
+ * be indexed is dropped from the index so searches fall back to the
+ * interpreter for it.
+ */
+void cu_fts_update(sqlite3 *db, uint64_t mid)
+{
+	if (!cu_fts_active(db) || cu_fts_index_message(db, mid))
+		return;
+	mlog(LV_DEBUG, "D-1369: could not index message %llu for full-text search",
+	        static_cast<unsigned long long>(mid));
+	cu_fts_forget(db, mid);
+}
+
+}
+
+/**
+ * Create the full-text index of a mailbox if necessary and (re)populate it
+ * from scratch. Work is committed in batches so that the store remains
+ * writable in the meantime; messages that have not been reached yet are
+ * simply searched the slow way.
+ */
+BOOL exmdb_server::rebuild_fulltext(const char *dir, uint32_t *count) try
+{
+	*count = 0;
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return false;
+	auto db = pdb->psqlite;
+	if (!cu_fts_attach(db, dir, true))
+		return false;
+	pdb->lock_base_wr()->fts_present = true;
+	if (gx_sql_exec(db, "DELETE FROM fts.msgindexed") != SQLITE_OK ||
+	    gx_sql_exec(db, "DELETE FROM fts.msgtext") != SQLITE_OK)
+		return false;
+
+	std::vector<uint64_t> mids;
+	uint64_t last_mid = 0;
+	do {
+		/* Property values of this batch are released at the end of it */
+		exmdb_server::alloc_scope batch_alloc;
+		auto sql_transact = gx_sql_begin(db, txn_mode::write);
+		if (!sql_transact)
+			return false;
+		auto stm = gx_sql_prep(db, "SELECT message_id FROM messages"
+		           " WHERE parent_fid IS NOT NULL AND message_id>?"
+		           " ORDER BY message_id LIMIT ?");
+		if (stm == nullptr)
+			return false;
+		stm.bind_int64(1, last_mid);
+		stm.bind_int64(2, FTS_REBUILD_BATCH);
+		mids.clear();
+		while (stm.step() == SQLITE_ROW)
+			mids.push_back(stm.col_uint64(0));
+		stm.finalize();
+		for (auto mid : mids)
+			if (cu_fts_index_message(db, mid))
+				++*count;
+		if (sql_transact.commit() != SQLITE_OK)
+			return false;
+		if (!mids.empty())
+			last_mid = mids.back();
+	} while (mids.size() == FTS_REBUILD_BATCH);
+	gx_sql_exec(db, "INSERT INTO fts.msgtext (msgtext) VALUES ('optimize')");
+	mlog(LV_NOTICE, "I-1325: %s: full-text index rebuilt, %u messages",
+	        dir, *count);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1328: ENOMEM");
+	return false;
+}
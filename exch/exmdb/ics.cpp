@@ -23,6 +23,7 @@ namespace {
 
 struct ENUM_PARAM {
 	xstmt stm_exist, stm_msg;
+	const std::vector<uint64_t> *exist = nullptr; /* sorted; replaces stm_exist */
 	EID_ARRAY *pdeleted_eids;
 	EID_ARRAY *pnolonger_mids;
 	BOOL b_result;
@@ -46,9 +47,8 @@ static void ics_enum_content_idset(void *vparam, uint64_t message_id)
 	if (!pparam->b_result)
 		return;
 	mid_val = rop_util_get_gc_value(message_id);
-	sqlite3_reset(pparam->stm_exist);
-	sqlite3_bind_int64(pparam->stm_exist, 1, mid_val);
-	if (pparam->stm_exist.step() == SQLITE_ROW)
+	if (std::binary_search(pparam->exist->cbegin(),
+	    pparam->exist->cend(), mid_val))
 		return;
 	sqlite3_reset(pparam->stm_msg);
 	sqlite3_bind_int64(pparam->stm_msg, 1, mid_val);
@@ -86,6 +86,80 @@ static ec_error_t delete_impossible_mids(const idset &given, EID_ARRAY &del)
 	return p1.error;
 }
 
+/**
+ * If @set is empty for replid 1, or holds exactly the one range 1..x there
+ * (which is the form the ICS state writers produce), report x, so that
+ * membership of a CN can be evaluated as "CN <= x" by an index range scan.
+ */
+static bool ics_cn_watermark(const idset *set, uint64_t *hwm)
+{
+	*hwm = 0;
+	if (set == nullptr)
+		return true;
+	const auto &rl = set->get_repl_list();
+	auto node = std::find_if(rl.cbegin(), rl.cend(),
+	            [](const repl_node &n) { return n.replid == 1; });
+	if (node == rl.cend() || node->range_list.size() == 0)
+		return true;
+	if (node->range_list.size() != 1 || node->range_list.begin()->lo > 1)
+		return false;
+	*hwm = node->range_list.begin()->hi;
+	return true;
+}
+
+/* Number of replid-1 IDs in @set */
+static uint64_t ics_idset_count(const idset &set)
+{
+	uint64_t count = 0;
+	for (const auto &node : set.get_repl_list())
+		if (node.replid == 1)
+			for (const auto &r : node.range_list)
+				count += r.hi - r.lo + 1;
+	return count;
+}
+
+static bool ics_have_tombstones(const db_conn &db)
+{
+	auto stm = db.prep("SELECT 1 FROM sqlite_master WHERE "
+	           "type='table' AND name='message_tombstones'");
+	return stm != nullptr && stm.step() == SQLITE_ROW;
+}
+
+/**
+ * Produce the deleted/nolonger MIDs from the folder's tombstone list rather
+ * than by enumerating all of @given. @missing is the number of replid-1 MIDs
+ * in @given that are not in @param->exist. If the tombstones do not account
+ * for all of them (deletions predating the list, restriction or FAI
+ * filtering), the arrays are rolled back and false is returned, so that the
+ * caller can do the full enumeration.
+ */
+static bool ics_deleted_from_tombstones(const db_conn &db, uint64_t fid_val,
+    const idset &given, uint64_t missing, ENUM_PARAM &param)
+{
+	auto stm = db.prep("SELECT message_id FROM message_tombstones "
+	           "WHERE folder_id=? ORDER BY message_id");
+	if (stm == nullptr)
+		return false;
+	sqlite3_bind_int64(stm, 1, fid_val);
+	auto del_before = param.pdeleted_eids->count;
+	auto nolonger_before = param.pnolonger_mids->count;
+	uint64_t found = 0;
+	while (stm.step() == SQLITE_ROW && param.b_result) {
+		auto eid = rop_util_make_eid_ex(1, sqlite3_column_int64(stm, 0));
+		if (!given.contains(eid))
+			continue;
+		auto n = param.pdeleted_eids->count + param.pnolonger_mids->count;
+		ics_enum_content_idset(&param, eid);
+		found += param.pdeleted_eids->count + param.pnolonger_mids->count - n;
+	}
+	if (param.b_result && found == missing)
+		return true;
+	param.pdeleted_eids->count = del_before;
+	param.pnolonger_mids->count = nolonger_before;
+	param.b_result = TRUE;
+	return false;
+}
+
 /**
  * @username:     Used for retrieving public store readstates
  * @pgiven:       Set of MIDs the client has
@@ -115,16 +189,15 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	/*
 	 * Setup of scratch space db.
 	 *
-	 * All three tables are implicitly ordered by MID (due to PK)
-	 * SELECTs on those three should use ORDER BY if explicit order is desired.
+	 * Both tables are implicitly ordered by MID (due to PK)
+	 * SELECTs on those two should use ORDER BY if explicit order is desired.
+	 * The set of messages the server has is kept in @exist instead, as it
+	 * can be large and is only ever looked up.
 	 */
 	if (sqlite3_open_v2(":memory:", &psqlite,
 	    SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
 		return FALSE;
 	auto cl_0 = make_scope_exit([&]() { sqlite3_close(psqlite); });
-	if (gx_sql_exec(psqlite, "CREATE TABLE existence "
-	    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
 	if (pread != nullptr &&
 	    gx_sql_exec(psqlite, "CREATE TABLE reads "
 	    "(message_id INTEGER PRIMARY KEY, read_state INTEGER)") != SQLITE_OK)
@@ -154,18 +227,38 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	xtransaction transact2 = gx_sql_begin(pdb->psqlite, txn_mode::read);
 	if (!transact2)
 		return false;
+	std::vector<uint64_t> exist;
+	uint64_t given_present = 0;
+	bool b_tombstones = ics_have_tombstones(*pdb);
 
 	/*
 	 * #1:
 	 * Determine message counts, bytesize totals, and maximum CNs.
 	 * (The result is dependent on prestriction.)
+	 *
+	 * When there is no restriction to evaluate and the client state is of
+	 * the "everything up to CN x" form, the CN index (schema 19) yields
+	 * the changed messages directly, and the per-message work is reduced
+	 * to reading (MID,CN) pairs off a covering index.
 	 */
 	{
+	uint64_t seen_hwm = 0, seen_fai_hwm = 0, read_hwm = 0;
+	bool b_cnindex = b_tombstones && prestriction == nullptr &&
+	                 (pseen != nullptr || pseen_fai != nullptr) &&
+	                 ics_cn_watermark(pseen, &seen_hwm) &&
+	                 ics_cn_watermark(pseen_fai, &seen_fai_hwm) &&
+	                 ics_cn_watermark(pread, &read_hwm);
 	auto transact1 = gx_sql_begin(psqlite, txn_mode::write);
 	if (!transact1)
 		return false;
-	char sql_string[256];
-	if (b_private)
+	char sql_string[384];
+	if (b_cnindex)
+		snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
+		         " change_number, is_associated FROM messages"
+		         " INDEXED BY pid_cn_messages_index19"
+		         " WHERE parent_fid=%llu AND is_deleted=0",
+		         static_cast<unsigned long long>(fid_val));
+	else if (b_private)
 		snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
 			" change_number, is_associated, message_size,"
 			" read_state, read_cn FROM messages WHERE "
@@ -184,9 +277,6 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	                      "INSERT INTO changes VALUES (?)");
 	if (stm_insert_chg == nullptr)
 		return false;
-	auto stm_insert_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
-	if (stm_insert_exist == nullptr)
-		return false;
 	xstmt stm_insert_reads, stm_select_rcn, stm_select_rst;
 	if (NULL != pread) {
 		if (!b_private) {
@@ -212,7 +302,142 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	}
 	*plast_cn = 0;
 	*plast_readcn = 0;
-	while (stm_select_msg.step() == SQLITE_ROW) {
+	auto add_read = [&](uint64_t mid_val, int read_state) {
+		sqlite3_reset(stm_insert_reads);
+		sqlite3_bind_int64(stm_insert_reads, 1, mid_val);
+		sqlite3_bind_int64(stm_insert_reads, 2, read_state);
+		return stm_insert_reads.step() == SQLITE_DONE;
+	};
+	auto add_change = [&](uint64_t mid_val, bool b_fai, uint64_t message_size) {
+		uint64_t dtime = 0, mtime = 0;
+		if (b_ordered) {
+			sqlite3_reset(stm_select_mp);
+			sqlite3_bind_int64(stm_select_mp, 1, PR_MESSAGE_DELIVERY_TIME);
+			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
+			dtime = stm_select_mp.step() == SQLITE_ROW ?
+			        sqlite3_column_int64(stm_select_mp, 0) : 0;
+			sqlite3_reset(stm_select_mp);
+			sqlite3_bind_int64(stm_select_mp, 1, PR_LAST_MODIFICATION_TIME);
+			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
+			mtime = stm_select_mp.step() == SQLITE_ROW ?
+			        sqlite3_column_int64(stm_select_mp, 0) : 0;
+		}
+		if (b_fai) {
+			(*pfai_count) ++;
+			*pfai_total += message_size;
+		} else {
+			(*pnormal_count) ++;
+			*pnormal_total += message_size;
+		}
+		sqlite3_reset(stm_insert_chg);
+		sqlite3_bind_int64(stm_insert_chg, 1, mid_val);
+		if (b_ordered) {
+			sqlite3_bind_int64(stm_insert_chg, 2, dtime);
+			sqlite3_bind_int64(stm_insert_chg, 3, mtime);
+		}
+		return stm_insert_chg.step() == SQLITE_DONE;
+	};
+	if (b_cnindex) {
+		/* Pass 1: what the server has, and what the client lacks */
+		std::vector<std::pair<uint64_t, bool>> cand;
+		while (stm_select_msg.step() == SQLITE_ROW) {
+			uint64_t mid_val = sqlite3_column_int64(stm_select_msg, 0);
+			uint64_t change_num = sqlite3_column_int64(stm_select_msg, 1);
+			bool b_fai = sqlite3_column_int64(stm_select_msg, 2) != 0;
+			if (b_fai ? pseen_fai == nullptr : pseen == nullptr)
+				continue;
+			exist.push_back(mid_val);
+			if (change_num > *plast_cn)
+				*plast_cn = change_num;
+			bool b_given = pgiven->contains(rop_util_make_eid_ex(1, mid_val));
+			if (b_given)
+				++given_present;
+			if (!b_given || change_num > (b_fai ? seen_fai_hwm : seen_hwm))
+				cand.emplace_back(mid_val, b_fai);
+		}
+		stm_select_msg.finalize();
+		auto stm_select_size = pdb->prep("SELECT message_size"
+		                       " FROM messages WHERE message_id=?");
+		if (stm_select_size == nullptr)
+			return false;
+		for (const auto &[mid_val, b_fai] : cand) {
+			sqlite3_reset(stm_select_size);
+			sqlite3_bind_int64(stm_select_size, 1, mid_val);
+			if (stm_select_size.step() != SQLITE_ROW)
+				return false;
+			if (!add_change(mid_val, b_fai,
+			    sqlite3_column_int64(stm_select_size, 0)))
+				return false;
+		}
+		/* Pass 2: highest read CN, and read state changes since @read_hwm */
+		auto fai_clause = pseen == nullptr ? " AND m.is_associated<>0" :
+		                  pseen_fai == nullptr ? " AND m.is_associated=0" : "";
+		if (b_private)
+			snprintf(sql_string, std::size(sql_string), "SELECT read_cn"
+			         " FROM messages AS m INDEXED BY pid_readcn_messages_index19"
+			         " WHERE parent_fid=%llu AND read_cn IS NOT NULL AND"
+			         " is_deleted=0%s ORDER BY read_cn DESC LIMIT 1",
+			         static_cast<unsigned long long>(fid_val), fai_clause);
+		else
+			snprintf(sql_string, std::size(sql_string), "SELECT r.read_cn"
+			         " FROM read_cns AS r JOIN messages AS m ON"
+			         " m.message_id=r.message_id WHERE r.username=?"
+			         " AND m.parent_fid=%llu AND m.is_deleted=0%s"
+			         " ORDER BY r.read_cn DESC LIMIT 1",
+			         static_cast<unsigned long long>(fid_val), fai_clause);
+		auto stm_select_rd = pdb->prep(sql_string);
+		if (stm_select_rd == nullptr)
+			return false;
+		if (!b_private)
+			sqlite3_bind_text(stm_select_rd, 1, username, -1, SQLITE_STATIC);
+		if (stm_select_rd.step() == SQLITE_ROW)
+			*plast_readcn = sqlite3_column_int64(stm_select_rd, 0);
+		stm_select_rd.finalize();
+		if (pread != nullptr && pseen != nullptr) {
+			if (b_private)
+				snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
+				         " change_number, read_state FROM messages"
+				         " INDEXED BY pid_readcn_messages_index19"
+				         " WHERE parent_fid=%llu AND read_cn>%llu AND"
+				         " is_deleted=0 AND is_associated=0",
+				         static_cast<unsigned long long>(fid_val),
+				         static_cast<unsigned long long>(read_hwm));
+			else
+				snprintf(sql_string, std::size(sql_string), "SELECT m.message_id,"
+				         " m.change_number FROM read_cns AS r JOIN messages AS m"
+				         " ON m.message_id=r.message_id WHERE r.username=?"
+				         " AND r.read_cn>%llu AND m.parent_fid=%llu AND"
+				         " m.is_deleted=0 AND m.is_associated=0",
+				         static_cast<unsigned long long>(read_hwm),
+				         static_cast<unsigned long long>(fid_val));
+			stm_select_rd = pdb->prep(sql_string);
+			if (stm_select_rd == nullptr)
+				return false;
+			if (!b_private)
+				sqlite3_bind_text(stm_select_rd, 1, username, -1, SQLITE_STATIC);
+			while (stm_select_rd.step() == SQLITE_ROW) {
+				uint64_t mid_val = sqlite3_column_int64(stm_select_rd, 0);
+				uint64_t change_num = sqlite3_column_int64(stm_select_rd, 1);
+				/* Unseen messages are transferred whole (see pass 1) */
+				if (change_num > seen_hwm ||
+				    !pgiven->contains(rop_util_make_eid_ex(1, mid_val)))
+					continue;
+				int read_state;
+				if (b_private) {
+					read_state = sqlite3_column_int64(stm_select_rd, 2);
+				} else {
+					sqlite3_reset(stm_select_rst);
+					sqlite3_bind_int64(stm_select_rst, 1, mid_val);
+					sqlite3_bind_text(stm_select_rst, 2,
+						username, -1, SQLITE_STATIC);
+					read_state = stm_select_rst.step() == SQLITE_ROW;
+				}
+				if (!add_read(mid_val, read_state))
+					return false;
+			}
+		}
+	}
+	while (!b_cnindex && stm_select_msg.step() == SQLITE_ROW) {
 		uint64_t mid_val = sqlite3_column_int64(stm_select_msg, 0);
 		uint64_t change_num = sqlite3_column_int64(stm_select_msg, 1);
 		BOOL b_fai = sqlite3_column_int64(stm_select_msg, 2) == 0 ? false : TRUE;
@@ -230,10 +455,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		    !cu_eval_msg_restriction(pdb->psqlite,
 		    cpid, mid_val, prestriction))
 			continue;	
-		sqlite3_reset(stm_insert_exist);
-		sqlite3_bind_int64(stm_insert_exist, 1, mid_val);
-		if (stm_insert_exist.step() != SQLITE_DONE)
-			return false;
+		exist.push_back(mid_val);
 		if (change_num > *plast_cn)
 			*plast_cn = change_num;
 		uint64_t read_cn;
@@ -252,11 +474,14 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 			*plast_readcn = read_cn;
 		auto msg_eid = rop_util_make_eid_ex(1, mid_val);
 		auto chg_eid = rop_util_make_eid_ex(1, change_num);
+		bool b_given = pgiven->contains(msg_eid);
+		if (b_given)
+			++given_present;
 		if (b_fai) {
-			if (pgiven->contains(msg_eid) &&
+			if (b_given &&
 			    const_cast<idset *>(pseen_fai)->contains(chg_eid))
 				continue;
-		} else if (pgiven->contains(msg_eid) &&
+		} else if (b_given &&
 		    const_cast<idset *>(pseen)->contains(chg_eid)) {
 			if (pread == nullptr)
 				continue;
@@ -273,45 +498,15 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 					username, -1 , SQLITE_STATIC);
 				read_state = stm_select_rst.step() == SQLITE_ROW;
 			}
-			sqlite3_reset(stm_insert_reads);
-			sqlite3_bind_int64(stm_insert_reads, 1, mid_val);
-			sqlite3_bind_int64(stm_insert_reads, 2, read_state);
-			if (stm_insert_reads.step() != SQLITE_DONE)
+			if (!add_read(mid_val, read_state))
 				return false;
 			continue;
 		}
-		uint64_t dtime = 0, mtime = 0;
-		if (b_ordered) {
-			sqlite3_reset(stm_select_mp);
-			sqlite3_bind_int64(stm_select_mp, 1, PR_MESSAGE_DELIVERY_TIME);
-			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
-			dtime = stm_select_mp.step() == SQLITE_ROW ?
-			        sqlite3_column_int64(stm_select_mp, 0) : 0;
-			sqlite3_reset(stm_select_mp);
-			sqlite3_bind_int64(stm_select_mp, 1, PR_LAST_MODIFICATION_TIME);
-			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
-			mtime = stm_select_mp.step() == SQLITE_ROW ?
-			        sqlite3_column_int64(stm_select_mp, 0) : 0;
-		}
-		if (b_fai) {
-			(*pfai_count) ++;
-			*pfai_total += message_size;
-		} else {
-			(*pnormal_count) ++;
-			*pnormal_total += message_size;
-		}
-		sqlite3_reset(stm_insert_chg);
-		sqlite3_bind_int64(stm_insert_chg, 1, mid_val);
-		if (b_ordered) {
-			sqlite3_bind_int64(stm_insert_chg, 2, dtime);
-			sqlite3_bind_int64(stm_insert_chg, 3, mtime);
-		}
-		if (stm_insert_chg.step() != SQLITE_DONE)
+		if (!add_change(mid_val, b_fai, message_size))
 			return false;
 	}
 	stm_select_msg.finalize();
 	stm_insert_chg.finalize();
-	stm_insert_exist.finalize();
 	stm_insert_reads.finalize();
 	stm_select_rcn.finalize();
 	stm_select_rst.finalize();
@@ -322,6 +517,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		*plast_readcn = rop_util_make_eid_ex(1, *plast_readcn);
 	if (transact1.commit() != SQLITE_OK)
 		return false;
+	std::sort(exist.begin(), exist.end());
 	} /* section 1 */
 
 	/*
@@ -375,10 +571,7 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	 */
 	{
 	ENUM_PARAM enum_param;
-	enum_param.stm_exist = gx_sql_prep(psqlite,
-	                       "SELECT message_id FROM existence WHERE message_id=?");
-	if (enum_param.stm_exist == nullptr)
-		return FALSE;
+	enum_param.exist = &exist;
 	enum_param.stm_msg = gx_sql_prep(pdb->psqlite,
 	                     "SELECT message_id FROM messages WHERE message_id=?");
 	if (enum_param.stm_msg == nullptr)
@@ -394,13 +587,20 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	}
 	if (delete_impossible_mids(*pgiven, *enum_param.pdeleted_eids) != ecSuccess)
 		return false;
-	if (!const_cast<idset *>(pgiven)->enum_repl(1, &enum_param,
+	/*
+	 * Nothing to do if everything the client has is still there;
+	 * otherwise try the tombstones before walking all of pgiven.
+	 */
+	auto given_total = ics_idset_count(*pgiven);
+	bool b_done = given_present == given_total ||
+	              (b_tombstones && ics_deleted_from_tombstones(*pdb,
+	              fid_val, *pgiven, given_total - given_present, enum_param));
+	if (!b_done && !const_cast<idset *>(pgiven)->enum_repl(1, &enum_param,
 	    ics_enum_content_idset)) {
 		eid_array_free(enum_param.pdeleted_eids);
 		eid_array_free(enum_param.pnolonger_mids);
 		return FALSE;	
 	}
-	enum_param.stm_exist.finalize();
 	enum_param.stm_msg.finalize();
 	pdeleted_mids->count = enum_param.pdeleted_eids->count;
 	if (0 != enum_param.pdeleted_eids->count) {
@@ -440,29 +640,15 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	pdb.reset();
 
 	/* Query section 4 - pgiven_mids: what the server has */
-	{
-	auto stm_select_exist = gx_sql_prep(psqlite, "SELECT count(*) FROM existence");
-	if (stm_select_exist == nullptr ||
-	    stm_select_exist.step() != SQLITE_ROW)
-		return FALSE;
-	int64_t count = sqlite3_column_int64(stm_select_exist, 0);
-	stm_select_exist.finalize();
 	pgiven_mids->count = 0;
-	if (count <= 0) {
+	if (exist.empty()) {
 		pgiven_mids->pids = NULL;
 	} else {
-		pgiven_mids->pids = cu_alloc<uint64_t>(count);
+		pgiven_mids->pids = cu_alloc<uint64_t>(exist.size());
 		if (pgiven_mids->pids == nullptr)
 			return FALSE;
-		auto stm_select_ex = gx_sql_prep(psqlite, "SELECT message_id"
-		                     " FROM existence ORDER BY message_id DESC");
-		if (stm_select_ex == nullptr)
-			return FALSE;
-		while (stm_select_ex.step() == SQLITE_ROW) {
-			uint64_t mid_val = sqlite3_column_int64(stm_select_ex, 0);
-			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		}
-	}
+		for (auto it = exist.crbegin(); it != exist.crend(); ++it)
+			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, *it);
 	} /* section 4 */
 
 	/* Query section 5 - Determine MIDs for unread and read sets */
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020-2024 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
@@ -632,8 +633,7 @@ void *instance_read_cid_content(const char *cid, uint32_t *plen, uint32_t tag) t
 	BINARY dxbin;
 	if (strchr(cid, '/') != nullptr) {
 		/* v3 */
-		errno = gx_decompress_file(cu_cid_path(nullptr, cid, 0).c_str(), dxbin,
-			common_util_alloc, [](void *, size_t z) { return common_util_alloc(z); });
+		errno = cu_read_cid(nullptr, cid, 0, dxbin);
 		if (errno == ENOENT && g_dbg_synth_content)
 			return fake_read_cid(g_dbg_synth_content, tag, cid, plen);
 		if (errno != 0)
@@ -643,8 +643,7 @@ void *instance_read_cid_content(const char *cid, uint32_t *plen, uint32_t tag) t
 		return dxbin.pv;
 	}
 
-	errno = gx_decompress_file(cu_cid_path(nullptr, cid, 2).c_str(), dxbin,
-	        common_util_alloc, [](void *, size_t z) { return common_util_alloc(z); });
+	errno = cu_read_cid(nullptr, cid, 2, dxbin);
 	if (errno == 0) {
 		if (plen != nullptr)
 			*plen = dxbin.cb;
@@ -652,8 +651,7 @@ void *instance_read_cid_content(const char *cid, uint32_t *plen, uint32_t tag) t
 	} else if (errno != ENOENT) {
 		return nullptr;
 	}
-	errno = gx_decompress_file(cu_cid_path(nullptr, cid, 1).c_str(), dxbin,
-	        common_util_alloc, [](void *, size_t z) { return common_util_alloc(z); });
+	errno = cu_read_cid(nullptr, cid, 1, dxbin);
 	if (errno == 0) {
 		if (dxbin.cb < 4)
 			return nullptr;
@@ -2442,6 +2440,110 @@ static BOOL set_xns_props_atx(instance_node *pinstance,
 	return TRUE;
 }
 
+/**
+ * Open the content file of @cid with the same lookup order as
+ * instance_read_cid_content.
+ */
+static errno_t instance_open_cid(gx_zreader &rd, const char *cid)
+{
+	if (strchr(cid, '/') != nullptr)
+		return rd.open(cu_cid_path(nullptr, cid, 0).c_str());
+	auto err = rd.open(cu_cid_path(nullptr, cid, 2).c_str());
+	if (err != ENOENT)
+		return err;
+	err = rd.open(cu_cid_path(nullptr, cid, 1).c_str(), 4);
+	if (err != ENOENT)
+		return err;
+	return rd.open(cu_cid_path(nullptr, cid, 0).c_str());
+}
+
+/**
+ * Read @length bytes at @offset of a large binary property (attachment
+ * data, PR_HTML, PR_RTF_COMPRESSED) without materializing the whole value.
+ * *@total_size is left at 0 if the property cannot be read this way, in
+ * which case the caller should use get_instance_properties.
+ */
+BOOL exmdb_server::read_instance_range(const char *dir, uint32_t instance_id,
+    uint32_t proptag, uint32_t offset, uint32_t length, BINARY *pbin,
+    uint32_t *total_size) try
+{
+	*pbin = {};
+	*total_size = 0;
+	std::string cid;
+	{
+		auto pdb = db_engine_get_db(dir);
+		if (!pdb)
+			return FALSE;
+		/* No database access, so no transaction. */
+		auto dbase = pdb->lock_base_rd();
+		auto pinstance = dbase->get_instance_c(instance_id);
+		if (pinstance == nullptr)
+			return FALSE;
+		const TPROPVAL_ARRAY *props;
+		uint32_t idtag = 0;
+		if (pinstance->type == instance_type::attachment) {
+			props = &static_cast<const ATTACHMENT_CONTENT *>(pinstance->pcontent)->proplist;
+			if (proptag == PR_ATTACH_DATA_BIN)
+				idtag = ID_TAG_ATTACHDATABINARY;
+			else if (proptag == PR_ATTACH_DATA_OBJ)
+				idtag = ID_TAG_ATTACHDATAOBJECT;
+		} else {
+			props = &static_cast<const MESSAGE_CONTENT *>(pinstance->pcontent)->proplist;
+			if (proptag == PR_HTML)
+				idtag = ID_TAG_HTML;
+			else if (proptag == PR_RTF_COMPRESSED)
+				idtag = ID_TAG_RTFCOMPRESSED;
+		}
+		if (idtag == 0)
+			return TRUE;
+		auto inmem = props->get<const BINARY>(proptag);
+		if (inmem != nullptr) {
+			*total_size = inmem->cb;
+			if (offset >= inmem->cb)
+				return TRUE;
+			pbin->cb = std::min(length, inmem->cb - offset);
+			pbin->pv = common_util_alloc(pbin->cb);
+			if (pbin->pv == nullptr)
+				return FALSE;
+			memcpy(pbin->pv, &inmem->pb[offset], pbin->cb);
+			return TRUE;
+		}
+		auto cidstr = props->get<const char>(idtag);
+		if (cidstr == nullptr)
+			return TRUE;
+		cid = cidstr;
+	}
+	/* Content files are never modified in place, so the lock can go. */
+	gx_zreader rd;
+	/*
+	 * Every call opens a new reader, so a large single-frame file (written
+	 * before seek tables existed) would be inflated from the start for
+	 * each chunk. Those are cheaper to fetch whole.
+	 */
+	if (g_dbg_synth_content == 2 || instance_open_cid(rd, cid.c_str()) != 0 ||
+	    rd.size() >= UINT32_MAX || !rd.seekable())
+		/* Let the caller go the get_instance_properties route */
+		return TRUE;
+	*total_size = rd.size();
+	if (offset >= *total_size)
+		return TRUE;
+	pbin->cb = std::min(length, *total_size - offset);
+	pbin->pv = common_util_alloc(pbin->cb);
+	if (pbin->pv == nullptr)
+		return FALSE;
+	size_t got = 0;
+	auto err = rd.pread(pbin->pv, pbin->cb, offset, &got);
+	if (err != 0) {
+		mlog(LV_ERR, "E-1313: read_instance_range %s: %s", cid.c_str(), strerror(err));
+		return FALSE;
+	}
+	pbin->cb = got;
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1314: ENOMEM");
+	return FALSE;
+}
+
 BOOL exmdb_server::set_instance_properties(const char *dir,
     uint32_t instance_id, const TPROPVAL_ARRAY *props, PROBLEM_ARRAY *prob)
 {
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2021–2024 grommunio GmbH
 // This file is part of Gromox.
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -20,6 +21,7 @@
 #include <gromox/exmdb_server.hpp>
 #include <gromox/fileio.h>
 #include <gromox/paths.h>
+#include <gromox/process.hpp>
 #include <gromox/svc_common.h>
 #include <gromox/textmaps.hpp>
 #include <gromox/util.hpp>
@@ -47,18 +49,27 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"dbg_synthesize_content", "0"},
 	{"enable_dam", "1", CFG_BOOL},
 	{"exmdb_body_autosynthesis", "1", CFG_BOOL},
+	{"exmdb_bulk_pacing", "1000", CFG_SIZE},
+	{"exmdb_cache_budget", "1G", CFG_SIZE},
+	{"exmdb_cid_cache_size", "64M", CFG_SIZE},
 	{"exmdb_file_compression", "zstd-6"},
 	{"exmdb_hosts_allow", ""}, /* ::1 default set later during startup */
+	{"exmdb_id_reserve", "1024", CFG_SIZE},
 	{"exmdb_listen_port", "5000"},
 	{"exmdb_max_sqlite_spares", "3", CFG_SIZE},
+	{"exmdb_notify_batch_delay", "10ms", CFG_TIME_NS, "0s", "1s"},
+	{"exmdb_notify_batch_max", "256", CFG_SIZE, "1", "65536"},
 	{"exmdb_pf_read_per_user", "1"},
 	{"exmdb_pf_read_states", "2"},
 	{"exmdb_private_folder_softdelete", "0", CFG_BOOL},
 	{"exmdb_schema_upgrades", "auto"},
+	{"exmdb_sqlite_reader_spares", "8", CFG_SIZE},
+	{"exmdb_statement_cache_size", "128", CFG_SIZE},
 	{"exmdb_search_nice", "0"},
 	{"exmdb_search_pacing", "250", CFG_SIZE},
 	{"exmdb_search_pacing_time", "0.5s", CFG_TIME_NS},
 	{"exmdb_search_yield", "0", CFG_BOOL},
+	{"exmdb_slow_rpc_threshold", "0", CFG_TIME_NS},
 	{"exrpc_debug", "0"},
 	{"listen_ip", "::1"},
 	{"listen_port", "exmdb_listen_port", CFG_ALIAS},
@@ -70,6 +81,8 @@ static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"notify_stub_threads_num", "4", CFG_SIZE, "0"},
 	{"populating_threads_num", "4", CFG_SIZE, "1", "50"},
 	{"rpc_proxy_connection_num", "10", CFG_SIZE, "0"},
+	{"rpc_stats_interval", "0", CFG_TIME_NS},
+	{"rpc_worker_threads_num", "0", CFG_SIZE},
 	{"sqlite_debug", "0"},
 	{"sqlite_busy_timeout", "60s", CFG_TIME_NS, "0s", "1h"},
 	{"table_size", "5000", CFG_SIZE, "100"},
@@ -111,7 +124,18 @@ static bool exmdb_provider_reload(std::shared_ptr<config_file> gxcfg = nullptr,
 	g_exmdb_search_nice = pconfig->get_ll("exmdb_search_nice");
 	g_exmdb_search_pacing_time = pconfig->get_ll("exmdb_search_pacing_time");
 	g_exmdb_max_sqlite_spares = pconfig->get_ll("exmdb_max_sqlite_spares");
+	g_exmdb_sqlite_reader_spares = pconfig->get_ll("exmdb_sqlite_reader_spares");
+	g_exmdb_stmt_cache_size = pconfig->get_ll("exmdb_statement_cache_size");
+	g_exmdb_bulk_pacing = pconfig->get_ll("exmdb_bulk_pacing");
+	g_exmdb_id_reserve = pconfig->get_ll("exmdb_id_reserve");
+	g_cid_cache_size = pconfig->get_ll("exmdb_cid_cache_size");
+	g_exmdb_cache_budget = pconfig->get_ll("exmdb_cache_budget");
+	g_exmdb_slow_rpc = std::chrono::duration_cast<gromox::time_duration>(
+		std::chrono::nanoseconds(pconfig->get_ll("exmdb_slow_rpc_threshold")));
 	g_sqlite_busy_timeout_ns = pconfig->get_ll("sqlite_busy_timeout");
+	g_notify_batch_max = pconfig->get_ll("exmdb_notify_batch_max");
+	g_notify_batch_delay = std::chrono::duration_cast<gromox::time_duration>(
+		std::chrono::nanoseconds(pconfig->get_ll("exmdb_notify_batch_delay")));
 	gx_sql_deep_backtrace = gxcfg->get_ll("exmdb_deep_backtrace");
 	gx_force_write_txn = gxcfg->get_ll("exmdb_force_write_txn");
 	auto s = gxcfg->get_value("exmdb_ics_log_file");
@@ -201,10 +225,15 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 		common_util_init(org_name, max_msg_count, max_rule, max_ext_rule);
 		db_engine_init(table_size, cache_interval, populating_num);
 		uint16_t listen_port = pconfig->get_ll("exmdb_listen_port");
+		unsigned int rpc_workers = pconfig->get_ll("rpc_worker_threads_num");
+		if (rpc_workers == 0)
+			rpc_workers = gx_concurrency();
+		std::chrono::nanoseconds stats_interval(pconfig->get_ll("rpc_stats_interval"));
 		if (0 == listen_port) {
-			exmdb_parser_init(0, 0);
+			exmdb_parser_init(0, 0, 0, {});
 		} else {
-			exmdb_parser_init(max_threads, max_routers);
+			exmdb_parser_init(max_threads, max_routers, rpc_workers,
+				std::chrono::duration_cast<gromox::time_duration>(stats_interval));
 		}
 		exmdb_client_init(connection_num, threads_num);
 		
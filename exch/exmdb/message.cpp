@@ -12,6 +12,7 @@
 #include <set>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 #include <fmt/core.h>
@@ -85,6 +86,11 @@ struct seen_list {
 	std::vector<message_node> msg;
 };
 
+/* Store size changes that write_messages applies once per batch */
+struct size_delta {
+	int64_t normal = 0, fai = 0;
+};
+
 }
 
 static ec_error_t message_rule_new_message(const rulexec_in &, seen_list &);
@@ -247,23 +253,166 @@ BOOL exmdb_server::movecopy_message(const char *dir, cpid_t cpid,
 	return TRUE;
 }
 
+namespace {
+
+struct bulk_msg {
+	uint64_t mid = 0, parent_fid = 0, size = 0;
+	bool assoc = false;
+};
+
+}
+
 /**
- * @b_guest:    0=acting as store owner (no permission checks),
- *              1=acting as logon_mode::delegate or ::guest.
- *              XXX: This field is redundant because it coincides with
- *              @username==STORE_OWNER_GRANTED.
- * @username:   Used for permission checks (SFOD & generic folders & message
- *              owner).
- * @src_fid:    The folder from which the action was invoked (this way, we know
- *              if it came from a search folder or a generic folder).
+ * Load the message IDs of @ids into temp.bulk_mids, which is the working
+ * set for the set-based statements of movecopy_messages and
+ * delete_messages. The table lives as long as the connection and is
+ * emptied on every use. @seq records the client's order.
  */
-BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
+static bool bulk_load(const db_conn &db, const EID_ARRAY &ids)
+{
+	if (db.exec("CREATE TEMP TABLE IF NOT EXISTS bulk_mids "
+	    "(seq INTEGER PRIMARY KEY, message_id INTEGER UNIQUE NOT NULL)") != SQLITE_OK ||
+	    db.exec("DELETE FROM temp.bulk_mids") != SQLITE_OK)
+		return false;
+	auto stm = db.prep("INSERT OR IGNORE INTO temp.bulk_mids (message_id) VALUES (?)");
+	if (stm == nullptr)
+		return false;
+	for (auto mid : ids) {
+		stm.bind_int64(1, rop_util_get_gc_value(mid));
+		if (stm.step() != SQLITE_DONE)
+			return false;
+		stm.reset();
+	}
+	return true;
+}
+
+static bool bulk_drop(const db_conn &db, const std::vector<uint64_t> &mids)
+{
+	if (mids.empty())
+		return true;
+	auto stm = db.prep("DELETE FROM temp.bulk_mids WHERE message_id=?");
+	if (stm == nullptr)
+		return false;
+	for (auto mid : mids) {
+		stm.bind_int64(1, mid);
+		if (stm.step() != SQLITE_DONE)
+			return false;
+		stm.reset();
+	}
+	return true;
+}
+
+/**
+ * Look up all messages of temp.bulk_mids in one go, in the order the client
+ * gave them, and apply the folder and owner checks. Messages that fail them are removed from temp.bulk_mids
+ * (and flag a partial result); so are nonexisting ones, which flag a partial
+ * result only if @missing_partial is set.
+ *
+ * @src_val:    folder the action was invoked on; unless it is a search folder,
+ *              messages must be immediate children of it
+ * @b_check:    whether the owner check applies
+ * @right:      folder right (besides frightsOwner) that exempts from the
+ *              owner check for messages reached through a search folder
+ */
+static bool bulk_select(const db_conn &db, uint32_t folder_type,
+    uint64_t src_val, bool b_check, const char *username, uint32_t right,
+    bool missing_partial, std::vector<bulk_msg> &out, BOOL *pb_partial) try
+{
+	auto stm = db.prep("SELECT b.message_id, m.parent_fid, m.is_associated,"
+	           " m.message_size, m.message_id FROM temp.bulk_mids AS b"
+	           " LEFT JOIN messages AS m ON b.message_id=m.message_id"
+	           " ORDER BY b.seq");
+	if (stm == nullptr)
+		return false;
+	std::vector<uint64_t> drop;
+	std::unordered_map<uint64_t, uint32_t> perm_cache;
+	while (stm.step() == SQLITE_ROW) {
+		bulk_msg m;
+		m.mid = stm.col_uint64(0);
+		if (sqlite3_column_type(stm, 4) == SQLITE_NULL) {
+			if (missing_partial)
+				*pb_partial = TRUE;
+			drop.push_back(m.mid);
+			continue;
+		}
+		/*
+		 * src_val may be a search folder (MS-OXCFOLD v23.2 §2.2.1.6),
+		 * so use the real parent of the message.
+		 */
+		m.parent_fid = stm.col_uint64(1);
+		m.assoc      = stm.col_int64(2) != 0;
+		m.size       = stm.col_uint64(3);
+		if (folder_type != FOLDER_SEARCH && m.parent_fid != src_val) {
+			*pb_partial = TRUE;
+			drop.push_back(m.mid);
+			continue;
+		}
+		uint32_t permission = 0;
+		if (b_check && folder_type == FOLDER_SEARCH) {
+			auto it = perm_cache.find(m.parent_fid);
+			if (it == perm_cache.end()) {
+				if (!cu_get_folder_permission(db.psqlite,
+				    m.parent_fid, username, &permission))
+					return false;
+				perm_cache.emplace(m.parent_fid, permission);
+			} else {
+				permission = it->second;
+			}
+		}
+		if (b_check && !(permission & (frightsOwner | right))) {
+			BOOL b_owner = false;
+			if (!common_util_check_message_owner(db.psqlite,
+			    m.mid, username, &b_owner))
+				return false;
+			if (!b_owner) {
+				*pb_partial = TRUE;
+				drop.push_back(m.mid);
+				continue;
+			}
+		}
+		out.push_back(m);
+	}
+	stm.finalize();
+	return bulk_drop(db, drop);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1336: ENOMEM");
+	return false;
+}
+
+/**
+ * Run @f over @ids in slices of at most exmdb_bulk_pacing messages. Each
+ * slice takes the store lock and a transaction of its own, so that other
+ * clients of the store get a turn in between. An empty array still makes
+ * one (empty) call, for the folder bookkeeping.
+ *
+ * If a slice fails after earlier ones were committed, the request counts as
+ * partially completed (*@pb_partial) rather than failed.
+ */
+template<typename F> static BOOL bulk_paced(const EID_ARRAY *ids,
+    BOOL *pb_partial, F &&f)
+{
+	size_t step = g_exmdb_bulk_pacing > 0 ? g_exmdb_bulk_pacing : UINT32_MAX;
+	size_t i = 0;
+	do {
+		const EID_ARRAY slice = {static_cast<uint32_t>(std::min<size_t>(step, ids->count - i)),
+		                        ids->count > 0 ? &ids->pids[i] : nullptr};
+		if (!f(slice)) {
+			if (i == 0)
+				return FALSE;
+			*pb_partial = TRUE;
+			return TRUE;
+		}
+		i += step;
+	} while (i < ids->count);
+	return TRUE;
+}
+
+static BOOL movecopy_slice(const char *dir, cpid_t cpid, BOOL b_guest,
     const char *username, uint64_t src_fid, uint64_t dst_fid, BOOL b_copy,
-    const EID_ARRAY *pmessage_ids, BOOL *pb_partial)
+    const EID_ARRAY &ids, BOOL *pb_partial) try
 {
-	BOOL b_check, b_owner, b_result;
+	BOOL b_check, b_result;
 	uint32_t permission, folder_type;
-	char sql_string[256];
 	
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
@@ -271,7 +420,6 @@ BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
 	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
 	if (!sql_transact)
 		return false;
-	*pb_partial = FALSE;
 	auto src_val = rop_util_get_gc_value(src_fid);
 	auto dst_val = rop_util_get_gc_value(dst_fid);
 	if (!common_util_get_folder_type(pdb->psqlite, src_val, &folder_type, dir))
@@ -287,7 +435,7 @@ BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
 		b_check = TRUE;
 	}
 
-	auto b_batch = pmessage_ids->count >= MIN_BATCH_MESSAGE_NUM;
+	auto b_batch = ids.count >= MIN_BATCH_MESSAGE_NUM;
 	auto dbase = pdb->lock_base_wr();
 	db_conn::NOTIFQ notifq;
 	if (b_batch)
@@ -296,125 +444,67 @@ BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
 		if (b_batch)
 			pdb->cancel_batch_mode(*dbase);
 	});
-	auto stm_find = pdb->prep("SELECT parent_fid, "
-	             "is_associated FROM messages WHERE message_id=?");
-	if (stm_find == nullptr)
+	std::vector<bulk_msg> msgs;
+	if (!bulk_load(*pdb, ids) ||
+	    !bulk_select(*pdb, folder_type, src_val, b_check, username,
+	    frightsReadAny, true, msgs, pb_partial))
 		return FALSE;
-	BOOL b_update = TRUE;
-	xstmt stm_del;
-	if (!b_copy) {
-		if (exmdb_server::is_private()) {
-			strcpy(sql_string, "DELETE FROM messages WHERE message_id=?");
-			b_update = FALSE;
-		} else {
-			strcpy(sql_string, "UPDATE messages SET is_deleted=1 WHERE message_id=?");
-		}
-		stm_del = pdb->prep(sql_string);
-		if (stm_del == nullptr)
-			return FALSE;
-	}
 	uint64_t fai_size = 0, normal_size = 0;
-	uint32_t del_count = 0, message_size = 0;
+	uint32_t message_size = 0;
 	std::set<uint64_t> touched_folders;
-	for (auto mid : *pmessage_ids) {
-		auto tmp_val = rop_util_get_gc_value(mid);
-		stm_find.bind_int64(1, tmp_val);
-		if (stm_find.step() != SQLITE_ROW) {
-			*pb_partial = TRUE;
-			continue;
-		}
-		/*
-		 * src_val may be a search folder (MS-OXCFOLD v23.2 §2.2.1.6),
-		 * so re-lookup for the real parent of the source.
-		 */
-		uint64_t parent_fid = stm_find.col_uint64(0);
-		bool is_associated = stm_find.col_uint64(1);
-		stm_find.reset();
-		if (folder_type == FOLDER_SEARCH) {
-			if (b_check) {
-				if (!cu_get_folder_permission(pdb->psqlite,
-				    parent_fid, username, &permission))
-					return false;
-				if (!(permission & (frightsOwner | frightsReadAny))) {
-					if (!common_util_check_message_owner(pdb->psqlite,
-					    tmp_val, username, &b_owner))
-						return false;
-					if (!b_owner) {
-						*pb_partial = TRUE;
-						continue;
-					}
-				}
-			}
-		} else {
-			if (parent_fid != src_val) {
-				*pb_partial = TRUE;
-				continue;
-			}
-			if (b_check) {
-				if (!common_util_check_message_owner(pdb->psqlite,
-				    tmp_val, username, &b_owner))
-					return false;
-				if (!b_owner) {
-					*pb_partial = TRUE;
-					continue;
-				}
-			}
-		}
+	std::vector<uint64_t> failed;
+	for (const auto &m : msgs) {
 		if (!b_copy)
 			pdb->proc_dynamic_event(cpid, dynamic_event::del_msg,
-				parent_fid, tmp_val, 0, *dbase, notifq);
+				m.parent_fid, m.mid, 0, *dbase, notifq);
 		uint64_t tmp_val1 = 0;
-		if (!cu_copy_message(pdb->psqlite, tmp_val, dst_val, &tmp_val1,
+		if (!cu_copy_message(pdb->psqlite, m.mid, dst_val, &tmp_val1,
 		    &b_result, &message_size))
 			return FALSE;
 		if (!b_result) {
 			*pb_partial = TRUE;
+			failed.push_back(m.mid);
 			continue;
 		}
-		if (!is_associated)
+		if (!m.assoc)
 			normal_size += message_size;
 		else
 			fai_size += message_size;
 		pdb->proc_dynamic_event(cpid, dynamic_event::new_msg,
 			dst_val, tmp_val1, 0, *dbase, notifq);
 		pdb->notify_message_movecopy(b_copy, dst_val, tmp_val1,
-			src_val, tmp_val, *dbase, notifq);
-		if (b_copy) {
-			mlog(LV_DEBUG, "exmdb-audit: copied(mmv) message %s:f%llu:m%llu to f%llu:m%llu",
-				dir, LLU{src_val}, LLU{tmp_val}, LLU{dst_val}, LLU{tmp_val1});
-			continue;
-		}
+			src_val, m.mid, *dbase, notifq);
+		mlog(LV_DEBUG, "exmdb-audit: %s(mmv) message %s:f%llu:m%llu to f%llu:m%llu",
+			b_copy ? "copied" : "moved", dir, LLU{src_val}, LLU{m.mid},
+			LLU{dst_val}, LLU{tmp_val1});
+		/* dst folders' change keys are already updated by common_util_copy_message */
+		if (!b_copy)
+			touched_folders.emplace(m.parent_fid);
+	}
 
-		/* Below here = moves */
-		del_count ++;
-		stm_del.bind_int64(1, tmp_val);
-		if (stm_del.step() != SQLITE_DONE)
+	/* Below here = moves; the sources go away in one statement */
+	uint32_t del_count = msgs.size() - failed.size();
+	BOOL b_update = TRUE;
+	if (!b_copy && del_count > 0) {
+		if (!bulk_drop(*pdb, failed))
 			return false;
-		stm_del.reset();
-		mlog(LV_DEBUG, "exmdb-audit: moved(mmv) message %s:f%llu:m%llu to f%llu:m%llu",
-			dir, LLU{src_val}, LLU{tmp_val}, LLU{dst_val}, LLU{tmp_val1});
-		if (!exmdb_server::is_private()) {
-			snprintf(sql_string, std::size(sql_string), "DELETE FROM read_states"
-			         " WHERE message_id=%llu", LLU{tmp_val});
-			if (pdb->exec(sql_string) != SQLITE_OK)
+		if (exmdb_server::is_private()) {
+			if (pdb->exec("DELETE FROM messages WHERE message_id IN"
+			    " (SELECT message_id FROM temp.bulk_mids)") != SQLITE_OK)
 				return false;
-		}
-
-		try {
-			/* dst folders' change keys are already updated by common_util_copy_message */
-			touched_folders.emplace(parent_fid);
-		} catch (const std::bad_alloc &) {
-			mlog(LV_ERR, "E-2232: ENOMEM");
+			b_update = FALSE;
+		} else if (pdb->exec("UPDATE messages SET is_deleted=1 WHERE message_id IN"
+		    " (SELECT message_id FROM temp.bulk_mids)") != SQLITE_OK ||
+		    pdb->exec("DELETE FROM read_states WHERE message_id IN"
+		    " (SELECT message_id FROM temp.bulk_mids)") != SQLITE_OK) {
 			return false;
 		}
 	}
-	stm_find.finalize();
-	stm_del.finalize();
 	if (b_update && normal_size + fai_size > 0 &&
 	    !cu_adjust_store_size(pdb->psqlite, ADJ_INCREASE, normal_size, fai_size))
 		return FALSE;
 	auto nt_time = rop_util_current_nttime();
-	if (!b_copy) for (auto parent_fid : touched_folders) {
+	for (auto parent_fid : touched_folders) {
 		TAGGED_PROPVAL tmp_propvals[5];
 		TPROPVAL_ARRAY propvals;
 		PROBLEM_ARRAY problems;
@@ -463,18 +553,41 @@ BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
 		db_conn::commit_batch_mode_release(std::move(pdb),std::move(dbase));
 	}
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-2232: ENOMEM");
+	return false;
 }
 
 /**
- * @username:   Used for evaluating delete permission.
+ * @b_guest:    0=acting as store owner (no permission checks),
+ *              1=acting as logon_mode::delegate or ::guest.
+ *              XXX: This field is redundant because it coincides with
+ *              @username==STORE_OWNER_GRANTED.
+ * @username:   Used for permission checks (SFOD & generic folders & message
+ *              owner).
+ * @src_fid:    The folder from which the action was invoked (this way, we know
+ *              if it came from a search folder or a generic folder).
+ *
+ * Large requests are committed in slices (cf. exmdb_bulk_pacing), so a
+ * failure midway leaves the earlier slices moved/copied, and is reported as
+ * partial completion.
  */
-BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
-    const char *username, uint64_t folder_id, const EID_ARRAY *pmessage_ids,
-    BOOL b_hard, BOOL *pb_partial)
+BOOL exmdb_server::movecopy_messages(const char *dir, cpid_t cpid, BOOL b_guest,
+    const char *username, uint64_t src_fid, uint64_t dst_fid, BOOL b_copy,
+    const EID_ARRAY *pmessage_ids, BOOL *pb_partial)
+{
+	*pb_partial = FALSE;
+	return bulk_paced(pmessage_ids, pb_partial, [&](const EID_ARRAY &slice) {
+		return movecopy_slice(dir, cpid, b_guest, username, src_fid,
+		       dst_fid, b_copy, slice, pb_partial);
+	});
+}
+
+static BOOL delete_slice(const char *dir, cpid_t cpid, const char *username,
+    uint64_t folder_id, const EID_ARRAY &ids, BOOL b_hard, BOOL *pb_partial)
 {
 	void *pvalue;
 	BOOL b_check;
-	BOOL b_owner;
 	uint32_t permission;
 	
 	auto pdb = db_engine_get_db(dir);
@@ -483,7 +596,6 @@ BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
 	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
 	if (!sql_transact)
 		return false;
-	*pb_partial = FALSE;
 	auto src_val = rop_util_get_gc_value(folder_id);
 	uint32_t folder_type = 0;
 	if (!common_util_get_folder_type(pdb->psqlite, src_val, &folder_type))
@@ -499,7 +611,7 @@ BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
 		b_check = (permission & (frightsOwner | frightsDeleteAny)) ? false : TRUE;
 	}
 
-	auto b_batch = pmessage_ids->count >= MIN_BATCH_MESSAGE_NUM;
+	auto b_batch = ids.count >= MIN_BATCH_MESSAGE_NUM;
 	auto dbase = pdb->lock_base_wr();
 	db_conn::NOTIFQ notifq;
 	if (b_batch)
@@ -508,123 +620,79 @@ BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
 		if (b_batch)
 			pdb->cancel_batch_mode(*dbase);
 	});
-	auto pstmt = pdb->prep("SELECT parent_fid, is_associated, "
-	             "message_size FROM messages WHERE message_id=?");
-	if (pstmt == nullptr)
-		return FALSE;
-	auto pstmt1 = pdb->prep(b_hard ?
-	              "DELETE FROM messages WHERE message_id=?" :
-	              "UPDATE messages SET is_deleted=1 WHERE message_id=?");
-	if (pstmt1 == nullptr)
+	std::vector<bulk_msg> msgs;
+	if (!bulk_load(*pdb, ids) ||
+	    !bulk_select(*pdb, folder_type, src_val, b_check, username,
+	    frightsDeleteAny, false, msgs, pb_partial))
 		return FALSE;
 	uint64_t fai_size = 0, normal_size = 0;
-	int del_count = 0;
+	int del_count = msgs.size();
 	auto nt_time = rop_util_current_nttime();
-	for (auto mid : *pmessage_ids) {
-		auto tmp_val = rop_util_get_gc_value(mid);
-		sqlite3_bind_int64(pstmt, 1, tmp_val);
-		if (pstmt.step() != SQLITE_ROW)
-			continue;
-		uint64_t parent_fid = sqlite3_column_int64(pstmt, 0);
-		auto is_assoc = pstmt.col_int64(1) != 0;
-		auto obj_size = pstmt.col_int64(2);
-		sqlite3_reset(pstmt);
-		if (folder_type == FOLDER_SEARCH) {
-			if (b_check) {
-				if (!cu_get_folder_permission(pdb->psqlite,
-				    parent_fid, username, &permission))
-					return FALSE;
-				if (!(permission & (frightsOwner | frightsDeleteAny))) {
-					if (!common_util_check_message_owner(pdb->psqlite,
-					    tmp_val, username, &b_owner))
-						return FALSE;
-					if (!b_owner) {
-						*pb_partial = TRUE;
-						continue;
-					}
-				}
-			}
-		} else {
-			if (parent_fid != src_val) {
-				*pb_partial = TRUE;
-				continue;
-			}
-			if (b_check) {
-				if (!common_util_check_message_owner(pdb->psqlite,
-				    tmp_val, username, &b_owner))
-					return FALSE;
-				if (!b_owner) {
-					*pb_partial = TRUE;
-					continue;
-				}
-			}
-		}
-		del_count ++;
-		if (is_assoc)
-			fai_size += obj_size;
+	for (const auto &m : msgs) {
+		if (m.assoc)
+			fai_size += m.size;
 		else
-			normal_size += obj_size;
+			normal_size += m.size;
 		pdb->proc_dynamic_event(cpid, dynamic_event::del_msg,
-			parent_fid, tmp_val, 0, *dbase, notifq);
+			m.parent_fid, m.mid, 0, *dbase, notifq);
 		if (folder_type == FOLDER_SEARCH)
-			pdb->notify_link_deletion(src_val, tmp_val, *dbase, notifq);
+			pdb->notify_link_deletion(src_val, m.mid, *dbase, notifq);
 		else
-			pdb->notify_message_deletion(src_val, tmp_val, *dbase, notifq);
-		sqlite3_bind_int64(pstmt1, 1, tmp_val);
-		if (pstmt1.step() != SQLITE_DONE)
-			return FALSE;
-		sqlite3_reset(pstmt1);
+			pdb->notify_message_deletion(src_val, m.mid, *dbase, notifq);
 		mlog(LV_DEBUG, "exmdb-audit: %s-deleted message %s:f%llu:m%llu (actor:%s)",
-			b_hard ? "hard" : "soft", dir, LLU{src_val}, LLU{tmp_val},
+			b_hard ? "hard" : "soft", dir, LLU{src_val}, LLU{m.mid},
 			username != nullptr ? username : "owner");
-		if (!b_hard) {
-			uint64_t change_num = 0;
-			if (cu_allocate_cn(pdb->psqlite, &change_num) != ecSuccess)
-				return false;
-			change_num = rop_util_make_eid_ex(1, change_num);
-			auto account_id = exmdb_server::get_account_id();
-			TAGGED_PROPVAL nprop[5];
-			nprop[0].proptag = PidTagChangeNumber;
-			nprop[0].pvalue = &change_num;
-			nprop[1].proptag = PR_CHANGE_KEY;
-			nprop[1].pvalue = cu_xid_to_bin({
-				exmdb_server::is_private() ?
-					rop_util_make_user_guid(account_id) :
-					rop_util_make_domain_guid(account_id),
-				change_num});
-			if (nprop[1].pvalue == nullptr ||
-			    !cu_get_property(MAPI_MESSAGE, tmp_val, CP_ACP,
-			    pdb->psqlite, PR_PREDECESSOR_CHANGE_LIST, &pvalue))
-				return false;
-			nprop[2].proptag = PR_PREDECESSOR_CHANGE_LIST;
-			nprop[2].pvalue = common_util_pcl_append(static_cast<BINARY *>(pvalue),
-			                  static_cast<const BINARY *>(nprop[1].pvalue));
-			if (nprop[2].pvalue == nullptr)
-				return false;
-			nprop[3].proptag = PR_LAST_MODIFICATION_TIME;
-			nprop[3].pvalue = &nt_time;
-			/*
-			 * Something is weird: EXC2019 does not expose PR_DELETED_ON, and OL
-			 * knows to display PR_LAST_MODIFICATION_TIME in the "Recover Items"
-			 * dialog instead...
-			 */
-			nprop[4].proptag = PR_DELETED_ON;
-			nprop[4].pvalue = &nt_time;
-			PROBLEM_ARRAY problems;
-			const TPROPVAL_ARRAY npropds = {std::size(nprop), nprop};
-			cu_set_properties(MAPI_MESSAGE, tmp_val, CP_ACP, pdb->psqlite,
-				&npropds, &problems);
-		}
-		if (!b_hard && !is_private()) {
-			char sql_string[256];
-			snprintf(sql_string, std::size(sql_string), "DELETE FROM read_states"
-			        " WHERE message_id=%llu", LLU{tmp_val});
-			if (pdb->exec(sql_string) != SQLITE_OK)
-				return FALSE;
-		}
+		if (b_hard)
+			continue;
+		uint64_t change_num = 0;
+		if (cu_allocate_cn(pdb->psqlite, &change_num) != ecSuccess)
+			return false;
+		change_num = rop_util_make_eid_ex(1, change_num);
+		auto account_id = exmdb_server::get_account_id();
+		TAGGED_PROPVAL nprop[5];
+		nprop[0].proptag = PidTagChangeNumber;
+		nprop[0].pvalue = &change_num;
+		nprop[1].proptag = PR_CHANGE_KEY;
+		nprop[1].pvalue = cu_xid_to_bin({
+			exmdb_server::is_private() ?
+				rop_util_make_user_guid(account_id) :
+				rop_util_make_domain_guid(account_id),
+			change_num});
+		if (nprop[1].pvalue == nullptr ||
+		    !cu_get_property(MAPI_MESSAGE, m.mid, CP_ACP,
+		    pdb->psqlite, PR_PREDECESSOR_CHANGE_LIST, &pvalue))
+			return false;
+		nprop[2].proptag = PR_PREDECESSOR_CHANGE_LIST;
+		nprop[2].pvalue = common_util_pcl_append(static_cast<BINARY *>(pvalue),
+		                  static_cast<const BINARY *>(nprop[1].pvalue));
+		if (nprop[2].pvalue == nullptr)
+			return false;
+		nprop[3].proptag = PR_LAST_MODIFICATION_TIME;
+		nprop[3].pvalue = &nt_time;
+		/*
+		 * Something is weird: EXC2019 does not expose PR_DELETED_ON, and OL
+		 * knows to display PR_LAST_MODIFICATION_TIME in the "Recover Items"
+		 * dialog instead...
+		 */
+		nprop[4].proptag = PR_DELETED_ON;
+		nprop[4].pvalue = &nt_time;
+		PROBLEM_ARRAY problems;
+		const TPROPVAL_ARRAY npropds = {std::size(nprop), nprop};
+		cu_set_properties(MAPI_MESSAGE, m.mid, CP_ACP, pdb->psqlite,
+			&npropds, &problems);
+	}
+	if (del_count > 0) {
+		if (pdb->exec(b_hard ?
+		    "DELETE FROM messages WHERE message_id IN"
+		    " (SELECT message_id FROM temp.bulk_mids)" :
+		    "UPDATE messages SET is_deleted=1 WHERE message_id IN"
+		    " (SELECT message_id FROM temp.bulk_mids)") != SQLITE_OK)
+			return FALSE;
+		if (!b_hard && !exmdb_server::is_private() &&
+		    pdb->exec("DELETE FROM read_states WHERE message_id IN"
+		    " (SELECT message_id FROM temp.bulk_mids)") != SQLITE_OK)
+			return FALSE;
 	}
-	pstmt.finalize();
-	pstmt1.finalize();
 	if (b_hard && !cu_adjust_store_size(pdb->psqlite, ADJ_DECREASE,
 	    normal_size, fai_size))
 		return FALSE;
@@ -673,6 +741,23 @@ BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
 	return TRUE;
 }
 
+/**
+ * @username:   Used for evaluating delete permission.
+ *
+ * Large requests are committed in slices (cf. exmdb_bulk_pacing); a failure
+ * midway is reported as partial completion.
+ */
+BOOL exmdb_server::delete_messages(const char *dir, cpid_t cpid,
+    const char *username, uint64_t folder_id, const EID_ARRAY *pmessage_ids,
+    BOOL b_hard, BOOL *pb_partial)
+{
+	*pb_partial = FALSE;
+	return bulk_paced(pmessage_ids, pb_partial, [&](const EID_ARRAY &slice) {
+		return delete_slice(dir, cpid, username, folder_id, slice,
+		       b_hard, pb_partial);
+	});
+}
+
 static BOOL message_get_message_rcpts(sqlite3 *psqlite, uint64_t message_id,
     TARRAY_SET *pset) try
 {
@@ -929,6 +1014,12 @@ BOOL exmdb_server::set_message_properties(const char *dir,
 	if (!cu_set_properties(MAPI_MESSAGE, mid_val, cpid,
 	    pdb->psqlite, pproperties, pproblems))
 		return FALSE;
+	for (const auto &pv : *pproperties) {
+		if (!cu_fts_indexed_tag(pv.proptag))
+			continue;
+		cu_fts_update(pdb->psqlite, mid_val);
+		break;
+	}
 	uint64_t fid_val = 0;
 	if (!common_util_get_message_parent_folder(pdb->psqlite,
 	    mid_val, &fid_val) || fid_val == 0)
@@ -961,6 +1052,12 @@ BOOL exmdb_server::remove_message_properties(const char *dir, cpid_t cpid,
 	if (!cu_remove_properties(MAPI_MESSAGE, mid_val,
 	    pdb->psqlite, pproptags))
 		return FALSE;
+	for (auto tag : *pproptags) {
+		if (!cu_fts_indexed_tag(tag))
+			continue;
+		cu_fts_update(pdb->psqlite, mid_val);
+		break;
+	}
 	uint64_t fid_val = 0;
 	if (!common_util_get_message_parent_folder(pdb->psqlite,
 	    mid_val, &fid_val) || fid_val == 0)
@@ -1794,7 +1891,7 @@ static ec_error_t message_rectify_message(const MESSAGE_CONTENT *src,
 static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
     cpid_t cpid, BOOL b_embedded, uint64_t parent_id,
     const MESSAGE_CONTENT *pmsgctnt, uint64_t *pmessage_id, uint64_t *outcn,
-    bool *partial_completion)
+    bool *partial_completion, size_delta *deferred = nullptr)
 {
 	BOOL b_cn;
 	int is_associated = 0;
@@ -2080,7 +2177,10 @@ static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
 			parent_id = sqlite3_column_int64(pstmt2, 0);
 		}
 	}
-	if (original_size > message_size) {
+	if (deferred != nullptr) {
+		(is_associated ? deferred->fai : deferred->normal) +=
+			static_cast<int64_t>(message_size) - original_size;
+	} else if (original_size > message_size) {
 		auto d = original_size - message_size;
 		if (!cu_adjust_store_size(psqlite, ADJ_DECREASE,
 		    is_associated ? 0 : d, is_associated ? d : 0))
@@ -2093,6 +2193,9 @@ static BOOL message_write_message(BOOL b_internal, sqlite3 *psqlite,
 	}
 	if (b_embedded)
 		return TRUE;
+	cu_fts_update(psqlite, *pmessage_id);
+	if (deferred != nullptr)
+		return TRUE;
 	auto nt_time = rop_util_current_nttime();
 	return cu_set_property(MAPI_FOLDER, parent_id, CP_ACP, psqlite,
 	       PR_LOCAL_COMMIT_TIME_MAX, &nt_time, &b_result);
@@ -3603,6 +3706,64 @@ static unsigned int detect_rcpt_type(const char *account, const TARRAY_SET *rcpt
 	return MAPI_BCC;
 }
 
+/**
+ * Make @tmp_msg a copy of @pmsg with the PR_RECEIVED_BY_* and
+ * PR_RCVD_REPRESENTING_* properties of mailbox @account added. The new values
+ * are allocated from the RPC context.
+ */
+static BOOL message_set_delivery_props(const char *account,
+    const MESSAGE_CONTENT *pmsg, MESSAGE_CONTENT &tmp_msg)
+{
+	tmp_msg = *pmsg;
+	tmp_msg.proplist.ppropval = cu_alloc<TAGGED_PROPVAL>(pmsg->proplist.count + 15);
+	if (tmp_msg.proplist.ppropval == nullptr)
+		return FALSE;
+	memcpy(tmp_msg.proplist.ppropval, pmsg->proplist.ppropval,
+				sizeof(TAGGED_PROPVAL)*pmsg->proplist.count);
+	auto pentryid = common_util_username_to_addressbook_entryid(account);
+	if (pentryid == nullptr)
+		return FALSE;	
+	std::string essdn_buff;
+	if (cvt_username_to_essdn(account, g_exmdb_org_name,
+	    common_util_get_user_ids, common_util_get_domain_ids,
+	    essdn_buff) != ecSuccess)
+		return FALSE;
+	HX_strupper(essdn_buff.data());
+	essdn_buff.insert(0, "EX:");
+	auto essdn = common_util_dup(essdn_buff.c_str());
+	auto searchkey_bin = cu_alloc<BINARY>();
+	if (essdn == nullptr || searchkey_bin == nullptr)
+		return FALSE;
+	searchkey_bin->cb = essdn_buff.size() + 1;
+	searchkey_bin->pc = essdn;
+	char display_name[1024], *dispname = nullptr;
+	if (common_util_get_user_displayname(account, display_name,
+	    std::size(display_name))) {
+		dispname = common_util_dup(display_name);
+		if (dispname == nullptr)
+			return FALSE;
+	}
+	cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_ENTRYID, pentryid);
+	cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_ADDRTYPE, "EX");
+	cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_EMAIL_ADDRESS, &essdn[3]);
+	if (dispname != nullptr)
+		cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_NAME, dispname);
+	cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_SEARCH_KEY, searchkey_bin);
+	if (!pmsg->proplist.has(PR_RCVD_REPRESENTING_ENTRYID)) {
+		cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_ENTRYID, pentryid);
+		cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_ADDRTYPE, "EX");
+		cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_EMAIL_ADDRESS, &essdn[3]);
+		if (dispname != nullptr)
+			cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_NAME, dispname);
+		cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_SEARCH_KEY, searchkey_bin);
+	}
+	auto rcpt_type = detect_rcpt_type(account, pmsg->children.prcpts);
+	if (rcpt_type != MAPI_BCC)
+		cu_set_propval(&tmp_msg.proplist, rcpt_type == MAPI_TO ?
+			PR_MESSAGE_TO_ME : PR_MESSAGE_CC_ME, &fake_true);
+	return TRUE;
+}
+
 /* 0 means success, 1 means mailbox full, other unknown error */
 BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
     const char *, cpid_t cpid, uint32_t dlflags,
@@ -3612,8 +3773,7 @@ BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
 	bool b_oof;
 	uint64_t fid_val;
 	char tmp_path[256];
-	BINARY searchkey_bin;
-	char mid_string[128], display_name[1024], account[UDOM_SIZE];
+	char mid_string[128], account[UDOM_SIZE];
 
 	if (exmdb_server::is_private()) {
 		if (!common_util_get_username_from_id(exmdb_server::get_account_id(),
@@ -3650,47 +3810,10 @@ BOOL exmdb_server::deliver_message(const char *dir, const char *from_address,
 	}
 	seen_list seen{{fid_val}};
 
-	MESSAGE_CONTENT tmp_msg = *pmsg; /* may reference buffers (vars above) */
-	std::string essdn_buff;
-	if (exmdb_server::is_private()) {
-		tmp_msg.proplist.ppropval = cu_alloc<TAGGED_PROPVAL>(pmsg->proplist.count + 15);
-		if (tmp_msg.proplist.ppropval == nullptr)
-			return FALSE;
-		memcpy(tmp_msg.proplist.ppropval, pmsg->proplist.ppropval,
-					sizeof(TAGGED_PROPVAL)*pmsg->proplist.count);
-		auto pentryid = common_util_username_to_addressbook_entryid(account);
-		if (pentryid == nullptr)
-			return FALSE;	
-		if (cvt_username_to_essdn(account, g_exmdb_org_name,
-		    common_util_get_user_ids, common_util_get_domain_ids,
-		    essdn_buff) != ecSuccess)
-			return FALSE;
-		HX_strupper(essdn_buff.data());
-		essdn_buff.insert(0, "EX:");
-		cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_ENTRYID, pentryid);
-		cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_ADDRTYPE, "EX");
-		cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_EMAIL_ADDRESS, &essdn_buff[3]);
-		if (common_util_get_user_displayname(account, display_name,
-		    std::size(display_name)))
-			cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_NAME, display_name);
-		else
-			display_name[0] = '\0';
-		searchkey_bin.cb = essdn_buff.size() + 1;
-		searchkey_bin.pv = deconst(essdn_buff.c_str());
-		cu_set_propval(&tmp_msg.proplist, PR_RECEIVED_BY_SEARCH_KEY, &searchkey_bin);
-		if (!pmsg->proplist.has(PR_RCVD_REPRESENTING_ENTRYID)) {
-			cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_ENTRYID, pentryid);
-			cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_ADDRTYPE, "EX");
-			cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_EMAIL_ADDRESS, &essdn_buff[3]);
-			if (*display_name != '\0')
-				cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_NAME, display_name);
-			cu_set_propval(&tmp_msg.proplist, PR_RCVD_REPRESENTING_SEARCH_KEY, &searchkey_bin);
-		}
-		auto rcpt_type = detect_rcpt_type(account, pmsg->children.prcpts);
-		if (rcpt_type != MAPI_BCC)
-			cu_set_propval(&tmp_msg.proplist, rcpt_type == MAPI_TO ?
-				PR_MESSAGE_TO_ME : PR_MESSAGE_CC_ME, &fake_true);
-	}
+	MESSAGE_CONTENT tmp_msg = *pmsg;
+	if (exmdb_server::is_private() &&
+	    !message_set_delivery_props(account, pmsg, tmp_msg))
+		return FALSE;
 	auto nt_time = rop_util_current_nttime();
 	auto ts = tmp_msg.proplist.get<uint64_t>(PR_MESSAGE_DELIVERY_TIME);
 	if (ts != nullptr)
@@ -3865,6 +3988,148 @@ BOOL exmdb_server::write_message(const char *dir, cpid_t cpid,
 	       &outmid, &outcn, e_result);
 }
 
+/**
+ * Write @count messages into @fid_val in one transaction. The store size and
+ * the folder's PR_LOCAL_COMMIT_TIME_MAX are updated once at the end, but the
+ * quota is checked against the running size before every message; once it
+ * is exceeded, the rest of the slice is rejected with MAPI_E_STORE_FULL and
+ * what was written so far is kept. Dynamic
+ * events (search folders) run for every new message, but open content tables
+ * are updated in batch mode, i.e. clients get one reload per table instead of
+ * per-message notifications.
+ */
+static BOOL write_messages_slice(const char *dir, cpid_t cpid,
+    uint64_t fid_val, uint32_t flags, const char *account,
+    const MESSAGE_CONTENT *const *msgs, size_t count,
+    std::vector<uint64_t> &outmids, ec_error_t *e_result)
+{
+	auto pdb = db_engine_get_db(dir);
+	if (!pdb)
+		return FALSE;
+	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	uint64_t store_size = 0, quota = 0;
+	if (!cu_get_store_quota(pdb->psqlite, account != nullptr ?
+	    PR_PROHIBIT_RECEIVE_QUOTA : PR_STORAGE_QUOTA_LIMIT,
+	    &store_size, &quota))
+		return FALSE;
+	if (store_size >= quota ||
+	    common_util_check_msgcnt_overflow(pdb->psqlite)) {
+		*e_result = MAPI_E_STORE_FULL;
+		return TRUE;
+	}
+	auto nt_time = rop_util_current_nttime();
+	size_delta delta;
+	std::vector<uint64_t> written;
+	written.reserve(count);
+	for (size_t i = 0; i < count; ++i) {
+		auto grown = delta.normal + delta.fai;
+		if (grown > 0 && store_size + grown >= quota) {
+			*e_result = MAPI_E_STORE_FULL;
+			break;
+		}
+		MESSAGE_CONTENT tmp_msg = *msgs[i];
+		if (account != nullptr &&
+		    !message_set_delivery_props(account, msgs[i], tmp_msg))
+			return FALSE;
+		auto ts = tmp_msg.proplist.get<uint64_t>(PR_LAST_MODIFICATION_TIME);
+		if (ts != nullptr)
+			*ts = nt_time;
+		if (flags & EXMDB_WRITE_DELIVERY) {
+			ts = tmp_msg.proplist.get<uint64_t>(PR_MESSAGE_DELIVERY_TIME);
+			if (ts != nullptr)
+				*ts = nt_time;
+		}
+		uint64_t mid_val = 0, cn_val = 0;
+		bool partial = false;
+		if (!message_write_message(false, pdb->psqlite, cpid, false,
+		    fid_val, &tmp_msg, &mid_val, &cn_val, &partial, &delta))
+			return FALSE;
+		outmids.push_back(mid_val != 0 ? rop_util_make_eid_ex(1, mid_val) : eid_t{});
+		if (mid_val != 0)
+			written.push_back(mid_val);
+	}
+	if (delta.normal != 0 || delta.fai != 0) {
+		/* The two may go in different directions (rewritten messages) */
+		if (!cu_adjust_store_size(pdb->psqlite, ADJ_INCREASE,
+		    std::max<int64_t>(delta.normal, 0), std::max<int64_t>(delta.fai, 0)) ||
+		    !cu_adjust_store_size(pdb->psqlite, ADJ_DECREASE,
+		    std::max<int64_t>(-delta.normal, 0), std::max<int64_t>(-delta.fai, 0)))
+			return FALSE;
+	}
+	if (written.empty())
+		return sql_transact.commit() == SQLITE_OK ? TRUE : false;
+	BOOL b_result = false;
+	if (!cu_set_property(MAPI_FOLDER, fid_val, CP_ACP,
+	    pdb->psqlite, PR_LOCAL_COMMIT_TIME_MAX, &nt_time, &b_result))
+		return FALSE;
+	auto dbase = pdb->lock_base_wr();
+	db_conn::NOTIFQ notifq, msg_notifq;
+	pdb->begin_batch_mode(*dbase);
+	auto cl_0 = make_scope_exit([&]() { pdb->cancel_batch_mode(*dbase); });
+	for (auto mid_val : written) {
+		/*
+		 * Table rows are still added (quietly, in batch mode); only the
+		 * per-message datagrams in msg_notifq are dropped.
+		 */
+		pdb->proc_dynamic_event(cpid, dynamic_event::new_msg, fid_val,
+			mid_val, 0, *dbase, msg_notifq);
+		pdb->notify_message_creation(fid_val, mid_val, *dbase, msg_notifq);
+		msg_notifq.clear();
+	}
+	pdb->notify_folder_modification(common_util_get_folder_parent_fid(
+		pdb->psqlite, fid_val), fid_val, *dbase, notifq);
+	if (sql_transact.commit() != SQLITE_OK)
+		return false;
+	dg_notify(std::move(notifq));
+	cl_0.release();
+	db_conn::commit_batch_mode_release(std::move(pdb), std::move(dbase));
+	return TRUE;
+}
+
+/**
+ * Bulk variant of write_message(_v2) for migration tools.
+ *
+ * Messages are written without PidTagMid/PidTagChangeNumber handling by the
+ * client: IDs, PR_CHANGE_KEY and PR_PREDECESSOR_CHANGE_LIST are assigned here
+ * unless present. The request is split into transactions of
+ * exmdb_bulk_pacing messages. Search folders are updated as usual, but
+ * instead of per-message notifications, every affected content table gets a
+ * single reload notification per transaction.
+ *
+ * With EXMDB_WRITE_DELIVERY, the messages get the same recipient
+ * properties as with deliver_message (no rules are run, though), and the
+ * receive quota rather than the storage quota applies.
+ */
+BOOL exmdb_server::write_messages(const char *dir, cpid_t cpid,
+    uint64_t folder_id, uint32_t flags,
+    const std::vector<const MESSAGE_CONTENT *> &msgs,
+    std::vector<uint64_t> *outmids, ec_error_t *e_result) try
+{
+	char account[UDOM_SIZE];
+	const char *acct = nullptr;
+	if ((flags & EXMDB_WRITE_DELIVERY) && exmdb_server::is_private()) {
+		if (!common_util_get_username_from_id(exmdb_server::get_account_id(),
+		    account, std::size(account)))
+			return false;
+		acct = account;
+	}
+	auto fid_val = rop_util_get_gc_value(folder_id);
+	size_t step = g_exmdb_bulk_pacing > 0 ? g_exmdb_bulk_pacing : UINT32_MAX;
+	*e_result = ecSuccess;
+	outmids->clear();
+	outmids->reserve(msgs.size());
+	for (size_t i = 0; i < msgs.size() && *e_result == ecSuccess; i += step)
+		if (!write_messages_slice(dir, cpid, fid_val, flags, acct,
+		    &msgs[i], std::min(step, msgs.size() - i), *outmids, e_result))
+			return FALSE;
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1361: ENOMEM");
+	return false;
+}
+
 /**
  * @username:   Used for adjusting public store readstates
  */
@@ -151,6 +151,14 @@ static constexpr const char *exmdb_rpc_names[] = {
 	E(movecopy_folder),
 	E(create_folder),
 	E(write_message_v2),
+	E(multi_call),
+	E(read_instance_range),
+	E(get_search_progress),
+	E(rebuild_fulltext),
+	E(get_cache_stats),
+	E(get_rpc_stats),
+	E(purge_datafiles_v2),
+	E(write_messages),
 };
 #undef E
 
@@ -159,9 +167,63 @@ namespace exmdb {
 const char *exmdb_rpc_idtoname(exmdb_callid i)
 {
 	auto j = static_cast<uint8_t>(i);
-	static_assert(std::size(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::write_message_v2) + 1);
+	static_assert(std::size(exmdb_rpc_names) == static_cast<uint8_t>(exmdb_callid::write_messages) + 1);
 	auto s = j < std::size(exmdb_rpc_names) ? exmdb_rpc_names[j] : nullptr;
 	return znul(s);
 }
 
+/**
+ * RPCs which never modify exchange.sqlite3 and may therefore be run on a
+ * read-only connection. (tables.sqlite3 stays writable for them.)
+ */
+bool exmdb_rpc_readonly(exmdb_callid i)
+{
+	using enum exmdb_callid;
+	switch (i) {
+	case ping_store:
+	case get_all_named_propids:
+	case get_named_propnames:
+	case get_store_all_proptags:
+	case get_store_properties:
+	case get_mbox_perm:
+	case get_folder_by_class:
+	case get_folder_class_table:
+	case is_folder_present:
+	case is_folder_deleted:
+	case get_folder_by_name:
+	case get_folder_perm:
+	case get_folder_all_proptags:
+	case get_folder_properties:
+	case is_descendant_folder:
+	case get_search_criteria:
+	case get_message_brief:
+	case sum_hierarchy:
+	case sum_content:
+	case sum_table:
+	case query_table:
+	case match_table:
+	case locate_table:
+	case read_table_row:
+	case mark_table:
+	case get_table_all_proptags:
+	case is_msg_present:
+	case is_msg_deleted:
+	case get_message_rcpts:
+	case get_message_properties:
+	case get_message_group_id:
+	case get_change_indices:
+	case get_message_timer:
+	case read_message:
+	case get_content_sync:
+	case get_hierarchy_sync:
+	case check_contact_address:
+	case get_public_folder_unread_count:
+	case autoreply_tsquery:
+	case get_search_progress:
+		return true;
+	default:
+		return false;
+	}
+}
+
 }
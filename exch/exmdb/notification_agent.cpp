@@ -1,12 +1,20 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <string>
 #include <unistd.h>
 #include <utility>
+#include <vector>
+#include <gromox/clock.hpp>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -14,6 +22,206 @@
 #include "notification_agent.hpp"
 #include "parser.hpp"
 
+/**
+ * Identity of the object @type refers to, as far as coalescing is concerned.
+ * Subscription (dir, b_table, id_array) is part of it.
+ */
+static std::string na_key(const DB_NOTIFY_DATAGRAM &dg, db_notify_type type,
+    uint64_t a, uint64_t b = 0, uint64_t c = 0)
+{
+	std::string k;
+	uint64_t ids[] = {a, b, c, dg.id_array.size()};
+	k.reserve(2 + sizeof(ids) + dg.id_array.size() * sizeof(uint32_t) + strlen(dg.dir));
+	k.push_back(static_cast<char>(type));
+	k.push_back(dg.b_table ? 1 : 0);
+	k.append(reinterpret_cast<const char *>(ids), sizeof(ids));
+	k.append(reinterpret_cast<const char *>(dg.id_array.data()),
+		dg.id_array.size() * sizeof(uint32_t));
+	k.append(dg.dir);
+	return k;
+}
+
+/**
+ * Identity of the message (or folder) an event is about, within the same
+ * subscription; 0 is not a valid event type and so cannot clash with a key.
+ */
+static std::string na_obj(const DB_NOTIFY_DATAGRAM &dg, bool folder, uint64_t id)
+{
+	return na_key(dg, static_cast<db_notify_type>(0), folder, id);
+}
+
+/* Drop the not-yet-sent datagram with @key, if any. */
+static bool na_drop(ROUTER_CONNECTION &rt, const std::string &key)
+{
+	auto ix = rt.dgram_index.find(key);
+	if (ix == rt.dgram_index.end())
+		return false;
+	rt.erase_dgram(ix->second);
+	++g_notifs_merged;
+	return true;
+}
+
+/* Drop all not-yet-sent datagrams about object @obj. */
+static void na_forget(ROUTER_CONNECTION &rt, const std::string &obj)
+{
+	for (auto it = rt.datagram_list.begin(); it != rt.datagram_list.end(); ) {
+		if (it->obj != obj) {
+			++it;
+			continue;
+		}
+		rt.erase_dgram(it++);
+		++g_notifs_merged;
+	}
+}
+
+static bool na_push(ROUTER_CONNECTION &rt, const DB_NOTIFY_DATAGRAM &dg,
+    std::string &&key, std::string &&obj, std::vector<uint32_t> &&proptags = {})
+{
+	router_dgram e;
+	if (exmdb_ext_push_db_notify(&dg, &e.bin) != EXT_ERR_SUCCESS)
+		return false;
+	try {
+		e.queued = gromox::tp_now();
+		e.key = std::move(key);
+		e.obj = std::move(obj);
+		e.proptags = std::move(proptags);
+		rt.datagram_list.push_back(std::move(e));
+		auto it = std::prev(rt.datagram_list.end());
+		if (!it->key.empty())
+			rt.dgram_index[it->key] = it;
+	} catch (const std::bad_alloc &) {
+		free(e.bin.pb);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Fold a modification event into a pending one for the same object. The
+ * newer event wins, with the proptag lists united, and takes the place of
+ * the pending one in the queue, so that it is still delivered before
+ * whatever was queued after the first modification.
+ */
+template<typename T> static bool na_modify(ROUTER_CONNECTION &rt,
+    const DB_NOTIFY_DATAGRAM &dg, std::string &&key, std::string &&obj)
+{
+	auto &n = *static_cast<const T *>(dg.db_notify.pdata);
+	std::vector<uint32_t> tags(n.proptags.pproptag, n.proptags.pproptag + n.proptags.count);
+	auto ix = rt.dgram_index.find(key);
+	if (ix == rt.dgram_index.end())
+		return na_push(rt, dg, std::move(key), std::move(obj), std::move(tags));
+	auto &old = ix->second->proptags;
+	for (auto t : old)
+		if (std::find(tags.begin(), tags.end(), t) == tags.end())
+			tags.push_back(t);
+	auto n2 = n;
+	n2.proptags.count = tags.size();
+	n2.proptags.pproptag = tags.data();
+	auto dg2 = dg;
+	dg2.db_notify.pdata = &n2;
+	BINARY bin{};
+	if (exmdb_ext_push_db_notify(&dg2, &bin) != EXT_ERR_SUCCESS)
+		return false;
+	/* Keeps its queue position and time, key and index entry */
+	auto &e = *ix->second;
+	free(e.bin.pb);
+	e.bin = bin;
+	e.proptags = std::move(tags);
+	++g_notifs_merged;
+	return true;
+}
+
+/**
+ * Queue @dg for @rt, merging it with what is still waiting to be sent:
+ * repeated modifications of an object collapse into one, and an object
+ * created and deleted again before anything went out is not reported at all
+ * (nor is anything else that happened to it in between).
+ * Caller holds rt.lock.
+ */
+static bool na_enqueue(ROUTER_CONNECTION &rt, const DB_NOTIFY_DATAGRAM &dg) try
+{
+	auto type = dg.db_notify.type;
+	auto pd = dg.db_notify.pdata;
+	++g_notifs;
+	switch (type) {
+	case db_notify_type::new_mail: {
+		auto &n = *static_cast<const DB_NOTIFY_NEW_MAIL *>(pd);
+		return na_push(rt, dg, na_key(dg, type, n.folder_id, n.message_id),
+		       na_obj(dg, false, n.message_id));
+	}
+	case db_notify_type::message_created: {
+		auto &n = *static_cast<const DB_NOTIFY_MESSAGE_CREATED *>(pd);
+		return na_push(rt, dg, na_key(dg, type, n.folder_id, n.message_id),
+		       na_obj(dg, false, n.message_id));
+	}
+	case db_notify_type::folder_created: {
+		auto &n = *static_cast<const DB_NOTIFY_FOLDER_CREATED *>(pd);
+		return na_push(rt, dg, na_key(dg, type, n.folder_id, n.parent_id),
+		       na_obj(dg, true, n.folder_id));
+	}
+	case db_notify_type::link_created: {
+		auto &n = *static_cast<const DB_NOTIFY_LINK_CREATED *>(pd);
+		return na_push(rt, dg, na_key(dg, type, n.folder_id, n.message_id, n.parent_id),
+		       na_obj(dg, false, n.message_id));
+	}
+	case db_notify_type::message_modified: {
+		auto &n = *static_cast<const DB_NOTIFY_MESSAGE_MODIFIED *>(pd);
+		return na_modify<DB_NOTIFY_MESSAGE_MODIFIED>(rt, dg,
+		       na_key(dg, type, n.folder_id, n.message_id),
+		       na_obj(dg, false, n.message_id));
+	}
+	case db_notify_type::folder_modified: {
+		auto &n = *static_cast<const DB_NOTIFY_FOLDER_MODIFIED *>(pd);
+		return na_modify<DB_NOTIFY_FOLDER_MODIFIED>(rt, dg,
+		       na_key(dg, type, n.folder_id), na_obj(dg, true, n.folder_id));
+	}
+	case db_notify_type::message_moved:
+	case db_notify_type::message_copied: {
+		auto &n = *static_cast<const DB_NOTIFY_MESSAGE_MVCP *>(pd);
+		return na_push(rt, dg, {}, na_obj(dg, false, n.message_id));
+	}
+	case db_notify_type::folder_moved:
+	case db_notify_type::folder_copied: {
+		auto &n = *static_cast<const DB_NOTIFY_FOLDER_MVCP *>(pd);
+		return na_push(rt, dg, {}, na_obj(dg, true, n.folder_id));
+	}
+	case db_notify_type::message_deleted: {
+		auto &n = *static_cast<const DB_NOTIFY_MESSAGE_DELETED *>(pd);
+		na_drop(rt, na_key(dg, db_notify_type::message_modified, n.folder_id, n.message_id));
+		na_drop(rt, na_key(dg, db_notify_type::new_mail, n.folder_id, n.message_id));
+		if (na_drop(rt, na_key(dg, db_notify_type::message_created, n.folder_id, n.message_id))) {
+			na_forget(rt, na_obj(dg, false, n.message_id));
+			++g_notifs_merged;
+			return true;
+		}
+		break;
+	}
+	case db_notify_type::folder_deleted: {
+		auto &n = *static_cast<const DB_NOTIFY_FOLDER_DELETED *>(pd);
+		na_drop(rt, na_key(dg, db_notify_type::folder_modified, n.folder_id));
+		if (na_drop(rt, na_key(dg, db_notify_type::folder_created, n.folder_id, n.parent_id))) {
+			na_forget(rt, na_obj(dg, true, n.folder_id));
+			++g_notifs_merged;
+			return true;
+		}
+		break;
+	}
+	case db_notify_type::link_deleted: {
+		auto &n = *static_cast<const DB_NOTIFY_LINK_DELETED *>(pd);
+		if (na_drop(rt, na_key(dg, db_notify_type::link_created, n.folder_id, n.message_id, n.parent_id))) {
+			++g_notifs_merged;
+			return true;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+	return na_push(rt, dg, {}, {});
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
 void notification_agent_backward_notify(const char *remote_id,
     const DB_NOTIFY_DATAGRAM *pnotify)
 {
@@ -27,22 +235,16 @@ void notification_agent_backward_notify(const char *remote_id,
 	if (NULL == prouter) {
 		return;
 	}
-	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
-		exmdb_parser_insert_router(std::move(prouter));
-		return;	
-	}
-	try {
-		std::unique_lock rt_hold(prouter->lock);
-		prouter->datagram_list.push_back(bin);
-	} catch (...) {
-		free(bin.pb);
-		return;
-	}
-	prouter->waken_cond.notify_one();
+	std::unique_lock rt_hold(prouter->lock);
+	auto queued = na_enqueue(*prouter, *pnotify);
+	rt_hold.unlock();
+	auto rt = prouter;
 	exmdb_parser_insert_router(std::move(prouter));
+	if (queued)
+		exmdb_parser_wake_router(std::move(rt));
 }
 
+#ifndef HAVE_SYS_EPOLL_H
 static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
 {
 	int tv_msec;
@@ -71,13 +273,8 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 		cn_hold.unlock();
 
 		std::unique_lock rt_hold(prouter->lock);
-		if (prouter->datagram_list.size() > 0) {
-			dg = prouter->datagram_list.front();
-			prouter->datagram_list.pop_front();
-		} else {
-			dg.cb = 0;
-			dg.pb = nullptr;
-		}
+		router_dgram e;
+		dg = prouter->pop_dgram(e) ? e.bin : BINARY{};
 		rt_hold.unlock();
 		if (dg.pb == nullptr) {
 			ping_buff = 0;
@@ -94,14 +291,8 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 			    !notification_agent_read_response(prouter))
 				goto EXIT_THREAD;
 			std::unique_lock rt_lock(prouter->lock);
-			if (prouter->datagram_list.size() > 0) {
-				dg = prouter->datagram_list.front();
-				prouter->datagram_list.pop_front();
-			} else {
-				rt_lock.unlock();
-				dg.cb = 0;
-				dg.pb = nullptr;
-			}
+			router_dgram e;
+			dg = prouter->pop_dgram(e) ? e.bin : BINARY{};
 		}
 	}
  EXIT_THREAD:
@@ -111,9 +302,10 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 	prouter->sockd = -1;
 	{
 		std::lock_guard lk(prouter->lock);
-		for (auto &&bin : prouter->datagram_list)
-			free(bin.pb);
+		for (auto &&e : prouter->datagram_list)
+			free(e.bin.pb);
 		prouter->datagram_list.clear();
+		prouter->dgram_index.clear();
 	}
 	if (!prouter->b_stop) {
 		prouter->thr_id = {};
@@ -121,3 +313,4 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 	}
 	pthread_exit(nullptr);
 }
+#endif
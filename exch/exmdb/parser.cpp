@@ -1,15 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2024 grommunio GmbH
 // This file is part of Gromox.
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <climits>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <memory>
 #include <mutex>
 #include <netdb.h>
@@ -17,16 +23,24 @@
 #include <pthread.h>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
+#ifdef HAVE_SYS_EPOLL_H
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <libHX/io.h>
 #include <libHX/socket.h>
 #include <libHX/string.h>
 #include <gromox/clock.hpp>
+#include <gromox/database.h>
 #include <gromox/defs.h>
+#include <gromox/endian.hpp>
 #include <gromox/exmdb_common_util.hpp>
 #include <gromox/exmdb_ext.hpp>
 #include <gromox/exmdb_rpc.hpp>
@@ -34,7 +48,9 @@
 #include <gromox/list_file.hpp>
 #include <gromox/mapi_types.hpp>
 #include <gromox/process.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/util.hpp>
+#include "db_engine.hpp"
 #include "notification_agent.hpp"
 #include "parser.hpp"
 #ifndef AI_V4MAPPED
@@ -43,31 +59,116 @@
 
 using namespace gromox;
 
+namespace {
+
+/* One request read off a connection, waiting for a worker */
+struct rpc_job {
+	std::shared_ptr<EXMDB_CONNECTION> conn;
+	uint32_t req_id = 0;
+	BINARY bin{}; /* manual (de)allocation of .pb */
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+/* What a descriptor registered with the event loop belongs to */
+struct ev_source {
+	uint32_t gen = 0;
+	std::shared_ptr<EXMDB_CONNECTION> conn;
+	std::shared_ptr<ROUTER_CONNECTION> router;
+};
+#endif
+
+}
+
 static size_t g_max_threads, g_max_routers;
+static unsigned int g_rpc_workers;
+static gromox::time_duration g_stats_interval;
+static gromox::atomic_bool g_rpc_stop{true};
+static std::vector<pthread_t> g_rpc_tids;
+static std::deque<rpc_job> g_rpc_queue;
+static std::mutex g_rpc_lock;
+static std::condition_variable g_rpc_cond;
+static std::atomic<unsigned int> g_rpc_busy;
+static std::atomic<size_t> g_rpc_queue_peak;
+static std::atomic<uint64_t> g_rpc_busy_ns, g_rpc_jobs;
 static std::vector<EXMDB_ITEM> g_local_list;
 static std::unordered_set<std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
 static std::unordered_set<std::shared_ptr<EXMDB_CONNECTION>> g_connection_list;
 static std::mutex g_router_lock, g_connection_lock;
+#ifdef HAVE_SYS_EPOLL_H
+static int g_epoll_fd = -1, g_wake_fd = -1;
+static pthread_t g_evloop_tid;
+static gromox::atomic_bool g_evloop_stop{true};
+static std::mutex g_ev_lock; /* protects g_ev_map, g_ev_gen, g_*_kicks */
+static std::unordered_map<int, ev_source> g_ev_map;
+static uint32_t g_ev_gen;
+static std::vector<std::shared_ptr<ROUTER_CONNECTION>> g_router_kicks;
+static std::vector<std::shared_ptr<EXMDB_CONNECTION>> g_conn_kicks;
+/* Routers holding back a notification batch; event loop only */
+static std::vector<std::shared_ptr<ROUTER_CONNECTION>> g_router_timed;
+#endif
 unsigned int g_enable_dam;
+unsigned int g_notify_batch_max = 256;
+gromox::time_duration g_notify_batch_delay;
+std::atomic<uint64_t> g_notifs, g_notifs_merged, g_notif_frames;
 
 EXMDB_CONNECTION::~EXMDB_CONNECTION()
 {
-	if (sockd >= 0)
+	if (sockd >= 0) {
 		close(sockd);
+		sockd = -1;
+	}
+	free(rd_buf);
 }
 
 ROUTER_CONNECTION::~ROUTER_CONNECTION()
 {
 	if (sockd >= 0)
 		close(sockd);
-	for (auto &&bin : datagram_list)
-		free(bin.pb);
+	for (auto &&dg : datagram_list)
+		free(dg.bin.pb);
+	free(out.pb);
 }
 
-void exmdb_parser_init(size_t max_threads, size_t max_routers)
+/* Caller holds @lock */
+void ROUTER_CONNECTION::unindex_dgram(dgram_list::iterator it)
+{
+	if (it->key.empty())
+		return;
+	auto ix = dgram_index.find(it->key);
+	if (ix != dgram_index.end() && ix->second == it)
+		dgram_index.erase(ix);
+}
+
+/* Caller holds @lock */
+void ROUTER_CONNECTION::erase_dgram(dgram_list::iterator it)
+{
+	unindex_dgram(it);
+	free(it->bin.pb);
+	datagram_list.erase(it);
+}
+
+/**
+ * Take the oldest datagram off the queue; ownership of .bin.pb passes to the
+ * caller. Caller holds @lock.
+ */
+bool ROUTER_CONNECTION::pop_dgram(router_dgram &dg)
+{
+	if (datagram_list.empty())
+		return false;
+	auto it = datagram_list.begin();
+	unindex_dgram(it);
+	dg = std::move(*it);
+	datagram_list.erase(it);
+	return true;
+}
+
+void exmdb_parser_init(size_t max_threads, size_t max_routers,
+    unsigned int rpc_workers, gromox::time_duration stats_interval)
 {
 	g_max_threads = max_threads;
 	g_max_routers = max_routers;
+	g_rpc_workers = rpc_workers;
+	g_stats_interval = stats_interval;
 }
 
 std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn()
@@ -151,16 +252,24 @@ static BOOL exmdb_parser_dispatch2(const exreq *prequest, std::unique_ptr<exresp
 	return false;
 }
 
-static BOOL exmdb_parser_dispatch(const exreq *prequest, std::unique_ptr<exresp> &presponse)
+/**
+ * @in_bytes: size of the serialized request, for the RPC counters
+ */
+static BOOL exmdb_parser_dispatch(const exreq *prequest,
+    std::unique_ptr<exresp> &presponse, size_t in_bytes)
 {
 	auto tstart = tp_now();
 	exmdb_server::set_dir(prequest->dir);
+	exmdb_server::set_readonly(exmdb_rpc_readonly(prequest->call_id));
 	auto ret = exmdb_parser_dispatch2(prequest, presponse);
+	exmdb_server::set_readonly(false);
 	if (ret)
 		presponse->call_id = prequest->call_id;
+	auto tend = tp_now();
+	exmdb_rpc_account(prequest->call_id, prequest->dir, ret, tend - tstart,
+		in_bytes, prequest);
 	if (g_exrpc_debug == 0)
 		return ret;
-	auto tend = tp_now();
 	if (!ret || g_exrpc_debug == 2)
 		mlog(LV_DEBUG, "EXRPC %s %s %5luµs %s", znul(prequest->dir),
 		        ret == 0 ? "ERR" : "ok ",
@@ -169,28 +278,1014 @@ static BOOL exmdb_parser_dispatch(const exreq *prequest, std::unique_ptr<exresp>
 	return ret;
 }
 
+static pack_result exmdb_parser_push(const exresp *presponse, BINARY *pbin)
+{
+	auto ret = exmdb_ext_push_response(presponse, pbin);
+	if (ret == pack_result::success)
+		exmdb_rpc_account_out(presponse->call_id, pbin->cb);
+	return ret;
+}
+
 static inline void stripslash(char *s)
 {
 	for (auto z = strlen(s); z > 1 && s[z-1] == '/'; --z)
 		s[z-1] = '\0';
 }
 
+/**
+ * Execute a batch of requests for one store in order. The sqlite handles are
+ * pinned for the duration, so the sub-requests do not each go through the
+ * db_base lookup and handle acquisition again.
+ */
+BOOL exmdb_server::multi_call(const char *dir, uint8_t flags,
+    const BINARY_ARRAY *reqs, BINARY_ARRAY *rsps)
+{
+	rsps->count = 0;
+	rsps->pbin = cu_alloc<BINARY>(reqs->count);
+	if (rsps->pbin == nullptr && reqs->count > 0)
+		return false;
+	db_conn_pin pin(dir);
+	for (size_t i = 0; i < reqs->count; ++i) {
+		std::unique_ptr<exreq> request;
+		std::unique_ptr<exresp> response;
+		BINARY rsp_bin{};
+		auto code = exmdb_response::success;
+		auto status = exmdb_ext_pull_request(&reqs->pbin[i], request);
+		if (request != nullptr && request->dir != nullptr)
+			stripslash(request->dir);
+		if (status != pack_result::ok || request == nullptr)
+			code = exmdb_response::pull_error;
+		else if (request->dir == nullptr || strcmp(request->dir, dir) != 0)
+			code = exmdb_response::dispatch_error;
+		else if (request->call_id == exmdb_callid::connect ||
+		    request->call_id == exmdb_callid::listen_notification ||
+		    request->call_id == exmdb_callid::multi_call ||
+		    request->call_id == exmdb_callid::unload_store)
+			code = exmdb_response::dispatch_error;
+		else if (!exmdb_parser_dispatch(request.get(), response, reqs->pbin[i].cb))
+			code = exmdb_response::dispatch_error;
+		else if (exmdb_parser_push(response.get(), &rsp_bin) != pack_result::success)
+			code = exmdb_response::push_error;
+		auto &out = rsps->pbin[rsps->count++];
+		if (code != exmdb_response::success) {
+			out.cb = 5;
+			out.pb = cu_alloc<uint8_t>(out.cb);
+			if (out.pb == nullptr)
+				return false;
+			out.pb[0] = static_cast<uint8_t>(code);
+			cpu_to_le32p(&out.pb[1], 0);
+		} else {
+			out.cb = rsp_bin.cb;
+			out.pb = cu_alloc<uint8_t>(out.cb);
+			if (out.pb == nullptr) {
+				free(rsp_bin.pb);
+				return false;
+			}
+			memcpy(out.pb, rsp_bin.pb, out.cb);
+			free(rsp_bin.pb);
+		}
+		if (code != exmdb_response::success &&
+		    flags & EXMDB_MULTI_STOP_ON_ERROR)
+			break;
+	}
+	exmdb_server::set_dir(dir);
+	return TRUE;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Write out queued output for as long as the socket takes it. Caller holds
+ * conn.wr_lock. Returns false if the connection is broken.
+ */
+static bool conn_flush(EXMDB_CONNECTION &conn)
+{
+	while (conn.wr_off < conn.wr_queue.size()) {
+		auto ret = write(conn.sockd, &conn.wr_queue[conn.wr_off],
+		           conn.wr_queue.size() - conn.wr_off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (ret <= 0)
+			return false;
+		conn.wr_off += ret;
+		conn.last_timestamp = tp_now();
+	}
+	conn.wr_queue.clear();
+	conn.wr_off = 0;
+	return true;
+}
+
+/**
+ * Have the event loop pick up the output queued for @pconn.
+ */
+static void conn_kick(std::shared_ptr<EXMDB_CONNECTION> &&pconn)
+{
+	try {
+		std::lock_guard lk(g_ev_lock);
+		g_conn_kicks.push_back(std::move(pconn));
+	} catch (const std::bad_alloc &) {
+		/* the next request or ping will re-arm the socket */
+		return;
+	}
+	uint64_t one = 1;
+	if (write(g_wake_fd, &one, sizeof(one)) < 0)
+		/* ignore */;
+}
+#endif
+
+/**
+ * Send @iov over the connection.
+ *
+ * In event loop mode, this never blocks: what the socket does not take right
+ * away is queued behind earlier output, and it is up to the caller to (have
+ * the event loop) arm the socket for EPOLLOUT. Returns the number of bytes
+ * left in the queue, or -1 if the connection is broken.
+ */
+static ssize_t conn_writev(EXMDB_CONNECTION &conn, struct iovec *iov,
+    unsigned int iovcnt) try
+{
+	std::lock_guard wr_hold(conn.wr_lock);
+#ifdef HAVE_SYS_EPOLL_H
+	size_t done = 0;
+	if (conn.wr_queue.empty()) {
+		ssize_t ret;
+		do {
+			ret = writev(conn.sockd, iov, iovcnt);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (ret > 0)
+			done = ret;
+	}
+	for (unsigned int i = 0; i < iovcnt; ++i) {
+		if (done >= iov[i].iov_len) {
+			done -= iov[i].iov_len;
+			continue;
+		}
+		conn.wr_queue.append(static_cast<const char *>(iov[i].iov_base) + done,
+			iov[i].iov_len - done);
+		done = 0;
+	}
+	return conn.wr_queue.size() - conn.wr_off;
+#else
+	return exmdb_client_writev_socket(conn.sockd, iov, iovcnt,
+	       SOCKET_TIMEOUT * 1000) ? 0 : -1;
+#endif
+} catch (const std::bad_alloc &) {
+	return -1;
+}
+
+static ssize_t conn_write(EXMDB_CONNECTION &conn, const void *data, uint32_t len)
+{
+	struct iovec iov = {const_cast<void *>(data), len};
+	return conn_writev(conn, &iov, 1);
+}
+
+/**
+ * Emit one response frame in multiplexed mode:
+ * {uint8_t status; leuint32_t length; leuint32_t req_id; char payload[];},
+ * where length covers req_id and payload. Return value as for conn_writev.
+ */
+static ssize_t mux_write_response(EXMDB_CONNECTION &conn, uint32_t req_id,
+    exmdb_response code, const void *data = nullptr, uint32_t len = 0)
+{
+	uint8_t hdr[9];
+	hdr[0] = static_cast<uint8_t>(code);
+	cpu_to_le32p(&hdr[1], len + sizeof(uint32_t));
+	cpu_to_le32p(&hdr[5], req_id);
+	struct iovec iov[2] = {{hdr, sizeof(hdr)}, {const_cast<void *>(data), len}};
+	return conn_writev(conn, iov, 2);
+}
+
+/**
+ * Validate the CONNECT request and send the reply. Returns the multiplexing
+ * flags granted, or a negative value if the connection is to be dropped.
+ */
+static int parser_connect(EXMDB_CONNECTION &conn, const exreq_connect &q)
+{
+	BOOL b_private = false;
+	exmdb_response code = exmdb_response::success;
+	if (!exmdb_parser_is_local(q.prefix, &b_private))
+		code = exmdb_response::misconfig_prefix;
+	else if (b_private != q.b_private)
+		code = exmdb_response::misconfig_mode;
+	if (code != exmdb_response::success) {
+		conn_write(conn, &code, 1);
+		return -1;
+	}
+	conn.remote_id = q.remote_id;
+	conn.b_private = b_private;
+	uint32_t flags = q.proto_flags & (g_rpc_workers > 0 ? EXMDB_PROTO_MUX : 0);
+	if (q.proto_flags == 0) {
+		uint8_t resp_buff[5]{};
+		if (conn_write(conn, resp_buff, 5) < 0)
+			return -1;
+	} else {
+		/* Client that offers flags gets to see our selection */
+		uint8_t ext_buff[9]{};
+		cpu_to_le32p(&ext_buff[1], sizeof(uint32_t));
+		cpu_to_le32p(&ext_buff[5], flags);
+		if (conn_write(conn, ext_buff, 9) < 0)
+			return -1;
+	}
+	return flags;
+}
+
+static void mux_process(rpc_job &&job)
+{
+	auto &conn = *job.conn;
+	auto cl_0 = make_scope_exit([&]() {
+		std::lock_guard lk(g_rpc_lock);
+		if (--conn.mux_inflight == 0)
+			conn.mux_idle_cond.notify_all();
+	});
+	exmdb_server::build_env(conn.b_private ? EM_PRIVATE : 0, nullptr);
+	exmdb_server::set_remote_id(conn.remote_id.c_str());
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&job.bin, request);
+	free(job.bin.pb);
+	job.bin.pb = nullptr;
+	if (request != nullptr && request->dir != nullptr)
+		stripslash(request->dir);
+	std::unique_ptr<exresp> response;
+	BINARY rsp_bin{};
+	exmdb_response code = exmdb_response::success;
+	if (status != pack_result::ok || request == nullptr)
+		code = exmdb_response::pull_error;
+	else if (request->call_id == exmdb_callid::connect ||
+	    request->call_id == exmdb_callid::listen_notification)
+		code = exmdb_response::dispatch_error;
+	else if (!exmdb_parser_dispatch(request.get(), response, job.bin.cb))
+		code = exmdb_response::dispatch_error;
+	else if (exmdb_parser_push(response.get(), &rsp_bin) != pack_result::success)
+		code = exmdb_response::push_error;
+	exmdb_server::free_env();
+	exmdb_server::set_remote_id(nullptr);
+	ssize_t ret;
+	if (code != exmdb_response::success)
+		ret = mux_write_response(conn, job.req_id, code);
+	else
+		/* Skip status byte and length of the lock-step encoding */
+		ret = mux_write_response(conn, job.req_id, code,
+		      rsp_bin.pb + 5, rsp_bin.cb - 5);
+	free(rsp_bin.pb);
+	if (ret < 0)
+		shutdown(conn.sockd, SHUT_RDWR);
+#ifdef HAVE_SYS_EPOLL_H
+	else if (ret > 0)
+		conn_kick(std::shared_ptr<EXMDB_CONNECTION>(job.conn));
+#endif
+}
+
+static bool rpc_enqueue(rpc_job &&job) try
+{
+	std::unique_lock lk(g_rpc_lock);
+	g_rpc_queue.push_back(std::move(job));
+	auto depth = g_rpc_queue.size();
+	if (depth > g_rpc_queue_peak)
+		g_rpc_queue_peak = depth;
+	lk.unlock();
+	g_rpc_cond.notify_one();
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int ev_arm(int fd, uint32_t gen, uint32_t events, bool add = false)
+{
+	struct epoll_event ev{};
+	ev.events = events | EPOLLONESHOT;
+	ev.data.u64 = static_cast<uint64_t>(gen) << 32 | static_cast<uint32_t>(fd);
+	return epoll_ctl(g_epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void conn_close(std::shared_ptr<EXMDB_CONNECTION> pconn)
+{
+	auto &conn = *pconn;
+	conn.b_stop = true;
+	if (conn.sockd >= 0) {
+		std::unique_lock lk(g_ev_lock);
+		auto it = g_ev_map.find(conn.sockd);
+		if (it != g_ev_map.end() && it->second.conn == pconn) {
+			epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, conn.sockd, nullptr);
+			g_ev_map.erase(it);
+		}
+		lk.unlock();
+		/* Descriptor itself is closed once workers let go of @pconn */
+		shutdown(conn.sockd, SHUT_RDWR);
+	}
+	std::lock_guard chold(g_connection_lock);
+	g_connection_list.erase(pconn);
+}
+
+static void conn_readable(std::shared_ptr<EXMDB_CONNECTION>);
+
+/**
+ * Watch @pconn for input, and for writability while output is queued. A
+ * connection with a lock-step RPC in progress is left alone; its worker
+ * re-arms it when done.
+ */
+static void conn_arm(std::shared_ptr<EXMDB_CONNECTION> pconn)
+{
+	auto &conn = *pconn;
+	std::unique_lock wr_hold(conn.wr_lock);
+	if (conn.b_stop || conn.busy || conn.sockd < 0)
+		return;
+	uint32_t events = EPOLLIN;
+	if (conn.wr_off < conn.wr_queue.size())
+		events |= EPOLLOUT;
+	if (ev_arm(conn.sockd, conn.ev_gen, events) == 0)
+		return;
+	wr_hold.unlock();
+	conn_close(std::move(pconn));
+}
+
+static void conn_rearm(const std::shared_ptr<EXMDB_CONNECTION> &pconn)
+{
+	pconn->last_timestamp = tp_now();
+	pconn->busy = false;
+	conn_arm(pconn);
+}
+
+/**
+ * Only called from the event loop: send queued output if the socket became
+ * writable, read requests if it became readable.
+ */
+static void conn_event(std::shared_ptr<EXMDB_CONNECTION> pconn, uint32_t events)
+{
+	auto &conn = *pconn;
+	if (events & EPOLLOUT) {
+		std::unique_lock wr_hold(conn.wr_lock);
+		if (!conn_flush(conn)) {
+			wr_hold.unlock();
+			conn_close(std::move(pconn));
+			return;
+		}
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		conn_readable(std::move(pconn));
+	else
+		conn_arm(std::move(pconn));
+}
+
+static void router_close(std::shared_ptr<ROUTER_CONNECTION> prt)
+{
+	auto &rt = *prt;
+	rt.b_stop = true;
+	if (rt.sockd >= 0) {
+		std::unique_lock lk(g_ev_lock);
+		auto it = g_ev_map.find(rt.sockd);
+		if (it != g_ev_map.end() && it->second.router == prt) {
+			epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, rt.sockd, nullptr);
+			g_ev_map.erase(it);
+		}
+		lk.unlock();
+		shutdown(rt.sockd, SHUT_RDWR);
+	}
+	/* If a notifier has it extracted right now, the periodic sweep gets it */
+	exmdb_parser_erase_router(prt);
+}
+
+/**
+ * Hand over the socket of @pconn to a new router (notification) connection.
+ */
+static void lockstep_listen(std::shared_ptr<EXMDB_CONNECTION> pconn,
+    const exreq_listen_notification &q)
+{
+	auto &conn = *pconn;
+	std::shared_ptr<ROUTER_CONNECTION> prouter;
+	try {
+		prouter = std::make_shared<ROUTER_CONNECTION>();
+		prouter->remote_id = q.remote_id;
+	} catch (const std::bad_alloc &) {
+	}
+	std::unique_lock rhold(g_router_lock);
+	auto nrouters = g_router_list.size();
+	rhold.unlock();
+	exmdb_response code;
+	if (prouter == nullptr) {
+		code = exmdb_response::lack_memory;
+	} else if (g_max_routers != 0 && nrouters >= g_max_routers) {
+		code = exmdb_response::max_reached;
+	} else {
+		uint8_t resp_buff[9]{};
+		size_t resp_len = 5;
+		if (q.proto_flags != 0) {
+			prouter->proto_flags = q.proto_flags & EXMDB_PROTO_NOTIFY_BATCH;
+			cpu_to_le32p(&resp_buff[1], sizeof(uint32_t));
+			cpu_to_le32p(&resp_buff[5], prouter->proto_flags);
+			resp_len = 9;
+		}
+		/*
+		 * The descriptor changes hands below, so the reply has to be
+		 * out in full. This runs on a worker, which may block.
+		 */
+		struct iovec iov = {resp_buff, resp_len};
+		std::unique_lock wr_hold(conn.wr_lock);
+		if (conn.wr_off < conn.wr_queue.size() ||
+		    !exmdb_client_writev_socket(conn.sockd, &iov, 1, SOCKET_TIMEOUT * 1000)) {
+			wr_hold.unlock();
+			conn_close(std::move(pconn));
+			return;
+		}
+		wr_hold.unlock();
+		std::unique_lock lk(g_ev_lock);
+		auto it = g_ev_map.find(conn.sockd);
+		if (it == g_ev_map.end() || it->second.conn != pconn) {
+			/* Torn down in the meantime */
+			lk.unlock();
+			conn_close(std::move(pconn));
+			return;
+		}
+		prouter->sockd = conn.sockd;
+		conn.sockd = -1;
+		prouter->ev_gen = it->second.gen = ++g_ev_gen;
+		prouter->last_time = time(nullptr);
+		it->second.conn.reset();
+		it->second.router = prouter;
+		lk.unlock();
+		rhold.lock();
+		g_router_list.insert(prouter);
+		rhold.unlock();
+		std::unique_lock chold(g_connection_lock);
+		g_connection_list.erase(pconn);
+		chold.unlock();
+		if (ev_arm(prouter->sockd, prouter->ev_gen, EPOLLIN) != 0)
+			router_close(std::move(prouter));
+		return;
+	}
+	conn_write(conn, &code, 1);
+	conn_close(std::move(pconn));
+}
+
+/**
+ * Execute one RPC of a connection in lock-step mode. The event loop does not
+ * watch the socket while this runs; it is re-armed once the response is out.
+ */
+static void lockstep_process(rpc_job &&job)
+{
+	auto pconn = std::move(job.conn);
+	auto &conn = *pconn;
+	exmdb_server::build_env(conn.b_private ? EM_PRIVATE : 0, nullptr);
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&job.bin, request);
+	free(job.bin.pb);
+	job.bin.pb = nullptr;
+	if (request != nullptr && request->dir != nullptr)
+		stripslash(request->dir);
+	exmdb_response code = exmdb_response::success;
+	std::unique_ptr<exresp> response;
+	BINARY rsp_bin{};
+	if (status != pack_result::ok ||
+	    request == nullptr /* [cov-scan] same as status==pack_result::alloc */) {
+		code = exmdb_response::pull_error;
+	} else if (!conn.is_connected) {
+		exmdb_server::free_env();
+		if (request->call_id == exmdb_callid::connect) {
+			auto flags = parser_connect(conn, *static_cast<const exreq_connect *>(request.get()));
+			if (flags < 0) {
+				conn_close(std::move(pconn));
+				return;
+			}
+			conn.is_connected = true;
+			conn.b_mux = flags & EXMDB_PROTO_MUX;
+			conn_rearm(pconn);
+			return;
+		} else if (request->call_id == exmdb_callid::listen_notification) {
+			lockstep_listen(std::move(pconn), *static_cast<const exreq_listen_notification *>(request.get()));
+			return;
+		}
+		code = exmdb_response::connect_incomplete;
+	} else {
+		exmdb_server::set_remote_id(conn.remote_id.c_str());
+		if (!exmdb_parser_dispatch(request.get(), response, job.bin.cb))
+			code = exmdb_response::dispatch_error;
+		else if (exmdb_parser_push(response.get(), &rsp_bin) != pack_result::success)
+			code = exmdb_response::push_error;
+		exmdb_server::set_remote_id(nullptr);
+	}
+	exmdb_server::free_env();
+	if (code == exmdb_response::success) {
+		auto ret = conn_write(conn, rsp_bin.pb, rsp_bin.cb);
+		free(rsp_bin.pb);
+		if (ret >= 0) {
+			conn_rearm(pconn);
+			return;
+		}
+	} else {
+		conn_write(conn, &code, 1);
+	}
+	conn_close(std::move(pconn));
+}
+
+/**
+ * Read whatever the socket has to offer and assemble request frames. Complete
+ * frames are queued for the worker pool. A lock-step connection is left
+ * unarmed until its worker is done; a multiplexed one keeps being read.
+ */
+static void conn_readable(std::shared_ptr<EXMDB_CONNECTION> pconn)
+{
+	auto &conn = *pconn;
+	while (!conn.b_stop) {
+		if (conn.rd_buf == nullptr) {
+			unsigned int hlen = conn.b_mux ? 8 : 4;
+			auto ret = read(conn.sockd, &conn.rd_hdr[conn.rd_hdr_len], hlen - conn.rd_hdr_len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (ret <= 0) {
+				conn_close(std::move(pconn));
+				return;
+			}
+			conn.rd_hdr_len += ret;
+			if (conn.rd_hdr_len < hlen)
+				continue;
+			conn.rd_hdr_len = 0;
+			conn.last_timestamp = tp_now();
+			uint32_t len = le32p_to_cpu(&conn.rd_hdr[0]), req_id = 0;
+			if (conn.b_mux) {
+				req_id = le32p_to_cpu(&conn.rd_hdr[4]);
+				if (len < sizeof(uint32_t)) {
+					conn_close(std::move(pconn));
+					return;
+				}
+				len -= sizeof(uint32_t);
+			}
+			if (len == 0) {
+				/* ping packet */
+				ssize_t ret;
+				if (conn.b_mux) {
+					ret = mux_write_response(conn, req_id, exmdb_response::success);
+				} else {
+					uint8_t resp = 0;
+					ret = conn_write(conn, &resp, 1);
+				}
+				if (ret < 0) {
+					conn_close(std::move(pconn));
+					return;
+				}
+				continue;
+			} else if (len >= UINT_MAX) {
+				/* make cov-scan happy that we tested for len */
+				conn_close(std::move(pconn));
+				return;
+			}
+			conn.rd_buf = malloc(len);
+			if (conn.rd_buf == nullptr) {
+				if (conn.b_mux) {
+					mux_write_response(conn, req_id, exmdb_response::lack_memory);
+				} else {
+					auto code = exmdb_response::lack_memory;
+					conn_write(conn, &code, 1);
+				}
+				conn_close(std::move(pconn));
+				return;
+			}
+			conn.rd_len = len;
+			conn.rd_off = 0;
+			conn.rd_req_id = req_id;
+			continue;
+		}
+		auto ret = read(conn.sockd, static_cast<char *>(conn.rd_buf) + conn.rd_off,
+		           conn.rd_len - conn.rd_off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0) {
+			conn_close(std::move(pconn));
+			return;
+		}
+		conn.rd_off += ret;
+		if (conn.rd_off < conn.rd_len)
+			continue;
+		rpc_job job;
+		job.conn = pconn;
+		job.req_id = conn.rd_req_id;
+		job.bin.cb = conn.rd_len;
+		job.bin.pv = conn.rd_buf;
+		conn.rd_buf = nullptr;
+		bool mux = conn.b_mux;
+		if (mux)
+			++conn.mux_inflight;
+		else
+			conn.busy = true;
+		if (!rpc_enqueue(std::move(job))) {
+			free(job.bin.pb);
+			if (mux)
+				--conn.mux_inflight;
+			conn_close(std::move(pconn));
+			return;
+		}
+		if (!mux)
+			return;
+	}
+	conn_arm(std::move(pconn));
+}
+
+/**
+ * Pack up to g_notify_batch_max queued datagrams into one batch frame:
+ * {leuint32_t length; datagram[];}, where each datagram retains its own
+ * length prefix. Caller holds rt.lock.
+ */
+static bool router_make_batch(ROUTER_CONNECTION &rt)
+{
+	size_t n = 0, total = 0;
+	for (auto it = rt.datagram_list.cbegin();
+	     it != rt.datagram_list.cend() && n < g_notify_batch_max; ++it, ++n)
+		total += it->bin.cb;
+	if (total > UINT32_MAX - sizeof(uint32_t))
+		n = 1;
+	if (n == 1)
+		total = rt.datagram_list.front().bin.cb;
+	auto pb = static_cast<uint8_t *>(malloc(sizeof(uint32_t) + total));
+	if (pb == nullptr)
+		return false;
+	cpu_to_le32p(pb, total);
+	size_t off = sizeof(uint32_t);
+	router_dgram dg;
+	for (size_t i = 0; i < n && rt.pop_dgram(dg); ++i) {
+		memcpy(&pb[off], dg.bin.pb, dg.bin.cb);
+		off += dg.bin.cb;
+		free(dg.bin.pb);
+	}
+	rt.out.pb = pb;
+	rt.out.cb = off;
+	return true;
+}
+
+/**
+ * Move the router's outbound side along: send the next datagram if the
+ * previous one has been acknowledged. Only called from the event loop.
+ */
+static void router_service(std::shared_ptr<ROUTER_CONNECTION> prt)
+{
+	auto &rt = *prt;
+	if (rt.b_stop)
+		return;
+	if (rt.out.pb == nullptr && !rt.awaiting_ack) {
+		std::unique_lock lk(rt.lock);
+		if (rt.datagram_list.empty()) {
+			/* nothing */
+		} else if (!(rt.proto_flags & EXMDB_PROTO_NOTIFY_BATCH)) {
+			router_dgram dg;
+			rt.pop_dgram(dg);
+			rt.out = dg.bin;
+			rt.out_off = 0;
+			++g_notif_frames;
+		} else if (rt.datagram_list.size() < g_notify_batch_max &&
+		    tp_now() - rt.datagram_list.front().queued < g_notify_batch_delay) {
+			/* Give the batch a chance to fill up */
+			auto due = rt.datagram_list.front().queued + g_notify_batch_delay;
+			lk.unlock();
+			if (!rt.flush_timed) {
+				rt.flush_timed = true;
+				rt.flush_at = due;
+				g_router_timed.push_back(prt);
+			}
+		} else if (router_make_batch(rt)) {
+			rt.out_off = 0;
+			++g_notif_frames;
+		}
+	}
+	if (rt.out.pb != nullptr) {
+		while (rt.out_off < rt.out.cb) {
+			auto ret = write(rt.sockd, rt.out.pb + rt.out_off, rt.out.cb - rt.out_off);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				if (ev_arm(rt.sockd, rt.ev_gen, EPOLLOUT) != 0)
+					router_close(std::move(prt));
+				return;
+			}
+			if (ret <= 0) {
+				router_close(std::move(prt));
+				return;
+			}
+			rt.out_off += ret;
+		}
+		free(rt.out.pb);
+		rt.out = {};
+		rt.out_off = 0;
+		rt.awaiting_ack = true;
+		rt.ack_since = time(nullptr);
+	}
+	if (ev_arm(rt.sockd, rt.ev_gen, EPOLLIN) != 0)
+		router_close(std::move(prt));
+}
+
+static void router_readable(std::shared_ptr<ROUTER_CONNECTION> prt)
+{
+	auto &rt = *prt;
+	exmdb_response code;
+	auto ret = read(rt.sockd, &code, 1);
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		if (ev_arm(rt.sockd, rt.ev_gen, EPOLLIN) != 0)
+			router_close(std::move(prt));
+		return;
+	}
+	if (ret != 1 || !rt.awaiting_ack || code != exmdb_response::success) {
+		router_close(std::move(prt));
+		return;
+	}
+	rt.awaiting_ack = false;
+	rt.last_time = time(nullptr);
+	router_service(std::move(prt));
+}
+
+/**
+ * Drop idle or unresponsive peers, ping idle routers, and reap routers which
+ * could not be taken off g_router_list at the time they died.
+ */
+static void evloop_scan()
+{
+	std::vector<ev_source> srcs;
+	{
+		std::lock_guard lk(g_ev_lock);
+		srcs.reserve(g_ev_map.size());
+		for (const auto &[fd, src] : g_ev_map)
+			srcs.push_back(src);
+	}
+	auto now = tp_now();
+	auto now_t = time(nullptr);
+	for (auto &src : srcs) {
+		if (src.conn != nullptr) {
+			auto &conn = *src.conn;
+			if (!conn.busy && conn.mux_inflight == 0 &&
+			    now - conn.last_timestamp >= std::chrono::seconds(SOCKET_TIMEOUT))
+				conn_close(std::move(src.conn));
+			continue;
+		}
+		auto &rt = *src.router;
+		if (rt.awaiting_ack) {
+			if (now_t - rt.ack_since >= SOCKET_TIMEOUT)
+				router_close(std::move(src.router));
+			continue;
+		}
+		static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
+		if (rt.out.pb != nullptr || now_t - rt.last_time < SOCKET_TIMEOUT - 3)
+			continue;
+		rt.out.pb = static_cast<uint8_t *>(calloc(1, sizeof(uint32_t)));
+		if (rt.out.pb == nullptr)
+			continue;
+		/* ping packet */
+		rt.out.cb = sizeof(uint32_t);
+		rt.out_off = 0;
+		router_service(std::move(src.router));
+	}
+	std::lock_guard rhold(g_router_lock);
+	std::erase_if(g_router_list, [](const std::shared_ptr<ROUTER_CONNECTION> &r) { return r->b_stop.load(); });
+}
+
+static void evloop_stats(uint64_t &last_busy_ns, gromox::time_point &last_report)
+{
+	exmdb_parser_stats st;
+	exmdb_parser_get_stats(st);
+	g_rpc_queue_peak = st.queue_depth;
+	auto now = tp_now();
+	auto span = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_report).count();
+	double util = span > 0 && st.workers > 0 ?
+	              100.0 * (st.busy_ns - last_busy_ns) / span / st.workers : 0;
+	uint64_t sc_hits = 0, sc_misses = 0;
+	gx_sql_cache_stats(sc_hits, sc_misses);
+	exmdb::cid_cache_stats cc;
+	exmdb::cu_cid_cache_stats(cc);
+	auto cc_total = cc.hits + cc.misses;
+	auto &ct = g_cttbl_counters;
+	auto &dc = g_db_cache_counters;
+	mlog(LV_INFO, "I-1303: exmdb_provider: %zu connections, %zu routers, "
+	        "RPC queue %zu (peak %zu), workers %u/%u busy, %.1f%% utilized, %llu RPCs, "
+	        "SQL statement cache %llu hits/%llu misses, "
+	        "content table rows %llu added/%llu deleted/%llu modified "
+	        "(%llu re-sorted), %llu table reloads, "
+	        "%llu tables shared/%llu private copies, "
+	        "content file cache %.1f%% hits, %llu MB saved, %zu objects/%zu MB, "
+	        "%llu notifications (%llu coalesced) in %llu datagrams, "
+	        "%llu stores cached/%llu MB (%llu evicted)",
+	        st.connections, st.routers, st.queue_depth, st.queue_peak,
+	        st.workers_busy, st.workers, util,
+	        static_cast<unsigned long long>(st.jobs),
+	        static_cast<unsigned long long>(sc_hits),
+	        static_cast<unsigned long long>(sc_misses),
+	        static_cast<unsigned long long>(ct.added.load()),
+	        static_cast<unsigned long long>(ct.deleted.load()),
+	        static_cast<unsigned long long>(ct.modified.load()),
+	        static_cast<unsigned long long>(ct.resorted.load()),
+	        static_cast<unsigned long long>(ct.reloaded.load()),
+	        static_cast<unsigned long long>(ct.shared.load()),
+	        static_cast<unsigned long long>(ct.copied.load()),
+	        cc_total > 0 ? 100.0 * cc.hits / cc_total : 0.0,
+	        static_cast<unsigned long long>(cc.bytes_saved >> 20),
+	        cc.items, cc.bytes_used >> 20,
+	        static_cast<unsigned long long>(st.notifs),
+	        static_cast<unsigned long long>(st.notifs_merged),
+	        static_cast<unsigned long long>(st.notif_frames),
+	        static_cast<unsigned long long>(dc.stores.load()),
+	        static_cast<unsigned long long>(dc.bytes.load() >> 20),
+	        static_cast<unsigned long long>(dc.evicted.load()));
+	last_busy_ns = st.busy_ns;
+	last_report = now;
+}
+
+static void *evloop_thread(void *)
+{
+	struct epoll_event evs[64];
+	auto last_scan = tp_now(), last_report = last_scan;
+	uint64_t last_busy_ns = 0;
+	while (!g_evloop_stop) {
+		int timeout = 1000;
+		if (g_router_timed.size() > 0) {
+			auto now = tp_now();
+			for (const auto &rt : g_router_timed) {
+				auto ms = std::chrono::ceil<std::chrono::milliseconds>(rt->flush_at - now).count();
+				if (ms < timeout)
+					timeout = std::max(ms, decltype(ms){0});
+			}
+		}
+		auto num = epoll_wait(g_epoll_fd, evs, std::size(evs), timeout);
+		for (int i = 0; i < num; ++i) {
+			int fd = static_cast<uint32_t>(evs[i].data.u64);
+			uint32_t gen = evs[i].data.u64 >> 32;
+			if (fd == g_wake_fd) {
+				uint64_t cnt;
+				if (read(g_wake_fd, &cnt, sizeof(cnt)) < 0)
+					/* ignore */;
+				std::vector<std::shared_ptr<ROUTER_CONNECTION>> kicks;
+				std::vector<std::shared_ptr<EXMDB_CONNECTION>> conn_kicks;
+				std::unique_lock lk(g_ev_lock);
+				kicks.swap(g_router_kicks);
+				conn_kicks.swap(g_conn_kicks);
+				lk.unlock();
+				ev_arm(g_wake_fd, 0, EPOLLIN);
+				for (auto &rt : kicks)
+					router_service(std::move(rt));
+				for (auto &c : conn_kicks)
+					conn_arm(std::move(c));
+				continue;
+			}
+			std::unique_lock lk(g_ev_lock);
+			auto it = g_ev_map.find(fd);
+			if (it == g_ev_map.end() || it->second.gen != gen)
+				continue; /* stale event */
+			auto src = it->second;
+			lk.unlock();
+			if (src.conn != nullptr)
+				conn_event(std::move(src.conn), evs[i].events);
+			else if (evs[i].events & EPOLLOUT)
+				router_service(std::move(src.router));
+			else
+				router_readable(std::move(src.router));
+		}
+		auto now = tp_now();
+		if (g_router_timed.size() > 0) {
+			std::vector<std::shared_ptr<ROUTER_CONNECTION>> due;
+			std::erase_if(g_router_timed, [&](std::shared_ptr<ROUTER_CONNECTION> &rt) {
+				if (rt->flush_at > now && !rt->b_stop)
+					return false;
+				rt->flush_timed = false;
+				due.push_back(std::move(rt));
+				return true;
+			});
+			for (auto &rt : due)
+				router_service(std::move(rt));
+		}
+		if (now - last_scan >= std::chrono::seconds(1)) {
+			evloop_scan();
+			last_scan = now;
+		}
+		if (g_stats_interval.count() > 0 && now - last_report >= g_stats_interval)
+			evloop_stats(last_busy_ns, last_report);
+	}
+	return nullptr;
+}
+
+static int evloop_start()
+{
+	g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epoll_fd < 0) {
+		mlog(LV_ERR, "E-1304: epoll_create: %s", strerror(errno));
+		return -1;
+	}
+	g_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (g_wake_fd < 0) {
+		mlog(LV_ERR, "E-1305: eventfd: %s", strerror(errno));
+		return -1;
+	}
+	if (ev_arm(g_wake_fd, 0, EPOLLIN, true) != 0) {
+		mlog(LV_ERR, "E-1306: epoll_ctl: %s", strerror(errno));
+		return -1;
+	}
+	g_evloop_stop = false;
+	auto ret = pthread_create4(&g_evloop_tid, nullptr, evloop_thread, nullptr);
+	if (ret != 0) {
+		g_evloop_stop = true;
+		mlog(LV_ERR, "E-1307: pthread_create: %s", strerror(ret));
+		return -1;
+	}
+	pthread_setname_np(g_evloop_tid, "exmdb_evloop");
+	return 0;
+}
+
+static void evloop_stop()
+{
+	if (!g_evloop_stop) {
+		g_evloop_stop = true;
+		uint64_t one = 1;
+		if (write(g_wake_fd, &one, sizeof(one)) < 0)
+			/* ignore */;
+		pthread_join(g_evloop_tid, nullptr);
+	}
+	std::unordered_map<int, ev_source> map;
+	{
+		std::lock_guard lk(g_ev_lock);
+		map.swap(g_ev_map);
+		g_router_kicks.clear();
+		g_conn_kicks.clear();
+	}
+	g_router_timed.clear();
+	for (auto &&[fd, src] : map) {
+		if (src.conn != nullptr) {
+			src.conn->b_stop = true;
+			shutdown(fd, SHUT_RDWR);
+		} else {
+			src.router->b_stop = true;
+			shutdown(fd, SHUT_RDWR);
+		}
+	}
+}
+#else /* !HAVE_SYS_EPOLL_H */
+/**
+ * Request reader for a connection that negotiated EXMDB_PROTO_MUX. Frames
+ * are {leuint32_t length; leuint32_t req_id; char pdu[];}; an empty PDU is
+ * a ping. The RPCs themselves are executed by the worker pool, so multiple
+ * requests of this connection can be in flight at once.
+ */
+static void mux_reader_loop(const std::shared_ptr<EXMDB_CONNECTION> &pconn)
+{
+	auto &conn = *pconn;
+	struct pollfd pfd_read = {conn.sockd, POLLIN | POLLPRI};
+	while (!conn.b_stop) {
+		if (poll(&pfd_read, 1, SOCKET_TIMEOUT * 1000) != 1)
+			break;
+		uint8_t hdr[8];
+		if (HXio_fullread(conn.sockd, hdr, sizeof(hdr)) != sizeof(hdr))
+			break;
+		auto buff_len = le32p_to_cpu(&hdr[0]);
+		auto req_id   = le32p_to_cpu(&hdr[4]);
+		if (buff_len < sizeof(uint32_t) || buff_len >= UINT_MAX)
+			break;
+		buff_len -= sizeof(uint32_t);
+		if (buff_len == 0) {
+			if (mux_write_response(conn, req_id, exmdb_response::success) < 0)
+				break;
+			continue;
+		}
+		rpc_job job;
+		job.bin.cb = buff_len;
+		job.bin.pv = malloc(buff_len);
+		if (job.bin.pv == nullptr) {
+			mux_write_response(conn, req_id, exmdb_response::lack_memory);
+			break;
+		}
+		if (HXio_fullread(conn.sockd, job.bin.pv, buff_len) != buff_len) {
+			free(job.bin.pv);
+			break;
+		}
+		job.conn = pconn;
+		job.req_id = req_id;
+		++conn.mux_inflight;
+		if (!rpc_enqueue(std::move(job))) {
+			free(job.bin.pv);
+			--conn.mux_inflight;
+			mux_write_response(conn, req_id, exmdb_response::lack_memory);
+			break;
+		}
+	}
+	/*
+	 * Workers may still be writing responses; only disallow further I/O
+	 * and wait for them before the caller closes the descriptor.
+	 */
+	shutdown(conn.sockd, SHUT_RDWR);
+	std::unique_lock lk(g_rpc_lock);
+	conn.mux_idle_cond.wait(lk, [&]() { return conn.mux_inflight == 0; });
+}
+
 static void *request_parser_thread(void *pparam)
 {
 	int tv_msec;
 	void *pbuff;
 	int read_len;
-	BOOL b_private;
 	BINARY tmp_bin;
 	uint32_t offset;
 	int written_len;
 	BOOL is_writing;
-	BOOL is_connected;
 	uint32_t buff_len;
 	uint8_t resp_buff[5]{};
 	struct pollfd pfd_read;
-	
-	b_private = FALSE; /* whatever for connect request */
+
 	auto connraw = static_cast<EXMDB_CONNECTION *>(pparam);
 	std::shared_ptr<EXMDB_CONNECTION> pconnection;
 	try {
@@ -212,7 +1307,6 @@ static void *request_parser_thread(void *pparam)
 	offset = 0;
 	buff_len = 0;
 	is_writing = FALSE;
-	is_connected = FALSE;
 	while (!pconnection->b_stop) {
 		if (is_writing) {
 			written_len = write(pconnection->sockd,
@@ -252,7 +1346,7 @@ static void *request_parser_thread(void *pparam)
 			if (NULL == pbuff) {
 				auto tmp_byte = exmdb_response::lack_memory;
 				if (HXio_fullwrite(pconnection->sockd, &tmp_byte, 1) != 1 ||
-				    !is_connected)
+				    !pconnection->is_connected)
 					break;
 				buff_len = 0;
 			}
@@ -266,7 +1360,7 @@ static void *request_parser_thread(void *pparam)
 		offset += read_len;
 		if (offset < buff_len)
 			continue;
-		exmdb_server::build_env(b_private ? EM_PRIVATE : 0, nullptr);
+		exmdb_server::build_env(pconnection->b_private ? EM_PRIVATE : 0, nullptr);
 		tmp_bin.pv = pbuff;
 		tmp_bin.cb = buff_len;
 		std::unique_ptr<exreq> request;
@@ -280,24 +1374,22 @@ static void *request_parser_thread(void *pparam)
 		if (status != pack_result::ok ||
 		    request == nullptr /* [cov-scan] same as status==pack_result::alloc */) {
 			tmp_byte = exmdb_response::pull_error;
-		} else if (!is_connected) {
+		} else if (!pconnection->is_connected) {
 			if (request->call_id == exmdb_callid::connect) {
-				auto &q = *static_cast<const exreq_connect *>(request.get());
-				if (!exmdb_parser_is_local(q.prefix, &b_private)) {
-					tmp_byte = exmdb_response::misconfig_prefix;
-				} else if (b_private != q.b_private) {
-					tmp_byte = exmdb_response::misconfig_mode;
-				} else {
-					pconnection->remote_id = q.remote_id;
-					exmdb_server::free_env();
-					exmdb_server::set_remote_id(pconnection->remote_id.c_str());
-					is_connected = TRUE;
-					if (HXio_fullwrite(pconnection->sockd, resp_buff, 5) != 5)
-						break;
-					offset = 0;
-					buff_len = 0;
-					continue;
+				exmdb_server::free_env();
+				auto flags = parser_connect(*pconnection, *static_cast<const exreq_connect *>(request.get()));
+				if (flags < 0)
+					break;
+				exmdb_server::set_remote_id(pconnection->remote_id.c_str());
+				pconnection->is_connected = true;
+				if (flags & EXMDB_PROTO_MUX) {
+					pconnection->b_mux = true;
+					mux_reader_loop(pconnection);
+					break;
 				}
+				offset = 0;
+				buff_len = 0;
+				continue;
 			} else if (request->call_id == exmdb_callid::listen_notification) {
 				auto &q = *static_cast<const exreq_listen_notification *>(request.get());
 				std::shared_ptr<ROUTER_CONNECTION> prouter;
@@ -333,9 +1425,9 @@ static void *request_parser_thread(void *pparam)
 			} else {
 				tmp_byte = exmdb_response::connect_incomplete;
 			}
-		} else if (!exmdb_parser_dispatch(request.get(), response)) {
+		} else if (!exmdb_parser_dispatch(request.get(), response, tmp_bin.cb)) {
 			tmp_byte = exmdb_response::dispatch_error;
-		} else if (exmdb_ext_push_response(response.get(), &tmp_bin) != pack_result::success) {
+		} else if (exmdb_parser_push(response.get(), &tmp_bin) != pack_result::success) {
 			tmp_byte = exmdb_response::push_error;
 		} else {
 			exmdb_server::free_env();
@@ -359,22 +1451,84 @@ static void *request_parser_thread(void *pparam)
 	}
 	return nullptr;
 }
+#endif /* HAVE_SYS_EPOLL_H */
+
+static void *rpc_worker_thread(void *)
+{
+	while (true) {
+		std::unique_lock lk(g_rpc_lock);
+		g_rpc_cond.wait(lk, []() { return g_rpc_stop || g_rpc_queue.size() > 0; });
+		if (g_rpc_stop)
+			break;
+		auto job = std::move(g_rpc_queue.front());
+		g_rpc_queue.pop_front();
+		lk.unlock();
+		++g_rpc_busy;
+		auto tstart = tp_now();
+#ifdef HAVE_SYS_EPOLL_H
+		if (!job.conn->b_mux)
+			lockstep_process(std::move(job));
+		else
+#endif
+			mux_process(std::move(job));
+		g_rpc_busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(tp_now() - tstart).count();
+		++g_rpc_jobs;
+		--g_rpc_busy;
+	}
+	return nullptr;
+}
 
-void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&pconnection)
+void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&uconn)
 {
-	auto ret = pthread_create4(&pconnection->thr_id, nullptr,
-	           request_parser_thread, pconnection.get());
+#ifdef HAVE_SYS_EPOLL_H
+	std::shared_ptr<EXMDB_CONNECTION> pconn;
+	try {
+		pconn = std::move(uconn);
+		std::lock_guard chold(g_connection_lock);
+		g_connection_list.insert(pconn);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_WARN, "W-1308: ENOMEM");
+		return;
+	}
+	auto fl = fcntl(pconn->sockd, F_GETFL);
+	if (fl < 0 || fcntl(pconn->sockd, F_SETFL, fl | O_NONBLOCK) != 0) {
+		mlog(LV_WARN, "W-1309: fcntl: %s", strerror(errno));
+		conn_close(std::move(pconn));
+		return;
+	}
+	pconn->last_timestamp = tp_now();
+	std::unique_lock lk(g_ev_lock);
+	try {
+		auto &src = g_ev_map[pconn->sockd];
+		src.gen = pconn->ev_gen = ++g_ev_gen;
+		src.conn = pconn;
+	} catch (const std::bad_alloc &) {
+		lk.unlock();
+		mlog(LV_WARN, "W-1310: ENOMEM");
+		conn_close(std::move(pconn));
+		return;
+	}
+	if (ev_arm(pconn->sockd, pconn->ev_gen, EPOLLIN, true) != 0) {
+		mlog(LV_WARN, "W-1311: epoll_ctl: %s", strerror(errno));
+		g_ev_map.erase(pconn->sockd);
+		lk.unlock();
+		conn_close(std::move(pconn));
+	}
+#else
+	auto ret = pthread_create4(&uconn->thr_id, nullptr,
+	           request_parser_thread, uconn.get());
 	if (ret != 0)
 		mlog(LV_WARN, "W-1440: pthread_create: %s", strerror(ret));
 	else
-		pconnection.release(); /* thread should be vivid now */
+		uconn.release(); /* thread should be vivid now */
+#endif
 }
 
 std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id)
 {
 	std::lock_guard rhold(g_router_lock);
 	auto it = std::find_if(g_router_list.begin(), g_router_list.end(),
-	          [&](const auto &r) { return r->remote_id == remote_id; });
+	          [&](const auto &r) { return r->remote_id == remote_id && !r->b_stop; });
 	if (it == g_router_list.end())
 		return nullptr;
 	auto rt = *it;
@@ -401,6 +1555,51 @@ BOOL exmdb_parser_erase_router(const std::shared_ptr<ROUTER_CONNECTION> &pconnec
 	return TRUE;
 }
 
+/**
+ * Tell whoever serves @prouter that it has new datagrams queued.
+ */
+void exmdb_parser_wake_router(std::shared_ptr<ROUTER_CONNECTION> &&prouter)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	try {
+		std::lock_guard lk(g_ev_lock);
+		g_router_kicks.push_back(std::move(prouter));
+	} catch (const std::bad_alloc &) {
+		/* the next ack or ping will flush the queue */
+		return;
+	}
+	uint64_t one = 1;
+	if (write(g_wake_fd, &one, sizeof(one)) < 0)
+		/* ignore */;
+#else
+	prouter->waken_cond.notify_one();
+#endif
+}
+
+void exmdb_parser_get_stats(exmdb_parser_stats &st)
+{
+	{
+		std::lock_guard chold(g_connection_lock);
+		st.connections = g_connection_list.size();
+	}
+	{
+		std::lock_guard rhold(g_router_lock);
+		st.routers = g_router_list.size();
+	}
+	{
+		std::lock_guard lk(g_rpc_lock);
+		st.queue_depth = g_rpc_queue.size();
+	}
+	st.queue_peak   = g_rpc_queue_peak;
+	st.workers      = g_rpc_tids.size();
+	st.workers_busy = g_rpc_busy;
+	st.jobs         = g_rpc_jobs;
+	st.busy_ns      = g_rpc_busy_ns;
+	st.notifs        = g_notifs;
+	st.notifs_merged = g_notifs_merged;
+	st.notif_frames  = g_notif_frames;
+}
+
 int exmdb_parser_run(const char *config_path)
 {
 	auto ret = list_file_read_exmdb("exmdb_list.txt", config_path, g_local_list);
@@ -410,13 +1609,33 @@ int exmdb_parser_run(const char *config_path)
 	}
 	std::erase_if(g_local_list,
 		[&](const EXMDB_ITEM &s) { return !HX_ipaddr_is_local(s.host.c_str(), AI_V4MAPPED); });
+	g_rpc_stop = false;
+	for (unsigned int i = 0; i < g_rpc_workers; ++i) {
+		pthread_t tid;
+		ret = pthread_create4(&tid, nullptr, rpc_worker_thread, nullptr);
+		if (ret != 0) {
+			mlog(LV_ERR, "E-1362: pthread_create: %s", strerror(ret));
+			return 2;
+		}
+		char buf[32];
+		snprintf(buf, std::size(buf), "exmdb_rpc/%u", i);
+		pthread_setname_np(tid, buf);
+		g_rpc_tids.push_back(tid);
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (g_rpc_workers > 0 && evloop_start() != 0)
+		return 3;
+#endif
 	return 0;
 }
 
 void exmdb_parser_stop()
 {
+#ifdef HAVE_SYS_EPOLL_H
+	evloop_stop();
+#else
 	std::vector<pthread_t> pthr_ids;
-	
+
 	std::unique_lock chold(g_connection_lock);
 	size_t num = g_connection_list.size();
 	pthr_ids.reserve(num);
@@ -451,4 +1670,31 @@ void exmdb_parser_stop()
 		for (auto tid : pthr_ids)
 			pthread_join(tid, nullptr);
 	}
+#endif
+	{
+		std::lock_guard lk(g_rpc_lock);
+		g_rpc_stop = true;
+	}
+	g_rpc_cond.notify_all();
+	for (auto tid : g_rpc_tids)
+		pthread_join(tid, nullptr);
+	g_rpc_tids.clear();
+	for (auto &job : g_rpc_queue)
+		free(job.bin.pb);
+	g_rpc_queue.clear();
+#ifdef HAVE_SYS_EPOLL_H
+	/* Only now, since workers may have been re-arming sockets */
+	if (g_wake_fd >= 0) {
+		close(g_wake_fd);
+		g_wake_fd = -1;
+	}
+	if (g_epoll_fd >= 0) {
+		close(g_epoll_fd);
+		g_epoll_fd = -1;
+	}
+	std::lock_guard chold(g_connection_lock);
+	g_connection_list.clear();
+	std::lock_guard rhold(g_router_lock);
+	g_router_list.clear();
+#endif
 }
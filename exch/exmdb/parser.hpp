@@ -1,11 +1,16 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
 #include <condition_variable>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <pthread.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <gromox/atomic.hpp>
+#include <gromox/clock.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/generic_connection.hpp>
 
@@ -18,6 +23,36 @@ class EXMDB_CONNECTION : public GENERIC_CONNECTION {
 	gromox::atomic_bool b_stop{false};
 	pthread_t thr_id{};
 	std::string remote_id;
+	bool b_private = false, is_connected = false;
+	gromox::atomic_bool b_mux{false};
+	/* Responses (from workers or the event loop) are serialized on this */
+	std::mutex wr_lock;
+	/*
+	 * Event loop mode: output the socket did not take yet, flushed by the
+	 * event loop on EPOLLOUT. Protected by @wr_lock.
+	 */
+	std::string wr_queue;
+	size_t wr_off = 0;
+	std::atomic<unsigned int> mux_inflight{0};
+	std::condition_variable mux_idle_cond;
+
+	/* Event loop mode: lock-step RPC being run by a worker */
+	gromox::atomic_bool busy{false};
+	uint32_t ev_gen = 0;
+	/* Frame assembly state, only touched by the event loop */
+	uint8_t rd_hdr[8]{};
+	unsigned int rd_hdr_len = 0;
+	uint32_t rd_req_id = 0, rd_len = 0, rd_off = 0;
+	void *rd_buf = nullptr;
+};
+
+/* A notification waiting to be sent to a router */
+struct router_dgram {
+	BINARY bin{}; /* serialized DB_NOTIFY_DATAGRAM; manual (de)allocation of .pb */
+	gromox::time_point queued;
+	std::string key; /* event identity for coalescing; empty if not mergeable */
+	std::string obj; /* message/folder the event is about; may be empty */
+	std::vector<uint32_t> proptags; /* of *_modified events */
 };
 
 struct ROUTER_CONNECTION {
@@ -25,17 +60,40 @@ struct ROUTER_CONNECTION {
 	NOMOVE(ROUTER_CONNECTION);
 	~ROUTER_CONNECTION();
 
+	using dgram_list = std::list<router_dgram>;
+	void unindex_dgram(dgram_list::iterator);
+	void erase_dgram(dgram_list::iterator);
+	bool pop_dgram(router_dgram &);
+
 	gromox::atomic_bool b_stop{false};
 	pthread_t thr_id{};
 	std::string remote_id;
+	uint32_t proto_flags = 0; /* EXMDB_PROTO_NOTIFY_BATCH */
 	int sockd = -1;
 	time_t last_time = 0;
 	std::mutex lock, cond_mutex;
 	std::condition_variable waken_cond;
-	std::list<BINARY> datagram_list; /* manual (de)allocation of .pb */
+	/* Protected by @lock */
+	dgram_list datagram_list;
+	std::unordered_map<std::string, dgram_list::iterator> dgram_index;
+
+	/* Event loop mode, only touched by the event loop */
+	uint32_t ev_gen = 0;
+	BINARY out{}; /* datagram being sent */
+	uint32_t out_off = 0;
+	bool awaiting_ack = false, flush_timed = false;
+	time_t ack_since = 0;
+	gromox::time_point flush_at;
+};
+
+struct exmdb_parser_stats {
+	size_t connections = 0, routers = 0, queue_depth = 0, queue_peak = 0;
+	unsigned int workers = 0, workers_busy = 0;
+	uint64_t jobs = 0, busy_ns = 0;
+	uint64_t notifs = 0, notifs_merged = 0, notif_frames = 0;
 };
 
-extern void exmdb_parser_init(size_t max_threads, size_t max_routers);
+extern void exmdb_parser_init(size_t max_threads, size_t max_routers, unsigned int rpc_workers, gromox::time_duration stats_interval);
 extern int exmdb_parser_run(const char *config_path);
 extern void exmdb_parser_stop();
 extern std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn();
@@ -43,5 +101,10 @@ extern void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&);
 extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id);
 extern void exmdb_parser_insert_router(std::shared_ptr<ROUTER_CONNECTION> &&);
 extern BOOL exmdb_parser_erase_router(const std::shared_ptr<ROUTER_CONNECTION> &);
+extern void exmdb_parser_wake_router(std::shared_ptr<ROUTER_CONNECTION> &&);
+extern void exmdb_parser_get_stats(exmdb_parser_stats &);
 
 extern unsigned int g_exrpc_debug, g_enable_dam;
+extern unsigned int g_notify_batch_max;
+extern gromox::time_duration g_notify_batch_delay;
+extern std::atomic<uint64_t> g_notifs, g_notifs_merged, g_notif_frames;
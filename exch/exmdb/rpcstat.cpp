@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * RPC counters. Per-callid numbers are relaxed atomics in a table indexed by
+ * callid, so accounting a call takes no lock. Per-store time goes into a
+ * sharded map, so RPCs for different stores rarely meet on a mutex.
+ */
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fmt/core.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapi_types.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+
+namespace {
+
+/* up to 2^22 µs (~4.2 s) in powers of two, plus one overflow bucket */
+static constexpr size_t RPCSTAT_BUCKETS = 24;
+/* per shard; stores beyond that are not tracked individually */
+static constexpr size_t RPCSTAT_MAX_DIRS = 1024;
+
+struct call_counters {
+	std::atomic<uint64_t> calls, errors, total_us, max_us, bytes_in, bytes_out;
+	std::atomic<uint64_t> hist[RPCSTAT_BUCKETS];
+};
+
+struct dir_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, exmdb_rpc_dirstat> map;
+};
+
+}
+
+static call_counters g_call_stats[UINT8_MAX+1];
+static dir_shard g_dir_stats[16];
+gromox::time_duration g_exmdb_slow_rpc;
+
+static std::string rpc_summary(const exreq *q0) try
+{
+	std::string s;
+	switch (q0->call_id) {
+#include <exmdb_summary.cpp>
+	default:
+		break;
+	}
+	return s;
+} catch (const std::bad_alloc &) {
+	return {};
+}
+
+namespace exmdb {
+
+/**
+ * @in_bytes: size of the serialized request (0 for same-process calls)
+ * @q:        the request, used for the slow-call log (may be nullptr)
+ */
+void exmdb_rpc_account(exmdb_callid id, const char *dir, bool ok,
+    gromox::time_duration d, size_t in_bytes, const exreq *q)
+{
+	static constexpr auto rlx = std::memory_order_relaxed;
+	uint64_t us = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+	auto &c = g_call_stats[static_cast<uint8_t>(id)];
+	c.calls.fetch_add(1, rlx);
+	if (!ok)
+		c.errors.fetch_add(1, rlx);
+	c.total_us.fetch_add(us, rlx);
+	c.bytes_in.fetch_add(in_bytes, rlx);
+	c.hist[std::min<size_t>(std::bit_width(us), RPCSTAT_BUCKETS - 1)].fetch_add(1, rlx);
+	auto max = c.max_us.load(rlx);
+	while (us > max && !c.max_us.compare_exchange_weak(max, us, rlx))
+		/* retry */;
+
+	if (dir != nullptr && *dir != '\0') try {
+		auto &sh = g_dir_stats[std::hash<std::string_view>{}(dir) % std::size(g_dir_stats)];
+		std::lock_guard lk(sh.lock);
+		auto it = sh.map.find(dir);
+		if (it == sh.map.end() && sh.map.size() < RPCSTAT_MAX_DIRS)
+			it = sh.map.emplace(dir, exmdb_rpc_dirstat{dir}).first;
+		if (it != sh.map.end()) {
+			++it->second.calls;
+			it->second.total_us += us;
+		}
+	} catch (const std::bad_alloc &) {
+	}
+
+	if (g_exmdb_slow_rpc.count() > 0 && d >= g_exmdb_slow_rpc)
+		mlog(LV_WARN, "W-1364: slow EXRPC %s %s %lluµs%s", znul(dir),
+		        exmdb_rpc_idtoname(id), static_cast<unsigned long long>(us),
+		        q != nullptr ? rpc_summary(q).c_str() : "");
+}
+
+void exmdb_rpc_account_out(exmdb_callid id, size_t out_bytes)
+{
+	g_call_stats[static_cast<uint8_t>(id)].bytes_out.fetch_add(out_bytes, std::memory_order_relaxed);
+}
+
+/**
+ * Snapshot of the counters. Callids that were never used are left out,
+ * stores are sorted by descending time and cut at @top_n.
+ */
+void exmdb_rpc_stats(std::vector<exmdb_rpc_stat> &calls,
+    std::vector<exmdb_rpc_dirstat> &dirs, size_t top_n, bool reset)
+{
+	static constexpr auto rlx = std::memory_order_relaxed;
+	auto get = [&](std::atomic<uint64_t> &a) { return reset ? a.exchange(0, rlx) : a.load(rlx); };
+	for (size_t i = 0; i < std::size(g_call_stats); ++i) {
+		auto &c = g_call_stats[i];
+		if (c.calls.load(rlx) == 0)
+			continue;
+		auto &e = calls.emplace_back();
+		e.name = exmdb_rpc_idtoname(static_cast<exmdb_callid>(i));
+		if (e.name.empty())
+			e.name = std::to_string(i);
+		e.calls     = get(c.calls);
+		e.errors    = get(c.errors);
+		e.total_us  = get(c.total_us);
+		e.max_us    = get(c.max_us);
+		e.bytes_in  = get(c.bytes_in);
+		e.bytes_out = get(c.bytes_out);
+		e.hist.resize(RPCSTAT_BUCKETS);
+		for (size_t j = 0; j < RPCSTAT_BUCKETS; ++j)
+			e.hist[j] = get(c.hist[j]);
+	}
+	for (auto &sh : g_dir_stats) {
+		std::lock_guard lk(sh.lock);
+		for (const auto &[k, v] : sh.map)
+			dirs.push_back(v);
+		if (reset)
+			sh.map.clear();
+	}
+	auto cut = std::min(top_n, dirs.size());
+	std::partial_sort(dirs.begin(), dirs.begin() + cut, dirs.end(),
+		[](const exmdb_rpc_dirstat &a, const exmdb_rpc_dirstat &b) {
+			return a.total_us > b.total_us;
+		});
+	dirs.resize(cut);
+}
+
+}
@@ -14,11 +14,13 @@ struct env_context {
 	const char *dir = nullptr;
 	int account_id = 0;
 	bool b_local = false, b_private = false;
+	bool b_readonly = false; /* current RPC is in exmdb_rpc_readonly */
 };
 
 }
 
 static thread_local const char *g_id_key;
+static thread_local alloc_context *g_alloc_scope;
 static thread_local const char *g_public_username_key;
 
 namespace exmdb_server {
@@ -52,12 +54,24 @@ void set_remote_id(const char *remote_id)
 
 ALLOC_CONTEXT *get_alloc_context()
 {
+	if (g_alloc_scope != nullptr)
+		return g_alloc_scope;
 	auto pctx = g_env_key.get();
 	if (pctx == nullptr || pctx->b_local)
 		return NULL;
 	return &pctx->alloc_ctx;
 }
 
+alloc_scope::alloc_scope() : m_prev(g_alloc_scope)
+{
+	g_alloc_scope = &m_ctx;
+}
+
+alloc_scope::~alloc_scope()
+{
+	g_alloc_scope = m_prev;
+}
+
 const char *get_remote_id()
 {
 	return g_id_key;
@@ -93,6 +107,20 @@ void set_dir(const char *dir)
 	g_env_key->dir = dir;
 }
 
+/* Whether db_engine_get_db may hand out a read-only connection */
+bool is_readonly()
+{
+	auto pctx = g_env_key.get();
+	return pctx != nullptr && pctx->b_readonly;
+}
+
+void set_readonly(bool v)
+{
+	auto pctx = g_env_key.get();
+	if (pctx != nullptr)
+		pctx->b_readonly = v;
+}
+
 int get_account_id()
 {
 	unsigned int account_id = 0;
@@ -25,9 +25,11 @@
 #include <gromox/mapi_types.hpp>
 #include <gromox/mapidefs.h>
 #include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
 #include <gromox/tie.hpp>
 #include <gromox/usercvt.hpp>
 #include "db_engine.hpp"
+#include "parser.hpp"
 
 using LLU = unsigned long long;
 using namespace std::string_literals;
@@ -51,6 +53,68 @@ BOOL exmdb_server::unload_store(const char *dir)
 	return db_engine_unload_db(dir);
 }
 
+BOOL exmdb_server::get_cache_stats(const char *, uint64_t *budget,
+    uint64_t *total, std::vector<exmdb_cache_entry> *entries) try
+{
+	*budget = g_exmdb_cache_budget;
+	*total  = g_db_cache_counters.bytes;
+	db_engine_cache_stats(*entries);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1332: ENOMEM");
+	return false;
+}
+
+/* The figures that the rpc_stats_interval log line (I-1303) also reports */
+static void exmdb_counters(std::vector<exmdb_counter> &out)
+{
+	uint64_t sc_hits = 0, sc_misses = 0;
+	gx_sql_cache_stats(sc_hits, sc_misses);
+	exmdb::cid_cache_stats cc;
+	exmdb::cu_cid_cache_stats(cc);
+	exmdb_parser_stats st;
+	exmdb_parser_get_stats(st);
+	const auto &ct = g_cttbl_counters;
+	const auto &dc = g_db_cache_counters;
+	out = {
+		{"connections", st.connections, true},
+		{"routers", st.routers, true},
+		{"stmt_cache_hits", sc_hits},
+		{"stmt_cache_misses", sc_misses},
+		{"cid_cache_hits", cc.hits},
+		{"cid_cache_misses", cc.misses},
+		{"cid_cache_saved_bytes", cc.bytes_saved},
+		{"cid_cache_items", cc.items, true},
+		{"cid_cache_bytes", cc.bytes_used, true},
+		{"cid_cache_budget_bytes", cc.budget, true},
+		{"table_rows_added", ct.added},
+		{"table_rows_deleted", ct.deleted},
+		{"table_rows_modified", ct.modified},
+		{"table_rows_resorted", ct.resorted},
+		{"table_reloads", ct.reloaded},
+		{"tables_shared", ct.shared},
+		{"tables_copied", ct.copied},
+		{"notifications", st.notifs},
+		{"notifications_merged", st.notifs_merged},
+		{"notification_frames", st.notif_frames},
+		{"stores_cached", dc.stores, true},
+		{"store_cache_bytes", dc.bytes, true},
+		{"stores_evicted", dc.evicted},
+	};
+}
+
+BOOL exmdb_server::get_rpc_stats(const char *, uint32_t flags, uint32_t top_n,
+    std::vector<exmdb_rpc_stat> *calls, std::vector<exmdb_rpc_dirstat> *dirs,
+    std::vector<exmdb_counter> *counters) try
+{
+	exmdb_rpc_stats(*calls, *dirs, top_n, flags & EXMDB_RPCSTAT_RESET);
+	exmdb_counters(*counters);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1335: ENOMEM");
+	return false;
+}
+
 BOOL exmdb_server::notify_new_mail(const char *dir, uint64_t folder_id,
 	uint64_t message_id)
 {
@@ -457,12 +521,14 @@ purg_delete_unused_files4(const std::string &cid_dir, const std::string &subdir,
 }
 
 static uint64_t purg_delete_unused_files(const std::string &cid_dir,
-    const std::vector<std::string> &used_ids, time_t upper_bound_ts)
+    const std::vector<std::string> &used_ids, time_t upper_bound_ts,
+    uint64_t *files)
 {
 	mlog(LV_INFO, "I-2019: purge_data: processing %s...", cid_dir.c_str());
 	auto [bytes, filecount] = purg_delete_unused_files4(cid_dir, {}, used_ids, upper_bound_ts);
 	if (bytes == UINT64_MAX)
 		return bytes;
+	*files += filecount;
 	char buf[32];
 	HX_unit_size(buf, std::size(buf), bytes, 0, 0);
 	mlog(LV_NOTICE, "I-2017: Purged %zu files (%sB) from %s",
@@ -476,40 +542,179 @@ static void sort_unique(std::vector<std::string> &c)
 	c.erase(std::unique(c.begin(), c.end()), c.end());
 }
 
-static bool purg_clean_cid(sqlite3 *db, const char *maildir, time_t upper_bound_ts)
+static bool purg_clean_cid(sqlite3 *db, const char *maildir,
+    time_t upper_bound_ts, uint64_t *files, uint64_t *bytes)
 {
 	std::vector<std::string> used;
 	if (!purg_discover_cids(db, maildir, used))
 		return false;
 	sort_unique(used);
-	return purg_delete_unused_files(maildir + "/cid"s,
-	       std::move(used), upper_bound_ts) < UINT64_MAX;
+	auto b = purg_delete_unused_files(maildir + "/cid"s,
+	         std::move(used), upper_bound_ts, files);
+	if (b == UINT64_MAX)
+		return false;
+	*bytes += b;
+	return true;
 }
 
-static bool purg_clean_mid(const char *maildir, time_t upper_bound_ts)
+static bool purg_clean_mid(const char *maildir, time_t upper_bound_ts,
+    uint64_t *files, uint64_t *bytes)
 {
 	std::vector<std::string> used;
 	if (!purg_discover_mids(maildir, used))
 		return false;
 	sort_unique(used);
-	if (purg_delete_unused_files(maildir + "/eml"s, used, upper_bound_ts) == UINT64_MAX)
+	for (auto sub : {"/eml", "/ext"}) {
+		auto b = purg_delete_unused_files(maildir + std::string(sub),
+		         used, upper_bound_ts, files);
+		if (b == UINT64_MAX)
+			return false;
+		*bytes += b;
+	}
+	return true;
+}
+
+static bool purg_have_cidrefs(sqlite3 *db)
+{
+	auto stm = gx_sql_prep(db, "SELECT 1 FROM sqlite_master "
+	           "WHERE type='table' AND name='cid_refs'");
+	return stm != nullptr && stm.step() == SQLITE_ROW;
+}
+
+/**
+ * Recount the content file references from scratch and replace cid_refs
+ * with the result. Deviations mean some write path got around the
+ * triggers; they are logged.
+ */
+static bool purg_recount_cids(sqlite3 *db, const char *maildir)
+{
+	auto xact = gx_sql_begin(db, txn_mode::write);
+	if (!xact)
+		return false;
+	auto query = fmt::format("CREATE TEMP TABLE cid_recount AS "
+	             "SELECT CAST(propval AS TEXT) AS cid, count(*) AS refcount FROM "
+	             "(SELECT propval FROM message_properties WHERE proptag IN ({},{},{},{},{},{}) "
+	             "UNION ALL SELECT propval FROM attachment_properties WHERE proptag IN ({},{})) "
+	             "GROUP BY 1",
+	             PR_TRANSPORT_MESSAGE_HEADERS, PR_TRANSPORT_MESSAGE_HEADERS_A,
+	             PR_BODY, PR_BODY_A, PR_HTML, PR_RTF_COMPRESSED,
+	             PR_ATTACH_DATA_BIN, PR_ATTACH_DATA_OBJ);
+	if (gx_sql_exec(db, "DROP TABLE IF EXISTS temp.cid_recount") != SQLITE_OK ||
+	    gx_sql_exec(db, query.c_str()) != SQLITE_OK)
+		return false;
+	auto cl_0 = make_scope_exit([&]() { gx_sql_exec(db, "DROP TABLE IF EXISTS temp.cid_recount"); });
+	auto stm = gx_sql_prep(db, "SELECT "
+	           "(SELECT count(*) FROM temp.cid_recount AS r LEFT JOIN cid_refs AS c"
+	           " ON c.cid=r.cid WHERE c.refcount IS NOT r.refcount) + "
+	           "(SELECT count(*) FROM cid_refs AS c WHERE c.refcount>0 AND NOT EXISTS"
+	           " (SELECT 1 FROM temp.cid_recount AS r WHERE r.cid=c.cid))");
+	if (stm == nullptr || stm.step() != SQLITE_ROW)
 		return false;
-	if (purg_delete_unused_files(maildir + "/ext"s, used, upper_bound_ts) == UINT64_MAX)
+	auto bad = stm.col_uint64(0);
+	stm.finalize();
+	if (bad > 0)
+		mlog(LV_WARN, "W-1340: purge_datafiles: %llu content reference counts in %s were off and have been corrected",
+		        LLU{bad}, maildir);
+	if (gx_sql_exec(db, "DELETE FROM cid_refs") != SQLITE_OK ||
+	    gx_sql_exec(db, "INSERT INTO cid_refs (cid, refcount) "
+	    "SELECT cid, refcount FROM temp.cid_recount") != SQLITE_OK)
 		return false;
+	return xact.commit() == SQLITE_OK;
+}
+
+/**
+ * Remove the content files whose reference count dropped to zero before
+ * @upper_bound_ts. A file touched since then may just have been picked up
+ * again by a writer (cu_cid_writeout deduplicates), so it is left for the
+ * next run.
+ */
+static bool purg_collect_cids(sqlite3 *db, const char *maildir,
+    time_t upper_bound_ts, uint64_t *files, uint64_t *bytes) try
+{
+	auto xact = gx_sql_begin(db, txn_mode::write);
+	if (!xact)
+		return false;
+	auto stm = gx_sql_prep(db, "SELECT cid FROM cid_refs "
+	           "WHERE zero_since<? AND refcount<=0");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, upper_bound_ts);
+	std::vector<std::string> dead;
+	while (stm.step() == SQLITE_ROW)
+		dead.emplace_back(stm.col_text(0));
+	stm = gx_sql_prep(db, "DELETE FROM cid_refs WHERE cid=?");
+	if (stm == nullptr)
+		return false;
+	for (const auto &cid : dead) {
+		bool busy = false;
+		for (unsigned int type = 0; type <= 2; ++type) {
+			auto path = cu_cid_path(maildir, cid.c_str(), type);
+			struct stat sb;
+			if (path.empty() || stat(path.c_str(), &sb) != 0)
+				continue;
+			if (sb.st_mtime >= upper_bound_ts) {
+				busy = true;
+			} else if (unlink(path.c_str()) == 0) {
+				++*files;
+				*bytes += sb.st_size;
+			} else if (errno != ENOENT) {
+				mlog(LV_ERR, "E-1341: unlink %s: %s", path.c_str(), strerror(errno));
+				busy = true;
+			}
+		}
+		if (busy)
+			continue;
+		stm.bind_text(1, cid.c_str());
+		if (stm.step() != SQLITE_DONE)
+			return false;
+		stm.reset();
+	}
+	if (xact.commit() != SQLITE_OK)
+		return false;
+	char buf[32];
+	HX_unit_size(buf, std::size(buf), *bytes, 0, 0);
+	mlog(LV_NOTICE, "I-1347: Purged %llu files (%sB) from %s/cid",
+	     LLU{*files}, buf, maildir);
 	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1343: ENOMEM");
+	return false;
 }
 
 BOOL exmdb_server::purge_datafiles(const char *dir)
 {
+	uint64_t files = 0, bytes = 0;
+	return purge_datafiles_v2(dir, EXMDB_PURGE_FULL, &files, &bytes);
+}
+
+/**
+ * Without EXMDB_PURGE_FULL, only content files whose reference count has
+ * dropped to zero are looked at (eml/ and ext/ are left alone). With it,
+ * the reference counts are verified and the whole directory tree is diffed
+ * against the database.
+ */
+BOOL exmdb_server::purge_datafiles_v2(const char *dir, uint32_t flags,
+    uint64_t *files, uint64_t *bytes)
+{
+	*files = *bytes = 0;
 	auto db = db_engine_get_db(dir);
 	if (!db)
 		return false;
+	auto upper_bound_ts = time(nullptr) - 60;
+	auto have_refs = purg_have_cidrefs(db->psqlite);
+	if (!(flags & EXMDB_PURGE_FULL)) {
+		if (have_refs)
+			return purg_collect_cids(db->psqlite, dir,
+			       upper_bound_ts, files, bytes);
+		mlog(LV_INFO, "I-1344: %s has no content reference counts yet (schema upgrade pending), doing a full purge", dir);
+	}
+	if (have_refs && !purg_recount_cids(db->psqlite, dir))
+		return false;
 	auto sql_transact = gx_sql_begin(db->psqlite, txn_mode::read);
 	if (!sql_transact)
 		return false;
-	auto upper_bound_ts = time(nullptr) - 60;
-	return purg_clean_cid(db->psqlite, dir, upper_bound_ts) &&
-	       purg_clean_mid(dir, upper_bound_ts) ? TRUE : false;
+	return purg_clean_cid(db->psqlite, dir, upper_bound_ts, files, bytes) &&
+	       purg_clean_mid(dir, upper_bound_ts, files, bytes) ? TRUE : false;
 }
 
 BOOL exmdb_server::autoreply_tsquery(const char *dir, const char *peer,
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <iconv.h>
 #include <list>
+#include <string>
 #include <unistd.h>
 #include <utility>
 #include <vector>
@@ -55,6 +56,7 @@ struct CONTENT_ROW_PARAM {
 	const SORTORDER_SET *psorts;
 	uint32_t instance_tag;
 	uint32_t extremum_tag;
+	hotprop_reader *hot;
 };
 
 struct HIERARCHY_ROW_PARAM {
@@ -538,6 +540,185 @@ static inline const BINARY *get_conv_id(const RESTRICTION *x)
 	return b->cb == 16 ? b : nullptr;
 }
 
+/**
+ * Key under which content tables may share their rows. @username is only
+ * relevant for public stores (per-user read states).
+ */
+static std::string table_share_key(uint64_t fid_val, uint8_t table_flags,
+    cpid_t cpid, const char *username, const RESTRICTION *prestriction,
+    const SORTORDER_SET *psorts)
+{
+	EXT_PUSH ep;
+	if (!ep.init(nullptr, 0, 0) ||
+	    ep.p_uint64(fid_val) != pack_result::ok ||
+	    ep.p_uint8(table_flags) != pack_result::ok ||
+	    ep.p_uint32(static_cast<uint32_t>(cpid)) != pack_result::ok ||
+	    ep.p_str(username != nullptr ? username : "") != pack_result::ok ||
+	    ep.p_uint8(prestriction != nullptr) != pack_result::ok ||
+	    (prestriction != nullptr &&
+	    ep.p_restriction(*prestriction) != pack_result::ok) ||
+	    ep.p_uint8(psorts != nullptr) != pack_result::ok ||
+	    (psorts != nullptr &&
+	    ep.p_sortorder_set(*psorts) != pack_result::ok))
+		return {};
+	return std::string(reinterpret_cast<const char *>(ep.m_udata), ep.m_offset);
+}
+
+/* Creates t<table_id> for the rows of a content table, with its indices */
+static BOOL table_create_content_rows(const db_conn &db, uint32_t table_id,
+    const SORTORDER_SET *psorts)
+{
+	char sql_string[512];
+
+	snprintf(sql_string, std::size(sql_string), "CREATE TABLE t%u "
+		"(row_id INTEGER PRIMARY KEY AUTOINCREMENT, "
+		"idx INTEGER UNIQUE DEFAULT NULL, "
+		"prev_id INTEGER UNIQUE DEFAULT NULL, "
+		"inst_id INTEGER NOT NULL, "
+		"row_type INTEGER NOT NULL, "
+		"row_stat INTEGER DEFAULT NULL, "	/* expanded(1) or collapsed(0) */
+		"parent_id INTEGER DEFAULT NULL, "
+		"depth INTEGER NOT NULL, "
+		"count INTEGER DEFAULT NULL, "
+		"unread INTEGER DEFAULT NULL, "
+		"inst_num INTEGER NOT NULL, "
+		"value NONE DEFAULT NULL, "
+		"extremum NONE DEFAULT NULL)",		/* read(unread) for message row */
+		table_id);
+	if (db.eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	if (NULL != psorts && psorts->ccategories > 0) {
+		snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_1 ON "
+			"t%u (inst_id, inst_num)", table_id, table_id);
+		if (db.eph_exec(sql_string) != SQLITE_OK)
+			return FALSE;
+		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_2 ON"
+			" t%u (parent_id)", table_id, table_id);
+		if (db.eph_exec(sql_string) != SQLITE_OK)
+			return FALSE;
+		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_3 ON t%u"
+			" (parent_id, value)", table_id, table_id);
+		if (db.eph_exec(sql_string) != SQLITE_OK)
+			return FALSE;
+	}
+	bool b_mvi = psorts != nullptr &&
+	             std::any_of(psorts->psort, psorts->psort + psorts->count,
+	             [](const SORT_ORDER &o) { return (o.type & MVI_FLAG) == MVI_FLAG; });
+	/* psorts == nullptr: for the row lookups of the dbeng_notify_cttbl_* handlers */
+	if (psorts != nullptr && !b_mvi)
+		snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_4 "
+			"ON t%u (inst_id)", table_id, table_id);
+	else
+		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_4 "
+			"ON t%u (inst_id)", table_id, table_id);
+	return db.eph_exec(sql_string) == SQLITE_OK ? TRUE : false;
+}
+
+/* Fills a fresh t<dst> with a copy of the rows of @src */
+static BOOL table_copy_content_rows(const db_conn &db, uint32_t dst,
+    const table_node &src)
+{
+	char sql_string[256];
+
+	if (!table_create_content_rows(db, dst, src.psorts))
+		return FALSE;
+	snprintf(sql_string, std::size(sql_string), "INSERT INTO t%u "
+	         "SELECT * FROM t%u", dst, src.table_id);
+	if (db.eph_exec(sql_string) != SQLITE_OK)
+		return FALSE;
+	++g_cttbl_counters.copied;
+	snprintf(sql_string, std::size(sql_string), "DELETE FROM sqlite_sequence"
+	         " WHERE name='t%u'; INSERT INTO sqlite_sequence (name, seq)"
+	         " SELECT 't%u', seq FROM sqlite_sequence WHERE name='t%u'",
+	         dst, dst, src.table_id);
+	return db.eph_exec(sql_string) == SQLITE_OK ? TRUE : false;
+}
+
+/**
+ * @owner is about to lose its rows to other users (expand/collapse) or go
+ * away entirely. Make the first of its sharers the new owner with a copy of
+ * the rows, and repoint the remaining sharers at that.
+ */
+static BOOL table_hand_over(const db_conn &db, db_base &dbase,
+    const table_node &owner)
+{
+	char sql_string[128];
+	table_node *heir = nullptr;
+
+	for (auto &t : dbase.tables.table_list) {
+		if (t.shared_id != owner.table_id)
+			continue;
+		if (heir == nullptr) {
+			snprintf(sql_string, std::size(sql_string),
+			         "DROP VIEW t%u", t.table_id);
+			if (db.eph_exec(sql_string) != SQLITE_OK ||
+			    !table_copy_content_rows(db, t.table_id, owner))
+				return FALSE;
+			t.shared_id = 0;
+			t.header_id = owner.header_id;
+			t.b_hint = owner.b_hint;
+			heir = &t;
+			continue;
+		}
+		snprintf(sql_string, std::size(sql_string), "DROP VIEW t%u;"
+		         " CREATE VIEW t%u AS SELECT * FROM t%u",
+		         t.table_id, t.table_id, heir->table_id);
+		if (db.eph_exec(sql_string) != SQLITE_OK)
+			return FALSE;
+		t.shared_id = heir->table_id;
+	}
+	return TRUE;
+}
+
+/**
+ * Give @t rows of its own before its expansion state is changed.
+ * Needs an open transaction on the eph database.
+ */
+static BOOL table_unshare(const db_conn &db, db_base &dbase, table_node &t)
+{
+	if (t.b_private)
+		return TRUE;
+	if (t.shared_id != 0) {
+		auto owner = dbase.find_table(t.shared_id);
+		if (owner == nullptr)
+			return FALSE;
+		char sql_string[64];
+		snprintf(sql_string, std::size(sql_string), "DROP VIEW t%u", t.table_id);
+		if (db.eph_exec(sql_string) != SQLITE_OK ||
+		    !table_copy_content_rows(db, t.table_id, *owner))
+			return FALSE;
+		t.header_id = owner->header_id;
+		t.shared_id = 0;
+	} else if (!table_hand_over(db, dbase, t)) {
+		return FALSE;
+	}
+	t.b_private = true;
+	return TRUE;
+}
+
+/**
+ * Drop the rows of content table @t (which has already been taken off
+ * the table list), keeping them for any sharers.
+ */
+static void table_release_content_rows(const db_conn &db, db_base &dbase,
+    const table_node &t)
+{
+	char sql_string[64];
+
+	if (t.shared_id != 0) {
+		snprintf(sql_string, std::size(sql_string), "DROP VIEW t%u", t.table_id);
+		db.eph_exec(sql_string);
+		return;
+	}
+	auto sql_transact = gx_sql_begin(db.m_sqlite_eph, txn_mode::write);
+	if (!sql_transact || !table_hand_over(db, dbase, t) ||
+	    sql_transact.commit() != SQLITE_OK)
+		mlog(LV_ERR, "E-1312: could not hand over shared rows of t%u", t.table_id);
+	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", t.table_id);
+	if (db.eph_exec(sql_string) != SQLITE_OK)
+		/* ignore - table_id is not going to get reused anyway */;
+}
+
 /**
  * @username:   Used for retrieving public store readstates
  *
@@ -613,6 +794,12 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 			" (parent_id, value)", table_id, table_id);
 		if (pdb->eph_exec(sql_string) != SQLITE_OK)
 			return FALSE;
+	} else if (psorts == nullptr) {
+		/* For the row lookups of the dbeng_notify_cttbl_* handlers */
+		snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_4 "
+			"ON t%u (inst_id)", table_id, table_id);
+		if (pdb->eph_exec(sql_string) != SQLITE_OK)
+			return FALSE;
 	}
 
 	std::list<table_node> holder;
@@ -647,6 +834,42 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		if (ptnode->prestriction == nullptr)
 			return false;
 	}
+	ptnode->share_key = table_share_key(fid_val, table_flags, cpid,
+	                    exmdb_server::is_private() ? nullptr : username,
+	                    prestriction, psorts);
+	auto &table_list = dbase->tables.table_list;
+	auto owner = std::find_if(table_list.cbegin(), table_list.cend(),
+	             [&](const table_node &t) {
+	             	return t.type == table_type::content && t.shared_id == 0 &&
+	             	       !t.b_private && !ptnode->share_key.empty() &&
+	             	       t.share_key == ptnode->share_key;
+	             });
+	if (owner != table_list.cend()) {
+		/* Same view as an existing table: read its rows through a view */
+		if (psorts != nullptr) {
+			ptnode->psorts = sortorder_set_dup(psorts);
+			if (ptnode->psorts == nullptr)
+				return false;
+		}
+		ptnode->instance_tag = owner->instance_tag;
+		ptnode->extremum_tag = owner->extremum_tag;
+		ptnode->header_id = owner->header_id;
+		ptnode->shared_id = owner->table_id;
+		snprintf(sql_string, std::size(sql_string), "CREATE VIEW t%u AS "
+		         "SELECT * FROM t%u", table_id, owner->table_id);
+		if (pdb->eph_exec(sql_string) != SQLITE_OK ||
+		    table_transact.commit() != SQLITE_OK)
+			return false;
+		table_list.splice(table_list.end(), std::move(holder));
+		if (*ptable_id == 0)
+			*ptable_id = table_id;
+		*prow_count = 0;
+		table_sum_table_count(pdb, table_id, prow_count);
+		++g_cttbl_counters.shared;
+		return TRUE;
+	}
+	if (!table_create_content_rows(*pdb, table_id, psorts))
+		return false;
 	xtransaction psort_transact;
 	if (NULL != psorts) {
 		ptnode->psorts = sortorder_set_dup(psorts);
@@ -734,14 +957,6 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 			if (gx_sql_exec(psqlite, sql_string) != SQLITE_OK)
 				return false;
 		}
-		if (ptnode->instance_tag == 0)
-			snprintf(sql_string, std::size(sql_string), "CREATE UNIQUE INDEX t%u_4 "
-					"ON t%u (inst_id)", table_id, table_id);
-		else
-			snprintf(sql_string, std::size(sql_string), "CREATE INDEX t%u_4 "
-				"ON t%u (inst_id)", table_id, table_id);
-		if (pdb->eph_exec(sql_string) != SQLITE_OK)
-			return false;
 		sql_len = snprintf(sql_string, std::size(sql_string), "INSERT INTO stbl VALUES (?");
 		for (size_t i = 0; i < tag_count; ++i)
 			sql_len += gx_snprintf(sql_string + sql_len,
@@ -834,10 +1049,16 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 		            " AND is_associated=0 AND is_deleted=%u",
 		            !!(table_flags & TABLE_FLAG_SOFTDELETES));
 	}
-	pstmt = pdb->prep(sql_string);
+	std::string query = sql_string, where;
+	auto res_kind = conv_id != nullptr || prestriction == nullptr ? res_sql::none :
+	                cu_msg_restriction_to_sql(prestriction, cpid, pdb->psqlite, where);
+	if (res_kind != res_sql::none)
+		query += " AND " + where;
+	pstmt = pdb->prep(query.c_str());
 	if (pstmt == nullptr)
 		return false;
 	uint64_t last_row_id = 0;
+	hotprop_reader hot(pdb->psqlite);
 	while (pstmt.step() == SQLITE_ROW) {
 		uint64_t mid_val = pstmt.col_uint64(0);
 		if (conv_id != nullptr) {
@@ -849,8 +1070,8 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 				return false;
 			if (parent_fid == 0)
 				continue;
-		} else if (prestriction != nullptr &&
-		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction)) {
+		} else if (prestriction != nullptr && res_kind != res_sql::exact &&
+		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction, &hot)) {
 			continue;
 		}
 		sqlite3_bind_int64(pstmt1, 1, mid_val);
@@ -859,7 +1080,7 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 				auto tmp_proptag = tmp_proptags[i];
 				if (tmp_proptag == ptnode->instance_tag)
 					continue;
-				if (!cu_get_property(MAPI_MESSAGE, mid_val,
+				if (!cu_get_msg_property(&hot, mid_val,
 				    cpid, pdb->psqlite, tmp_proptag, &pvalue))
 					return false;
 				if (pvalue == nullptr)
@@ -1064,7 +1285,6 @@ BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id)
 {
 	BOOL b_result;
 	uint32_t row_count;
-	char sql_string[128];
 	
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
@@ -1078,13 +1298,12 @@ BOOL exmdb_server::reload_content_table(const char *dir, uint32_t table_id)
 	            });
 	if (iter == table_list.end())
 		return TRUE;
+	++g_cttbl_counters.reloaded;
 
 	std::list<table_node> holder;
 	holder.splice(holder.end(), table_list, iter);
 	auto ptnode = &holder.back();
-	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", table_id);
-	if (pdb->eph_exec(sql_string) != SQLITE_OK)
-		/* ignore; the id won't be reused anyway */;
+	table_release_content_rows(*pdb, *dbase, *ptnode);
 	auto sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
 	if (!sql_transact)
 		return false;
@@ -1379,7 +1598,6 @@ BOOL exmdb_server::unload_table(const char *dir, uint32_t table_id)
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
 		return FALSE;
-	/* Only one SQL operation, no transaction needed. */
 	auto dbase = pdb->lock_base_wr();
 	auto &table_list = dbase->tables.table_list;
 	auto iter = std::find_if(table_list.begin(), table_list.end(),
@@ -1389,6 +1607,11 @@ BOOL exmdb_server::unload_table(const char *dir, uint32_t table_id)
 
 	std::list<table_node> holder;
 	holder.splice(holder.end(), table_list, iter);
+	if (holder.back().type == table_type::content) {
+		table_release_content_rows(*pdb, *dbase, holder.back());
+		return TRUE;
+	}
+	/* Only one SQL operation, no transaction needed. */
 	dbase.reset();
 	snprintf(sql_string, std::size(sql_string), "DROP TABLE t%u", table_id);
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
@@ -1563,6 +1786,14 @@ const table_node *db_base::find_table(uint32_t table_id) const
 	return nullptr;
 }
 
+table_node *db_base::find_table(uint32_t table_id)
+{
+	for (auto &t : tables.table_list)
+		if (t.table_id == table_id)
+			return &t;
+	return nullptr;
+}
+
 static BOOL query_hierarchy(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
     const PROPTAG_ARRAY *pproptags, uint32_t start_pos, int32_t row_needed,
     TARRAY_SET *pset)
@@ -1944,7 +2175,7 @@ static BOOL table_get_content_row_property(
 			*ppvalue = NULL;
 			return TRUE;
 		}
-		if (!cu_get_property(MAPI_MESSAGE, prow_param->inst_id,
+		if (!cu_get_msg_property(prow_param->hot, prow_param->inst_id,
 		    prow_param->cpid, prow_param->psqlite, proptag,
 		    ppvalue))
 			return FALSE;	
@@ -2174,6 +2405,7 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 	auto optim = pdb->begin_optim();
 	if (optim == nullptr)
 		return FALSE;
+	hotprop_reader hot(pdb->psqlite);
 	while (pstmt.step() == SQLITE_ROW) {
 		CONTENT_ROW_PARAM content_param;
 
@@ -2190,6 +2422,7 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 		content_param.psorts = ptnode->psorts;
 		content_param.instance_tag = ptnode->instance_tag;
 		content_param.extremum_tag = ptnode->extremum_tag;
+		content_param.hot = &hot;
 		if (!table_evaluate_row_restriction(pres,
 		    &content_param, table_get_content_row_property))
 			continue;
@@ -2206,7 +2439,7 @@ static BOOL match_tbl_ctnt(cpid_t cpid, uint32_t table_id, BOOL b_forward,
 			    ptnode->extremum_tag, &pvalue)) {
 				if (row_type == CONTENT_ROW_HEADER)
 					continue;
-				if (!cu_get_property(MAPI_MESSAGE, inst_id, cpid,
+				if (!cu_get_msg_property(&hot, inst_id, cpid,
 				    pdb->psqlite, tag, &pvalue))
 					return FALSE;
 			}
@@ -2832,7 +3065,7 @@ BOOL exmdb_server::expand_table(const char *dir,
 	auto sql_transact_eph = gx_sql_begin(pdb->m_sqlite_eph, txn_mode::write);
 	if (!sql_transact_eph)
 		return false;
-	auto dbase = pdb->lock_base_rd();
+	auto dbase = pdb->lock_base_wr();
 	auto ptnode = dbase->find_table(table_id);
 	if (ptnode == nullptr) {
 		*pb_found = FALSE;
@@ -2887,6 +3120,8 @@ BOOL exmdb_server::expand_table(const char *dir,
 			return FALSE;
 	}
 	pstmt.finalize();
+	if (!table_unshare(*pdb, *dbase, *ptnode))
+		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET row_stat=1 "
 	        "WHERE row_id=%llu", ptnode->table_id, LLU{row_id});
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
@@ -2942,7 +3177,7 @@ BOOL exmdb_server::collapse_table(const char *dir,
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
 		return FALSE;
-	auto dbase = pdb->lock_base_rd();
+	auto dbase = pdb->lock_base_wr();
 	auto ptnode = dbase->find_table(table_id);
 	if (ptnode == nullptr) {
 		*pb_found = FALSE;
@@ -2978,6 +3213,8 @@ BOOL exmdb_server::collapse_table(const char *dir,
 	idx = sqlite3_column_int64(pstmt, 4);
 	*pposition = idx - 1;
 	pstmt.finalize();
+	if (!table_unshare(*pdb, *dbase, *ptnode))
+		return FALSE;
 	snprintf(sql_string, std::size(sql_string), "UPDATE t%u SET row_stat=0 "
 	        "WHERE row_id=%llu", ptnode->table_id, LLU{row_id});
 	if (pdb->eph_exec(sql_string) != SQLITE_OK)
@@ -3326,7 +3563,7 @@ BOOL exmdb_server::restore_table_state(const char *dir,
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
 		return FALSE;
-	auto dbase = pdb->lock_base_rd();
+	auto dbase = pdb->lock_base_wr();
 	auto ptnode = dbase->find_table(table_id);
 	if (ptnode == nullptr)
 		return TRUE;
@@ -3386,6 +3623,8 @@ BOOL exmdb_server::restore_table_state(const char *dir,
 	auto table_transact = gx_sql_begin(pdb->m_sqlite_eph, txn_mode::write);
 	if (!table_transact)
 		return false;
+	if (!table_unshare(*pdb, *dbase, *ptnode))
+		return false;
 	/* reset table into initial state */
 	snprintf(sql_string, std::size(sql_string), "SELECT row_id, "
 		"row_stat, depth FROM t%u WHERE row_type=%u",
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <sqlite3.h>
 #include <gromox/defs.h>
@@ -43,13 +44,23 @@ class GX_EXPORT xsavepoint {
 
 extern GX_EXPORT int gx_sql_step(sqlite3_stmt *, unsigned int flags = 0);
 
+/**
+ * State of a cached statement, shared by the statement cache and the xstmt
+ * that has it on loan. If the cache goes away first, it sets @orphan and the
+ * borrower finalizes the statement itself.
+ */
+struct xstmt_lease {
+	bool lent = false, orphan = false;
+};
+
+/**
+ * @m_lease: if non-null, the statement belongs to a statement cache
+ *           (gx_sql_cache_attach) and is handed back instead of finalized
+ */
 struct GX_EXPORT xstmt {
 	xstmt() = default;
-	xstmt(xstmt &&o) noexcept : m_ptr(o.m_ptr) { o.m_ptr = nullptr; }
-	~xstmt() {
-		if (m_ptr != nullptr)
-			sqlite3_finalize(m_ptr);
-	}
+	xstmt(xstmt &&o) noexcept : m_ptr(o.m_ptr), m_lease(std::move(o.m_lease)) { o.m_ptr = nullptr; }
+	~xstmt() { finalize(); }
 	/*
 	 * How sqlite treats literals in SQL command text:
 	 * - if L is a hex integer literal (0x prefix),
@@ -70,19 +81,28 @@ struct GX_EXPORT xstmt {
 	inline int step(unsigned int flags = 0) { return gx_sql_step(m_ptr, flags); }
 	inline int reset() { return sqlite3_reset(m_ptr); }
 	void finalize() {
-		if (m_ptr != nullptr)
+		if (m_ptr == nullptr)
+			return;
+		if (m_lease == nullptr || m_lease->orphan) {
 			sqlite3_finalize(m_ptr);
+		} else {
+			sqlite3_reset(m_ptr);
+			sqlite3_clear_bindings(m_ptr);
+			m_lease->lent = false;
+		}
+		m_lease.reset();
 		m_ptr = nullptr;
 	}
 	inline void operator=(std::nullptr_t) { finalize(); }
 	void operator=(xstmt &&o) noexcept {
-		if (m_ptr != nullptr)
-			sqlite3_finalize(m_ptr);
+		finalize();
 		m_ptr = o.m_ptr;
+		m_lease = std::move(o.m_lease);
 		o.m_ptr = nullptr;
 	}
 	operator sqlite3_stmt *() { return m_ptr; }
 	sqlite3_stmt *m_ptr = nullptr;
+	std::shared_ptr<xstmt_lease> m_lease;
 };
 
 enum {
@@ -94,6 +114,10 @@ enum class txn_mode {
 };
 
 extern GX_EXPORT struct xstmt gx_sql_prep(sqlite3 *, const char *);
+extern GX_EXPORT void gx_sql_cache_attach(sqlite3 *, size_t max_stmts);
+extern GX_EXPORT void gx_sql_cache_detach(sqlite3 *);
+extern GX_EXPORT void gx_sql_cache_flush(sqlite3 *);
+extern GX_EXPORT void gx_sql_cache_stats(uint64_t &hits, uint64_t &misses);
 extern GX_EXPORT xtransaction gx_sql_begin3(const std::string &, sqlite3 *, txn_mode);
 #define gx_sql_begin(...) gx_sql_begin3(std::string(__FILE__) + ":" + std::to_string(__LINE__), __VA_ARGS__)
 extern GX_EXPORT int gx_sql_exec(sqlite3 *, const char *query, unsigned int flags = 0);
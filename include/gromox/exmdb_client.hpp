@@ -3,15 +3,25 @@
 #include <condition_variable>
 #include <ctime>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <pthread.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <gromox/atomic.hpp>
+#include <gromox/clock.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/list_file.hpp>
 
+struct BINARY_ARRAY;
 struct DB_NOTIFY;
 struct exreq;
+struct exreq_get_named_propids;
+struct exreq_get_named_propnames;
 struct exresp;
+struct exresp_get_named_propids;
+struct exresp_get_named_propnames;
 
 namespace gromox {
 
@@ -51,10 +61,34 @@ struct remote_conn {
 	int sockd = -1;
 };
 
+struct mux_waiter;
+
+/**
+ * A connection in EXMDB_PROTO_MUX mode. Any number of callers may have
+ * requests outstanding; a reader thread matches responses to the waiting
+ * callers by request ID.
+ */
+struct mux_conn {
+	mux_conn(remote_svr *s) : psvr(s) {}
+	NOMOVE(mux_conn);
+	~mux_conn();
+
+	remote_svr *psvr = nullptr;
+	int sockd = -1;
+	pthread_t thr_id{};
+	gromox::atomic_bool b_dead{false};
+	std::atomic<uint32_t> next_id{1};
+	std::mutex wr_lock, pend_lock;
+	std::unordered_map<uint32_t, mux_waiter *> pending; /* under pend_lock */
+};
+
 struct GX_EXPORT remote_svr : public EXMDB_ITEM {
 	remote_svr(EXMDB_ITEM &&o) noexcept : EXMDB_ITEM(std::move(o)) {}
 	std::list<remote_conn> conn_list;
+	std::list<std::shared_ptr<mux_conn>> mux_list;
 	std::atomic<unsigned int> active_handles{0};
+	unsigned int mux_connecting = 0; /* mux connects in progress; under mdcl_server_lock */
+	bool mux_unsupported = false; /* server only speaks lock-step */
 };
 
 struct GX_EXPORT remote_conn_ref {
@@ -75,10 +109,52 @@ using REMOTE_CONN = remote_conn;
 using REMOTE_SVR = remote_svr;
 using REMOTE_CONN_floating = remote_conn_ref;
 
+/**
+ * Collects several requests for one store and ships them in a single
+ * exmdb_callid::multi_call round trip. The exreq/exresp objects are owned by
+ * the caller and must outlive exec(); each exreq must have its call_id set.
+ */
+struct GX_EXPORT exmdb_multi_call {
+	exmdb_multi_call(const char *dir, bool stop_on_error = false) :
+		m_dir(dir), m_stop(stop_on_error) {}
+	NOMOVE(exmdb_multi_call);
+
+	void add(exreq &q, exresp &r) { m_calls.emplace_back(&q, &r); }
+	BOOL exec();
+	size_t size() const { return m_calls.size(); }
+	/* Whether sub-request @i was executed and its response decoded */
+	bool ok(size_t i) const { return i < m_ok.size() && m_ok[i]; }
+
+	private:
+	const char *m_dir = nullptr;
+	bool m_stop = false;
+	std::vector<std::pair<exreq *, exresp *>> m_calls;
+	std::vector<bool> m_ok;
+};
+
 extern GX_EXPORT void exmdb_client_init(unsigned int conn_max, unsigned int notify_threads_max);
 extern GX_EXPORT void exmdb_client_stop();
 extern GX_EXPORT int exmdb_client_run(const char *dir, unsigned int fl = EXMDB_CLIENT_NO_FLAGS, void (*)(const remote_svr &) = nullptr, void (*)() = nullptr, void (*)(const char *, BOOL, uint32_t, const DB_NOTIFY *) = nullptr);
 extern GX_EXPORT bool exmdb_client_is_local(const char *pfx, BOOL *pvt);
 extern GX_EXPORT BOOL exmdb_client_do_rpc(const exreq *, exresp *);
+/*
+ * Set by exmdb_provider, so that exmdb_multi_call runs batches for its own
+ * (exmdb_client_is_local) stores in-process.
+ */
+extern GX_EXPORT BOOL (*exmdb_client_local_multi_call)(const char *dir, uint8_t flags, const BINARY_ARRAY *, BINARY_ARRAY *);
+
+/*
+ * Named property cache (exmdb_namecache.cpp), consulted by the generated
+ * exmdb_client_remote functions. A lookup that returns true has filled the
+ * response and no RPC is needed.
+ */
+extern void exmdb_client_cache_init(size_t max_stores, time_duration ttl, time_duration recheck);
+extern void exmdb_client_cache_forget(const char *dir);
+extern bool exmdb_client_cache_lookup(const exreq_get_named_propids &, exresp_get_named_propids &);
+extern bool exmdb_client_cache_lookup(const exreq_get_named_propnames &, exresp_get_named_propnames &);
+extern bool exmdb_client_cache_lookup(const exreq &, exresp &);
+extern void exmdb_client_cache_update(const exreq_get_named_propids &, const exresp_get_named_propids &);
+extern void exmdb_client_cache_update(const exreq_get_named_propnames &, const exresp_get_named_propnames &);
+extern void exmdb_client_cache_update(const exreq &, const exresp &);
 
 }
@@ -6,10 +6,13 @@
 #include <type_traits>
 #include <vector>
 #include <vmime/message.hpp>
+#include <gromox/clock.hpp>
 #include <gromox/common_types.hpp>
+#include <gromox/database.h>
 #include <gromox/defs.h>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/mysql_adaptor.hpp>
+#include <gromox/restriction.hpp>
 #include <gromox/svc_common.h>
 #define MAXIMUM_PROPNAME_NUMBER								0x7000
 #define MAX_DIGLEN											256*1024
@@ -43,6 +46,27 @@ enum {
 struct MAIL;
 
 namespace exmdb {
+/* Reads the message_hotprops row (schema 18+) of one message at a time */
+struct hotprop_reader {
+	hotprop_reader(sqlite3 *);
+	NOMOVE(hotprop_reader);
+	/* 1: served, 0: caller should use cu_get_property, -1: error */
+	int get(uint64_t msgid, uint32_t proptag, void **out);
+
+	gromox::xstmt m_stmt;
+	uint64_t m_mid = 0;
+	bool m_row = false;
+};
+
+/* How much of a restriction cu_msg_restriction_to_sql could express */
+enum class res_sql { none, partial, exact };
+
+/* Counters of the decompressed content file cache (since startup) */
+struct cid_cache_stats {
+	uint64_t hits = 0, misses = 0, bytes_saved = 0;
+	size_t items = 0, bytes_used = 0, budget = 0;
+};
+
 #define E(s) extern decltype(mysql_adaptor_ ## s) *common_util_ ## s;
 E(get_username_from_id)
 E(check_mlist_include)
@@ -95,6 +119,7 @@ extern BOOL cu_get_proptags(mapi_object_type, uint64_t id, sqlite3 *, std::vecto
 BOOL common_util_get_mapping_guid(sqlite3 *psqlite,
 	uint16_t replid, BOOL *pb_found, GUID *pguid);
 extern BOOL cu_get_property(mapi_object_type, uint64_t id, cpid_t, sqlite3 *, uint32_t proptag, void **out);
+extern BOOL cu_get_msg_property(hotprop_reader *, uint64_t msgid, cpid_t, sqlite3 *, uint32_t proptag, void **out);
 extern BOOL cu_get_properties(mapi_object_type, uint64_t id, cpid_t, sqlite3 *, const PROPTAG_ARRAY *, TPROPVAL_ARRAY *);
 extern BOOL cu_set_property(mapi_object_type, uint64_t id, cpid_t, sqlite3 *, uint32_t tag, const void *data, BOOL *result);
 extern BOOL cu_set_properties(mapi_object_type, uint64_t id, cpid_t, sqlite3 *, const TPROPVAL_ARRAY *, PROBLEM_ARRAY *);
@@ -105,6 +130,7 @@ BOOL common_util_get_rule_property(uint64_t rule_id,
 extern bool cu_get_permission_property(int64_t member_id, sqlite3 *, uint32_t proptag, void **outval);
 BOOL common_util_check_msgcnt_overflow(sqlite3 *psqlite);
 extern BOOL cu_check_msgsize_overflow(sqlite3 *psqlite, uint32_t qtag);
+extern bool cu_get_store_quota(sqlite3 *, uint32_t qtag, uint64_t *used, uint64_t *limit);
 extern uint32_t cu_folder_unread_count(sqlite3 *psqlite, uint64_t folder_id, unsigned int flags = 0);
 extern BOOL common_util_get_folder_type(sqlite3 *, uint64_t folder_id, uint32_t *type, const char *dir = nullptr);
 uint64_t common_util_get_folder_parent_fid(
@@ -118,6 +144,8 @@ BOOL common_util_get_message_flags(sqlite3 *psqlite,
 	uint64_t message_id, BOOL b_native,
 	uint32_t **ppmessage_flags);
 extern std::string cu_cid_path(const char *dir, const char *cid, unsigned int type);
+extern gromox::errno_t cu_read_cid(const char *dir, const char *cid, unsigned int type, BINARY &);
+extern void cu_cid_cache_stats(cid_cache_stats &);
 void common_util_set_message_read(sqlite3 *psqlite,
 	uint64_t message_id, uint8_t is_read);
 BINARY* common_util_username_to_addressbook_entryid(
@@ -136,7 +164,16 @@ BOOL common_util_get_message_parent_folder(sqlite3 *psqlite,
 BOOL common_util_load_search_scopes(sqlite3 *psqlite,
 	uint64_t folder_id, LONGLONG_ARRAY *pfolder_ids);
 extern bool cu_eval_folder_restriction(sqlite3 *, uint64_t folder_id, const RESTRICTION *);
-extern bool cu_eval_msg_restriction(sqlite3 *, cpid_t, uint64_t msgid, const RESTRICTION *);
+extern bool cu_eval_msg_restriction(sqlite3 *, cpid_t, uint64_t msgid, const RESTRICTION *, hotprop_reader * = nullptr);
+extern bool cu_eval_msg_program(sqlite3 *, cpid_t, uint64_t msgid, const gromox::res_program &);
+extern res_sql cu_msg_restriction_to_sql(const RESTRICTION *, cpid_t, sqlite3 *, std::string &where);
+extern bool cu_fts_attach(sqlite3 *, const char *dir, bool create);
+extern bool cu_fts_active(sqlite3 *);
+extern const char *cu_fts_column(uint32_t proptag);
+extern bool cu_fts_indexed_tag(uint32_t proptag);
+extern bool cu_fts_index_message(sqlite3 *, uint64_t msgid);
+extern bool cu_fts_forget(sqlite3 *, uint64_t msgid);
+extern void cu_fts_update(sqlite3 *, uint64_t msgid);
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist);
 BOOL common_util_get_mid_string(sqlite3 *psqlite,
@@ -167,11 +204,19 @@ BOOL common_util_indexing_sub_contents(
 extern uint32_t common_util_calculate_message_size(const message_content *);
 extern uint32_t common_util_calculate_attachment_size(const attachment_content *);
 extern const char *exmdb_rpc_idtoname(exmdb_callid);
+extern bool exmdb_rpc_readonly(exmdb_callid);
+extern void exmdb_rpc_account(exmdb_callid, const char *dir, bool ok, gromox::time_duration, size_t in_bytes, const exreq * = nullptr);
+extern void exmdb_rpc_account_out(exmdb_callid, size_t out_bytes);
+extern void exmdb_rpc_stats(std::vector<exmdb_rpc_stat> &, std::vector<exmdb_rpc_dirstat> &, size_t top_n, bool reset);
 extern int need_msg_perm_check(sqlite3 *, const char *user, uint64_t fid);
 extern int have_delete_perm(sqlite3 *, const char *user, uint64_t fid, uint64_t mid = 0);
 extern ec_error_t cu_id2user(int, std::string &);
 
 extern unsigned int g_max_rule_num, g_max_extrule_num, g_cid_compression;
+/* Memory budget of the decompressed content file cache, 0 = off */
+extern size_t g_cid_cache_size;
+/* RPCs taking at least this long are logged, 0 = off */
+extern gromox::time_duration g_exmdb_slow_rpc;
 extern thread_local unsigned int g_inside_flush_instance;
 extern thread_local sqlite3 *g_sqlite_for_oxcmail;
 extern char g_exmdb_org_name[];
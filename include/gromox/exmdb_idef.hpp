@@ -137,3 +137,11 @@ EXMIDL(purge_datafiles, (const char *dir))
 EXMIDL(autoreply_tsquery, (const char *dir, const char *peer, uint64_t window, IDLOUT uint64_t *tdiff))
 EXMIDL(autoreply_tsupdate, (const char *dir, const char *peer))
 EXMIDL(recalc_store_size, (const char *dir, uint32_t flags))
+EXMIDL(multi_call, (const char *dir, uint8_t flags, const BINARY_ARRAY *reqs, IDLOUT BINARY_ARRAY *rsps))
+EXMIDL(read_instance_range, (const char *dir, uint32_t instance_id, uint32_t proptag, uint32_t offset, uint32_t length, IDLOUT BINARY *data, uint32_t *total_size))
+EXMIDL(get_search_progress, (const char *dir, uint64_t folder_id, IDLOUT uint32_t *scanned, uint32_t *total))
+EXMIDL(rebuild_fulltext, (const char *dir, IDLOUT uint32_t *count))
+EXMIDL(get_cache_stats, (const char *dir, IDLOUT uint64_t *budget, uint64_t *total, std::vector<exmdb_cache_entry> *entries))
+EXMIDL(get_rpc_stats, (const char *dir, uint32_t flags, uint32_t top_n, IDLOUT std::vector<exmdb_rpc_stat> *calls, std::vector<exmdb_rpc_dirstat> *dirs, std::vector<exmdb_counter> *counters))
+EXMIDL(purge_datafiles_v2, (const char *dir, uint32_t flags, IDLOUT uint64_t *files, uint64_t *bytes))
+EXMIDL(write_messages, (const char *dir, cpid_t cpid, uint64_t folder_id, uint32_t flags, const std::vector<const MESSAGE_CONTENT *> &msgs, IDLOUT std::vector<uint64_t> *outmids, ec_error_t *e_result))
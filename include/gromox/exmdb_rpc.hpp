@@ -24,6 +24,46 @@ enum class exmdb_response : uint8_t {
 	invalid = 0xff,
 };
 
+/*
+ * Protocol feature flags, offered by the client as an optional trailer of
+ * the CONNECT request and echoed back (masked to what the server supports)
+ * in the CONNECT response.
+ */
+enum {
+	/*
+	 * Multiplexed mode: every frame carries a 32-bit request ID after the
+	 * length field, multiple requests may be outstanding on one
+	 * connection, and responses may arrive in any order.
+	 */
+	EXMDB_PROTO_MUX = 0x1U,
+	/*
+	 * Notification batches (offered in LISTEN_NOTIFICATION): every
+	 * datagram on the router connection is a concatenation of one or more
+	 * length-prefixed DB_NOTIFY_DATAGRAMs, acknowledged as a whole.
+	 */
+	EXMDB_PROTO_NOTIFY_BATCH = 0x2U,
+};
+
+enum { /* exmdb_callid::multi_call flags */
+	/* Do not execute further sub-requests after one failed */
+	EXMDB_MULTI_STOP_ON_ERROR = 0x1U,
+};
+
+enum { /* exmdb_callid::get_rpc_stats flags */
+	/* Zero the counters after reading them */
+	EXMDB_RPCSTAT_RESET = 0x1U,
+};
+
+enum { /* exmdb_callid::purge_datafiles_v2 flags */
+	/* Verify reference counts and diff all of cid/, eml/, ext/ */
+	EXMDB_PURGE_FULL = 0x1U,
+};
+
+enum { /* exmdb_callid::write_messages flags */
+	/* Stamp PR_RECEIVED_BY_* etc. like deliver_message does */
+	EXMDB_WRITE_DELIVERY = 0x1U,
+};
+
 enum class exmdb_callid : uint8_t {
 	connect = 0x00,
 	listen_notification = 0x01,
@@ -167,9 +207,19 @@ enum class exmdb_callid : uint8_t {
 	movecopy_folder = 0x8b,
 	create_folder = 0x8c,
 	write_message_v2 = 0x8d,
+	multi_call = 0x8e,
+	read_instance_range = 0x8f,
+	get_search_progress = 0x90,
+	rebuild_fulltext = 0x91,
+	get_cache_stats = 0x92,
+	get_rpc_stats = 0x93,
+	purge_datafiles_v2 = 0x94,
+	write_messages = 0x95,
 	/* update exch/exmdb_provider/names.cpp:exmdb_rpc_idtoname! */
 };
 
+struct iovec;
+
 struct exreq {
 	exreq() = default; /* Prevent use of direct-list-init */
 	virtual ~exreq() = default;
@@ -181,10 +231,12 @@ struct exreq_connect final : public exreq {
 	char *prefix;
 	char *remote_id;
 	BOOL b_private;
+	uint32_t proto_flags = 0; /* EXMDB_PROTO_*; absent in old clients */
 };
 
 struct exreq_listen_notification final : public exreq {
 	char *remote_id;
+	uint32_t proto_flags = 0; /* EXMDB_PROTO_*; absent in old clients */
 };
 
 struct exreq_get_named_propids final : public exreq {
@@ -852,6 +904,24 @@ struct exreq_recalc_store_size final : public exreq {
 	uint32_t flags = 0;
 };
 
+/*
+ * Each element of @reqs is a complete request PDU (call_id, dir, args) as
+ * produced by exmdb_ext_push_request, minus the leading length field. All
+ * sub-requests must be for the same dir as the multi_call itself.
+ */
+struct exreq_multi_call final : public exreq {
+	uint8_t flags = 0;
+	BINARY_ARRAY *reqs = nullptr;
+};
+
+struct exreq_read_instance_range final : public exreq {
+	uint32_t instance_id = 0, proptag = 0, offset = 0, length = 0;
+};
+
+struct exreq_get_search_progress final : public exreq {
+	uint64_t folder_id = 0;
+};
+
 struct exresp {
 	exresp() = default; /* Prevent use of direct-init-list */
 	virtual ~exresp() = default;
@@ -1295,6 +1365,89 @@ struct exresp_write_message_v2 final : public exresp {
 	ec_error_t e_result{};
 };
 
+/*
+ * One element per sub-request executed, in order, each encoded as
+ * {uint8_t status; leuint32_t length; char payload[];}, i.e. the same as a
+ * lock-step response. Fewer elements than requests are returned if
+ * execution stopped early (EXMDB_MULTI_STOP_ON_ERROR).
+ */
+struct exresp_multi_call final : public exresp {
+	BINARY_ARRAY rsps{};
+};
+
+/*
+ * @total_size is the length of the whole property value; 0 means the
+ * property is not (or no longer) available for ranged reading.
+ */
+struct exresp_read_instance_range final : public exresp {
+	BINARY data{};
+	uint32_t total_size = 0;
+};
+
+/*
+ * Messages of the search scope evaluated so far, out of @total. Both are 0
+ * when no population is pending.
+ */
+struct exresp_get_search_progress final : public exresp {
+	uint32_t scanned = 0, total = 0;
+};
+
+/* Number of messages put into the full-text index */
+struct exresp_rebuild_fulltext final : public exresp {
+	uint32_t count = 0;
+};
+
+/*
+ * exmdb_cache_budget (0 = unlimited), the estimated memory held by all
+ * cached stores, and the stores themselves. Not specific to the store given
+ * in the request.
+ */
+struct exresp_get_cache_stats final : public exresp {
+	uint64_t budget = 0, total = 0;
+	std::vector<exmdb_cache_entry> entries;
+};
+
+struct exreq_get_rpc_stats final : public exreq {
+	uint32_t flags, top_n;
+};
+
+/*
+ * Per-RPC counters (for callids that have been used at all), the @top_n
+ * stores by time spent in RPCs, and the instance's cache, content table and
+ * notification counters (which EXMDB_RPCSTAT_RESET leaves alone). Not
+ * specific to the store given in the request.
+ */
+struct exresp_get_rpc_stats final : public exresp {
+	std::vector<exmdb_rpc_stat> calls;
+	std::vector<exmdb_rpc_dirstat> dirs;
+	std::vector<exmdb_counter> counters;
+};
+
+struct exreq_purge_datafiles_v2 final : public exreq {
+	uint32_t flags;
+};
+
+struct exresp_purge_datafiles_v2 final : public exresp {
+	uint64_t files = 0, bytes = 0;
+};
+
+struct exreq_write_messages final : public exreq {
+	cpid_t cpid;
+	uint64_t folder_id;
+	uint32_t flags;
+	std::vector<const MESSAGE_CONTENT *> msgs;
+};
+
+/*
+ * One MID per message written, in request order; 0 for a message that was
+ * rejected. Fewer elements than messages are returned if the store became
+ * full (@e_result is then MAPI_E_STORE_FULL).
+ */
+struct exresp_write_messages final : public exresp {
+	std::vector<uint64_t> outmids;
+	ec_error_t e_result{};
+};
+
 using exreq_ping_store = exreq;
 using exreq_get_all_named_propids = exreq;
 using exreq_get_store_all_proptags = exreq;
@@ -1303,6 +1456,8 @@ using exreq_allocate_cn = exreq;
 using exreq_vacuum = exreq;
 using exreq_unload_store = exreq;
 using exreq_purge_datafiles = exreq;
+using exreq_rebuild_fulltext = exreq;
+using exreq_get_cache_stats = exreq;
 using exreq_create_folder_v1 = exreq_create_folder;
 using exresp_remove_folder_properties = exresp;
 using exresp_reload_content_table = exresp;
@@ -1356,6 +1511,7 @@ extern GX_EXPORT pack_result exmdb_ext_push_db_notify(const DB_NOTIFY_DATAGRAM *
 extern GX_EXPORT const char *exmdb_rpc_strerror(exmdb_response);
 extern GX_EXPORT BOOL exmdb_client_read_socket(int, BINARY &, long timeout = -1);
 extern GX_EXPORT BOOL exmdb_client_write_socket(int, const BINARY &, long timeout = -1);
+extern GX_EXPORT BOOL exmdb_client_writev_socket(int, struct iovec *, unsigned int iovcnt, long timeout = -1);
 
 extern GX_EXPORT void *(*exmdb_rpc_alloc)(size_t);
 extern GX_EXPORT void (*exmdb_rpc_free)(void *);
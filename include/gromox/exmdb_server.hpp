@@ -20,9 +20,29 @@ extern const char *get_remote_id();
 extern void set_public_username(const char *);
 extern const char *get_public_username();
 extern ALLOC_CONTEXT *get_alloc_context();
+
+/**
+ * While an alloc_scope is alive, get_alloc_context (and thus
+ * common_util_alloc) hands out memory from the scope's own arena, which is
+ * released when the scope ends. For long-running RPCs that would otherwise
+ * accumulate everything in the request's arena.
+ */
+class GX_EXPORT alloc_scope {
+	public:
+	alloc_scope();
+	~alloc_scope();
+	NOMOVE(alloc_scope);
+
+	private:
+	alloc_context m_ctx;
+	alloc_context *m_prev = nullptr;
+};
+
 extern bool is_private();
 extern const char *get_dir();
 extern void set_dir(const char *);
+extern bool is_readonly();
+extern void set_readonly(bool);
 extern int get_account_id();
 extern const GUID *get_handle();
 
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdarg>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <dirent.h>
@@ -80,6 +81,42 @@ class GX_EXPORT wrapfd {
 	int m_fd = -1;
 };
 
+/**
+ * Random-access reader for content files (zstd with or without seek table,
+ * or uncompressed). @skip hides a fixed-size prefix of the content.
+ * Sequential pread calls only inflate each frame once; memory use is
+ * bounded by one frame regardless of the file size.
+ */
+class GX_EXPORT gx_zreader {
+	public:
+	struct frame {
+		uint64_t c_off = 0, d_off = 0;
+		uint32_t c_size = 0, d_size = 0;
+	};
+
+	gx_zreader() = default;
+	~gx_zreader();
+	NOMOVE(gx_zreader);
+	errno_t open(const char *path, uint32_t skip = 0);
+	uint64_t size() const { return m_size; }
+	/* false if random access has to inflate everything before @off */
+	bool seekable() const { return m_seekable; }
+	errno_t pread(void *buf, size_t len, uint64_t off, size_t *got);
+
+	private:
+	void reposition(uint64_t off);
+	errno_t next_chunk();
+
+	wrapfd m_fd;
+	bool m_plain = false, m_seekable = true;
+	uint32_t m_skip = 0;
+	uint64_t m_size = 0, m_cpos = 0, m_out_start = 0;
+	std::vector<frame> m_frames;
+	std::unique_ptr<char[]> m_in, m_out;
+	size_t m_in_pos = 0, m_in_len = 0, m_out_len = 0;
+	void *m_dstream = nullptr;
+};
+
 extern GX_EXPORT std::string iconvtext(const char *, size_t, const char *from, const char *to);
 extern GX_EXPORT pid_t popenfd(const char *const *, int *, int *, int *, const char *const *);
 extern GX_EXPORT int feed_w3m(const void *in, size_t insize, std::string &out);
@@ -1048,6 +1048,42 @@ enum {
 static_assert(static_cast<unsigned int>(ALLOCATED_EID_RANGE) > static_cast<unsigned int>(CUSTOM_EID_BEGIN),
 	"mkprivate/mkpublic picks EIDs such that it expects to find a hole between CUSTOM_EID_BEGIN and ALLOCATED_EID_RANGE.");
 
+/* A store held in exmdb_provider's cache (exmdb get_cache_stats) */
+struct exmdb_cache_entry {
+	std::string dir;
+	uint64_t mem_bytes = 0; /* estimated */
+	uint32_t idle_secs = 0, references = 0, handles = 0;
+	uint32_t tables = 0, instances = 0, dynamics = 0;
+};
+
+/* Counters for one RPC type in exmdb_provider (exmdb get_rpc_stats) */
+struct exmdb_rpc_stat {
+	std::string name;
+	uint64_t calls = 0, errors = 0, total_us = 0, max_us = 0;
+	uint64_t bytes_in = 0, bytes_out = 0;
+	/*
+	 * Latency histogram; hist[0] counts calls below 1 µs, hist[i] those in
+	 * [2^(i-1), 2^i) µs, and the last bucket everything above.
+	 */
+	std::vector<uint64_t> hist;
+};
+
+/* Time spent in RPCs for one store (exmdb get_rpc_stats) */
+struct exmdb_rpc_dirstat {
+	std::string dir;
+	uint64_t calls = 0, total_us = 0;
+};
+
+/*
+ * An instance-wide figure of exmdb_provider (exmdb get_rpc_stats), either a
+ * monotonic counter or (@gauge) a current level.
+ */
+struct exmdb_counter {
+	std::string name;
+	uint64_t value = 0;
+	bool gauge = false;
+};
+
 using GET_PROPIDS = std::function<BOOL(const PROPNAME_ARRAY *, PROPID_ARRAY *)>;
 /* if it returns TRUE, PROPERTY_NAME must be available */
 using GET_PROPNAME = std::function<BOOL (uint16_t, PROPERTY_NAME **)>;
@@ -1,6 +1,70 @@
 #pragma once
 #include <cstdint>
+#include <string>
+#include <vector>
 #include <gromox/mapi_types.hpp>
 
 extern GX_EXPORT void restriction_free(RESTRICTION *);
 extern GX_EXPORT uint32_t restriction_size(const RESTRICTION *);
+
+namespace gromox {
+
+/**
+ * A RESTRICTION compiled into flat bytecode, for evaluating the same
+ * criteria against many objects (e.g. dynamic search folders vs. every
+ * incoming message).
+ *
+ * Property tags are resolved into slots at compile time; a slot is fetched
+ * at most once per evaluation, and only if evaluation reaches it. String
+ * operands of case-insensitive RES_CONTENT are lowercased up front and
+ * constant subtrees (RES_NULL, empty AND/OR, incomparable operands, ...)
+ * are folded. Other operands are referenced from the source restriction,
+ * which must outlive the program.
+ *
+ * RES_SUBRESTRICTION and RES_COUNT are not supported; compile() fails and
+ * the caller should keep using its interpreter.
+ */
+struct GX_EXPORT res_program {
+	enum {
+		/* slot is the left-hand side of a RES_PROPERTY */
+		F_RELOP = 0x1U,
+	};
+	/* Returns false on error, which makes the requesting leaf false */
+	using fetch_fn = bool (*)(void *ctx, uint32_t proptag, unsigned int flags, void **out);
+
+	bool compile(const RESTRICTION &);
+	bool eval(fetch_fn, void *ctx) const;
+	inline bool compiled() const { return m_state != state::none; }
+	inline size_t size() const { return m_code.size(); }
+	inline size_t slot_count() const { return m_slots.size(); }
+	size_t mem_usage() const;
+
+	private:
+	enum class state : uint8_t { none, k_false, k_true, code };
+	enum class op : uint8_t {
+		jf, jt, inv, str_content, content, property, anr, propcmp,
+		bitmask, size, exist,
+	};
+	struct insn {
+		op code;
+		uint8_t mode = 0;
+		uint16_t slot = 0, slot2 = 0;
+		uint32_t arg = 0;
+		const void *ref = nullptr;
+	};
+	struct slot {
+		uint32_t proptag;
+		unsigned int flags;
+	};
+
+	state emit(const RESTRICTION &);
+	uint16_t get_slot(uint32_t proptag, unsigned int flags);
+
+	std::vector<insn> m_code;
+	std::vector<slot> m_slots;
+	std::vector<std::string> m_strs;
+	state m_state = state::none;
+	bool m_unsupported = false;
+};
+
+}
@@ -1,22 +1,142 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021-2023 grommunio GmbH
 // This file is part of Gromox.
+#include <atomic>
 #include <cstdio>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <sqlite3.h>
-#include <string>
 #include <unistd.h>
+#include <libHX/ctype_helper.h>
 #include <gromox/database.h>
 #include <gromox/process.hpp>
 #include <gromox/util.hpp>
 
 namespace gromox {
 
+namespace {
+
+/**
+ * Prepared statements of one sqlite handle, most recently used first.
+ * Like the handle itself, only ever used by one thread at a time.
+ *
+ * @lease: shared with the xstmt that currently holds the statement
+ * @stale: flushed while lent; finalize when next seen
+ */
+struct stmt_cache {
+	struct entry {
+		std::string sql;
+		sqlite3_stmt *stmt = nullptr;
+		std::shared_ptr<xstmt_lease> lease;
+		bool stale = false;
+		bool lent() const { return lease->lent; }
+	};
+	using iter = std::list<entry>::iterator;
+
+	stmt_cache(size_t m) : max(m) {}
+	~stmt_cache();
+	NOMOVE(stmt_cache);
+	void drop(iter);
+	void flush();
+	bool make_room();
+
+	size_t max = 0;
+	std::list<entry> lru;
+	std::unordered_map<std::string_view, iter> index;
+};
+
+}
+
 static std::unordered_map<std::string, std::string> active_xa;
 static std::mutex active_xa_lock;
+static std::unordered_map<sqlite3 *, std::unique_ptr<stmt_cache>> stmt_caches;
+static std::shared_mutex stmt_caches_lock;
+static std::atomic<uint64_t> stmt_cache_hits, stmt_cache_misses;
 unsigned int gx_sqlite_debug, gx_force_write_txn, gx_sql_deep_backtrace;
 
+void stmt_cache::drop(iter it)
+{
+	index.erase(it->sql);
+	sqlite3_finalize(it->stmt);
+	lru.erase(it);
+}
+
+/* Statements still on loan are left to their borrowers to finalize. */
+stmt_cache::~stmt_cache()
+{
+	for (auto &e : lru) {
+		if (e.lent())
+			e.lease->orphan = true;
+		else
+			sqlite3_finalize(e.stmt);
+	}
+}
+
+void stmt_cache::flush()
+{
+	for (auto it = lru.begin(); it != lru.end(); ) {
+		auto next = std::next(it);
+		if (it->lent())
+			it->stale = true;
+		else
+			drop(it);
+		it = next;
+	}
+}
+
+/* Evict the least recently used idle statement if the cache is full. */
+bool stmt_cache::make_room()
+{
+	if (lru.size() < max)
+		return true;
+	for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+		if (it->lent())
+			continue;
+		drop(std::prev(it.base()));
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Whether @q contains a numeric literal of two or more digits, e.g. an object
+ * ID that was formatted into the text. Such statements are rarely seen twice.
+ */
+static bool has_id_literal(const char *q)
+{
+	bool quoted = false;
+	for (auto prev = ' '; *q != '\0'; prev = *q++) {
+		if (*q == '\'')
+			quoted = !quoted;
+		if (quoted || !HX_isdigit(*q) || HX_isalnum(prev) || prev == '_')
+			continue;
+		if (HX_isdigit(q[1]))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Only plain DML is worth keeping; DDL and transaction control are one-offs
+ * and may refer to objects that go away. Same goes for statements with
+ * literal IDs; those that are run often take them as bound parameters.
+ */
+static bool cacheable_statement(const char *q)
+{
+	while (HX_isspace(*q))
+		++q;
+	if (strncasecmp(q, "SELECT", 6) != 0 && strncasecmp(q, "INSERT", 6) != 0 &&
+	    strncasecmp(q, "UPDATE", 6) != 0 && strncasecmp(q, "REPLACE", 7) != 0 &&
+	    strncasecmp(q, "DELETE", 6) != 0 && strncasecmp(q, "WITH", 4) != 0)
+		return false;
+	return !has_id_literal(q);
+}
+
 static bool write_statement(const char *q)
 {
 	return strncasecmp(q, "CREATE", 6) == 0 || strncasecmp(q, "ALTER", 5) == 0 ||
@@ -40,14 +160,106 @@ xstmt gx_sql_prep(sqlite3 *db, const char *query)
 			it != active_xa.end() ? it->second.c_str() : "unknown",
 			simple_backtrace().c_str());
 	}
+	stmt_cache *cache = nullptr;
+	if (cacheable_statement(query)) {
+		std::shared_lock hold(stmt_caches_lock);
+		auto it = stmt_caches.find(db);
+		if (it != stmt_caches.end())
+			cache = it->second.get();
+	}
+	if (cache != nullptr) {
+		auto it = cache->index.find(query);
+		if (it != cache->index.end() && it->second->stale && !it->second->lent()) {
+			cache->drop(it->second);
+			it = cache->index.end();
+		}
+		if (it != cache->index.end() && !it->second->lent()) {
+			++stmt_cache_hits;
+			auto &e = *it->second;
+			cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+			e.lease->lent = true;
+			out.m_ptr   = e.stmt;
+			out.m_lease = e.lease;
+			return out;
+		}
+		++stmt_cache_misses;
+		if (it != cache->index.end() || !cache->make_room())
+			/* Same text already in use (nested loop), or all busy */
+			cache = nullptr;
+	}
 	int ret = sqlite3_prepare_v2(db, query, -1, &out.m_ptr, nullptr);
-	if (ret != SQLITE_OK)
+	if (ret != SQLITE_OK) {
 		mlog(LV_ERR, "sqlite_prep(%s) \"%s\": %s (%d)",
 			znul(sqlite3_db_filename(db, nullptr)),
 		        query, sqlite3_errstr(ret), ret);
+		return out;
+	}
+	if (cache == nullptr || out.m_ptr == nullptr)
+		return out;
+	try {
+		auto lease = std::make_shared<xstmt_lease>();
+		lease->lent = true;
+		auto &e = cache->lru.emplace_front();
+		e.stmt  = out.m_ptr;
+		e.lease = lease;
+		try {
+			e.sql = query;
+			cache->index.emplace(e.sql, cache->lru.begin());
+		} catch (const std::bad_alloc &) {
+			cache->lru.pop_front();
+			return out;
+		}
+		out.m_lease = std::move(lease);
+	} catch (const std::bad_alloc &) {
+	}
 	return out;
 }
 
+/**
+ * Give @db its own prepared statement cache. gx_sql_prep will then hand out
+ * statements from the cache, and xstmt will reset rather than finalize them.
+ * Must be undone with gx_sql_cache_detach before the handle is closed.
+ */
+void gx_sql_cache_attach(sqlite3 *db, size_t max_stmts) try
+{
+	if (max_stmts == 0)
+		return;
+	auto c = std::make_unique<stmt_cache>(max_stmts);
+	std::unique_lock hold(stmt_caches_lock);
+	stmt_caches.emplace(db, std::move(c));
+} catch (const std::bad_alloc &) {
+}
+
+/*
+ * Finalize all idle cached statements. Statements that are still held by an
+ * xstmt are finalized when that xstmt lets go of them.
+ */
+void gx_sql_cache_detach(sqlite3 *db)
+{
+	std::unique_ptr<stmt_cache> c;
+	std::unique_lock hold(stmt_caches_lock);
+	auto it = stmt_caches.find(db);
+	if (it == stmt_caches.end())
+		return;
+	c = std::move(it->second);
+	stmt_caches.erase(it);
+}
+
+/* Discard cached statements, e.g. after a schema change. */
+void gx_sql_cache_flush(sqlite3 *db)
+{
+	std::shared_lock hold(stmt_caches_lock);
+	auto it = stmt_caches.find(db);
+	if (it != stmt_caches.end())
+		it->second->flush();
+}
+
+void gx_sql_cache_stats(uint64_t &hits, uint64_t &misses)
+{
+	hits   = stmt_cache_hits;
+	misses = stmt_cache_misses;
+}
+
 xtransaction &xtransaction::operator=(xtransaction &&o) noexcept
 {
 	teardown();
@@ -346,6 +346,171 @@ static constexpr char tbl_fixsyseidalloc_16[] =
 static constexpr char tbl_fixsyseidalloc_17[] =
 "UPDATE configurations SET config_value=(SELECT MAX(range_end) FROM allocated_eids) WHERE config_id=3"; // CONIFG_ID_MAXIMUM_EID
 
+/*
+ * Denormalized copies of frequently sorted/filtered message properties, so
+ * that content tables need not go through message_properties one proptag at
+ * a time. A NULL column means "look in message_properties".
+ *
+ * subject is the PR_SUBJECT synthesis (prefix + normalized subject, see
+ * common_util_get_message_subject), left NULL whenever 8-bit variants of the
+ * parts are present, since those need cpid conversion.
+ */
+#define HOTPROPS_TAGS \
+	"0x0e060040,0x00390040,0x30070040,0x30080040,0x001a001f,0x0042001f," \
+	"0x0c1a001f,0x00170003,0x10900003,0x003d001f,0x0e1d001f,0x003d001e,0x0e1d001e"
+#define HOTPROPS_SUBJECT(m) \
+	"CASE WHEN EXISTS (SELECT 1 FROM message_properties WHERE message_id=" m \
+	" AND proptag IN (0x003d001e,0x0e1d001e)) THEN NULL ELSE" \
+	" COALESCE((SELECT propval FROM message_properties WHERE message_id=" m " AND proptag=0x003d001f),'') ||" \
+	" COALESCE((SELECT propval FROM message_properties WHERE message_id=" m " AND proptag=0x0e1d001f),'') END"
+#define HOTPROPS_COL(col, tag, r, v) \
+	col "=CASE " r ".proptag WHEN " tag " THEN " v " ELSE " col " END,"
+#define HOTPROPS_SET(r, v) \
+	HOTPROPS_COL("delivery_time", "0x0e060040", r, v) \
+	HOTPROPS_COL("submit_time", "0x00390040", r, v) \
+	HOTPROPS_COL("creation_time", "0x30070040", r, v) \
+	HOTPROPS_COL("lastmod_time", "0x30080040", r, v) \
+	HOTPROPS_COL("message_class", "0x001a001f", r, v) \
+	HOTPROPS_COL("sent_repr_name", "0x0042001f", r, v) \
+	HOTPROPS_COL("sender_name", "0x0c1a001f", r, v) \
+	HOTPROPS_COL("importance", "0x00170003", r, v) \
+	HOTPROPS_COL("flag_status", "0x10900003", r, v) \
+	"subject=CASE WHEN " r ".proptag IN (0x003d001f,0x0e1d001f,0x003d001e,0x0e1d001e)" \
+	" THEN " HOTPROPS_SUBJECT(r ".message_id") " ELSE subject END"
+#define HOTPROPS_18 \
+	"CREATE TABLE message_hotprops (" \
+	"  message_id INTEGER PRIMARY KEY," \
+	"  delivery_time BLOB DEFAULT NULL," \
+	"  submit_time BLOB DEFAULT NULL," \
+	"  creation_time BLOB DEFAULT NULL," \
+	"  lastmod_time BLOB DEFAULT NULL," \
+	"  message_class BLOB DEFAULT NULL," \
+	"  sent_repr_name BLOB DEFAULT NULL," \
+	"  sender_name BLOB DEFAULT NULL," \
+	"  importance BLOB DEFAULT NULL," \
+	"  flag_status BLOB DEFAULT NULL," \
+	"  subject BLOB DEFAULT NULL," \
+	"  FOREIGN KEY (message_id) REFERENCES messages (message_id) ON DELETE CASCADE ON UPDATE CASCADE);" \
+	"CREATE TRIGGER hotprops_ins18 AFTER INSERT ON message_properties" \
+	" WHEN NEW.proptag IN (" HOTPROPS_TAGS ") BEGIN" \
+	" INSERT OR IGNORE INTO message_hotprops (message_id) VALUES (NEW.message_id);" \
+	" UPDATE message_hotprops SET " HOTPROPS_SET("NEW", "NEW.propval") \
+	" WHERE message_id=NEW.message_id; END;" \
+	"CREATE TRIGGER hotprops_upd18 AFTER UPDATE OF propval ON message_properties" \
+	" WHEN NEW.proptag IN (" HOTPROPS_TAGS ") BEGIN" \
+	" INSERT OR IGNORE INTO message_hotprops (message_id) VALUES (NEW.message_id);" \
+	" UPDATE message_hotprops SET " HOTPROPS_SET("NEW", "NEW.propval") \
+	" WHERE message_id=NEW.message_id; END;" \
+	"CREATE TRIGGER hotprops_del18 AFTER DELETE ON message_properties" \
+	" WHEN OLD.proptag IN (" HOTPROPS_TAGS ") BEGIN" \
+	" UPDATE message_hotprops SET " HOTPROPS_SET("OLD", "NULL") \
+	" WHERE message_id=OLD.message_id; END;"
+
+static constexpr char tbl_hotprops_18[] = HOTPROPS_18;
+
+static constexpr char tbl_hotprops_fill18[] = HOTPROPS_18
+"INSERT INTO message_hotprops SELECT m.message_id,"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x0e060040),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x00390040),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x30070040),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x30080040),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x001a001f),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x0042001f),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x0c1a001f),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x00170003),"
+" (SELECT propval FROM message_properties WHERE message_id=m.message_id AND proptag=0x10900003),"
+" " HOTPROPS_SUBJECT("m.message_id")
+" FROM messages AS m WHERE EXISTS (SELECT 1 FROM message_properties"
+" WHERE message_id=m.message_id AND proptag IN (" HOTPROPS_TAGS "))";
+
+/*
+ * Index for picking changed messages by CN, and a list of MIDs that left a
+ * folder (hard or soft deletion), so that content sync need not visit every
+ * message to find the client's deltas.
+ */
+#define CNINDEX_19 \
+	"CREATE INDEX pid_cn_messages_index19 ON messages(parent_fid, is_deleted, change_number, is_associated);" \
+	"CREATE TABLE message_tombstones (" \
+	"  message_id INTEGER PRIMARY KEY," \
+	"  folder_id INTEGER NOT NULL);" \
+	"CREATE INDEX fid_tombstones_index19 ON message_tombstones(folder_id);" \
+	"CREATE TRIGGER tombstones_del19 AFTER DELETE ON messages" \
+	" WHEN OLD.parent_fid IS NOT NULL AND OLD.is_deleted=0 BEGIN" \
+	" INSERT OR REPLACE INTO message_tombstones VALUES (OLD.message_id, OLD.parent_fid); END;" \
+	"CREATE TRIGGER tombstones_softdel19 AFTER UPDATE OF is_deleted ON messages" \
+	" WHEN NEW.parent_fid IS NOT NULL AND NEW.is_deleted<>0 AND OLD.is_deleted=0 BEGIN" \
+	" INSERT OR REPLACE INTO message_tombstones VALUES (NEW.message_id, NEW.parent_fid); END;" \
+	"CREATE TRIGGER tombstones_fld19 AFTER DELETE ON folders BEGIN" \
+	" DELETE FROM message_tombstones WHERE folder_id=OLD.folder_id; END;"
+
+static constexpr char tbl_pvt_cnindex_19[] = CNINDEX_19
+"CREATE INDEX pid_readcn_messages_index19 ON messages(parent_fid, read_cn);";
+
+static constexpr char tbl_pub_cnindex_19[] = CNINDEX_19;
+
+/*
+ * Scope folders of a search folder population that is underway, so that it
+ * can continue where it left off after a restart. last_mid is the highest
+ * message_id evaluated so far, total the scope size when the search began.
+ */
+static constexpr char tbl_pvt_searchprogress_20[] =
+"CREATE TABLE search_progress ("
+"  folder_id INTEGER NOT NULL,"
+"  scope_fid INTEGER NOT NULL,"
+"  cpid INTEGER NOT NULL,"
+"  last_mid INTEGER NOT NULL DEFAULT 0,"
+"  total INTEGER NOT NULL DEFAULT 0,"
+"  done INTEGER NOT NULL DEFAULT 0,"
+"  PRIMARY KEY (folder_id, scope_fid),"
+"  FOREIGN KEY (folder_id) REFERENCES folders (folder_id) ON DELETE CASCADE ON UPDATE CASCADE);";
+
+/*
+ * Number of references to every content file (cid/) from message and
+ * attachment properties, kept by triggers. zero_since is the time the count
+ * last dropped to zero, so purge_datafiles only needs to look at those rows
+ * rather than diff the whole directory against the database.
+ *
+ * REPLACE INTO deletes the conflicting row without running delete triggers,
+ * hence the BEFORE INSERT trigger which accounts for the row about to be
+ * overwritten.
+ */
+#define CIDREFS_MSG_TAGS \
+	"0x007d001f,0x007d001e,0x1000001f,0x1000001e,0x10130102,0x10090102"
+#define CIDREFS_ATX_TAGS "0x37010102,0x3701000d"
+#define CIDREFS_INC(v) \
+	" INSERT OR IGNORE INTO cid_refs (cid) VALUES (" v ");" \
+	" UPDATE cid_refs SET refcount=refcount+1, zero_since=NULL WHERE cid=" v ";"
+#define CIDREFS_DEC(v) \
+	" UPDATE cid_refs SET refcount=refcount-1, zero_since=CASE WHEN refcount<=1" \
+	" THEN CAST(strftime('%s','now') AS INTEGER) ELSE NULL END WHERE cid=" v ";"
+#define CIDREFS_TRIGGERS(t, key, tags) \
+	"CREATE TRIGGER " t "_cidref_ins21 AFTER INSERT ON " t \
+	" WHEN NEW.proptag IN (" tags ") BEGIN" CIDREFS_INC("NEW.propval") " END;" \
+	"CREATE TRIGGER " t "_cidref_rpl21 BEFORE INSERT ON " t \
+	" WHEN NEW.proptag IN (" tags ") BEGIN" CIDREFS_DEC("(SELECT propval FROM " t \
+	" WHERE " key "=NEW." key " AND proptag=NEW.proptag)") " END;" \
+	"CREATE TRIGGER " t "_cidref_upd21 AFTER UPDATE OF propval ON " t \
+	" WHEN NEW.proptag IN (" tags ") BEGIN" CIDREFS_DEC("OLD.propval") \
+	CIDREFS_INC("NEW.propval") " END;" \
+	"CREATE TRIGGER " t "_cidref_del21 AFTER DELETE ON " t \
+	" WHEN OLD.proptag IN (" tags ") BEGIN" CIDREFS_DEC("OLD.propval") " END;"
+#define CIDREFS_21 \
+	"CREATE TABLE cid_refs (" \
+	"  cid TEXT PRIMARY KEY," \
+	"  refcount INTEGER NOT NULL DEFAULT 0," \
+	"  zero_since INTEGER DEFAULT NULL);" \
+	"CREATE INDEX zero_cid_refs_index21 ON cid_refs(zero_since) WHERE zero_since IS NOT NULL;" \
+	CIDREFS_TRIGGERS("message_properties", "message_id", CIDREFS_MSG_TAGS) \
+	CIDREFS_TRIGGERS("attachment_properties", "attachment_id", CIDREFS_ATX_TAGS)
+
+static constexpr char tbl_cidrefs_21[] = CIDREFS_21;
+
+static constexpr char tbl_cidrefs_fill21[] = CIDREFS_21
+"INSERT INTO cid_refs (cid, refcount) SELECT CAST(propval AS TEXT), count(*) FROM"
+" (SELECT propval FROM message_properties WHERE proptag IN (" CIDREFS_MSG_TAGS ")"
+" UNION ALL SELECT propval FROM attachment_properties WHERE proptag IN (" CIDREFS_ATX_TAGS "))"
+" GROUP BY 1";
+
 static constexpr char tbl_pub_folders_0[] =
 "CREATE TABLE folders ("
 "  folder_id INTEGER PRIMARY KEY,"
@@ -439,6 +604,10 @@ static constexpr tbl_init tbl_pvt_init_top[] = {
 	{"search_scopes", tbl_pvt_searchscopes_0},
 	{"search_result", tbl_pvt_searchresult_0},
 	{"autoreply_ts", tbl_pvt_autoreply_ts_11},
+	{"message_hotprops", tbl_hotprops_18},
+	{"message_tombstones", tbl_pvt_cnindex_19},
+	{"search_progress", tbl_pvt_searchprogress_20},
+	{"cid_refs", tbl_cidrefs_21},
 	TABLE_END,
 };
 
@@ -483,6 +652,9 @@ static constexpr tbl_init tbl_pub_init_top[] = {
 	{"read_states", tbl_pub_readst_0},
 	{"read_cns", tbl_pub_readcn_0},
 	{"replguidmap", tbl_replguidmap_14},
+	{"message_hotprops", tbl_hotprops_18},
+	{"message_tombstones", tbl_pub_cnindex_19},
+	{"cid_refs", tbl_cidrefs_21},
 	TABLE_END,
 };
 
@@ -581,6 +753,10 @@ static constexpr tblite_upgradefn tbl_pvt_upgrade_list[] = {
 	{15, tbl_fixsyseidalloc_15},
 	{16, tbl_fixsyseidalloc_16},
 	{17, tbl_fixsyseidalloc_17},
+	{18, tbl_hotprops_fill18},
+	{19, tbl_pvt_cnindex_19},
+	{20, tbl_pvt_searchprogress_20},
+	{21, tbl_cidrefs_fill21},
 	/* advance schema numbers in lockstep with public stores */
 	TABLE_END,
 };
@@ -596,6 +772,9 @@ static constexpr tblite_upgradefn tbl_pub_upgrade_list[] = {
 	{15, tbl_fixsyseidalloc_15},
 	{16, tbl_fixsyseidalloc_16},
 	{17, tbl_fixsyseidalloc_17},
+	{18, tbl_hotprops_fill18},
+	{19, tbl_pub_cnindex_19},
+	{21, tbl_cidrefs_fill21},
 	/* advance schema numbers in lockstep with private stores */
 	TABLE_END,
 };
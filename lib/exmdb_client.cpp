@@ -3,16 +3,23 @@
 // This file is part of Gromox.
 #include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <netdb.h>
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <libHX/io.h>
 #include <libHX/socket.h>
 #include <gromox/atomic.hpp>
 #include <gromox/config_file.hpp>
@@ -35,6 +42,7 @@ namespace gromox {
 
 static int mdcl_rpc_timeout = -1;
 static constexpr unsigned int mdcl_ping_timeout = 2;
+static unsigned int mdcl_mux_max;
 static_assert(SOCKET_TIMEOUT >= mdcl_ping_timeout);
 static std::list<agent_thread> mdcl_agent_list;
 static std::list<remote_svr> mdcl_server_list;
@@ -47,6 +55,24 @@ static void (*mdcl_free_env)();
 static void (*mdcl_event_proc)(const char *, BOOL, uint32_t, const DB_NOTIFY *);
 static char mdcl_remote_id[128];
 
+struct mux_waiter {
+	std::condition_variable cv;
+	bool done = false;
+	exmdb_response code = exmdb_response::invalid;
+	BINARY bin{}; /* malloc'd; response payload after the req_id */
+	void *buf = nullptr;
+};
+
+mux_conn::~mux_conn()
+{
+	if (sockd >= 0) {
+		close(sockd);
+		sockd = -1;
+		if (psvr != nullptr)
+			--psvr->active_handles;
+	}
+}
+
 remote_conn::~remote_conn()
 {
 	if (sockd >= 0) {
@@ -77,6 +103,10 @@ void remote_conn_ref::reset(bool lost)
 }
 
 static constexpr cfg_directive exmdb_client_dflt[] = {
+	{"exmdb_client_mux_connections", "2", CFG_SIZE},
+	{"exmdb_client_propname_cache", "256", CFG_SIZE},
+	{"exmdb_client_propname_cache_recheck", "10s", CFG_TIME},
+	{"exmdb_client_propname_cache_ttl", "15min", CFG_TIME},
 	{"exmdb_client_rpc_timeout", "0", CFG_TIME, "0"},
 	CFG_TABLE_END,
 };
@@ -93,6 +123,10 @@ void exmdb_client_init(unsigned int conn_max, unsigned int notify_threads_max)
 			mdcl_rpc_timeout = -1;
 		if (mdcl_rpc_timeout > 0)
 			mdcl_rpc_timeout *= 1000;
+		mdcl_mux_max = cfg->get_ll("exmdb_client_mux_connections");
+		exmdb_client_cache_init(cfg->get_ll("exmdb_client_propname_cache"),
+			std::chrono::seconds(cfg->get_ll("exmdb_client_propname_cache_ttl")),
+			std::chrono::seconds(cfg->get_ll("exmdb_client_propname_cache_recheck")));
 	}
 	setup_sigalrm();
 	mdcl_notify_stop = true;
@@ -113,6 +147,22 @@ void exmdb_client_stop()
 		}
 	}
 	mdcl_notify_stop = true;
+	std::vector<std::shared_ptr<mux_conn>> mux_hold;
+	{
+		std::lock_guard sv_hold(mdcl_server_lock);
+		for (auto &srv : mdcl_server_list) {
+			mux_hold.insert(mux_hold.end(), srv.mux_list.begin(), srv.mux_list.end());
+			srv.mux_list.clear();
+		}
+	}
+	/* mux readers need mdcl_server_lock for exiting, so join them unlocked */
+	for (auto &mc : mux_hold) {
+		mc->b_dead = true;
+		shutdown(mc->sockd, SHUT_RDWR);
+		if (!pthread_equal(mc->thr_id, {}))
+			pthread_join(mc->thr_id, nullptr);
+	}
+	mux_hold.clear();
 	std::lock_guard sv_hold(mdcl_server_lock);
 	for (auto &ag : mdcl_agent_list) {
 		pthread_kill(ag.thr_id, SIGALRM);
@@ -133,8 +183,12 @@ void exmdb_client_stop()
 	mdcl_event_proc = nullptr;
 }
 
+/**
+ * @proto_flags:	(in) EXMDB_PROTO_* features to offer,
+ * 			(out) features the server agreed to
+ */
 static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
-    const char *prog_id)
+    const char *prog_id, uint32_t *proto_flags = nullptr)
 {
 	int sockd = HX_inet_connect(srv.host.c_str(), srv.port, 0);
 	if (sockd < 0) {
@@ -155,9 +209,11 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		rqc.prefix = deconst(srv.prefix.c_str());
 		rqc.remote_id = mdcl_remote_id;
 		rqc.b_private = srv.type == EXMDB_ITEM::EXMDB_PRIVATE ? TRUE : false;
+		rqc.proto_flags = proto_flags != nullptr ? *proto_flags : 0;
 	} else {
 		rql.call_id = exmdb_callid::listen_notification;
 		rql.remote_id = mdcl_remote_id;
+		rql.proto_flags = proto_flags != nullptr ? *proto_flags : 0;
 	}
 	BINARY bin;
 	if (b_listen) {
@@ -180,6 +236,11 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 	    bin.pb == nullptr)
 		return -1;
 	auto response_code = static_cast<exmdb_response>(bin.pb[0]);
+	/*
+	 * Servers predating feature flags answer with a 5-byte response
+	 * regardless of what was offered, which amounts to "no features".
+	 */
+	uint32_t granted = bin.cb == 9 ? le32p_to_cpu(&bin.pb[5]) : 0;
 	exmdb_rpc_free(bin.pb);
 	bin.pb = nullptr;
 	if (response_code != exmdb_response::success) {
@@ -187,12 +248,15 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		       srv.host.c_str(), srv.port, srv.prefix.c_str(),
 		       exmdb_rpc_strerror(response_code));
 		return -1;
-	} else if (bin.cb != 5) {
+	} else if (bin.cb != 5 && (bin.cb != 9 ||
+	    proto_flags == nullptr || *proto_flags == 0)) {
 		mlog(LV_ERR, "exmdb_client: response format error "
 		       "during connect to [%s]:%hu/%s",
 		       srv.host.c_str(), srv.port, srv.prefix.c_str());
 		return -1;
 	}
+	if (proto_flags != nullptr)
+		*proto_flags &= granted;
 	cl_sock.release();
 	return sockd;
 }
@@ -261,24 +325,84 @@ static void *cl_pinger(void *)
 	return nullptr;
 }
 
+/**
+ * Dispatch the datagrams of one notification frame. In batch mode, @bin is a
+ * concatenation of {leuint32_t length; char datagram[];}; all of them are
+ * decoded (and acknowledged) before the first one is handed to the event
+ * procedure.
+ */
+static int cl_notif_dispatch(agent_thread &agent, const BINARY &bin, bool batch) try
+{
+	mdcl_build_env(*agent.pserver);
+	auto cl_0 = make_scope_exit([]() { if (mdcl_free_env != nullptr) mdcl_free_env(); });
+	std::vector<DB_NOTIFY_DATAGRAM> notes;
+	auto resp_code = exmdb_response::success;
+	if (!batch) {
+		notes.emplace_back();
+		if (exmdb_ext_pull_db_notify(&bin, &notes.back()) != EXT_ERR_SUCCESS)
+			resp_code = exmdb_response::pull_error;
+	} else {
+		for (uint32_t off = 0; off < bin.cb; ) {
+			if (bin.cb - off < sizeof(uint32_t)) {
+				resp_code = exmdb_response::pull_error;
+				break;
+			}
+			BINARY sub;
+			sub.cb = le32p_to_cpu(&bin.pb[off]);
+			off += sizeof(uint32_t);
+			if (sub.cb > bin.cb - off) {
+				resp_code = exmdb_response::pull_error;
+				break;
+			}
+			sub.pb = &bin.pb[off];
+			off += sub.cb;
+			notes.emplace_back();
+			if (exmdb_ext_pull_db_notify(&sub, &notes.back()) != EXT_ERR_SUCCESS) {
+				resp_code = exmdb_response::pull_error;
+				break;
+			}
+		}
+	}
+	if (write(agent.sockd, &resp_code, 1) != 1)
+		return -1;
+	if (resp_code != exmdb_response::success)
+		return 0;
+	for (const auto &notify : notes)
+		for (size_t i = 0; i < notify.id_array.size(); ++i)
+			mdcl_event_proc(notify.dir, notify.b_table,
+				notify.id_array[i], &notify.db_notify);
+	return 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1329: ENOMEM");
+	return -1;
+}
+
 static int cl_notif_reader3(agent_thread &agent, pollfd &pfd,
-    uint8_t (&buff)[0x8000], uint32_t &buff_len, uint32_t &offset)
+    std::vector<uint8_t> &buff, uint32_t &buff_len, uint32_t &offset,
+    bool batch)
 {
 	if (poll(&pfd, 1, SOCKET_TIMEOUT * 1000) != 1)
 		return -1;
 	if (buff_len == 0) {
 		if (read(agent.sockd, &buff_len, sizeof(uint32_t)) != sizeof(uint32_t))
 			return -1;
+		buff_len = le32_to_cpu(buff_len);
 		/* ping packet */
 		if (buff_len == 0) {
 			auto resp_code = exmdb_response::success;
 			if (write(agent.sockd, &resp_code, 1) != 1)
 				return -1;
+		} else if (buff_len > buff.size()) {
+			try {
+				buff.resize(buff_len);
+			} catch (const std::bad_alloc &) {
+				return -1;
+			}
 		}
 		offset = 0;
 		return 0;
 	}
-	auto read_len = read(agent.sockd, buff + offset, buff_len - offset);
+	auto read_len = read(agent.sockd, &buff[offset], buff_len - offset);
 	if (read_len <= 0)
 		return -1;
 	offset += read_len;
@@ -288,25 +412,15 @@ static int cl_notif_reader3(agent_thread &agent, pollfd &pfd,
 	/* packet complete */
 	BINARY bin;
 	bin.cb = buff_len;
-	bin.pb = buff;
-	mdcl_build_env(*agent.pserver);
-	auto cl_0 = make_scope_exit([]() { if (mdcl_free_env != nullptr) mdcl_free_env(); });
-	DB_NOTIFY_DATAGRAM notify;
-	auto resp_code = exmdb_ext_pull_db_notify(&bin, &notify) == EXT_ERR_SUCCESS ?
-	                 exmdb_response::success : exmdb_response::pull_error;
-	if (write(agent.sockd, &resp_code, 1) != 1)
-		return -1;
-	if (resp_code == exmdb_response::success)
-		for (size_t i = 0; i < notify.id_array.size(); ++i)
-			mdcl_event_proc(notify.dir, notify.b_table,
-				notify.id_array[i], &notify.db_notify);
+	bin.pb = buff.data();
 	buff_len = 0;
-	return 0;
+	return cl_notif_dispatch(agent, bin, batch);
 }
 
 static void cl_notif_reader2(agent_thread &agent)
 {
-	agent.sockd = exmdb_client_connect_exmdb(*agent.pserver, true, "mdclntfy");
+	uint32_t flags = EXMDB_PROTO_NOTIFY_BATCH;
+	agent.sockd = exmdb_client_connect_exmdb(*agent.pserver, true, "mdclntfy", &flags);
 	if (agent.sockd < 0) {
 		sleep(1);
 		return;
@@ -315,8 +429,13 @@ static void cl_notif_reader2(agent_thread &agent)
 	agent.startup_cv.notify_one();
 	struct pollfd pfd = {agent.sockd, POLLIN | POLLPRI};
 	uint32_t buff_len = 0, offset = 0;
-	uint8_t buff[0x8000];
-	while (cl_notif_reader3(agent, pfd, buff, buff_len, offset) == 0)
+	std::vector<uint8_t> buff;
+	try {
+		buff.resize(0x8000);
+	} catch (const std::bad_alloc &) {
+	}
+	while (cl_notif_reader3(agent, pfd, buff, buff_len, offset,
+	       flags & EXMDB_PROTO_NOTIFY_BATCH) == 0)
 		/* */;
 	close(agent.sockd);
 	agent.sockd = -1;
@@ -498,12 +617,221 @@ static remote_conn_ref exmdb_client_get_connection(const char *dir)
 	return fc;
 }
 
-BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
+/**
+ * Receives responses for a multiplexed connection and hands them to the
+ * waiting callers. Keeps the connection alive with pings when idle.
+ */
+static void *cl_mux_reader(void *vargs)
+{
+	auto argp = static_cast<std::shared_ptr<mux_conn> *>(vargs);
+	auto mc = std::move(*argp);
+	delete argp;
+	struct pollfd pfd = {mc->sockd, POLLIN | POLLPRI};
+	static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
+	while (!mc->b_dead) {
+		auto ret = poll(&pfd, 1, (SOCKET_TIMEOUT - 3) / 2 * 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			/* Ping is a frame with empty PDU; req_id 0 is never waited on */
+			uint8_t ping[8];
+			cpu_to_le32p(&ping[0], sizeof(uint32_t));
+			cpu_to_le32p(&ping[4], 0);
+			std::lock_guard wr_hold(mc->wr_lock);
+			if (HXio_fullwrite(mc->sockd, ping, sizeof(ping)) != sizeof(ping))
+				break;
+			continue;
+		}
+		uint8_t hdr[9];
+		if (HXio_fullread(mc->sockd, hdr, sizeof(hdr)) != sizeof(hdr))
+			break;
+		auto code   = static_cast<exmdb_response>(hdr[0]);
+		auto len    = le32p_to_cpu(&hdr[1]);
+		auto req_id = le32p_to_cpu(&hdr[5]);
+		if (len < sizeof(uint32_t))
+			break;
+		len -= sizeof(uint32_t);
+		void *buf = nullptr;
+		if (len > 0) {
+			buf = malloc(len);
+			if (buf == nullptr)
+				break;
+			if (HXio_fullread(mc->sockd, buf, len) != len) {
+				free(buf);
+				break;
+			}
+		}
+		std::unique_lock pd_hold(mc->pend_lock);
+		auto it = mc->pending.find(req_id);
+		if (it == mc->pending.end()) {
+			/* Ping reply, or the caller gave up waiting */
+			pd_hold.unlock();
+			free(buf);
+			continue;
+		}
+		auto w = it->second;
+		mc->pending.erase(it);
+		w->code = code;
+		w->buf = buf;
+		w->bin.cb = len;
+		w->bin.pv = buf;
+		w->done = true;
+		w->cv.notify_one();
+	}
+	mc->b_dead = true;
+	shutdown(mc->sockd, SHUT_RDWR);
+	{
+		std::lock_guard pd_hold(mc->pend_lock);
+		for (auto &&[id, w] : mc->pending) {
+			w->done = true;
+			w->cv.notify_one();
+		}
+		mc->pending.clear();
+	}
+	std::lock_guard sv_hold(mdcl_server_lock);
+	if (!mdcl_notify_stop) {
+		/* Nobody is going to join us */
+		mc->thr_id = {};
+		pthread_detach(pthread_self());
+	}
+	return nullptr;
+}
+
+/**
+ * Pick (or establish) a multiplexed connection for @dir. Returns nullptr if
+ * the caller should fall back to lock-step mode. The connection attempt
+ * itself is made without mdcl_server_lock, so that an unreachable server
+ * does not hold up callers for other servers.
+ */
+static std::shared_ptr<mux_conn> exmdb_client_get_mux(const char *dir) try
+{
+	std::unique_lock sv_hold(mdcl_server_lock);
+	auto i = *dir == '\0' ? mdcl_server_list.begin() :
+	         std::find_if(mdcl_server_list.begin(), mdcl_server_list.end(),
+	         [&](const remote_svr &s) { return strncmp(dir, s.prefix.c_str(), s.prefix.size()) == 0; });
+	if (i == mdcl_server_list.end() || i->mux_unsupported)
+		return nullptr;
+	std::erase_if(i->mux_list, [](const std::shared_ptr<mux_conn> &m) { return m->b_dead.load(); });
+	std::shared_ptr<mux_conn> best;
+	size_t best_load = SIZE_MAX;
+	for (const auto &mc : i->mux_list) {
+		std::lock_guard pd_hold(mc->pend_lock);
+		if (mc->pending.size() < best_load) {
+			best = mc;
+			best_load = mc->pending.size();
+		}
+	}
+	if (best != nullptr && (best_load == 0 || i->mux_connecting > 0 ||
+	    i->mux_list.size() >= mdcl_mux_max))
+		return best;
+	if (i->active_handles >= mdcl_conn_max)
+		return best;
+	/* Reserve the slot, then connect unlocked */
+	++i->active_handles;
+	++i->mux_connecting;
+	sv_hold.unlock();
+	uint32_t flags = EXMDB_PROTO_MUX;
+	auto sockd = exmdb_client_connect_exmdb(*i, false, "mdcl", &flags);
+	sv_hold.lock();
+	--i->mux_connecting;
+	if (sockd < 0 || mdcl_notify_stop) {
+		if (sockd >= 0)
+			close(sockd);
+		--i->active_handles;
+		return best;
+	}
+	if (!(flags & EXMDB_PROTO_MUX)) {
+		/* Server only speaks lock-step; keep the socket for that. */
+		mlog(LV_INFO, "exmdb_client: [%s]:%hu does not offer multiplexing, using lock-step mode",
+		        i->host.c_str(), i->port);
+		i->mux_unsupported = true;
+		i->conn_list.emplace_back(&*i);
+		i->conn_list.back().sockd = sockd;
+		i->conn_list.back().last_time = time(nullptr);
+		return nullptr;
+	}
+	auto mc = std::make_shared<mux_conn>(&*i);
+	mc->sockd = sockd;
+	auto argp = new std::shared_ptr<mux_conn>(mc);
+	auto ret = pthread_create4(&mc->thr_id, nullptr, cl_mux_reader, argp);
+	if (ret != 0) {
+		delete argp;
+		mlog(LV_ERR, "E-1300: pthread_create: %s", strerror(ret));
+		return best;
+	}
+	pthread_setname_np(mc->thr_id, "exmdbcl/mux");
+	i->mux_list.push_back(mc);
+	if (mdcl_agent_list.size() < mdcl_threads_max)
+		launch_notify_listener(*i);
+	return mc;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1301: ENOMEM");
+	return nullptr;
+}
+
+static BOOL exmdb_client_do_mux_rpc(mux_conn &mc, BINARY &bin,
+    const exreq *rq, exresp *rsp) try
+{
+	mux_waiter w;
+	uint32_t req_id;
+	do {
+		req_id = mc.next_id++;
+	} while (req_id == 0);
+	std::unique_lock pd_hold(mc.pend_lock);
+	mc.pending.emplace(req_id, &w);
+	pd_hold.unlock();
+
+	/* Lock-step header is just the length; mux adds the req_id */
+	uint8_t hdr[8];
+	cpu_to_le32p(&hdr[0], bin.cb);
+	cpu_to_le32p(&hdr[4], req_id);
+	struct iovec iov[2] = {{hdr, sizeof(hdr)}, {bin.pb + sizeof(uint32_t), bin.cb - sizeof(uint32_t)}};
+	std::unique_lock wr_hold(mc.wr_lock);
+	auto ok = exmdb_client_writev_socket(mc.sockd, iov, std::size(iov), SOCKET_TIMEOUT * 1000);
+	wr_hold.unlock();
+	free(bin.pb);
+	bin.pb = nullptr;
+	pd_hold.lock();
+	if (!ok) {
+		mc.pending.erase(req_id);
+		/* Partial frame may have gone out; the stream is unusable now */
+		mc.b_dead = true;
+		shutdown(mc.sockd, SHUT_RDWR);
+		return false;
+	}
+	if (mdcl_rpc_timeout < 0) {
+		w.cv.wait(pd_hold, [&]() { return w.done; });
+	} else if (!w.cv.wait_for(pd_hold, std::chrono::milliseconds(mdcl_rpc_timeout),
+	    [&]() { return w.done; })) {
+		mc.pending.erase(req_id);
+		return false;
+	}
+	pd_hold.unlock();
+	auto cl_0 = make_scope_exit([&]() { free(w.buf); });
+	if (w.code != exmdb_response::success)
+		return false;
+	rsp->call_id = rq->call_id;
+	return exmdb_ext_pull_response(&w.bin, rsp) == EXT_ERR_SUCCESS ? TRUE : false;
+} catch (const std::bad_alloc &) {
+	free(bin.pb);
+	bin.pb = nullptr;
+	mlog(LV_ERR, "E-1302: ENOMEM");
+	return false;
+}
+
+static BOOL exmdb_client_do_rpc1(const exreq *rq, exresp *rsp)
 {
 	BINARY bin;
 
 	if (exmdb_ext_push_request(rq, &bin) != EXT_ERR_SUCCESS)
 		return false;
+	if (mdcl_mux_max > 0) {
+		auto mc = exmdb_client_get_mux(rq->dir);
+		if (mc != nullptr)
+			return exmdb_client_do_mux_rpc(*mc, bin, rq, rsp);
+	}
 	auto conn = exmdb_client_get_connection(rq->dir);
 	if (conn == nullptr || !exmdb_client_write_socket(conn->sockd,
 	    bin, SOCKET_TIMEOUT * 1000)) {
@@ -542,6 +870,65 @@ BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 	return ret == EXT_ERR_SUCCESS ? TRUE : false;
 }
 
+BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
+{
+	if (exmdb_client_do_rpc1(rq, rsp))
+		return TRUE;
+	/* The store may be gone or being replaced; refetch its names later */
+	exmdb_client_cache_forget(rq->dir);
+	return false;
+}
+
+BOOL (*exmdb_client_local_multi_call)(const char *, uint8_t, const BINARY_ARRAY *, BINARY_ARRAY *);
+
+/**
+ * Returns false if the batch as a whole could not be transferred. Otherwise,
+ * use ok() to inspect the outcome of the individual calls.
+ */
+BOOL exmdb_multi_call::exec()
+{
+	m_ok.assign(m_calls.size(), false);
+	if (m_calls.empty())
+		return TRUE;
+	std::vector<BINARY> reqs;
+	auto cl_0 = make_scope_exit([&]() {
+		for (auto &b : reqs)
+			free(b.pb - sizeof(uint32_t));
+	});
+	reqs.reserve(m_calls.size());
+	for (auto [q, r] : m_calls) {
+		q->dir = deconst(m_dir);
+		BINARY bin;
+		if (exmdb_ext_push_request(q, &bin) != EXT_ERR_SUCCESS)
+			return false;
+		/* Sub-requests go without the length field */
+		bin.pb += sizeof(uint32_t);
+		bin.cb -= sizeof(uint32_t);
+		reqs.push_back(bin);
+	}
+	BINARY_ARRAY in{static_cast<uint32_t>(reqs.size()), reqs.data()}, out{};
+	uint8_t flags = m_stop ? EXMDB_MULTI_STOP_ON_ERROR : 0;
+	BOOL b_private = false;
+	if (exmdb_client_local_multi_call != nullptr &&
+	    exmdb_client_is_local(m_dir, &b_private)) {
+		if (!exmdb_client_local_multi_call(m_dir, flags, &in, &out))
+			return false;
+	} else if (!exmdb_client_remote::multi_call(m_dir, flags, &in, &out)) {
+		return false;
+	}
+	for (size_t i = 0; i < out.count && i < m_calls.size(); ++i) {
+		auto bin = out.pbin[i];
+		if (bin.cb < 5 || bin.pb[0] != static_cast<uint8_t>(exmdb_response::success))
+			continue;
+		auto r = m_calls[i].second;
+		r->call_id = m_calls[i].first->call_id;
+		bin.pb += 5;
+		bin.cb -= 5;
+		m_ok[i] = exmdb_ext_pull_response(&bin, r) == EXT_ERR_SUCCESS;
+	}
+	return TRUE;
+}
+
 }
 
 #ifdef TEST1
@@ -1,11 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2024 grommunio GmbH
 // This file is part of Gromox.
+#include <cerrno>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <poll.h>
+#include <sys/uio.h>
 #include <type_traits>
 #include <unistd.h>
 #include <utility>
@@ -38,24 +40,40 @@ static pack_result exmdb_pull(EXT_PULL &x, exreq_connect &d)
 {
 	TRY(x.g_str(&d.prefix));
 	TRY(x.g_str(&d.remote_id));
-	return x.g_bool(&d.b_private);
+	TRY(x.g_bool(&d.b_private));
+	/* Feature flags are an optional trailer (older clients do not send it) */
+	d.proto_flags = 0;
+	if (x.m_data_size - x.m_offset >= sizeof(uint32_t))
+		TRY(x.g_uint32(&d.proto_flags));
+	return EXT_ERR_SUCCESS;
 }
 
 static pack_result exmdb_push(EXT_PUSH &x, const exreq_connect &d)
 {
 	TRY(x.p_str(d.prefix));
 	TRY(x.p_str(d.remote_id));
-	return x.p_bool(d.b_private);
+	TRY(x.p_bool(d.b_private));
+	/* Old servers ignore trailing bytes, so this is safe to always send */
+	if (d.proto_flags != 0)
+		TRY(x.p_uint32(d.proto_flags));
+	return EXT_ERR_SUCCESS;
 }
 
 static pack_result exmdb_pull(EXT_PULL &x, exreq_listen_notification &d)
 {
-	return x.g_str(&d.remote_id);
+	TRY(x.g_str(&d.remote_id));
+	d.proto_flags = 0;
+	if (x.m_data_size - x.m_offset >= sizeof(uint32_t))
+		TRY(x.g_uint32(&d.proto_flags));
+	return EXT_ERR_SUCCESS;
 }
 
 static pack_result exmdb_push(EXT_PUSH &x, const exreq_listen_notification &d)
 {
-	return x.p_str(d.remote_id);
+	TRY(x.p_str(d.remote_id));
+	if (d.proto_flags != 0)
+		TRY(x.p_uint32(d.proto_flags));
+	return EXT_ERR_SUCCESS;
 }
 
 static pack_result exmdb_pull(EXT_PULL &x, exreq_get_named_propids &d)
@@ -2244,6 +2262,99 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_recalc_store_size &d)
 	return x.p_uint32(d.flags);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exreq_multi_call &d)
+{
+	TRY(x.g_uint8(&d.flags));
+	d.reqs = cu_alloc<BINARY_ARRAY>();
+	if (d.reqs == nullptr)
+		return EXT_ERR_ALLOC;
+	return x.g_bin_a(d.reqs);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_multi_call &d)
+{
+	TRY(x.p_uint8(d.flags));
+	return x.p_bin_a(*d.reqs);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_read_instance_range &d)
+{
+	TRY(x.g_uint32(&d.instance_id));
+	TRY(x.g_uint32(&d.proptag));
+	TRY(x.g_uint32(&d.offset));
+	return x.g_uint32(&d.length);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_read_instance_range &d)
+{
+	TRY(x.p_uint32(d.instance_id));
+	TRY(x.p_uint32(d.proptag));
+	TRY(x.p_uint32(d.offset));
+	return x.p_uint32(d.length);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_get_search_progress &d)
+{
+	return x.g_uint64(&d.folder_id);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_get_search_progress &d)
+{
+	return x.p_uint64(d.folder_id);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_get_rpc_stats &d)
+{
+	TRY(x.g_uint32(&d.flags));
+	return x.g_uint32(&d.top_n);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_get_rpc_stats &d)
+{
+	TRY(x.p_uint32(d.flags));
+	return x.p_uint32(d.top_n);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_purge_datafiles_v2 &d)
+{
+	return x.g_uint32(&d.flags);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_purge_datafiles_v2 &d)
+{
+	return x.p_uint32(d.flags);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exreq_write_messages &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_nlscp(&d.cpid));
+	TRY(x.g_uint64(&d.folder_id));
+	TRY(x.g_uint32(&d.flags));
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		auto ctnt = cu_alloc<MESSAGE_CONTENT>();
+		if (ctnt == nullptr)
+			return EXT_ERR_ALLOC;
+		TRY(x.g_msgctnt(ctnt));
+		d.msgs.push_back(ctnt);
+	}
+	return EXT_ERR_SUCCESS;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_write_messages &d)
+{
+	TRY(x.p_uint32(d.cpid));
+	TRY(x.p_uint64(d.folder_id));
+	TRY(x.p_uint32(d.flags));
+	TRY(x.p_uint32(d.msgs.size()));
+	for (auto ctnt : d.msgs)
+		TRY(x.p_msgctnt(*ctnt));
+	return EXT_ERR_SUCCESS;
+}
+
 #define RQ_WITH_ARGS \
 	E(get_named_propids) \
 	E(get_named_propnames) \
@@ -2367,7 +2478,13 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_recalc_store_size &d)
 	E(autoreply_tsquery) \
 	E(autoreply_tsupdate) \
 	E(recalc_store_size) \
-	E(write_message_v2)
+	E(write_message_v2) \
+	E(multi_call) \
+	E(read_instance_range) \
+	E(get_search_progress) \
+	E(get_rpc_stats) \
+	E(purge_datafiles_v2) \
+	E(write_messages)
 
 /**
  * This uses *& because we do not know which request type we are going to get
@@ -2411,7 +2528,9 @@ pack_result exmdb_ext_pull_request(const BINARY *pbin_in,
 	case exmdb_callid::allocate_cn:
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
-	case exmdb_callid::purge_datafiles: {
+	case exmdb_callid::purge_datafiles:
+	case exmdb_callid::rebuild_fulltext:
+	case exmdb_callid::get_cache_stats: {
 		prequest = std::make_unique<exreq>();
 		xret = EXT_ERR_SUCCESS;
 		break;
@@ -2465,6 +2584,8 @@ pack_result exmdb_ext_push_request(const exreq *prequest, BINARY *pbin_out)
 	case exmdb_callid::vacuum:
 	case exmdb_callid::unload_store:
 	case exmdb_callid::purge_datafiles:
+	case exmdb_callid::rebuild_fulltext:
+	case exmdb_callid::get_cache_stats:
 		status = EXT_ERR_SUCCESS;
 		break;
 #define E(t) case exmdb_callid::t: status = exmdb_push(ext_push, *static_cast<const exreq_ ## t *>(prequest)); break;
@@ -3649,6 +3770,190 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_write_message_v2 &d)
 	return x.p_uint32(d.e_result);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exresp_multi_call &d)
+{
+	return x.g_bin_a(&d.rsps);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_multi_call &d)
+{
+	return x.p_bin_a(d.rsps);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_read_instance_range &d)
+{
+	TRY(x.g_bin(&d.data));
+	return x.g_uint32(&d.total_size);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_read_instance_range &d)
+{
+	TRY(x.p_bin(d.data));
+	return x.p_uint32(d.total_size);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_get_search_progress &d)
+{
+	TRY(x.g_uint32(&d.scanned));
+	return x.g_uint32(&d.total);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_get_search_progress &d)
+{
+	TRY(x.p_uint32(d.scanned));
+	return x.p_uint32(d.total);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_rebuild_fulltext &d)
+{
+	return x.g_uint32(&d.count);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_rebuild_fulltext &d)
+{
+	return x.p_uint32(d.count);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_get_cache_stats &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_uint64(&d.budget));
+	TRY(x.g_uint64(&d.total));
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		auto &e = d.entries.emplace_back();
+		TRY(x.g_str(&e.dir));
+		TRY(x.g_uint64(&e.mem_bytes));
+		TRY(x.g_uint32(&e.idle_secs));
+		TRY(x.g_uint32(&e.references));
+		TRY(x.g_uint32(&e.handles));
+		TRY(x.g_uint32(&e.tables));
+		TRY(x.g_uint32(&e.instances));
+		TRY(x.g_uint32(&e.dynamics));
+	}
+	return EXT_ERR_SUCCESS;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_get_cache_stats &d)
+{
+	TRY(x.p_uint64(d.budget));
+	TRY(x.p_uint64(d.total));
+	TRY(x.p_uint32(d.entries.size()));
+	for (const auto &e : d.entries) {
+		TRY(x.p_str(e.dir));
+		TRY(x.p_uint64(e.mem_bytes));
+		TRY(x.p_uint32(e.idle_secs));
+		TRY(x.p_uint32(e.references));
+		TRY(x.p_uint32(e.handles));
+		TRY(x.p_uint32(e.tables));
+		TRY(x.p_uint32(e.instances));
+		TRY(x.p_uint32(e.dynamics));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_get_rpc_stats &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		auto &e = d.calls.emplace_back();
+		uint32_t nbuckets = 0;
+		TRY(x.g_str(&e.name));
+		TRY(x.g_uint64(&e.calls));
+		TRY(x.g_uint64(&e.errors));
+		TRY(x.g_uint64(&e.total_us));
+		TRY(x.g_uint64(&e.max_us));
+		TRY(x.g_uint64(&e.bytes_in));
+		TRY(x.g_uint64(&e.bytes_out));
+		TRY(x.g_uint32(&nbuckets));
+		for (uint32_t j = 0; j < nbuckets; ++j)
+			TRY(x.g_uint64(&e.hist.emplace_back()));
+	}
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		auto &e = d.dirs.emplace_back();
+		TRY(x.g_str(&e.dir));
+		TRY(x.g_uint64(&e.calls));
+		TRY(x.g_uint64(&e.total_us));
+	}
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		auto &e = d.counters.emplace_back();
+		uint8_t gauge = 0;
+		TRY(x.g_str(&e.name));
+		TRY(x.g_uint64(&e.value));
+		TRY(x.g_uint8(&gauge));
+		e.gauge = gauge;
+	}
+	return EXT_ERR_SUCCESS;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_get_rpc_stats &d)
+{
+	TRY(x.p_uint32(d.calls.size()));
+	for (const auto &e : d.calls) {
+		TRY(x.p_str(e.name));
+		TRY(x.p_uint64(e.calls));
+		TRY(x.p_uint64(e.errors));
+		TRY(x.p_uint64(e.total_us));
+		TRY(x.p_uint64(e.max_us));
+		TRY(x.p_uint64(e.bytes_in));
+		TRY(x.p_uint64(e.bytes_out));
+		TRY(x.p_uint32(e.hist.size()));
+		for (auto v : e.hist)
+			TRY(x.p_uint64(v));
+	}
+	TRY(x.p_uint32(d.dirs.size()));
+	for (const auto &e : d.dirs) {
+		TRY(x.p_str(e.dir));
+		TRY(x.p_uint64(e.calls));
+		TRY(x.p_uint64(e.total_us));
+	}
+	TRY(x.p_uint32(d.counters.size()));
+	for (const auto &e : d.counters) {
+		TRY(x.p_str(e.name));
+		TRY(x.p_uint64(e.value));
+		TRY(x.p_uint8(e.gauge));
+	}
+	return EXT_ERR_SUCCESS;
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_purge_datafiles_v2 &d)
+{
+	TRY(x.g_uint64(&d.files));
+	return x.g_uint64(&d.bytes);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_purge_datafiles_v2 &d)
+{
+	TRY(x.p_uint64(d.files));
+	return x.p_uint64(d.bytes);
+}
+
+static pack_result exmdb_pull(EXT_PULL &x, exresp_write_messages &d) try
+{
+	uint32_t count = 0;
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i)
+		TRY(x.g_uint64(&d.outmids.emplace_back()));
+	return x.g_uint32(reinterpret_cast<uint32_t *>(&d.e_result));
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_write_messages &d)
+{
+	TRY(x.p_uint32(d.outmids.size()));
+	for (auto mid : d.outmids)
+		TRY(x.p_uint64(mid));
+	return x.p_uint32(d.e_result);
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3781,7 +4086,15 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_write_message_v2 &d)
 	E(get_public_folder_unread_count) \
 	E(store_eid_to_user) \
 	E(autoreply_tsquery) \
-	E(write_message_v2)
+	E(write_message_v2) \
+	E(multi_call) \
+	E(read_instance_range) \
+	E(get_search_progress) \
+	E(rebuild_fulltext) \
+	E(get_cache_stats) \
+	E(get_rpc_stats) \
+	E(purge_datafiles_v2) \
+	E(write_messages)
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 /*
@@ -4339,3 +4652,47 @@ BOOL exmdb_client_write_socket(int fd, const BINARY &bin, long timeout_ms)
 			return TRUE;
 	}
 }
+
+/**
+ * Write out a (multiplexed-mode) frame that is composed of multiple pieces,
+ * typically the frame header plus the PDU as produced by
+ * exmdb_ext_push_request/response. Using writev keeps header and body in one
+ * TCP segment where possible.
+ */
+BOOL exmdb_client_writev_socket(int fd, struct iovec *iov, unsigned int iovcnt,
+    long timeout_ms)
+{
+	if (fd < 0) {
+		errno = EBADF;
+		return false;
+	}
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT | POLLWRBAND;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			++iov;
+			--iovcnt;
+			continue;
+		}
+		if (poll(&pfd, 1, timeout_ms) != 1)
+			return false;
+		auto written_len = writev(fd, iov, iovcnt);
+		if (written_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			continue; /* non-blocking socket */
+		if (written_len <= 0)
+			return false;
+		size_t wz = written_len;
+		while (iovcnt > 0 && wz >= iov->iov_len) {
+			wz -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char *>(iov->iov_base) + wz;
+			iov->iov_len -= wz;
+		}
+	}
+	return TRUE;
+}
@@ -0,0 +1,345 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Named property mappings of remote stores, kept per process.
+ *
+ * Once a store has assigned a propid to a name, the pair does not change for
+ * the lifetime of the store, so get_named_propids/get_named_propnames can be
+ * answered locally. The first lookup for a store loads the complete mapping
+ * (get_all_named_propids + get_named_propnames); a request with any name or
+ * id that is not known yet goes to the server as usual, and its answer is
+ * added. Names that do not exist are not remembered, since another client
+ * may create them at any time.
+ *
+ * A store can be recreated under the same directory by another process
+ * (gromox-mkprivate -f), which this cache does not get to see. Each entry
+ * therefore remembers the store's PR_STORE_RECORD_KEY (the mailbox GUID,
+ * which is new for a recreated store) and compares it again once
+ * exmdb_client_propname_cache_recheck has passed. That interval is how long
+ * a stale mapping can be served after such a recreation, so it is kept
+ * short. An entry is also dropped as soon as a server answer contradicts one
+ * of its pairs, when any RPC for the store fails (it may be gone or in the
+ * middle of being replaced), and on unload_store issued through this
+ * library. Entries are reloaded after exmdb_client_propname_cache_ttl in any
+ * case.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <libHX/string.h>
+#include <gromox/clock.hpp>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/util.hpp>
+
+namespace gromox {
+
+namespace {
+
+struct nc_store {
+	time_point loaded;
+	std::atomic<time_point> used, verified;
+	std::string store_key;
+	std::unordered_map<std::string, propid_t> ids;
+	std::unordered_map<propid_t, PROPERTY_XNAME> names;
+};
+
+}
+
+static size_t nc_max_stores;
+static time_duration nc_ttl, nc_recheck;
+static std::unordered_map<std::string, std::shared_ptr<nc_store>> nc_stores;
+static std::shared_mutex nc_lock; /* protects nc_stores and the nc_store maps */
+
+static bool propname_to_packed(const PROPERTY_NAME &n, char *dst, size_t z)
+{
+	char guid[GUIDSTR_SIZE];
+	n.guid.to_str(guid, std::size(guid));
+	if (n.kind == MNID_ID)
+		snprintf(dst, z, "%s:lid:%u", guid, n.lid);
+	else if (n.kind == MNID_STRING && n.pname != nullptr)
+		snprintf(dst, z, "%s:name:%s", guid, n.pname);
+	else
+		return false;
+	HX_strlower(dst);
+	return true;
+}
+
+/**
+ * Returns false if a pair from a server answer disagrees with what @st has
+ * (meaning the store was recreated); adds it otherwise.
+ * Caller must hold nc_lock exclusively.
+ */
+static bool nc_merge(nc_store &st, const PROPERTY_NAME &name, propid_t id)
+{
+	char s[NP_STRBUF_SIZE];
+	if (!propname_to_packed(name, s, std::size(s))) {
+		/* Unknown id: only a problem if we know it */
+		return id == 0 || st.names.find(id) == st.names.end();
+	}
+	auto i = st.ids.find(s);
+	if (i != st.ids.end() && i->second != id)
+		return false;
+	if (id == 0)
+		return true;
+	auto n = st.names.find(id);
+	if (n != st.names.end()) {
+		char t[NP_STRBUF_SIZE];
+		if (!propname_to_packed(static_cast<PROPERTY_NAME>(n->second),
+		    t, std::size(t)) || strcmp(s, t) != 0)
+			return false;
+	}
+	st.ids.emplace(s, id);
+	st.names.emplace(id, name);
+	return true;
+}
+
+/* Caller must hold nc_lock exclusively. */
+static void nc_add(nc_store &st, const PROPERTY_NAME &name, propid_t id)
+{
+	char s[NP_STRBUF_SIZE];
+	if (id == 0 || !propname_to_packed(name, s, std::size(s)))
+		return;
+	st.ids.emplace(s, id);
+	st.names.emplace(id, name);
+}
+
+/* Caller must hold nc_lock exclusively. */
+static void nc_evict()
+{
+	while (nc_stores.size() >= nc_max_stores) {
+		auto victim = std::min_element(nc_stores.begin(), nc_stores.end(),
+		              [](const auto &a, const auto &b) {
+		              	return a.second->used.load() < b.second->used.load();
+		              });
+		nc_stores.erase(victim);
+	}
+}
+
+static bool nc_store_key(const char *dir, std::string &key)
+{
+	static constexpr proptag_t tags[] = {PR_STORE_RECORD_KEY};
+	exreq_get_store_properties q{};
+	exresp_get_store_properties r{};
+	PROPTAG_ARRAY pt = {std::size(tags), deconst(tags)};
+	q.call_id   = exmdb_callid::get_store_properties;
+	q.dir       = deconst(dir);
+	q.cpid      = CP_ACP;
+	q.pproptags = &pt;
+	if (!exmdb_client_do_rpc(&q, &r))
+		return false;
+	auto bin = r.propvals.get<const BINARY>(PR_STORE_RECORD_KEY);
+	if (bin == nullptr)
+		return false;
+	key.assign(bin->pc, bin->cb);
+	return true;
+}
+
+/**
+ * Returns the entry for @dir, loading the store's complete mapping if there
+ * is no fresh entry yet. nullptr if caching is off or loading failed.
+ */
+static std::shared_ptr<nc_store> nc_get(const char *dir) try
+{
+	if (nc_max_stores == 0)
+		return nullptr;
+	auto now = tp_now();
+	std::shared_ptr<nc_store> old;
+	{
+		std::shared_lock hold(nc_lock);
+		auto it = nc_stores.find(dir);
+		if (it != nc_stores.end() && (nc_ttl.count() == 0 ||
+		    now - it->second->loaded < nc_ttl)) {
+			it->second->used = now;
+			old = it->second;
+		}
+	}
+	std::string key;
+	if (old != nullptr) {
+		if (now - old->verified.load() < nc_recheck)
+			return old;
+		if (!nc_store_key(dir, key))
+			return nullptr;
+		if (key == old->store_key) {
+			old->verified = now;
+			return old;
+		}
+		/* Recreated behind our back; reload */
+	} else if (!nc_store_key(dir, key)) {
+		return nullptr;
+	}
+
+	exreq_get_all_named_propids aq{};
+	exresp_get_all_named_propids ar{};
+	aq.call_id = exmdb_callid::get_all_named_propids;
+	aq.dir = deconst(dir);
+	if (!exmdb_client_do_rpc(&aq, &ar) || ar.propids.size() > UINT16_MAX)
+		return nullptr;
+	exreq_get_named_propnames nq{};
+	exresp_get_named_propnames nr{};
+	nq.call_id = exmdb_callid::get_named_propnames;
+	nq.dir = deconst(dir);
+	nq.ppropids = std::move(ar.propids);
+	if (!nq.ppropids.empty() && (!exmdb_client_do_rpc(&nq, &nr) ||
+	    nr.propnames.count != nq.ppropids.size()))
+		return nullptr;
+
+	auto st = std::make_shared<nc_store>();
+	st->loaded    = now;
+	st->used      = now;
+	st->verified  = now;
+	st->store_key = std::move(key);
+	std::unique_lock hold(nc_lock);
+	for (size_t i = 0; i < nq.ppropids.size(); ++i)
+		nc_add(*st, nr.propnames.ppropname[i], nq.ppropids[i]);
+	auto it = nc_stores.find(dir);
+	if (it != nc_stores.end()) {
+		it->second = st;
+		return st;
+	}
+	nc_evict();
+	nc_stores.emplace(dir, st);
+	return st;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1367: ENOMEM");
+	return nullptr;
+}
+
+void exmdb_client_cache_init(size_t max_stores, time_duration ttl,
+    time_duration recheck)
+{
+	std::unique_lock hold(nc_lock);
+	nc_max_stores = max_stores;
+	nc_ttl = ttl;
+	nc_recheck = recheck;
+	nc_stores.clear();
+}
+
+void exmdb_client_cache_forget(const char *dir) try
+{
+	if (nc_max_stores == 0 || dir == nullptr)
+		return;
+	std::unique_lock hold(nc_lock);
+	nc_stores.erase(dir);
+} catch (const std::bad_alloc &) {
+}
+
+bool exmdb_client_cache_lookup(const exreq_get_named_propids &q,
+    exresp_get_named_propids &r) try
+{
+	if (q.ppropnames == nullptr || q.ppropnames->count == 0)
+		return false;
+	auto st = nc_get(q.dir);
+	if (st == nullptr)
+		return false;
+	PROPID_ARRAY ids(q.ppropnames->count);
+	std::shared_lock hold(nc_lock);
+	for (size_t i = 0; i < q.ppropnames->count; ++i) {
+		char s[NP_STRBUF_SIZE];
+		if (!propname_to_packed(q.ppropnames->ppropname[i], s, std::size(s)))
+			return false;
+		auto it = st->ids.find(s);
+		if (it == st->ids.end())
+			return false;
+		ids[i] = it->second;
+	}
+	r.propids = std::move(ids);
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+bool exmdb_client_cache_lookup(const exreq_get_named_propnames &q,
+    exresp_get_named_propnames &r)
+{
+	if (q.ppropids.empty() || q.ppropids.size() > UINT16_MAX)
+		return false;
+	auto st = nc_get(q.dir);
+	if (st == nullptr)
+		return false;
+	std::shared_lock hold(nc_lock);
+	for (auto id : q.ppropids)
+		if (st->names.find(id) == st->names.end())
+			return false;
+	/* Same allocator as exmdb_ext_pull_response would have used */
+	auto names = static_cast<PROPERTY_NAME *>(exmdb_rpc_alloc(sizeof(PROPERTY_NAME) * q.ppropids.size()));
+	if (names == nullptr)
+		return false;
+	for (size_t i = 0; i < q.ppropids.size(); ++i) {
+		auto &x = st->names.find(q.ppropids[i])->second;
+		auto &n = names[i];
+		n.kind  = x.kind;
+		n.guid  = x.guid;
+		n.lid   = x.lid;
+		n.pname = nullptr;
+		if (x.kind != MNID_STRING)
+			continue;
+		n.pname = static_cast<char *>(exmdb_rpc_alloc(x.name.size() + 1));
+		if (n.pname == nullptr)
+			return false;
+		memcpy(n.pname, x.name.c_str(), x.name.size() + 1);
+	}
+	r.propnames.count = q.ppropids.size();
+	r.propnames.ppropname = names;
+	return true;
+}
+
+bool exmdb_client_cache_lookup(const exreq &, exresp &)
+{
+	return false;
+}
+
+void exmdb_client_cache_update(const exreq_get_named_propids &q,
+    const exresp_get_named_propids &r) try
+{
+	if (nc_max_stores == 0 || q.ppropnames == nullptr ||
+	    r.propids.size() != q.ppropnames->count)
+		return;
+	std::unique_lock hold(nc_lock);
+	auto it = nc_stores.find(q.dir);
+	if (it == nc_stores.end())
+		return;
+	for (size_t i = 0; i < r.propids.size(); ++i) {
+		if (!nc_merge(*it->second, q.ppropnames->ppropname[i], r.propids[i])) {
+			nc_stores.erase(it);
+			return;
+		}
+	}
+} catch (const std::bad_alloc &) {
+}
+
+void exmdb_client_cache_update(const exreq_get_named_propnames &q,
+    const exresp_get_named_propnames &r) try
+{
+	if (nc_max_stores == 0 || r.propnames.count != q.ppropids.size())
+		return;
+	std::unique_lock hold(nc_lock);
+	auto it = nc_stores.find(q.dir);
+	if (it == nc_stores.end())
+		return;
+	for (size_t i = 0; i < r.propnames.count; ++i) {
+		if (!nc_merge(*it->second, r.propnames.ppropname[i], q.ppropids[i])) {
+			nc_stores.erase(it);
+			return;
+		}
+	}
+} catch (const std::bad_alloc &) {
+}
+
+/* unload_store: the store may be recreated before it is loaded again */
+void exmdb_client_cache_update(const exreq &q, const exresp &)
+{
+	exmdb_client_cache_forget(q.dir);
+}
+
+}
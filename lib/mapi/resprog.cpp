@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later WITH linking exception
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Restriction bytecode. Boolean structure becomes forward jumps with
+ * relative offsets: an AND is "child; JF end; child; JF end; child", an OR
+ * the same with JT. Every leaf sets the accumulator, so a jump to the end
+ * of a subexpression leaves its value in place for the enclosing one.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <strings.h>
+#include <vector>
+#include <gromox/mapidefs.h>
+#include <gromox/propval.hpp>
+#include <gromox/restriction.hpp>
+
+namespace gromox {
+
+/* insn::mode bit for str_content, next to the FL_* match level */
+static constexpr uint8_t MODE_ICASE = 0x80;
+
+static inline char ascii_lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/* strcasestr with a needle that is already in lowercase */
+static bool lc_substr(const char *h, const char *n, size_t nlen)
+{
+	if (nlen == 0)
+		return true;
+	for (; *h != '\0'; ++h) {
+		if (ascii_lower(*h) != n[0])
+			continue;
+		size_t k = 1;
+		while (k < nlen && h[k] != '\0' && ascii_lower(h[k]) == n[k])
+			++k;
+		if (k == nlen)
+			return true;
+		if (h[k] == '\0')
+			return false;
+	}
+	return false;
+}
+
+/* strncasecmp(h, n, nlen) == 0 with lowercase @n */
+static bool lc_prefix(const char *h, const char *n, size_t nlen)
+{
+	for (size_t k = 0; k < nlen; ++k)
+		if (h[k] == '\0' || ascii_lower(h[k]) != n[k])
+			return false;
+	return true;
+}
+
+uint16_t res_program::get_slot(uint32_t proptag, unsigned int flags)
+{
+	for (size_t i = 0; i < m_slots.size(); ++i)
+		if (m_slots[i].proptag == proptag && m_slots[i].flags == flags)
+			return i;
+	if (m_slots.size() >= UINT16_MAX) {
+		m_unsupported = true;
+		return 0;
+	}
+	m_slots.push_back({proptag, flags});
+	return m_slots.size() - 1;
+}
+
+/*
+ * Appends code for @r and returns state::code, or returns a constant
+ * without appending anything.
+ */
+res_program::state res_program::emit(const RESTRICTION &r)
+{
+	switch (r.rt) {
+	case RES_AND:
+	case RES_OR: {
+		bool is_and = r.rt == RES_AND;
+		auto absorb = is_and ? state::k_false : state::k_true;
+		auto start = m_code.size();
+		std::vector<size_t> jumps;
+		for (size_t i = 0; i < r.andor->count; ++i) {
+			auto k = emit(r.andor->pres[i]);
+			if (k == absorb) {
+				m_code.resize(start);
+				return absorb;
+			} else if (k != state::code) {
+				continue;
+			}
+			jumps.push_back(m_code.size());
+			m_code.push_back({is_and ? op::jf : op::jt});
+		}
+		if (jumps.empty())
+			return is_and ? state::k_true : state::k_false;
+		/* the last child needs no jump */
+		m_code.pop_back();
+		jumps.pop_back();
+		for (auto j : jumps)
+			m_code[j].arg = m_code.size() - j;
+		return state::code;
+	}
+	case RES_NOT: {
+		auto k = emit(r.xnot->res);
+		if (k == state::k_true)
+			return state::k_false;
+		else if (k == state::k_false)
+			return state::k_true;
+		m_code.push_back({op::inv});
+		return state::code;
+	}
+	case RES_CONTENT: {
+		auto &c = *r.cont;
+		if (!c.comparable())
+			return state::k_false;
+		insn i{op::content};
+		i.slot = get_slot(c.proptag, 0);
+		i.ref = &c;
+		auto type = PROP_TYPE(c.proptag);
+		auto level = c.fuzzy_level & 0xFFFF;
+		if ((type == PT_UNICODE || type == PT_STRING8) &&
+		    c.propval.pvalue != nullptr &&
+		    (level == FL_FULLSTRING || level == FL_SUBSTRING ||
+		    level == FL_PREFIX)) {
+			std::string s = static_cast<const char *>(c.propval.pvalue);
+			bool icase = c.fuzzy_level & (FL_IGNORECASE | FL_LOOSE);
+			if (icase)
+				std::transform(s.begin(), s.end(), s.begin(), ascii_lower);
+			i.code = op::str_content;
+			i.mode = level | (icase ? MODE_ICASE : 0);
+			i.arg = m_strs.size();
+			m_strs.push_back(std::move(s));
+		}
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_PROPERTY: {
+		auto &p = *r.prop;
+		if (!p.comparable())
+			return state::k_false;
+		insn i{p.proptag == PR_ANR && p.propval.pvalue != nullptr ?
+		       op::anr : op::property};
+		i.slot = get_slot(p.proptag, F_RELOP);
+		i.ref = &p;
+		if (i.code == op::anr) {
+			std::string s = static_cast<const char *>(p.propval.pvalue);
+			std::transform(s.begin(), s.end(), s.begin(), ascii_lower);
+			i.arg = m_strs.size();
+			m_strs.push_back(std::move(s));
+		}
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_PROPCOMPARE: {
+		auto &p = *r.pcmp;
+		if (!p.comparable())
+			return state::k_false;
+		insn i{op::propcmp};
+		i.slot = get_slot(p.proptag1, 0);
+		i.slot2 = get_slot(p.proptag2, 0);
+		i.ref = &p;
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_BITMASK: {
+		auto &b = *r.bm;
+		if (!b.comparable())
+			return state::k_false;
+		insn i{op::bitmask};
+		i.slot = get_slot(b.proptag, 0);
+		i.ref = &b;
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_SIZE: {
+		insn i{op::size};
+		i.slot = get_slot(r.size->proptag, 0);
+		i.ref = r.size;
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_EXIST: {
+		insn i{op::exist};
+		i.slot = get_slot(r.exist->proptag, 0);
+		m_code.push_back(std::move(i));
+		return state::code;
+	}
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (r.comment->pres == nullptr)
+			return state::k_true;
+		return emit(*r.comment->pres);
+	case RES_NULL:
+		return state::k_true;
+	case RES_SUBRESTRICTION:
+	case RES_COUNT:
+		m_unsupported = true;
+		return state::k_false;
+	default:
+		return state::k_false;
+	}
+}
+
+bool res_program::compile(const RESTRICTION &r) try
+{
+	m_code.clear();
+	m_slots.clear();
+	m_strs.clear();
+	m_unsupported = false;
+	m_state = emit(r);
+	if (!m_unsupported)
+		return true;
+	m_code.clear();
+	m_slots.clear();
+	m_strs.clear();
+	m_state = state::none;
+	return false;
+} catch (const std::bad_alloc &) {
+	m_state = state::none;
+	return false;
+}
+
+size_t res_program::mem_usage() const
+{
+	size_t z = m_code.capacity() * sizeof(insn) +
+	           m_slots.capacity() * sizeof(slot) +
+	           m_strs.capacity() * sizeof(std::string);
+	for (const auto &s : m_strs)
+		z += s.capacity();
+	return z;
+}
+
+bool res_program::eval(fetch_fn fetch, void *ctx) const
+{
+	if (m_state == state::k_true)
+		return true;
+	else if (m_state != state::code)
+		return false;
+	/* 0: not fetched yet, 1: have value, 2: fetch failed */
+	static constexpr size_t inline_slots = 16;
+	void *val_buf[inline_slots];
+	uint8_t st_buf[inline_slots]{};
+	std::vector<void *> val_vec;
+	std::vector<uint8_t> st_vec;
+	void **val = val_buf;
+	uint8_t *st = st_buf;
+	if (m_slots.size() > inline_slots) {
+		val_vec.resize(m_slots.size());
+		st_vec.resize(m_slots.size());
+		val = val_vec.data();
+		st = st_vec.data();
+	}
+	auto get = [&](uint16_t s, void *&v) {
+		if (st[s] == 0) {
+			val[s] = nullptr;
+			st[s] = fetch(ctx, m_slots[s].proptag, m_slots[s].flags, &val[s]) ? 1 : 2;
+		}
+		v = val[s];
+		return st[s] == 1;
+	};
+
+	bool acc = false;
+	void *v = nullptr, *v2 = nullptr;
+	for (size_t pc = 0; pc < m_code.size(); ++pc) {
+		auto &i = m_code[pc];
+		switch (i.code) {
+		case op::jf:
+			if (!acc)
+				pc += i.arg - 1;
+			break;
+		case op::jt:
+			if (acc)
+				pc += i.arg - 1;
+			break;
+		case op::inv:
+			acc = !acc;
+			break;
+		case op::str_content: {
+			if (!get(i.slot, v) || v == nullptr) {
+				acc = false;
+				break;
+			}
+			auto h = static_cast<const char *>(v);
+			auto &n = m_strs[i.arg];
+			bool icase = i.mode & MODE_ICASE;
+			switch (i.mode & ~MODE_ICASE) {
+			case FL_FULLSTRING:
+				acc = icase ? strcasecmp(h, n.c_str()) == 0 : strcmp(h, n.c_str()) == 0;
+				break;
+			case FL_SUBSTRING:
+				acc = icase ? lc_substr(h, n.c_str(), n.size()) :
+				      strstr(h, n.c_str()) != nullptr;
+				break;
+			default:
+				acc = icase ? lc_prefix(h, n.c_str(), n.size()) :
+				      strncmp(h, n.c_str(), n.size()) == 0;
+				break;
+			}
+			break;
+		}
+		case op::content:
+			acc = get(i.slot, v) &&
+			      static_cast<const RESTRICTION_CONTENT *>(i.ref)->eval(v);
+			break;
+		case op::property:
+			acc = get(i.slot, v) &&
+			      static_cast<const RESTRICTION_PROPERTY *>(i.ref)->eval(v);
+			break;
+		case op::anr:
+			if (!get(i.slot, v))
+				acc = false;
+			else if (v == nullptr)
+				acc = static_cast<const RESTRICTION_PROPERTY *>(i.ref)->eval(v);
+			else
+				acc = lc_substr(static_cast<const char *>(v),
+				      m_strs[i.arg].c_str(), m_strs[i.arg].size());
+			break;
+		case op::propcmp: {
+			auto &p = *static_cast<const RESTRICTION_PROPCOMPARE *>(i.ref);
+			acc = get(i.slot, v) && get(i.slot2, v2) &&
+			      propval_compare_relop_nullok(p.relop,
+			      PROP_TYPE(p.proptag1), v, v2);
+			break;
+		}
+		case op::bitmask:
+			acc = get(i.slot, v) &&
+			      static_cast<const RESTRICTION_BITMASK *>(i.ref)->eval(v);
+			break;
+		case op::size:
+			acc = get(i.slot, v) &&
+			      static_cast<const RESTRICTION_SIZE *>(i.ref)->eval(v);
+			break;
+		case op::exist:
+			acc = get(i.slot, v) && v != nullptr;
+			break;
+		}
+	}
+	return acc;
+}
+
+}
@@ -1159,6 +1159,68 @@ std::string zstd_decompress(std::string_view x)
 	return out;
 }
 
+namespace {
+
+/* Layout of the zstd "seekable format" trailer (contrib/seekable_format) */
+enum {
+	ZSKIP_MAGIC = 0x184D2A5E, ZSEEK_MAGIC = 0x8F92EAB1,
+	ZSEEK_FOOTER = 9, ZSEEK_ENTRY = 8, ZSEEK_CKSUM_FLAG = 0x80,
+};
+
+/* Uncompressed size of the independent frames written by gx_compress_tofd */
+static constexpr size_t ZFRAME_SIZE = 256 * 1024;
+
+}
+
+/**
+ * Parse the seek table at the end of @fd (if any) into @frames, with offsets
+ * filled in. Returns false for files without (or with a broken) seek table.
+ */
+static bool zstd_seek_table(int fd, uint64_t fsize,
+    std::vector<gx_zreader::frame> &frames) try
+{
+	char footer[ZSEEK_FOOTER];
+	if (fsize < 8 + ZSEEK_FOOTER || pread(fd, footer, sizeof(footer),
+	    fsize - sizeof(footer)) != sizeof(footer) ||
+	    le32p_to_cpu(&footer[5]) != ZSEEK_MAGIC)
+		return false;
+	uint64_t nframes = le32p_to_cpu(&footer[0]);
+	unsigned int esize = ZSEEK_ENTRY + (footer[4] & ZSEEK_CKSUM_FLAG ? 4 : 0);
+	uint64_t tblsize = 8 + nframes * esize + ZSEEK_FOOTER;
+	if (tblsize > fsize)
+		return false;
+	auto tbl = std::make_unique<char[]>(tblsize);
+	if (pread(fd, tbl.get(), tblsize, fsize - tblsize) !=
+	    static_cast<ssize_t>(tblsize) ||
+	    le32p_to_cpu(&tbl[0]) != ZSKIP_MAGIC ||
+	    le32p_to_cpu(&tbl[4]) != tblsize - 8)
+		return false;
+	frames.resize(nframes);
+	uint64_t c_off = 0, d_off = 0;
+	for (size_t i = 0; i < nframes; ++i) {
+		auto e = &tbl[8 + i * esize];
+		auto &f  = frames[i];
+		f.c_off  = c_off;
+		f.d_off  = d_off;
+		f.c_size = le32p_to_cpu(&e[0]);
+		f.d_size = le32p_to_cpu(&e[4]);
+		c_off += f.c_size;
+		d_off += f.d_size;
+	}
+	if (c_off + tblsize != fsize) {
+		frames.clear();
+		return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
+
+static uint64_t zstd_seek_total(const std::vector<gx_zreader::frame> &frames)
+{
+	return frames.empty() ? 0 : frames.back().d_off + frames.back().d_size;
+}
+
 size_t gx_decompressed_size(const char *infile)
 {
 	wrapfd fd(open(infile, O_RDONLY));
@@ -1167,6 +1229,9 @@ size_t gx_decompressed_size(const char *infile)
 	struct stat sb;
 	if (fstat(fd.get(), &sb) < 0 || !S_ISREG(sb.st_mode))
 		return 0;
+	std::vector<gx_zreader::frame> frames;
+	if (zstd_seek_table(fd.get(), sb.st_size, frames))
+		return std::min(zstd_seek_total(frames), static_cast<uint64_t>(SIZE_MAX - 1));
 	size_t inbufsize = ZSTD_DStreamInSize();
 	if (static_cast<unsigned long long>(sb.st_size) < inbufsize)
 		inbufsize = sb.st_size;
@@ -1215,7 +1280,10 @@ errno_t gx_decompress_file(const char *infile, BINARY &outbin,
 	auto rdret = read(fd.get(), inbuf.get(), inbufsize);
 	if (rdret < 0)
 		return errno;
-	auto outsize = ZSTD_getFrameContentSize(inbuf.get(), rdret);
+	std::vector<gx_zreader::frame> frames;
+	auto outsize = zstd_seek_table(fd.get(), sb.st_size, frames) ?
+	               zstd_seek_total(frames) :
+	               ZSTD_getFrameContentSize(inbuf.get(), rdret);
 	if (outsize == ZSTD_CONTENTSIZE_ERROR)
 		return EIO;
 	else if (outsize == ZSTD_CONTENTSIZE_UNKNOWN)
@@ -1276,7 +1344,13 @@ errno_t gx_decompress_file(const char *infile, BINARY &outbin,
 	return ENOMEM;
 }
 
-errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
+/**
+ * Content larger than one ZFRAME_SIZE is cut into independently compressed
+ * frames, followed by a seek table in a skippable frame, so that
+ * gx_zreader can get at any byte range by inflating only the frames that
+ * overlap it. Plain zstd decoders skip over the table.
+ */
+errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl) try
 {
 #ifdef HAVE_FSETXATTR
 	if (fsetxattr(fd, "btrfs.compression", "none", 4, XATTR_CREATE) != 0)
@@ -1284,9 +1358,42 @@ errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
 #endif
 
 	auto strm = ZSTD_createCStream();
+	if (strm == nullptr)
+		return ENOMEM;
 	auto cl_0 = make_scope_exit([&]() { ZSTD_freeCStream(strm); });
-	ZSTD_initCStream(strm, complvl == 0 ? ZSTD_minCLevel() : complvl);
+	ZSTD_CCtx_setParameter(strm, ZSTD_c_compressionLevel,
+		complvl == 0 ? ZSTD_minCLevel() : complvl);
 	ZSTD_CCtx_setParameter(strm, ZSTD_c_checksumFlag, 1);
+	if (inbuf.size() > ZFRAME_SIZE) {
+		auto outsize = ZSTD_compressBound(ZFRAME_SIZE);
+		auto outbuf = std::make_unique<char[]>(outsize);
+		std::string table;
+		table.resize(8);
+		for (size_t pos = 0; pos < inbuf.size(); pos += ZFRAME_SIZE) {
+			auto chunk = inbuf.substr(pos, ZFRAME_SIZE);
+			auto zr = ZSTD_compress2(strm, outbuf.get(), outsize,
+			          chunk.data(), chunk.size());
+			if (ZSTD_isError(zr))
+				return EIO;
+			if (HXio_fullwrite(fd, outbuf.get(), zr) < 0)
+				return EIO;
+			char ent[ZSEEK_ENTRY];
+			cpu_to_le32p(&ent[0], zr);
+			cpu_to_le32p(&ent[4], chunk.size());
+			table.append(ent, sizeof(ent));
+		}
+		char footer[ZSEEK_FOOTER];
+		cpu_to_le32p(&footer[0], (table.size() - 8) / ZSEEK_ENTRY);
+		footer[4] = 0;
+		cpu_to_le32p(&footer[5], ZSEEK_MAGIC);
+		table.append(footer, sizeof(footer));
+		cpu_to_le32p(&table[0], ZSKIP_MAGIC);
+		cpu_to_le32p(&table[4], table.size() - 8);
+		if (HXio_fullwrite(fd, table.data(), table.size()) < 0)
+			return EIO;
+		return 0;
+	}
+
 	ZSTD_CCtx_setPledgedSrcSize(strm, inbuf.size());
 	ZSTD_inBuffer inds = {inbuf.data(), inbuf.size()};
 	ZSTD_outBuffer outds{};
@@ -1313,6 +1420,8 @@ errno_t gx_compress_tofd(std::string_view inbuf, int fd, uint8_t complvl)
 			break;
 	}
 	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
 }
 
 errno_t gx_compress_tofile(std::string_view inbuf, const char *outfile,
@@ -1325,6 +1434,163 @@ errno_t gx_compress_tofile(std::string_view inbuf, const char *outfile,
 	return fd.close_wr();
 }
 
+gx_zreader::~gx_zreader()
+{
+	ZSTD_freeDStream(static_cast<ZSTD_DStream *>(m_dstream));
+}
+
+errno_t gx_zreader::open(const char *path, uint32_t skip) try
+{
+	m_fd = ::open(path, O_RDONLY);
+	if (m_fd.get() < 0)
+		return errno;
+	struct stat sb;
+	if (fstat(m_fd.get(), &sb) < 0)
+		return errno;
+	if (!S_ISREG(sb.st_mode))
+		return ENOENT;
+	m_plain = false;
+	m_seekable = true;
+	m_frames.clear();
+	char hdr[32];
+	auto ret = ::pread(m_fd.get(), hdr, sizeof(hdr), 0);
+	if (ret < 0)
+		return errno;
+	uint64_t total;
+	if (ret < 4 || le32p_to_cpu(hdr) != ZSTD_MAGICNUMBER) {
+		m_plain = true;
+		total = sb.st_size;
+	} else if (zstd_seek_table(m_fd.get(), sb.st_size, m_frames)) {
+		total = zstd_seek_total(m_frames);
+	} else {
+		/* Single frame from an older gx_compress_tofd */
+		total = ZSTD_getFrameContentSize(hdr, ret);
+		if (total == ZSTD_CONTENTSIZE_ERROR)
+			return EIO;
+		else if (total == ZSTD_CONTENTSIZE_UNKNOWN)
+			return EOPNOTSUPP;
+		m_seekable = total <= ZFRAME_SIZE;
+	}
+	if (total < skip)
+		return EIO;
+	m_skip = skip;
+	m_size = total - skip;
+	if (m_plain)
+		return 0;
+	if (m_dstream == nullptr) {
+		m_dstream = ZSTD_createDStream();
+		if (m_dstream == nullptr)
+			return ENOMEM;
+	}
+	if (m_in == nullptr)
+		m_in = std::make_unique<char[]>(ZSTD_DStreamInSize());
+	if (m_out == nullptr)
+		m_out = std::make_unique<char[]>(ZSTD_DStreamOutSize());
+	reposition(0);
+	return 0;
+} catch (const std::bad_alloc &) {
+	return ENOMEM;
+}
+
+/**
+ * Restart decompression at the beginning of the frame containing @off
+ * (raw content offset).
+ */
+void gx_zreader::reposition(uint64_t off)
+{
+	m_cpos = m_out_start = 0;
+	if (!m_frames.empty()) {
+		auto it = std::upper_bound(m_frames.cbegin(), m_frames.cend(), off,
+		          [](uint64_t v, const frame &f) { return v < f.d_off; });
+		--it;
+		m_cpos      = it->c_off;
+		m_out_start = it->d_off;
+	}
+	m_in_pos = m_in_len = m_out_len = 0;
+	ZSTD_DCtx_reset(static_cast<ZSTD_DStream *>(m_dstream), ZSTD_reset_session_only);
+}
+
+/**
+ * Replace the output window by the next piece of decompressed data.
+ */
+errno_t gx_zreader::next_chunk()
+{
+	auto strm = static_cast<ZSTD_DStream *>(m_dstream);
+	m_out_start += m_out_len;
+	m_out_len = 0;
+	ZSTD_outBuffer outds = {m_out.get(), ZSTD_DStreamOutSize(), 0};
+	while (outds.pos == 0) {
+		if (m_in_pos == m_in_len) {
+			auto ret = ::pread(m_fd.get(), m_in.get(), ZSTD_DStreamInSize(), m_cpos);
+			if (ret < 0)
+				return errno;
+			else if (ret == 0)
+				return EIO;
+			m_cpos  += ret;
+			m_in_pos = 0;
+			m_in_len = ret;
+		}
+		ZSTD_inBuffer inds = {m_in.get(), m_in_len, m_in_pos};
+		auto zr = ZSTD_decompressStream(strm, &outds, &inds);
+		m_in_pos = inds.pos;
+		if (ZSTD_isError(zr)) {
+			mlog(LV_ERR, "ZSTD_decompressStream: %s", ZSTD_getErrorName(zr));
+			return EIO;
+		}
+	}
+	m_out_len = outds.pos;
+	return 0;
+}
+
+/**
+ * Copy up to @len bytes of content starting at @off into @vbuf. *@got is
+ * short only when the end of the content was reached.
+ */
+errno_t gx_zreader::pread(void *vbuf, size_t len, uint64_t off, size_t *got)
+{
+	*got = 0;
+	if (off >= m_size)
+		return 0;
+	len = std::min(static_cast<uint64_t>(len), m_size - off);
+	off += m_skip;
+	auto buf = static_cast<char *>(vbuf);
+	if (m_plain) {
+		while (len > 0) {
+			auto ret = ::pread(m_fd.get(), buf, len, off);
+			if (ret < 0)
+				return errno;
+			else if (ret == 0)
+				return EIO;
+			buf  += ret;
+			off  += ret;
+			len  -= ret;
+			*got += ret;
+		}
+		return 0;
+	}
+	while (len > 0) {
+		auto out_end = m_out_start + m_out_len;
+		if (off >= m_out_start && off < out_end) {
+			size_t have = std::min(static_cast<uint64_t>(len), out_end - off);
+			memcpy(buf, &m_out[off - m_out_start], have);
+			buf  += have;
+			off  += have;
+			len  -= have;
+			*got += have;
+			continue;
+		}
+		if (off < m_out_start)
+			reposition(off);
+		else if (!m_frames.empty() && off - out_end >= ZFRAME_SIZE)
+			/* Skip frames that are not needed at all */
+			reposition(off);
+		auto err = next_chunk();
+		if (err != 0)
+			return err;
+	}
+	return 0;
+}
+
 namespace {
 
 struct iomembuf : public std::streambuf {
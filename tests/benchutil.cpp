@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+#include <cstdint>
+#include <string>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/paths.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/util.hpp>
+#include "benchutil.hpp"
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+
+namespace bench {
+
+thread_local alloc_context g_alloc_mgr;
+
+/**
+ * Set up exmdb_client with @conns connections per server. The caller is
+ * responsible for exmdb_client_stop.
+ */
+int client_run(unsigned int conns)
+{
+	exmdb_rpc_alloc = [](size_t z) { return g_alloc_mgr.alloc(z); };
+	exmdb_rpc_free = [](void *) {};
+	exmdb_client_init(conns, 0);
+	return exmdb_client_run(PKGSYSCONFDIR);
+}
+
+/**
+ * Create a generic folder below IPM_SUBTREE. Returns its ID, or 0 on failure
+ * (mostly because a folder of that name was left over by an earlier run).
+ */
+uint64_t make_folder(const char *dir, const char *name, const char *cls)
+{
+	static constexpr BINARY v_binzero = {0, {.pc = deconst("")}};
+	static constexpr uint32_t v_type = FOLDER_GENERIC;
+	uint64_t parent = rop_util_make_eid_ex(1, PRIVATE_FID_IPMSUBTREE), cn = 0;
+	if (!exmdb_client::allocate_cn(dir, &cn))
+		return 0;
+	TAGGED_PROPVAL pv[] = {
+		{PidTagParentFolderId, &parent},
+		{PR_DISPLAY_NAME, deconst(name)},
+		{PR_FOLDER_TYPE, deconst(&v_type)},
+		{PidTagChangeNumber, &cn},
+		{PR_CHANGE_KEY, deconst(&v_binzero)},
+		{PR_PREDECESSOR_CHANGE_LIST, deconst(&v_binzero)},
+		{PR_CONTAINER_CLASS, deconst(cls)},
+	};
+	TPROPVAL_ARRAY props = {std::size(pv), pv};
+	if (cls == nullptr)
+		--props.count;
+	uint64_t fid = 0;
+	ec_error_t err = ecSuccess;
+	if (!exmdb_client::create_folder(dir, CP_UTF8, &props, &fid, &err) ||
+	    err != ecSuccess)
+		return 0;
+	return fid;
+}
+
+void remove_folder(const char *dir, uint64_t fid)
+{
+	BOOL partial = false, done = false;
+	exmdb_client::empty_folder(dir, CP_UTF8, nullptr, fid,
+		DEL_MESSAGES | DEL_ASSOCIATED | DELETE_HARD_DELETE, &partial);
+	exmdb_client::delete_folder(dir, CP_UTF8, fid, TRUE, &done);
+}
+
+/**
+ * Write a synthetic mail into @fid and return its MID (0 on failure). @n
+ * makes the message vary. Without @full, only the envelope properties are
+ * set; with it, the message gets a plain-text body and one recipient, about
+ * the shape of what a delivery agent would write.
+ */
+uint64_t write_message(const char *dir, uint64_t fid, unsigned int n, bool full)
+{
+	static constexpr uint32_t v_flags = MSGFLAG_READ, v_imp = IMPORTANCE_NORMAL;
+	static constexpr uint32_t v_rtype = MAPI_TO;
+	auto subj = "Quarterly report, revision " + std::to_string(n);
+	auto msgid = "<" + std::to_string(n) + ".bench@example.com>";
+	std::string body;
+	if (full)
+		for (unsigned int i = 0; i < 16 + n % 96; ++i)
+			body += "The quick brown fox jumps over the lazy dog. Lorem ipsum dolor sit amet.\r\n";
+	uint64_t now = rop_util_current_nttime();
+	TAGGED_PROPVAL pv[] = {
+		{PR_MESSAGE_CLASS, deconst("IPM.Note")},
+		{PR_SUBJECT, deconst(subj.c_str())},
+		{PR_SENDER_NAME, deconst("Alice Example")},
+		{PR_SENDER_SMTP_ADDRESS, deconst("alice@example.com")},
+		{PR_SENT_REPRESENTING_NAME, deconst("Alice Example")},
+		{PR_DISPLAY_TO, deconst("Bob Example")},
+		{PR_INTERNET_MESSAGE_ID, deconst(msgid.c_str())},
+		{PR_IMPORTANCE, deconst(&v_imp)},
+		{PR_MESSAGE_FLAGS, deconst(&v_flags)},
+		{PR_CLIENT_SUBMIT_TIME, &now},
+		{PR_MESSAGE_DELIVERY_TIME, &now},
+		{PR_BODY, deconst(body.c_str())},
+	};
+	const TAGGED_PROPVAL rv[] = {
+		{PR_RECIPIENT_TYPE, deconst(&v_rtype)},
+		{PR_DISPLAY_NAME, deconst("Bob Example")},
+		{PR_ADDRTYPE, deconst("SMTP")},
+		{PR_EMAIL_ADDRESS, deconst("bob@example.com")},
+		{PR_SMTP_ADDRESS, deconst("bob@example.com")},
+	};
+	TPROPVAL_ARRAY rcpt = {std::size(rv), deconst(rv)};
+	TPROPVAL_ARRAY *rcpt_list[] = {&rcpt};
+	TARRAY_SET rcpts = {std::size(rcpt_list), rcpt_list};
+	MESSAGE_CONTENT ct{};
+	ct.proplist = {std::size(pv), pv};
+	if (full)
+		ct.children.prcpts = &rcpts;
+	else
+		--ct.proplist.count; /* no PR_BODY */
+	uint64_t mid = 0, cn = 0;
+	ec_error_t err = ecSuccess;
+	if (!exmdb_client::write_message_v2(dir, CP_UTF8, fid, &ct, &mid,
+	    &cn, &err) || err != ecSuccess)
+		return 0;
+	return mid;
+}
+
+}
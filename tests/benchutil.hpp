@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <gromox/util.hpp>
+
+/*
+ * Fixture shared by the exmdb benchmarks: scratch folders under the IPM
+ * subtree, synthetic messages, and the exmdb_client setup.
+ */
+namespace bench {
+
+/* Backs exmdb_rpc_alloc; clear it after every few RPCs */
+extern thread_local alloc_context g_alloc_mgr;
+
+extern int client_run(unsigned int conns);
+extern uint64_t make_folder(const char *dir, const char *name, const char *cls = nullptr);
+extern void remove_folder(const char *dir, uint64_t fid);
+extern uint64_t write_message(const char *dir, uint64_t fid, unsigned int n, bool full = false);
+
+}
@@ -1,9 +1,11 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <gromox/mapidefs.h>
 #include <gromox/fileio.h>
 #include <gromox/util.hpp>
@@ -13,6 +15,7 @@ using namespace gromox;
 [[noreturn]] static void usage()
 {
 	fprintf(stderr, "Usage: test -d x.zst\n");
+	fprintf(stderr, "       test -r x.zst offset length >out\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -56,12 +59,40 @@ static int detsize(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int ranged(int argc, char **argv)
+{
+	if (argc < 4)
+		usage();
+	gx_zreader rd;
+	auto ret = rd.open(argv[1]);
+	if (ret != 0) {
+		fprintf(stderr, "gx_zreader::open %s: %s\n", argv[1], strerror(ret));
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Uncompressed size: %llu%s\n",
+		static_cast<unsigned long long>(rd.size()),
+		rd.seekable() ? "" : " (no seek table)");
+	uint64_t off = strtoull(argv[2], nullptr, 0);
+	size_t len = strtoul(argv[3], nullptr, 0);
+	auto buf = std::make_unique<char[]>(len);
+	size_t got = 0;
+	ret = rd.pread(buf.get(), len, off, &got);
+	if (ret != 0) {
+		fprintf(stderr, "gx_zreader::pread: %s\n", strerror(ret));
+		return EXIT_FAILURE;
+	}
+	fwrite(buf.get(), got, 1, stdout);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	if (argc < 2)
 		usage();
 	if (strcmp(argv[1], "-d") == 0)
 		return decomp(argc - 1, argv + 1);
+	if (strcmp(argv[1], "-r") == 0)
+		return ranged(argc - 1, argv + 1);
 	if (strcmp(argv[1], "-s") == 0)
 		return detsize(argc - 1, argv + 1);
 	if (strcmp(argv[1], "-z") == 0)
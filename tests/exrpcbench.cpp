@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * exmdb load generator.
+ *
+ * Fills scratch folders in one or more private stores with synthetic mail,
+ * then drives a weighted mix of RPCs against them from a number of threads
+ * over TCP, and reports throughput and latency percentiles per operation.
+ *
+ * The operations that were issued can be written to a log (-w), and such a
+ * log can be replayed (-r): the replay recreates the same folder layout and
+ * issues the same operations with the same arguments, which makes runs
+ * comparable across releases on the same hardware. Operations refer to
+ * folders and messages by index, not by ID, so that a log stays valid
+ * against freshly populated stores. The log records which thread issued an
+ * operation, and the replay runs one thread per recorded thread, each with
+ * its own operations in their original order; moves depend on what the same
+ * thread wrote before, so this is what keeps them reproducible.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <libHX/option.h>
+#include <libHX/proc.h>
+#include <libHX/string.h>
+#include <gromox/element_data.hpp>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/fileio.h>
+#include <gromox/mapidefs.h>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "benchutil.hpp"
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+using bench::g_alloc_mgr;
+using LLU = unsigned long long;
+static constexpr int EXIT_PARAM = 2;
+
+namespace {
+
+enum class op : uint8_t { query, read, write, sync, move };
+static constexpr const char *op_names[] = {"query", "read", "write", "sync", "move"};
+static constexpr size_t op_count = std::size(op_names);
+
+/* One operation as issued or replayed; folder/message by index */
+struct action {
+	op o = op::query;
+	uint16_t store = 0, folder = 0;
+	uint32_t arg = 0; /* query: row, read: message, move: destination folder */
+};
+
+struct store {
+	std::string dir;
+	std::vector<uint64_t> fids;
+	std::vector<std::vector<uint64_t>> mids; /* populated messages, per folder */
+};
+
+struct op_stats {
+	uint64_t errors = 0;
+	std::vector<uint32_t> lat_us;
+};
+
+}
+
+static unsigned int g_folders = 4, g_messages = 500, g_threads = 8;
+static unsigned int g_seconds = 30, g_keep;
+static char *g_mix, *g_mkprivate, *g_logfile, *g_replayfile;
+static std::vector<store> g_stores;
+static unsigned int g_weights[op_count] = {30, 30, 15, 15, 10};
+static std::atomic<bool> g_stop{false};
+static FILE *g_log;
+static std::mutex g_log_lock, g_stats_lock;
+static std::vector<std::vector<action>> g_replay; /* per thread */
+static op_stats g_stats[op_count];
+
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'F', HXTYPE_UINT, &g_folders, {}, {}, 0, "Scratch folders per store (default: 4)", "N"},
+	{nullptr, 'M', HXTYPE_STRING, &g_mkprivate, {}, {}, 0, "Recreate the stores with gromox-mkprivate first (one user per maildir)", "USER[,...]"},
+	{nullptr, 'T', HXTYPE_UINT, &g_seconds, {}, {}, 0, "Duration of the synthetic run (default: 30)", "SECONDS"},
+	{nullptr, 'k', HXTYPE_NONE, &g_keep, {}, {}, 0, "Keep the scratch folders afterwards"},
+	{nullptr, 'm', HXTYPE_UINT, &g_messages, {}, {}, 0, "Messages per folder (default: 500)", "N"},
+	{nullptr, 'r', HXTYPE_STRING, &g_replayfile, {}, {}, 0, "Replay an operation log instead of a synthetic mix", "FILE"},
+	{nullptr, 't', HXTYPE_UINT, &g_threads, {}, {}, 0, "Client threads (default: 8; replay: as recorded)", "N"},
+	{nullptr, 'w', HXTYPE_STRING, &g_logfile, {}, {}, 0, "Write issued operations to a log", "FILE"},
+	{nullptr, 'x', HXTYPE_STRING, &g_mix, {}, {}, 0, "Operation weights (default: query=30,read=30,write=15,sync=15,move=10)", "OP=W[,...]"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static bool parse_mix(const char *s)
+{
+	std::fill(std::begin(g_weights), std::end(g_weights), 0);
+	std::unique_ptr<char[], stdlib_delete> dup(strdup(s));
+	if (dup == nullptr)
+		return false;
+	char *save = nullptr;
+	for (auto tok = strtok_r(dup.get(), ",", &save); tok != nullptr;
+	     tok = strtok_r(nullptr, ",", &save)) {
+		auto eq = strchr(tok, '=');
+		if (eq == nullptr)
+			return false;
+		*eq++ = '\0';
+		auto it = std::find_if(std::begin(op_names), std::end(op_names),
+		          [&](const char *n) { return strcmp(n, tok) == 0; });
+		if (it == std::end(op_names)) {
+			fprintf(stderr, "Unknown operation \"%s\"\n", tok);
+			return false;
+		}
+		g_weights[it - std::begin(op_names)] = strtoul(eq, nullptr, 0);
+	}
+	return std::any_of(std::begin(g_weights), std::end(g_weights),
+	       [](unsigned int w) { return w > 0; });
+}
+
+static bool mkprivate(const std::vector<std::string> &users)
+{
+	for (size_t i = 0; i < users.size(); ++i) {
+		/* Get the old files out of exmdb_provider's hands */
+		exmdb_client::unload_store(g_stores[i].dir.c_str());
+		const char *const argv[] = {"gromox-mkprivate", "-f", users[i].c_str(), nullptr};
+		auto ret = HXproc_run_sync(argv, HXPROC_VERBOSE);
+		if (ret != 0) {
+			fprintf(stderr, "gromox-mkprivate %s: exit status %d\n",
+				users[i].c_str(), ret);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool setup()
+{
+	for (auto &st : g_stores) {
+		auto dir = st.dir.c_str();
+		for (unsigned int f = 0; f < g_folders; ++f) {
+			auto name = "exrpcbench-" + std::to_string(f);
+			auto fid = bench::make_folder(dir, name.c_str(), "IPF.Note");
+			if (fid == 0) {
+				fprintf(stderr, "%s: create_folder failed (left-over folder \"exrpcbench-%u\"?)\n", dir, f);
+				return false;
+			}
+			st.fids.push_back(fid);
+			auto &mids = st.mids.emplace_back();
+			for (unsigned int i = 0; i < g_messages; ++i) {
+				auto mid = bench::write_message(dir, fid, f * g_messages + i, true);
+				if (mid == 0) {
+					fprintf(stderr, "%s: write_message failed\n", dir);
+					return false;
+				}
+				mids.push_back(mid);
+				if (i % 1024 == 0)
+					g_alloc_mgr.clear();
+			}
+			g_alloc_mgr.clear();
+		}
+		fprintf(stderr, "%s: %u folders with %u messages each\n", dir,
+			g_folders, g_messages);
+	}
+	return true;
+}
+
+static void cleanup()
+{
+	for (const auto &st : g_stores)
+		for (auto fid : st.fids)
+			bench::remove_folder(st.dir.c_str(), fid);
+}
+
+/* Per-thread state: content tables, messages this thread wrote */
+struct worker {
+	std::map<std::pair<unsigned int, unsigned int>, std::pair<uint32_t, uint32_t>> tables;
+	std::map<std::pair<unsigned int, unsigned int>, std::vector<uint64_t>> own_mids;
+	unsigned int serial = 0;
+	op_stats stats[op_count];
+
+	op resolve(const action &) const;
+	bool run(const action &);
+	bool query(const action &);
+	bool write(const action &);
+	bool move(const action &);
+	void unload();
+};
+
+bool worker::query(const action &a)
+{
+	static constexpr uint32_t tags[] = {
+		PidTagMid, PR_SUBJECT, PR_SENDER_NAME, PR_MESSAGE_DELIVERY_TIME,
+		PR_MESSAGE_SIZE, PR_MESSAGE_FLAGS, PR_IMPORTANCE,
+	};
+	static constexpr PROPTAG_ARRAY ptags = {std::size(tags), deconst(tags)};
+	auto &st = g_stores[a.store];
+	auto &t = tables[{a.store, a.folder}];
+	if (t.first == 0 &&
+	    !exmdb_client::load_content_table(st.dir.c_str(), CP_UTF8,
+	    st.fids[a.folder], nullptr, 0, nullptr, nullptr, &t.first, &t.second))
+		return false;
+	TARRAY_SET set{};
+	return exmdb_client::query_table(st.dir.c_str(), nullptr, CP_UTF8,
+	       t.first, &ptags, t.second > 0 ? a.arg % t.second : 0, 50, &set);
+}
+
+bool worker::write(const action &a)
+{
+	auto &st = g_stores[a.store];
+	auto mid = bench::write_message(st.dir.c_str(), st.fids[a.folder], ++serial, true);
+	if (mid == 0)
+		return false;
+	own_mids[{a.store, a.folder}].push_back(mid);
+	return true;
+}
+
+/*
+ * Moves give messages new IDs, so only messages that this thread wrote
+ * itself are moved (and forgotten), never the populated ones that other
+ * operations refer to by index. The most recently written ones go first.
+ */
+bool worker::move(const action &a)
+{
+	auto &st = g_stores[a.store];
+	auto &own = own_mids[{a.store, a.folder}];
+	if (own.empty())
+		return false;
+	auto n = std::min<size_t>(own.size(), 5);
+	std::vector<uint64_t> ids(own.end() - n, own.end());
+	own.resize(own.size() - n);
+	const EID_ARRAY eids = {static_cast<uint32_t>(ids.size()), ids.data()};
+	BOOL partial = false;
+	return exmdb_client::movecopy_messages(st.dir.c_str(), CP_UTF8, false,
+	       nullptr, st.fids[a.folder], st.fids[a.arg % st.fids.size()],
+	       false, &eids, &partial);
+}
+
+/* A move with nothing to move is carried out (and accounted) as a write. */
+op worker::resolve(const action &a) const
+{
+	if (a.o != op::move)
+		return a.o;
+	auto it = own_mids.find({a.store, a.folder});
+	return it == own_mids.end() || it->second.empty() ? op::write : op::move;
+}
+
+bool worker::run(const action &a)
+{
+	auto &st = g_stores[a.store];
+	switch (a.o) {
+	case op::query:
+		return query(a);
+	case op::read: {
+		auto &mids = st.mids[a.folder];
+		MESSAGE_CONTENT *ct = nullptr;
+		return exmdb_client::read_message(st.dir.c_str(), nullptr, CP_UTF8,
+		       mids[a.arg % mids.size()], &ct);
+	}
+	case op::write:
+		return write(a);
+	case op::sync: {
+		auto given = idset::create(idset::type::id_loose);
+		auto seen = idset::create(idset::type::id_loose);
+		auto read = idset::create(idset::type::id_loose);
+		if (given == nullptr || seen == nullptr || read == nullptr)
+			return false;
+		uint32_t fai_count = 0, normal_count = 0;
+		uint64_t fai_total = 0, normal_total = 0, last_cn = 0, last_readcn = 0;
+		EID_ARRAY updated{}, chg{}, given_mids{}, deleted{}, nolonger{}, read_mids{}, unread_mids{};
+		return exmdb_client::get_content_sync(st.dir.c_str(),
+		       st.fids[a.folder], nullptr, given.get(), seen.get(),
+		       nullptr, read.get(), CP_UTF8, nullptr, false, &fai_count,
+		       &fai_total, &normal_count, &normal_total, &updated, &chg,
+		       &last_cn, &given_mids, &deleted, &nolonger, &read_mids,
+		       &unread_mids, &last_readcn);
+	}
+	case op::move:
+		return move(a);
+	}
+	return false;
+}
+
+void worker::unload()
+{
+	for (const auto &[k, t] : tables)
+		if (t.first != 0)
+			exmdb_client::unload_table(g_stores[k.first].dir.c_str(), t.first);
+	tables.clear();
+}
+
+static void log_action(unsigned int thread, const action &a)
+{
+	std::lock_guard lk(g_log_lock);
+	fprintf(g_log, "%s %u %u %u %u\n", op_names[static_cast<unsigned int>(a.o)],
+		thread, a.store, a.folder, a.arg);
+}
+
+static void work(unsigned int idx)
+{
+	worker w;
+	std::mt19937 rng(idx);
+	std::discrete_distribution<unsigned int> pick(std::begin(g_weights), std::end(g_weights));
+	for (size_t pos = 0; !g_stop; ++pos) {
+		action a;
+		if (g_replayfile != nullptr) {
+			if (pos >= g_replay[idx].size())
+				break;
+			a = g_replay[idx][pos];
+			a.o = w.resolve(a);
+		} else {
+			a.o      = static_cast<op>(pick(rng));
+			a.store  = rng() % g_stores.size();
+			a.folder = rng() % g_folders;
+			a.arg    = a.o == op::move ? (a.folder + 1) % g_folders : rng();
+			a.o      = w.resolve(a);
+			if (g_log != nullptr)
+				log_action(idx, a);
+		}
+		auto t0 = std::chrono::steady_clock::now();
+		auto ok = w.run(a);
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		auto &s = w.stats[static_cast<unsigned int>(a.o)];
+		if (ok)
+			s.lat_us.push_back(std::min<int64_t>(us, UINT32_MAX));
+		else
+			++s.errors;
+		g_alloc_mgr.clear();
+	}
+	w.unload();
+	std::lock_guard lk(g_stats_lock);
+	for (size_t i = 0; i < op_count; ++i) {
+		g_stats[i].errors += w.stats[i].errors;
+		g_stats[i].lat_us.insert(g_stats[i].lat_us.end(),
+			w.stats[i].lat_us.begin(), w.stats[i].lat_us.end());
+	}
+}
+
+static bool load_replay(const char *file)
+{
+	std::unique_ptr<FILE, file_deleter> fp(fopen(file, "r"));
+	if (fp == nullptr) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return false;
+	}
+	char line[128], name[16];
+	unsigned int nstores = 0, t = 0, s = 0, f = 0, arg = 0;
+	if (fgets(line, sizeof(line), fp.get()) == nullptr ||
+	    sscanf(line, "setup %u %u %u %u", &nstores, &g_folders,
+	    &g_messages, &g_threads) != 4 ||
+	    g_folders == 0 || g_messages == 0 || g_threads == 0) {
+		fprintf(stderr, "%s: no setup line\n", file);
+		return false;
+	}
+	if (nstores > g_stores.size()) {
+		fprintf(stderr, "%s: log is for %u stores, but only %zu given\n",
+			file, nstores, g_stores.size());
+		return false;
+	}
+	g_stores.resize(nstores);
+	g_replay.resize(g_threads);
+	while (fgets(line, sizeof(line), fp.get()) != nullptr) {
+		if (sscanf(line, "%15s %u %u %u %u", name, &t, &s, &f, &arg) != 5)
+			continue;
+		auto it = std::find_if(std::begin(op_names), std::end(op_names),
+		          [&](const char *n) { return strcmp(n, name) == 0; });
+		if (it == std::end(op_names) || t >= g_threads ||
+		    s >= nstores || f >= g_folders)
+			continue;
+		g_replay[t].push_back({static_cast<op>(it - std::begin(op_names)),
+			static_cast<uint16_t>(s), static_cast<uint16_t>(f), arg});
+	}
+	return true;
+}
+
+static void report(double secs)
+{
+	uint64_t total = 0;
+	printf("%-6s %10s %8s %10s %10s %10s %10s\n", "OP", "CALLS", "ERR",
+		"OPS/s", "P50(ms)", "P99(ms)", "MAX(ms)");
+	for (size_t i = 0; i < op_count; ++i) {
+		auto &l = g_stats[i].lat_us;
+		if (l.empty() && g_stats[i].errors == 0)
+			continue;
+		std::sort(l.begin(), l.end());
+		auto pct = [&](double q) { return l.empty() ? 0 : l[std::min<size_t>(l.size() * q, l.size() - 1)] / 1000.0; };
+		printf("%-6s %10zu %8llu %10.1f %10.3f %10.3f %10.3f\n", op_names[i],
+			l.size(), LLU{g_stats[i].errors}, l.size() / secs,
+			pct(0.50), pct(0.99), l.empty() ? 0 : l.back() / 1000.0);
+		total += l.size();
+	}
+	printf("%-6s %10llu %8s %10.1f  (%.1f s, %u threads)\n", "total",
+		LLU{total}, "", total / secs, secs, g_threads);
+}
+
+int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_PARAM;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s [options] maildir...\n", argv[0]);
+		return EXIT_PARAM;
+	}
+	for (int i = 1; i < argc; ++i)
+		g_stores.push_back({argv[i]});
+	if (g_mix != nullptr && !parse_mix(g_mix)) {
+		fprintf(stderr, "Invalid -x argument\n");
+		return EXIT_PARAM;
+	}
+	if (g_replayfile != nullptr && !load_replay(g_replayfile))
+		return EXIT_FAILURE;
+	if (g_threads == 0 || g_folders == 0 || g_messages == 0 ||
+	    g_folders > UINT16_MAX || g_stores.size() > UINT16_MAX) {
+		fprintf(stderr, "Invalid -t/-F/-m argument\n");
+		return EXIT_PARAM;
+	}
+	auto cl_1 = make_scope_exit(exmdb_client_stop);
+	if (bench::client_run(g_threads + 1) != 0)
+		return EXIT_FAILURE;
+
+	if (g_mkprivate != nullptr) {
+		std::vector<std::string> users = gx_split(g_mkprivate, ',');
+		if (users.size() != g_stores.size()) {
+			fprintf(stderr, "-M needs one user per maildir\n");
+			return EXIT_PARAM;
+		}
+		if (!mkprivate(users))
+			return EXIT_FAILURE;
+	}
+	auto cl_2 = make_scope_exit([]() { if (!g_keep) cleanup(); });
+	if (!setup())
+		return EXIT_FAILURE;
+
+	std::unique_ptr<FILE, file_deleter> logfp;
+	if (g_logfile != nullptr && g_replayfile == nullptr) {
+		logfp.reset(fopen(g_logfile, "w"));
+		if (logfp == nullptr) {
+			fprintf(stderr, "%s: %s\n", g_logfile, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		g_log = logfp.get();
+		fprintf(g_log, "setup %zu %u %u %u\n", g_stores.size(),
+			g_folders, g_messages, g_threads);
+	}
+	std::vector<std::thread> thr;
+	auto t0 = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < g_threads; ++i)
+		thr.emplace_back(work, i);
+	if (g_replayfile == nullptr) {
+		std::this_thread::sleep_for(std::chrono::seconds(g_seconds));
+		g_stop = true;
+	}
+	for (auto &t : thr)
+		t.join();
+	g_log = nullptr;
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - t0;
+	report(d.count());
+	return EXIT_SUCCESS;
+}
@@ -53,6 +53,23 @@ static int t_2209(const char *dir)
 	return EXIT_SUCCESS;
 }
 
+static int t_hierarchy(const char *dir)
+{
+	uint32_t table_id = 0, row_count = 0;
+	if (!exmdb_client::load_hierarchy_table(dir,
+	    rop_util_make_eid_ex(1, PRIVATE_FID_ROOT), nullptr,
+	    TABLE_FLAG_DEPTH, nullptr, &table_id, &row_count)) {
+		mlog(LV_ERR, "load_hierarchy_table failed unexpectedly");
+		return EXIT_FAILURE;
+	}
+	exmdb_client::unload_table(dir, table_id);
+	if (row_count == 0) {
+		mlog(LV_ERR, "load_hierarchy_table: root folder has no subfolders");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	exmdb_rpc_alloc = [](size_t z) { return g_alloc_mgr.alloc(z); };
@@ -82,5 +99,8 @@ int main(int argc, char **argv)
 	if (!exmdb_client::get_store_properties(g_storedir, CP_UTF8, &ptags, &props))
 		mlog(LV_ERR, "get_store_properties failed unexpectedly");
 
-	return t_2209(g_storedir);
+	auto ret = t_2209(g_storedir);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	return t_hierarchy(g_storedir);
 }
@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Content synchronization latency versus folder size.
+ *
+ * For every requested size, a scratch folder is filled with that many
+ * messages, then a full sync (empty client state) and an incremental sync
+ * (client state from the full sync, plus a handful of server-side changes)
+ * are timed.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/rop_util.hpp>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "benchutil.hpp"
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+using bench::g_alloc_mgr;
+
+static constexpr unsigned int g_rounds = 5, g_changes = 3;
+
+struct sync_result {
+	uint64_t last_cn = 0, last_readcn = 0;
+	EID_ARRAY given{}, chg{}, deleted{};
+};
+
+static bool do_sync(const char *dir, uint64_t fid, const idset &given,
+    const idset &seen, const idset &read, sync_result &r)
+{
+	uint32_t fai_count = 0, normal_count = 0;
+	uint64_t fai_total = 0, normal_total = 0;
+	EID_ARRAY updated{}, nolonger{}, read_mids{}, unread_mids{};
+	return exmdb_client::get_content_sync(dir, fid, nullptr, &given, &seen,
+	       nullptr, &read, CP_UTF8, nullptr, false, &fai_count, &fai_total,
+	       &normal_count, &normal_total, &updated, &r.chg, &r.last_cn,
+	       &r.given, &r.deleted, &nolonger, &read_mids, &unread_mids,
+	       &r.last_readcn);
+}
+
+static double best_sync(const char *dir, uint64_t fid, const idset &given,
+    const idset &seen, const idset &read, sync_result &r)
+{
+	double best = -1;
+	for (unsigned int i = 0; i < g_rounds; ++i) {
+		auto t0 = std::chrono::steady_clock::now();
+		if (!do_sync(dir, fid, given, seen, read, r))
+			return -1;
+		std::chrono::duration<double, std::milli> d =
+			std::chrono::steady_clock::now() - t0;
+		if (best < 0 || d.count() < best)
+			best = d.count();
+	}
+	return best;
+}
+
+static int run(const char *dir, size_t size)
+{
+	auto name = "icsbench-" + std::to_string(size);
+	auto fid = bench::make_folder(dir, name.c_str());
+	if (fid == 0) {
+		fprintf(stderr, "create_folder failed (left-over folder \"icsbench-%zu\"?)\n", size);
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit([&]() { bench::remove_folder(dir, fid); });
+	for (size_t i = 0; i < size; ++i) {
+		if (bench::write_message(dir, fid, i) == 0) {
+			fprintf(stderr, "write_message failed\n");
+			return EXIT_FAILURE;
+		}
+		if (i % 1024 == 0)
+			g_alloc_mgr.clear();
+	}
+
+	auto given = idset::create(idset::type::id_loose);
+	auto seen = idset::create(idset::type::id_loose);
+	auto read = idset::create(idset::type::id_loose);
+	if (given == nullptr || seen == nullptr || read == nullptr)
+		return EXIT_FAILURE;
+	sync_result r;
+	auto t_full = best_sync(dir, fid, *given, *seen, *read, r);
+	if (t_full < 0) {
+		fprintf(stderr, "get_content_sync failed\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Client state as an ICS downloader would have saved it */
+	for (auto eid : r.given)
+		if (!given->append(eid))
+			return EXIT_FAILURE;
+	if (r.last_cn != 0 &&
+	    !seen->append_range(1, 1, rop_util_get_gc_value(r.last_cn)))
+		return EXIT_FAILURE;
+	if (r.last_readcn != 0 &&
+	    !read->append_range(1, 1, rop_util_get_gc_value(r.last_readcn)))
+		return EXIT_FAILURE;
+	std::vector<uint64_t> victims(r.given.begin(), r.given.begin() +
+		std::min<size_t>(g_changes, r.given.count));
+	g_alloc_mgr.clear();
+
+	for (unsigned int i = 0; i < g_changes; ++i)
+		if (bench::write_message(dir, fid, size + i) == 0)
+			return EXIT_FAILURE;
+	const EID_ARRAY del = {static_cast<uint32_t>(victims.size()), victims.data()};
+	BOOL partial = false;
+	if (!exmdb_client::delete_messages(dir, CP_UTF8, nullptr, fid, &del,
+	    TRUE, &partial))
+		return EXIT_FAILURE;
+	auto t_incr = best_sync(dir, fid, *given, *seen, *read, r);
+	if (t_incr < 0) {
+		fprintf(stderr, "get_content_sync failed\n");
+		return EXIT_FAILURE;
+	}
+	printf("%10zu %12.2f %12.2f %6u %6u\n", size, t_full, t_incr,
+		r.chg.count, r.deleted.count);
+	g_alloc_mgr.clear();
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, const char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <maildir> [folder sizes...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit(exmdb_client_stop);
+	if (bench::client_run(1) != 0)
+		return EXIT_FAILURE;
+
+	auto dir = argv[1];
+	std::vector<size_t> sizes;
+	for (int i = 2; i < argc; ++i)
+		sizes.push_back(strtoull(argv[i], nullptr, 0));
+	if (sizes.empty())
+		sizes = {1000, 10000, 100000};
+	printf("%10s %12s %12s %6s %6s\n", "messages", "full/ms", "incr/ms",
+		"chg", "del");
+	for (auto size : sizes) {
+		auto ret = run(dir, size);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	return EXIT_SUCCESS;
+}
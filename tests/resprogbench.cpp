@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Restriction bytecode versus tree-walking evaluation.
+ *
+ * A handful of criteria as Outlook puts them on its search folders is
+ * evaluated against a synthetic message population in an in-memory
+ * exchange.sqlite3, once with exmdb's interpreter (cu_eval_msg_restriction)
+ * and once with res_program (cu_eval_msg_program). Both must agree on every
+ * message.
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sqlite3.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/restriction.hpp>
+#include <gromox/scope.hpp>
+
+using namespace gromox;
+using namespace exmdb;
+
+namespace {
+
+struct bcase {
+	const char *name;
+	RESTRICTION res;
+};
+
+}
+
+static bool make_population(sqlite3 *db, size_t n)
+{
+	static const char *const words[] = {
+		"Invoice", "meeting", "Re: lunch", "quarterly report", "INVOICE #",
+		"newsletter", "Your order", "holiday", "build failed", "urgent",
+	};
+	static const char *const senders[] = {
+		"Alice Example", "billing department", "Bob", "ci-bot",
+		"Carol Billing", "Newsletter Team",
+	};
+	static const char *const classes[] = {
+		"IPM.Note", "IPM.Schedule.Meeting.Request", "IPM.Note.SMIME",
+		"IPM.Appointment", "IPM.Contact", "ipm.note",
+	};
+	if (dbop_sqlite_create(db, sqlite_kind::pvt, 0) != 0 ||
+	    gx_sql_exec(db, "INSERT INTO folders (folder_id, parent_id,"
+	    " change_number, cur_eid, max_eid) VALUES (1, NULL, 1, 1, 1)") != SQLITE_OK)
+		return false;
+	auto sql_transact = gx_sql_begin(db, txn_mode::write);
+	if (!sql_transact)
+		return false;
+	auto mst = gx_sql_prep(db, "INSERT INTO messages (message_id, parent_fid,"
+	           " is_associated, change_number, read_state, message_size)"
+	           " VALUES (?,1,0,?,?,?)");
+	auto pst = gx_sql_prep(db, "INSERT INTO message_properties"
+	           " (message_id, proptag, propval) VALUES (?,?,?)");
+	if (mst == nullptr || pst == nullptr)
+		return false;
+	auto put = [&](uint64_t mid, uint32_t tag, auto &&bind) {
+		pst.bind_int64(1, mid);
+		pst.bind_int64(2, tag);
+		bind();
+		auto ret = pst.step();
+		pst.reset();
+		return ret == SQLITE_DONE;
+	};
+	uint32_t seed = 1;
+	auto rnd = [&]() { seed = seed * 1103515245 + 12345; return seed >> 8; };
+	for (uint64_t mid = 1; mid <= n; ++mid) {
+		auto subject = std::string(words[rnd() % std::size(words)]) + " " +
+		               std::to_string(rnd() % 1000);
+		auto sender = senders[rnd() % std::size(senders)];
+		auto cls = classes[rnd() % std::size(classes)];
+		auto delivery = 133000000000000000ULL + rnd() % 10000000;
+		/* some messages never went through submission */
+		auto submit = rnd() % 8 == 0 ? 0 : delivery - 1000000 + rnd() % 2000000;
+		mst.bind_int64(1, mid);
+		mst.bind_int64(2, mid);
+		mst.bind_int64(3, rnd() % 4 != 0);
+		mst.bind_int64(4, rnd() % 200000);
+		if (mst.step() != SQLITE_DONE)
+			return false;
+		mst.reset();
+		if (!put(mid, PR_NORMALIZED_SUBJECT, [&]() { pst.bind_text(3, subject.c_str()); }) ||
+		    !put(mid, PR_SENDER_NAME, [&]() { pst.bind_text(3, sender); }) ||
+		    !put(mid, PR_MESSAGE_CLASS, [&]() { pst.bind_text(3, cls); }) ||
+		    !put(mid, PR_MESSAGE_DELIVERY_TIME, [&]() { pst.bind_int64(3, delivery); }) ||
+		    (submit != 0 && !put(mid, PR_CLIENT_SUBMIT_TIME, [&]() { pst.bind_int64(3, submit); })))
+			return false;
+	}
+	return sql_transact.commit() == SQLITE_OK;
+}
+
+int main(int argc, char **argv)
+{
+	size_t msgs = argc >= 2 ? strtoull(argv[1], nullptr, 0) : 2000;
+	unsigned int rounds = argc >= 3 ? strtoul(argv[2], nullptr, 0) : 5;
+
+	/* Unread mail of interest, received after a cutoff */
+	static uint64_t v_cutoff = 133000000000000000ULL + 5000000;
+	static RESTRICTION_BITMASK r_unread{BMR_EQZ, PR_MESSAGE_FLAGS, MSGFLAG_READ};
+	static RESTRICTION_CONTENT r_cls1{FL_PREFIX | FL_IGNORECASE,
+		PR_MESSAGE_CLASS, {PR_MESSAGE_CLASS, deconst("IPM.Note")}};
+	static RESTRICTION_CONTENT r_cls2{FL_PREFIX | FL_IGNORECASE,
+		PR_MESSAGE_CLASS, {PR_MESSAGE_CLASS, deconst("IPM.Schedule")}};
+	static RESTRICTION_CONTENT r_subj{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SUBJECT, {PR_SUBJECT, deconst("invoice")}};
+	static RESTRICTION_CONTENT r_from{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("billing")}};
+	static RESTRICTION_CONTENT r_subj2{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SUBJECT, {PR_SUBJECT, deconst("report")}};
+	static RESTRICTION_PROPERTY r_recent{RELOP_GE, PR_MESSAGE_DELIVERY_TIME,
+		{PR_MESSAGE_DELIVERY_TIME, &v_cutoff}};
+	static RESTRICTION_EXIST r_exist{PR_SUBJECT};
+	static RESTRICTION r_cls_or[] = {{RES_CONTENT, {&r_cls1}}, {RES_CONTENT, {&r_cls2}}};
+	static RESTRICTION r_txt_or[] = {
+		{RES_CONTENT, {&r_subj}}, {RES_CONTENT, {&r_from}},
+		{RES_CONTENT, {&r_subj2}},
+	};
+	static RESTRICTION_AND_OR r_cls{std::size(r_cls_or), r_cls_or};
+	static RESTRICTION_AND_OR r_txt{std::size(r_txt_or), r_txt_or};
+	static RESTRICTION r_empty_and_list[1]{};
+	static RESTRICTION_AND_OR r_empty_and{0, r_empty_and_list};
+	static RESTRICTION r_top_list[] = {
+		{RES_AND, {&r_empty_and}}, /* folds away */
+		{RES_EXIST, {&r_exist}},
+		{RES_OR, {&r_cls}},
+		{RES_BITMASK, {&r_unread}},
+		{RES_OR, {&r_txt}},
+		{RES_PROPERTY, {&r_recent}},
+		{RES_CONTENT, {&r_subj}}, /* same proptag again */
+	};
+	static RESTRICTION_AND_OR r_top_and{std::size(r_top_list), r_top_list};
+
+	/* Read mail that is not about invoices */
+	static RESTRICTION_NOT r_not_txt{{RES_OR, {&r_txt}}};
+	static RESTRICTION_NOT r_not_unread{{RES_BITMASK, {&r_unread}}};
+	static RESTRICTION r_not_list[] = {{RES_NOT, {&r_not_txt}}, {RES_NOT, {&r_not_unread}}};
+	static RESTRICTION_AND_OR r_not_and{std::size(r_not_list), r_not_list};
+
+	/* Submitted before delivery, or never submitted */
+	static RESTRICTION_PROPCOMPARE r_cmp{RELOP_LT, PR_CLIENT_SUBMIT_TIME,
+		PR_MESSAGE_DELIVERY_TIME};
+	static RESTRICTION_EXIST r_submitted{PR_CLIENT_SUBMIT_TIME};
+	static RESTRICTION_NOT r_unsubmitted{{RES_EXIST, {&r_submitted}}};
+	static RESTRICTION r_cmp_list[] = {{RES_PROPCOMPARE, {&r_cmp}}, {RES_NOT, {&r_unsubmitted}}};
+	static RESTRICTION_AND_OR r_cmp_or{std::size(r_cmp_list), r_cmp_list};
+
+	/* Ambiguous name resolution, as from the search box */
+	static RESTRICTION_PROPERTY r_anr{RELOP_EQ, PR_ANR, {PR_ANR, deconst("bill")}};
+	static RESTRICTION r_anr_list[] = {{RES_PROPERTY, {&r_anr}}, {RES_CONTENT, {&r_cls1}}};
+	static RESTRICTION_AND_OR r_anr_or{std::size(r_anr_list), r_anr_list};
+
+	static const bcase cases[] = {
+		{"outlook", {RES_AND, {&r_top_and}}},
+		{"not", {RES_AND, {&r_not_and}}},
+		{"propcmp", {RES_OR, {&r_cmp_or}}},
+		{"anr", {RES_OR, {&r_anr_or}}},
+	};
+
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3_open: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit([&]() { sqlite3_close(db); });
+	exmdb_server::build_env(EM_PRIVATE, "/nonexistent");
+	auto cl_1 = make_scope_exit(exmdb_server::free_env);
+	if (!make_population(db, msgs)) {
+		fprintf(stderr, "cannot populate store: %s\n", sqlite3_errmsg(db));
+		return EXIT_FAILURE;
+	}
+
+	for (const auto &c : cases) {
+		res_program prog;
+		if (!prog.compile(c.res)) {
+			fprintf(stderr, "%s: compile failed\n", c.name);
+			return EXIT_FAILURE;
+		}
+		size_t hits = 0;
+		for (uint64_t mid = 1; mid <= msgs; ++mid) {
+			exmdb_server::alloc_scope as;
+			auto a = cu_eval_msg_restriction(db, CP_UTF8, mid, &c.res);
+			auto b = cu_eval_msg_program(db, CP_UTF8, mid, prog);
+			if (a != b) {
+				fprintf(stderr, "%s: mismatch on message %llu: tree=%d prog=%d\n",
+				        c.name, static_cast<unsigned long long>(mid), a, b);
+				return EXIT_FAILURE;
+			}
+			hits += a;
+		}
+		printf("%s: %zu instructions, %zu property slots, %zu of %zu messages match\n",
+		       c.name, prog.size(), prog.slot_count(), hits, msgs);
+
+		auto bench = [&](const char *name, auto &&fn) {
+			size_t n = 0;
+			auto t0 = std::chrono::steady_clock::now();
+			for (unsigned int r = 0; r < rounds; ++r)
+				for (uint64_t mid = 1; mid <= msgs; ++mid) {
+					exmdb_server::alloc_scope as;
+					n += fn(mid);
+				}
+			std::chrono::duration<double, std::nano> d =
+				std::chrono::steady_clock::now() - t0;
+			printf("  %-8s %10.1f ns/eval (%zu)\n", name,
+			       d.count() / (static_cast<double>(rounds) * msgs), n);
+		};
+		bench("tree", [&](uint64_t mid) { return cu_eval_msg_restriction(db, CP_UTF8, mid, &c.res); });
+		bench("program", [&](uint64_t mid) { return cu_eval_msg_program(db, CP_UTF8, mid, prog); });
+	}
+	return EXIT_SUCCESS;
+}
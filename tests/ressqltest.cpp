@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * cu_msg_restriction_to_sql versus cu_eval_msg_restriction.
+ *
+ * A small message population is put into an in-memory exchange.sqlite3, and
+ * every restriction of the table below is both translated to SQL and
+ * interpreted message by message. Where the translation claims to be exact,
+ * both must select the same messages; where it is partial, the SQL must not
+ * lose any. Each case also states how far it is expected to translate, so
+ * that refused constructs stay refused.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <sqlite3.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+using namespace exmdb;
+
+namespace {
+
+struct tmsg {
+	const char *sender, *cls; /* nullptr: absent */
+	int64_t importance;       /* -1: absent */
+	bool has_i8;
+	uint64_t i8;
+	const char *bin;          /* hex; nullptr: absent */
+};
+
+struct tcase {
+	const char *name;
+	RESTRICTION res;
+	res_sql kind;
+};
+
+}
+
+static constexpr uint32_t PR_TEST_I8 = PROP_TAG(PT_I8, 0x6830);
+static constexpr uint32_t PR_TEST_BIN = PROP_TAG(PT_BINARY, 0x6831);
+
+static constexpr tmsg g_msgs[] = {
+	{"Alice Example", "IPM.Note", 1, true, 5, "0102"},
+	{"alice example", "IPM.Note.SMIME", 2, true, 0x8000000000000001ULL, "010203"},
+	{"Bob_50%", nullptr, 0, true, 1, "ff"},
+	{nullptr, "IPM.Appointment", -1, false, 0, nullptr},
+	{"M\xc3\xbcller", "ipm.note", 1, true, UINT64_MAX, "0a0b"},
+	{"", "IPM.Contact", 2, false, 0, "00"},
+	{"Carol Billing", "IPM.Schedule.Meeting.Request", -1, true, 7, nullptr},
+};
+
+static bool mkstore(sqlite3 *db)
+{
+	if (dbop_sqlite_create(db, sqlite_kind::pvt, 0) != 0 ||
+	    gx_sql_exec(db, "INSERT INTO folders (folder_id, parent_id,"
+	    " change_number, cur_eid, max_eid) VALUES (1, NULL, 1, 1, 1)") != SQLITE_OK)
+		return false;
+	auto mst = gx_sql_prep(db, "INSERT INTO messages (message_id, parent_fid,"
+	           " is_associated, change_number, message_size) VALUES (?,1,0,?,100)");
+	auto pst = gx_sql_prep(db, "INSERT INTO message_properties"
+	           " (message_id, proptag, propval) VALUES (?,?,?)");
+	if (mst == nullptr || pst == nullptr)
+		return false;
+	auto put = [&](uint64_t mid, uint32_t tag, auto &&bind) {
+		pst.bind_int64(1, mid);
+		pst.bind_int64(2, tag);
+		bind();
+		auto ret = pst.step();
+		pst.reset();
+		return ret == SQLITE_DONE;
+	};
+	for (size_t i = 0; i < std::size(g_msgs); ++i) {
+		auto &m = g_msgs[i];
+		uint64_t mid = i + 1;
+		auto bin = m.bin != nullptr ? hex2bin(m.bin) : std::string();
+		mst.bind_int64(1, mid);
+		mst.bind_int64(2, mid);
+		if (mst.step() != SQLITE_DONE)
+			return false;
+		mst.reset();
+		if ((m.sender != nullptr && !put(mid, PR_SENDER_NAME, [&]() { pst.bind_text(3, m.sender); })) ||
+		    (m.cls != nullptr && !put(mid, PR_MESSAGE_CLASS, [&]() { pst.bind_text(3, m.cls); })) ||
+		    (m.importance >= 0 && !put(mid, PR_IMPORTANCE, [&]() { pst.bind_int64(3, m.importance); })) ||
+		    (m.has_i8 && !put(mid, PR_TEST_I8, [&]() { pst.bind_int64(3, m.i8); })) ||
+		    (m.bin != nullptr && !put(mid, PR_TEST_BIN, [&]() { pst.bind_blob(3, bin.data(), bin.size()); })))
+			return false;
+	}
+	return true;
+}
+
+static bool check(sqlite3 *db, const tcase &t)
+{
+	std::string where;
+	auto kind = cu_msg_restriction_to_sql(&t.res, CP_UTF8, db, where);
+	if (kind != t.kind) {
+		fprintf(stderr, "%s: translated as %d, expected %d (%s)\n", t.name,
+		        static_cast<int>(kind), static_cast<int>(t.kind), where.c_str());
+		return false;
+	}
+	std::set<uint64_t> interp, sql;
+	for (uint64_t mid = 1; mid <= std::size(g_msgs); ++mid)
+		if (cu_eval_msg_restriction(db, CP_UTF8, mid, &t.res))
+			interp.insert(mid);
+	if (kind == res_sql::none)
+		return true;
+	auto query = "SELECT message_id FROM messages WHERE parent_fid=1 AND " + where;
+	auto stm = gx_sql_prep(db, query.c_str());
+	if (stm == nullptr) {
+		fprintf(stderr, "%s: bad SQL: %s\n", t.name, where.c_str());
+		return false;
+	}
+	while (stm.step() == SQLITE_ROW)
+		sql.insert(stm.col_uint64(0));
+	if (kind == res_sql::exact ? sql == interp :
+	    std::includes(sql.begin(), sql.end(), interp.begin(), interp.end()))
+		return true;
+	fprintf(stderr, "%s: SQL selects", t.name);
+	for (auto mid : sql)
+		fprintf(stderr, " %llu", static_cast<unsigned long long>(mid));
+	fprintf(stderr, ", interpreter");
+	for (auto mid : interp)
+		fprintf(stderr, " %llu", static_cast<unsigned long long>(mid));
+	fprintf(stderr, "\n\t%s\n", where.c_str());
+	return false;
+}
+
+int main()
+{
+	static uint32_t v_imp1 = 1, v_imp1b = 1;
+	static uint64_t v_i8small = 10, v_i8big = 0x8000000000000001ULL, v_i8three = 3;
+	static BINARY v_bin12 = {2, {.pc = deconst("\x01\x02")}};
+
+	/* NOCASE and LIKE, including LIKE metacharacters and non-ASCII */
+	static RESTRICTION_CONTENT c_alice_sub{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("ALICE")}};
+	static RESTRICTION_CONTENT c_alice_full{FL_FULLSTRING | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("alice example")}};
+	static RESTRICTION_CONTENT c_alice_cs{FL_FULLSTRING,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("alice example")}};
+	static RESTRICTION_CONTENT c_pct{FL_SUBSTRING,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("50%")}};
+	static RESTRICTION_CONTENT c_bob{FL_PREFIX | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("bob_")}};
+	static RESTRICTION_CONTENT c_underscore{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("e_e")}};
+	static RESTRICTION_CONTENT c_umlaut{FL_SUBSTRING | FL_IGNORECASE,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("m\xc3\xbc")}};
+	static RESTRICTION_CONTENT c_empty{FL_SUBSTRING,
+		PR_SENDER_NAME, {PR_SENDER_NAME, deconst("")}};
+	static RESTRICTION_CONTENT c_ipmnote{FL_PREFIX | FL_IGNORECASE,
+		PR_MESSAGE_CLASS, {PR_MESSAGE_CLASS, deconst("ipm.note")}};
+	static RESTRICTION_CONTENT c_bin{FL_SUBSTRING,
+		PR_TEST_BIN, {PR_TEST_BIN, &v_bin12}};
+	static RESTRICTION_PROPERTY p_alice_eq{RELOP_EQ, PR_SENDER_NAME,
+		{PR_SENDER_NAME, deconst("ALICE EXAMPLE")}};
+	static RESTRICTION_PROPERTY p_lt_b{RELOP_LT, PR_SENDER_NAME,
+		{PR_SENDER_NAME, deconst("b")}};
+	/* Absent values */
+	static RESTRICTION_PROPERTY p_imp_ge{RELOP_GE, PR_IMPORTANCE, {PR_IMPORTANCE, &v_imp1}};
+	static RESTRICTION_PROPERTY p_imp_eq{RELOP_EQ, PR_IMPORTANCE, {PR_IMPORTANCE, &v_imp1b}};
+	static RESTRICTION_PROPERTY p_imp_ne{RELOP_NE, PR_IMPORTANCE, {PR_IMPORTANCE, &v_imp1b}};
+	static RESTRICTION_BITMASK b_imp{BMR_NEZ, PR_IMPORTANCE, 2};
+	static RESTRICTION_BITMASK b_imp0{BMR_EQZ, PR_IMPORTANCE, 2};
+	static RESTRICTION_SIZE s_sender{RELOP_LT, PR_SENDER_NAME, 4};
+	static RESTRICTION_EXIST e_sender{PR_SENDER_NAME};
+	/* PT_I8/PT_BINARY: only equality is translated */
+	static RESTRICTION_PROPERTY p_i8_lt{RELOP_LT, PR_TEST_I8, {PR_TEST_I8, &v_i8small}};
+	static RESTRICTION_PROPERTY p_i8_gt{RELOP_GT, PR_TEST_I8, {PR_TEST_I8, &v_i8three}};
+	static RESTRICTION_PROPERTY p_i8_eq{RELOP_EQ, PR_TEST_I8, {PR_TEST_I8, &v_i8big}};
+	static RESTRICTION_PROPERTY p_bin_gt{RELOP_GT, PR_TEST_BIN, {PR_TEST_BIN, &v_bin12}};
+	static RESTRICTION_PROPERTY p_bin_eq{RELOP_EQ, PR_TEST_BIN, {PR_TEST_BIN, &v_bin12}};
+	/* PR_SUBJECT is computed and left to the interpreter */
+	static RESTRICTION_PROPERTY p_subject{RELOP_EQ, PR_SUBJECT, {PR_SUBJECT, deconst("x")}};
+
+	static RESTRICTION_NOT n_alice{{RES_CONTENT, {&c_alice_sub}}};
+	static RESTRICTION_NOT n_exist{{RES_EXIST, {&e_sender}}};
+	static RESTRICTION_NOT n_imp_eq{{RES_PROPERTY, {&p_imp_eq}}};
+	static RESTRICTION_NOT n_lt_b{{RES_PROPERTY, {&p_lt_b}}};
+	static RESTRICTION_NOT n_i8_gt{{RES_PROPERTY, {&p_i8_gt}}};
+	static RESTRICTION and_partial_l[] = {{RES_CONTENT, {&c_alice_sub}}, {RES_PROPERTY, {&p_subject}}};
+	static RESTRICTION_AND_OR and_partial{std::size(and_partial_l), and_partial_l};
+	static RESTRICTION and_i8_l[] = {{RES_EXIST, {&e_sender}}, {RES_PROPERTY, {&p_i8_lt}}};
+	static RESTRICTION_AND_OR and_i8{std::size(and_i8_l), and_i8_l};
+	static RESTRICTION or_none_l[] = {{RES_PROPERTY, {&p_i8_lt}}, {RES_EXIST, {&e_sender}}};
+	static RESTRICTION_AND_OR or_none{std::size(or_none_l), or_none_l};
+	static RESTRICTION or_exact_l[] = {{RES_NOT, {&n_exist}}, {RES_BITMASK, {&b_imp}}};
+	static RESTRICTION_AND_OR or_exact{std::size(or_exact_l), or_exact_l};
+
+	static const tcase cases[] = {
+		{"substring/icase", {RES_CONTENT, {&c_alice_sub}}, res_sql::exact},
+		{"fullstring/icase", {RES_CONTENT, {&c_alice_full}}, res_sql::exact},
+		{"fullstring", {RES_CONTENT, {&c_alice_cs}}, res_sql::exact},
+		{"substring with %", {RES_CONTENT, {&c_pct}}, res_sql::exact},
+		{"prefix with _", {RES_CONTENT, {&c_bob}}, res_sql::exact},
+		{"_ is no wildcard", {RES_CONTENT, {&c_underscore}}, res_sql::exact},
+		{"non-ASCII", {RES_CONTENT, {&c_umlaut}}, res_sql::exact},
+		{"empty needle", {RES_CONTENT, {&c_empty}}, res_sql::exact},
+		{"synthesized class", {RES_CONTENT, {&c_ipmnote}}, res_sql::exact},
+		{"binary substring", {RES_CONTENT, {&c_bin}}, res_sql::exact},
+		{"string EQ", {RES_PROPERTY, {&p_alice_eq}}, res_sql::exact},
+		{"string LT, absent", {RES_PROPERTY, {&p_lt_b}}, res_sql::exact},
+		{"NOT string LT", {RES_NOT, {&n_lt_b}}, res_sql::exact},
+		{"long GE, absent", {RES_PROPERTY, {&p_imp_ge}}, res_sql::exact},
+		{"long NE, absent", {RES_PROPERTY, {&p_imp_ne}}, res_sql::exact},
+		{"NOT long EQ, absent", {RES_NOT, {&n_imp_eq}}, res_sql::exact},
+		{"NOT content", {RES_NOT, {&n_alice}}, res_sql::exact},
+		{"NOT exist", {RES_NOT, {&n_exist}}, res_sql::exact},
+		{"bitmask NEZ, absent", {RES_BITMASK, {&b_imp}}, res_sql::exact},
+		{"bitmask EQZ, absent", {RES_BITMASK, {&b_imp0}}, res_sql::exact},
+		{"size, absent", {RES_SIZE, {&s_sender}}, res_sql::exact},
+		{"OR of NOT", {RES_OR, {&or_exact}}, res_sql::exact},
+		{"I8 EQ above 2^63", {RES_PROPERTY, {&p_i8_eq}}, res_sql::exact},
+		{"I8 LT refused", {RES_PROPERTY, {&p_i8_lt}}, res_sql::none},
+		{"NOT I8 GT refused", {RES_NOT, {&n_i8_gt}}, res_sql::none},
+		{"binary EQ", {RES_PROPERTY, {&p_bin_eq}}, res_sql::exact},
+		{"binary GT refused", {RES_PROPERTY, {&p_bin_gt}}, res_sql::none},
+		{"AND with computed prop", {RES_AND, {&and_partial}}, res_sql::partial},
+		{"AND with refused I8", {RES_AND, {&and_i8}}, res_sql::partial},
+		{"OR with refused I8", {RES_OR, {&or_none}}, res_sql::none},
+	};
+
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	    SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3_open: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit([&]() { sqlite3_close(db); });
+	exmdb_server::build_env(EM_PRIVATE, "/nonexistent");
+	auto cl_1 = make_scope_exit(exmdb_server::free_env);
+	if (!mkstore(db)) {
+		fprintf(stderr, "cannot populate store: %s\n", sqlite3_errmsg(db));
+		return EXIT_FAILURE;
+	}
+	unsigned int failed = 0;
+	for (const auto &t : cases)
+		if (!check(db, t))
+			++failed;
+	printf("%zu cases, %u failed\n", std::size(cases), failed);
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
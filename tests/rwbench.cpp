@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2024 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Reader throughput on one store, alone and next to writers.
+ *
+ * A scratch folder is filled, then reader threads issue
+ * get_message_properties, sum_content and query_table (on a content table
+ * loaded once up front) while writer threads issue set_message_properties.
+ * Comparing the readers-only phase with the mixed phase (and runs with
+ * exmdb_sqlite_reader_spares=0 on the server) shows how much writers hold
+ * up readers.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gromox/exmdb_client.hpp>
+#include <gromox/exmdb_rpc.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/scope.hpp>
+#include <gromox/util.hpp>
+#include "benchutil.hpp"
+
+using namespace gromox;
+namespace exmdb_client = exmdb_client_remote;
+using bench::g_alloc_mgr;
+
+static std::atomic<bool> g_stop{false};
+static std::atomic<uint64_t> g_reads, g_writes, g_errors;
+
+static bool list_mids(const char *dir, uint32_t table_id, uint32_t rows,
+    std::vector<uint64_t> &mids)
+{
+	static constexpr uint32_t tags[] = {PidTagMid};
+	static constexpr PROPTAG_ARRAY ptags = {std::size(tags), deconst(tags)};
+	TARRAY_SET set{};
+	if (!exmdb_client::query_table(dir, nullptr, CP_UTF8, table_id, &ptags,
+	    0, rows, &set))
+		return false;
+	for (size_t i = 0; i < set.count; ++i) {
+		auto mid = set.pparray[i]->get<const uint64_t>(PidTagMid);
+		if (mid != nullptr)
+			mids.push_back(*mid);
+	}
+	g_alloc_mgr.clear();
+	return !mids.empty();
+}
+
+static void reader(const char *dir, uint64_t fid, uint32_t table_id,
+    uint32_t rows, const std::vector<uint64_t> &mids, unsigned int seed)
+{
+	static constexpr uint32_t tags[] = {PR_SUBJECT, PR_MESSAGE_SIZE, PR_LAST_MODIFICATION_TIME};
+	static constexpr PROPTAG_ARRAY ptags = {std::size(tags), deconst(tags)};
+	std::mt19937 rng(seed);
+	for (unsigned int n = 0; !g_stop; ++n) {
+		bool ok;
+		switch (n % 3) {
+		case 0: {
+			TPROPVAL_ARRAY props{};
+			ok = exmdb_client::get_message_properties(dir, nullptr,
+			     CP_UTF8, mids[rng() % mids.size()], &ptags, &props);
+			break;
+		}
+		case 1: {
+			uint32_t count = 0;
+			ok = exmdb_client::sum_content(dir, fid, false, false, &count);
+			break;
+		}
+		default: {
+			TARRAY_SET set{};
+			ok = exmdb_client::query_table(dir, nullptr, CP_UTF8,
+			     table_id, &ptags, rng() % rows, 50, &set);
+			break;
+		}
+		}
+		++(ok ? g_reads : g_errors);
+		g_alloc_mgr.clear();
+	}
+}
+
+static void writer(const char *dir, const std::vector<uint64_t> &mids,
+    unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	for (unsigned int n = 0; !g_stop; ++n) {
+		auto text = "rwbench write " + std::to_string(n);
+		const TAGGED_PROPVAL pv[] = {{PR_COMMENT, deconst(text.c_str())}};
+		const TPROPVAL_ARRAY props = {std::size(pv), deconst(pv)};
+		PROBLEM_ARRAY problems{};
+		auto ok = exmdb_client::set_message_properties(dir, nullptr,
+		          CP_UTF8, mids[rng() % mids.size()], &props, &problems);
+		++(ok ? g_writes : g_errors);
+		g_alloc_mgr.clear();
+	}
+}
+
+static void phase(const char *label, const char *dir, uint64_t fid,
+    uint32_t table_id, uint32_t rows, const std::vector<uint64_t> &mids,
+    unsigned int readers, unsigned int writers, unsigned int secs)
+{
+	g_stop = false;
+	g_reads = g_writes = g_errors = 0;
+	std::vector<std::thread> thr;
+	for (unsigned int i = 0; i < readers; ++i)
+		thr.emplace_back(reader, dir, fid, table_id, rows, std::cref(mids), i);
+	for (unsigned int i = 0; i < writers; ++i)
+		thr.emplace_back(writer, dir, std::cref(mids), readers + i);
+	auto t0 = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(secs));
+	g_stop = true;
+	for (auto &t : thr)
+		t.join();
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - t0;
+	printf("%-8s %3u %3u %12.1f %12.1f %8llu\n", label, readers, writers,
+		g_reads / d.count(), g_writes / d.count(),
+		static_cast<unsigned long long>(g_errors.load()));
+}
+
+int main(int argc, const char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <maildir> [readers [writers [seconds [messages]]]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	auto dir = argv[1];
+	unsigned int readers = argc > 2 ? strtoul(argv[2], nullptr, 0) : 8;
+	unsigned int writers = argc > 3 ? strtoul(argv[3], nullptr, 0) : 2;
+	unsigned int secs    = argc > 4 ? strtoul(argv[4], nullptr, 0) : 10;
+	unsigned int msgs    = argc > 5 ? strtoul(argv[5], nullptr, 0) : 5000;
+	if (readers == 0 || msgs == 0) {
+		fprintf(stderr, "Need at least one reader and one message\n");
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = make_scope_exit(exmdb_client_stop);
+	if (bench::client_run(readers + writers + 1) != 0)
+		return EXIT_FAILURE;
+
+	auto fid = bench::make_folder(dir, "rwbench");
+	if (fid == 0) {
+		fprintf(stderr, "create_folder failed (left-over folder \"rwbench\"?)\n");
+		return EXIT_FAILURE;
+	}
+	auto cl_1 = make_scope_exit([&]() { bench::remove_folder(dir, fid); });
+	for (unsigned int i = 0; i < msgs; ++i) {
+		if (bench::write_message(dir, fid, i) == 0) {
+			fprintf(stderr, "write_message failed\n");
+			return EXIT_FAILURE;
+		}
+		if (i % 1024 == 0)
+			g_alloc_mgr.clear();
+	}
+	uint32_t table_id = 0, rows = 0;
+	if (!exmdb_client::load_content_table(dir, CP_UTF8, fid, nullptr,
+	    0, nullptr, nullptr, &table_id, &rows) || rows == 0) {
+		fprintf(stderr, "load_content_table failed\n");
+		return EXIT_FAILURE;
+	}
+	auto cl_2 = make_scope_exit([&]() { exmdb_client::unload_table(dir, table_id); });
+	std::vector<uint64_t> mids;
+	if (!list_mids(dir, table_id, rows, mids)) {
+		fprintf(stderr, "query_table failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %3s %3s %12s %12s %8s\n", "phase", "rd", "wr",
+		"reads/s", "writes/s", "errors");
+	phase("read", dir, fid, table_id, rows, mids, readers, 0, secs);
+	if (writers > 0)
+		phase("mixed", dir, fid, table_id, rows, mids, readers, writers, secs);
+	return EXIT_SUCCESS;
+}
@@ -9,7 +9,15 @@ our $gen_mode = "";
 	"client" => sub { $gen_mode = "CLN"; },
 	"server" => sub { $gen_mode = "SDF"; },
 	"shm-api" => sub { $gen_mode = "SDP"; },
+	"summary" => sub { $gen_mode = "SUM"; },
 );
+# Request argument types that --summary can print
+our %sum_scalar = map { $_ => 1 } qw(uint8_t uint16_t uint32_t int32_t BOOL);
+our %sum_counted = map { $_ => 1 } qw(PROPTAG_ARRAY TPROPVAL_ARRAY EID_ARRAY
+	LONGLONG_ARRAY BINARY_ARRAY PROPNAME_ARRAY TARRAY_SET);
+# Client functions that go through exmdb_client_cache_lookup/update
+our %cl_cached = map { $_ => 1 } qw(get_named_propids get_named_propnames
+	unload_store);
 
 if ($gen_mode eq "CLN" || $gen_mode eq "SDP") {
 	print "#include <$_>\n" for qw(cstring utility gromox/exmdb_client.hpp gromox/exmdb_rpc.hpp);
@@ -48,13 +56,38 @@ while (<STDIN>) {
 		print "\t\treturn exmdb_client_remote::$func(".join(", ", @anames).");\n";
 		print "\tauto tstart = gromox::tp_now();\n";
 		print "\texmdb_server::build_env(EM_LOCAL | (xb_private ? EM_PRIVATE : 0), dir);\n";
+		print "\texmdb_server::set_readonly(exmdb_rpc_readonly(exmdb_callid::$func));\n";
 		print "\tauto xbresult = exmdb_server::$func(".join(", ", @anames).");\n";
-		print "\tsmlpc_log(xbresult, dir, \"$func\", tstart, gromox::tp_now());\n";
+		print "\tauto tend = gromox::tp_now();\n";
+		print "\tsmlpc_log(xbresult, dir, \"$func\", tstart, tend);\n";
+		print "\texmdb_rpc_account(exmdb_callid::$func, dir, xbresult, tend - tstart, 0);\n";
 		print "\texmdb_server::free_env();\n";
 		print "\treturn xbresult;\n";
 		print "}\n\n";
 		next;
 	}
+	if ($gen_mode eq "SUM") {
+		my @lines;
+		for (@$iargs) {
+			my($type, $field) = @$_;
+			$type =~ s{^\s+|\s+$}{}g;
+			if ($type eq "uint64_t") {
+				push(@lines, "\ts += fmt::format(\" $field={:#x}\", q.$field);\n");
+			} elsif (exists($sum_scalar{$type})) {
+				push(@lines, "\ts += fmt::format(\" $field={}\", q.$field);\n");
+			} elsif ($type eq "const char *") {
+				push(@lines, "\tif (q.$field != nullptr)\n\t\ts += fmt::format(\" $field=\\\"{}\\\"\", q.$field);\n");
+			} elsif ($type =~ m{^const\s+(\w+)\s*\*$} && exists($sum_counted{$1})) {
+				push(@lines, "\tif (q.$field != nullptr)\n\t\ts += fmt::format(\" $field\[{}\]\", q.$field->count);\n");
+			}
+		}
+		next if scalar(@lines) == 0;
+		print "case exmdb_callid::$func: {\n";
+		print "\tauto &q = *static_cast<const exreq_$func *>(q0);\n";
+		print @lines;
+		print "\tbreak;\n}\n";
+		next;
+	}
 	if ($gen_mode eq "SDF") {
 		print "case exmdb_callid::$func: {\n";
 		if (scalar(@$iargs) > 0) {
@@ -86,7 +119,13 @@ while (<STDIN>) {
 			print "\tq.$field = $field;\n";
 		}
 	}
-	print "\tif (!exmdb_client_do_rpc(&q, &r))\n\t\treturn false;\n";
+	if (exists($cl_cached{$func})) {
+		print "\tif (!exmdb_client_cache_lookup(q, r)) {\n";
+		print "\t\tif (!exmdb_client_do_rpc(&q, &r))\n\t\t\treturn false;\n";
+		print "\t\texmdb_client_cache_update(q, r);\n\t}\n";
+	} else {
+		print "\tif (!exmdb_client_do_rpc(&q, &r))\n\t\treturn false;\n";
+	}
 	for (@$oargs) {
 		my($type, $field) = @$_;
 		print "\t", (substr($type, -1, 1) eq "&" ? "" : "*"),
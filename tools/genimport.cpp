@@ -423,6 +423,99 @@ int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *ctnt)
 	return 0;
 }
 
+/*
+ * Messages waiting for exm_flush_msgs. All of them go to the same folder with
+ * the same write_messages flags.
+ */
+static std::vector<message_content_ptr> g_msg_queue;
+static uint64_t g_msg_queue_fld;
+static unsigned int g_msg_queue_flags;
+static size_t g_msg_queue_bytes;
+
+int exm_flush_msgs()
+{
+	if (g_msg_queue.empty())
+		return 0;
+	std::vector<const MESSAGE_CONTENT *> msgs;
+	msgs.reserve(g_msg_queue.size());
+	for (const auto &m : g_msg_queue)
+		msgs.push_back(m.get());
+	std::vector<uint64_t> mids;
+	ec_error_t e_result = ecRpcFailed;
+	auto ok = exmdb_client::write_messages(g_storedir, CP_UTF8,
+	          g_msg_queue_fld, g_msg_queue_flags, msgs, &mids, &e_result);
+	auto count = g_msg_queue.size();
+	g_msg_queue.clear();
+	g_msg_queue_bytes = 0;
+	if (!ok) {
+		fprintf(stderr, "exm: write_messages RPC failed (%zu messages)\n", count);
+		return -EIO;
+	}
+	int ret = 0;
+	for (size_t i = 0; i < mids.size(); ++i) {
+		if (mids[i] == 0) {
+			fprintf(stderr, "exm: write_messages: message %zu/%zu was rejected\n",
+			        i + 1, count);
+			ret = -EIO;
+		} else if (g_verbose_create) {
+			fprintf(stderr, "Created new message 0x%llx:0x%llx\n",
+				LLU{rop_util_get_gc_value(g_msg_queue_fld)},
+				LLU{rop_util_get_gc_value(mids[i])});
+		}
+	}
+	if (e_result != ecSuccess) {
+		fprintf(stderr, "exm: write_messages: %s (%zu of %zu messages not written)\n",
+		        mapi_strerror(e_result), count - mids.size(), count);
+		return -EIO;
+	}
+	return ret;
+}
+
+/**
+ * Queue a copy of @ctnt for being written to @parent_fld with one
+ * write_messages RPC per @batch messages (or about 64 MB, whichever comes
+ * first). The server assigns MID, CN and change keys. @size is the caller's
+ * estimate of the message size.
+ */
+int exm_queue_msg(uint64_t parent_fld, const MESSAGE_CONTENT &ctnt,
+    size_t size, unsigned int batch, unsigned int flags)
+{
+	static constexpr size_t max_bytes = 64ULL << 20;
+	if (!g_msg_queue.empty() && (parent_fld != g_msg_queue_fld ||
+	    flags != g_msg_queue_flags)) {
+		auto ret = exm_flush_msgs();
+		if (ret != 0)
+			return ret;
+	}
+	message_content_ptr m(ctnt.dup());
+	if (m == nullptr) {
+		fprintf(stderr, "exm: message_content_dup: ENOMEM\n");
+		return -ENOMEM;
+	}
+	auto props = &m->proplist;
+	props->erase(PidTagMid);
+	props->erase(PidTagChangeNumber);
+	props->erase(PR_CHANGE_KEY);
+	props->erase(PR_PREDECESSOR_CHANGE_LIST);
+	auto now = rop_util_current_nttime();
+	int ret = 0;
+	if (flags & EXMDB_WRITE_DELIVERY)
+		ret = props->set(PR_MESSAGE_DELIVERY_TIME, &now);
+	else if (!props->has(PR_LAST_MODIFICATION_TIME))
+		ret = props->set(PR_LAST_MODIFICATION_TIME, &now);
+	if (ret != 0) {
+		fprintf(stderr, "exm: tpropval: %s\n", strerror(-ret));
+		return ret;
+	}
+	g_msg_queue.push_back(std::move(m));
+	g_msg_queue_fld   = parent_fld;
+	g_msg_queue_flags = flags;
+	g_msg_queue_bytes += size;
+	if (g_msg_queue.size() >= batch || g_msg_queue_bytes >= max_bytes)
+		return exm_flush_msgs();
+	return 0;
+}
+
 static std::string sql_escape(MYSQL *sqh, const char *in)
 {
 	std::string out;
@@ -105,6 +105,8 @@ extern int exm_create_folder(uint64_t parent_fld, TPROPVAL_ARRAY *props, bool o_
 extern int exm_permissions(eid_t, const std::vector<PERMISSION_DATA> &);
 extern int exm_deliver_msg(const char *target, MESSAGE_CONTENT *, unsigned int flags = 0);
 extern int exm_create_msg(uint64_t parent_fld, MESSAGE_CONTENT *);
+extern int exm_queue_msg(uint64_t parent_fld, const MESSAGE_CONTENT &, size_t size, unsigned int batch, unsigned int flags = 0);
+extern int exm_flush_msgs();
 extern int gi_setup_from_user(const char *);
 extern int gi_setup_from_dir(const char *);
 extern int gi_startup_client(unsigned int maxconn = 1);
@@ -387,6 +387,35 @@ static int main(int argc, char **argv)
 
 }
 
+namespace purgedatafiles {
+
+static unsigned int g_full;
+static constexpr HXoption g_options_table[] = {
+	{"full", 0, HXTYPE_NONE, &g_full, nullptr, nullptr, 0, "Verify reference counts and scan all data directories"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_PARAM;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	uint64_t files = 0, bytes = 0;
+	if (!exmdb_client::purge_datafiles_v2(g_storedir,
+	    g_full ? EXMDB_PURGE_FULL : 0, &files, &bytes)) {
+		fprintf(stderr, "purge-datafiles: the operation failed\n");
+		return EXIT_FAILURE;
+	}
+	char buf[32];
+	HX_unit_size(buf, std::size(buf), bytes, 0, 0);
+	printf("Purged %llu files (%sB)\n", LLU{files}, buf);
+	return EXIT_SUCCESS;
+}
+
+}
+
 namespace set_locale {
 
 static const char *g_language;
@@ -546,12 +575,14 @@ static int main2(int, char **);
 
 static void command_overview()
 {
-	fprintf(stderr, "Commands:\n\tclear-photo clear-profile clear-rwz delmsg "
+	fprintf(stderr, "Commands:\n\tcache-stats clear-photo clear-profile clear-rwz delmsg "
 		"echo-username "
 		"emptyfld get-freebusy get-photo get-websettings "
 		"get-websettings-persistent "
 		"get-websettings-recipients ping "
-		"purge-datafiles purge-softdelete recalc-sizes set-locale "
+		"purge-datafiles purge-softdelete rebuild-fts recalc-sizes "
+		"rpc-stats "
+		"set-locale "
 		"set-photo set-websettings set-websettings-persistent "
 		"set-websettings-recipients unload vacuum\n");
 }
@@ -570,6 +601,121 @@ static int help()
 
 } /* namespace global */
 
+namespace rpc_stats {
+
+static unsigned int g_reset, g_prometheus, g_top_n = 10;
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'n', HXTYPE_UINT, &g_top_n, {}, {}, 0, "Number of stores to list (default: 10)", "N"},
+	{nullptr, 'r', HXTYPE_NONE, &g_reset, {}, {}, 0, "Reset the counters after reading"},
+	{"prometheus", 0, HXTYPE_NONE, &g_prometheus, {}, {}, 0, "Output in Prometheus text format"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+/* Upper bound (µs) of the histogram bucket holding quantile @q */
+static uint64_t hist_quantile(const exmdb_rpc_stat &e, double q)
+{
+	uint64_t want = e.calls * q, sum = 0;
+	for (size_t i = 0; i < e.hist.size(); ++i) {
+		sum += e.hist[i];
+		if (sum > want)
+			return i + 1 < e.hist.size() ? UINT64_C(1) << i : e.max_us;
+	}
+	return e.max_us;
+}
+
+static void print_prometheus(const std::vector<exmdb_rpc_stat> &calls,
+    const std::vector<exmdb_rpc_dirstat> &dirs,
+    const std::vector<exmdb_counter> &figures)
+{
+	static constexpr const char *counters[][2] = {
+		{"calls", "Number of RPCs"},
+		{"errors", "Number of failed RPCs"},
+		{"request_bytes", "Size of serialized requests"},
+		{"response_bytes", "Size of serialized responses"},
+	};
+	for (size_t k = 0; k < std::size(counters); ++k) {
+		printf("# HELP gromox_exmdb_rpc_%s_total %s\n", counters[k][0], counters[k][1]);
+		printf("# TYPE gromox_exmdb_rpc_%s_total counter\n", counters[k][0]);
+		for (const auto &e : calls) {
+			auto v = k == 0 ? e.calls : k == 1 ? e.errors :
+			         k == 2 ? e.bytes_in : e.bytes_out;
+			printf("gromox_exmdb_rpc_%s_total{call=\"%s\"} %llu\n",
+				counters[k][0], e.name.c_str(), LLU{v});
+		}
+	}
+	printf("# HELP gromox_exmdb_rpc_duration_seconds RPC execution time\n");
+	printf("# TYPE gromox_exmdb_rpc_duration_seconds histogram\n");
+	for (const auto &e : calls) {
+		uint64_t cum = 0;
+		for (size_t i = 0; i + 1 < e.hist.size(); ++i) {
+			cum += e.hist[i];
+			printf("gromox_exmdb_rpc_duration_seconds_bucket{call=\"%s\",le=\"%g\"} %llu\n",
+				e.name.c_str(), static_cast<double>(UINT64_C(1) << i) / 1e6, LLU{cum});
+		}
+		printf("gromox_exmdb_rpc_duration_seconds_bucket{call=\"%s\",le=\"+Inf\"} %llu\n",
+			e.name.c_str(), LLU{e.calls});
+		printf("gromox_exmdb_rpc_duration_seconds_sum{call=\"%s\"} %.6f\n",
+			e.name.c_str(), e.total_us / 1e6);
+		printf("gromox_exmdb_rpc_duration_seconds_count{call=\"%s\"} %llu\n",
+			e.name.c_str(), LLU{e.calls});
+	}
+	printf("# HELP gromox_exmdb_store_rpc_seconds_total RPC execution time per store (top N)\n");
+	printf("# TYPE gromox_exmdb_store_rpc_seconds_total counter\n");
+	for (const auto &d : dirs)
+		printf("gromox_exmdb_store_rpc_seconds_total{dir=\"%s\"} %.6f\n",
+			d.dir.c_str(), d.total_us / 1e6);
+	for (const auto &c : figures) {
+		auto sfx = c.gauge ? "" : "_total";
+		printf("# TYPE gromox_exmdb_%s%s %s\n", c.name.c_str(), sfx,
+			c.gauge ? "gauge" : "counter");
+		printf("gromox_exmdb_%s%s %llu\n", c.name.c_str(), sfx, LLU{c.value});
+	}
+}
+
+static int main(int argc, char **argv)
+{
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_PARAM;
+	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
+	std::vector<exmdb_rpc_stat> calls;
+	std::vector<exmdb_rpc_dirstat> dirs;
+	std::vector<exmdb_counter> counters;
+	if (!exmdb_client::get_rpc_stats(g_storedir,
+	    g_reset ? EXMDB_RPCSTAT_RESET : 0, g_top_n, &calls, &dirs, &counters)) {
+		fprintf(stderr, "rpc-stats: the operation failed\n");
+		return EXIT_FAILURE;
+	}
+	std::sort(calls.begin(), calls.end(),
+		[](const exmdb_rpc_stat &a, const exmdb_rpc_stat &b) { return a.total_us > b.total_us; });
+	if (g_prometheus) {
+		print_prometheus(calls, dirs, counters);
+		return EXIT_SUCCESS;
+	}
+	printf("%10s %6s %9s %9s %9s %9s %9s %9s  %s\n", "CALLS", "ERR",
+		"AVG(µs)", "P50(µs)", "P99(µs)", "MAX(µs)", "IN(KB)", "OUT(KB)", "RPC");
+	for (const auto &e : calls)
+		printf("%10llu %6llu %9llu %9llu %9llu %9llu %9llu %9llu  %s\n",
+			LLU{e.calls}, LLU{e.errors}, LLU{e.total_us / e.calls},
+			LLU{hist_quantile(e, 0.50)}, LLU{hist_quantile(e, 0.99)},
+			LLU{e.max_us}, LLU{e.bytes_in >> 10}, LLU{e.bytes_out >> 10},
+			e.name.c_str());
+	if (!dirs.empty()) {
+		printf("\n%10s %12s  %s\n", "CALLS", "TIME(ms)", "DIR");
+		for (const auto &d : dirs)
+			printf("%10llu %12llu  %s\n", LLU{d.calls},
+				LLU{d.total_us / 1000}, d.dir.c_str());
+	}
+	if (!counters.empty())
+		printf("\n");
+	for (const auto &c : counters)
+		printf("%20llu  %s\n", LLU{c.value}, c.name.c_str());
+	return EXIT_SUCCESS;
+}
+
+}
+
 namespace simple_rpc {
 
 static constexpr HXoption g_options_table[] = {
@@ -582,6 +728,28 @@ static inline uint64_t inul(const uint64_t *v)
 	return v != nullptr ? *v : 0;
 }
 
+static bool cache_stats(const char *dir)
+{
+	uint64_t budget = 0, total = 0;
+	std::vector<exmdb_cache_entry> entries;
+	if (!exmdb_client::get_cache_stats(dir, &budget, &total, &entries))
+		return false;
+	std::sort(entries.begin(), entries.end(),
+		[](const exmdb_cache_entry &a, const exmdb_cache_entry &b) { return a.mem_bytes > b.mem_bytes; });
+	if (budget == 0)
+		printf("%zu stores, %llu KB (no budget)\n", entries.size(), LLU{total >> 10});
+	else
+		printf("%zu stores, %llu KB of %llu KB budget\n", entries.size(),
+			LLU{total >> 10}, LLU{budget >> 10});
+	printf("%10s %8s %4s %4s %6s %5s %4s  %s\n", "KB", "IDLE(s)",
+		"REFS", "HDLS", "TABLES", "INST", "DYN", "DIR");
+	for (const auto &e : entries)
+		printf("%10llu %8u %4u %4u %6u %5u %4u  %s\n",
+			LLU{e.mem_bytes >> 10}, e.idle_secs, e.references,
+			e.handles, e.tables, e.instances, e.dynamics, e.dir.c_str());
+	return true;
+}
+
 static bool recalc_sizes(const char *dir)
 {
 	static constexpr uint32_t tags[] = {
@@ -618,8 +786,8 @@ static int main(int argc, char **argv)
 	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
 		return EXIT_PARAM;
 	auto cl_0 = make_scope_exit([=]() { HX_zvecfree(argv); });
-	if (strcmp(argv[0], "purge-datafiles") == 0)
-		ok = exmdb_client::purge_datafiles(g_storedir);
+	if (strcmp(argv[0], "cache-stats") == 0)
+		ok = cache_stats(g_storedir);
 	else if (strcmp(argv[0], "echo-username") == 0) {
 		printf("%s\n", g_dstuser.c_str());
 		ok = true;
@@ -631,6 +799,12 @@ static int main(int argc, char **argv)
 		ok = exmdb_client::vacuum(g_storedir);
 	else if (strcmp(argv[0], "recalc-sizes") == 0)
 		ok = recalc_sizes(g_storedir);
+	else if (strcmp(argv[0], "rebuild-fts") == 0) {
+		uint32_t count = 0;
+		ok = exmdb_client::rebuild_fulltext(g_storedir, &count);
+		if (ok)
+			printf("%u messages indexed\n", count);
+	}
 	else {
 		fprintf(stderr, "Unrecognized subcommand \"%s\"\n", argv[0]);
 		return EXIT_PARAM;
@@ -1009,10 +1183,14 @@ static int main2(int argc, char **argv)
 		ret = showstoreprop(argc, argv, PSETID_Gromox, "websettings_recipienthistory", PT_UNICODE);
 	} else if (strcmp(argv[0], "set-websettings-recipients") == 0) {
 		ret = setstoreprop(argc, argv, PSETID_Gromox, "websettings_recipienthistory", PT_UNICODE);
+	} else if (strcmp(argv[0], "purge-datafiles") == 0) {
+		ret = purgedatafiles::main(argc, argv);
 	} else if (strcmp(argv[0], "purge-softdelete") == 0) {
 		ret = purgesoftdel::main(argc, argv);
 	} else if (strcmp(argv[0], "set-locale") == 0) {
 		ret = set_locale::main(argc, argv);
+	} else if (strcmp(argv[0], "rpc-stats") == 0) {
+		ret = rpc_stats::main(argc, argv);
 	} else if (strcmp(argv[0], "get-freebusy") == 0 || strcmp(argv[0], "gfb") == 0) {
 		ret = getfreebusy::main(argc, argv);
 	} else if (strcmp(argv[0], "echo-username") == 0) {
@@ -1,19 +1,30 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2021–2024 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 #include <libHX/io.h>
 #include <libHX/option.h>
+#include <gromox/clock.hpp>
 #include <gromox/endian.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/ext_buffer.hpp>
 #include <gromox/paths.h>
+#include <gromox/process.hpp>
 #include <gromox/scope.hpp>
 #include <gromox/svc_loader.hpp>
 #include <gromox/textmaps.hpp>
@@ -33,6 +44,45 @@ struct ob_desc {
 	parent_desc parent;
 };
 
+/*
+ * One packet of the input stream. Messages are decoded and have their
+ * propids adjusted by a worker (@msg); all other packets are handled from
+ * @buf by the commit stage.
+ */
+struct mt_item {
+	std::unique_ptr<char[]> buf;
+	size_t size = 0;
+	bool ready = false;
+	ob_desc obd;
+	message_content_ptr msg;
+	std::exception_ptr err;
+};
+
+/*
+ * -j: one thread reads the stream, N workers transform messages, and the
+ * caller of next() gets the packets back in stream order.
+ */
+class mt_pipeline {
+	public:
+	mt_pipeline(unsigned int nworkers);
+	~mt_pipeline();
+	NOMOVE(mt_pipeline);
+	std::unique_ptr<mt_item> next();
+
+	private:
+	void reader();
+	void worker();
+
+	std::mutex m_lock;
+	std::condition_variable m_space_cv, m_work_cv, m_ready_cv;
+	std::deque<std::unique_ptr<mt_item>> m_order;
+	std::deque<mt_item *> m_work;
+	size_t m_max_inflight;
+	bool m_eof = false, m_stop = false;
+	std::exception_ptr m_read_err;
+	std::vector<std::thread> m_threads;
+};
+
 }
 
 using propididmap_t = std::unordered_map<uint16_t, uint16_t>;
@@ -43,9 +93,13 @@ static gi_name_map g_src_name_map;
 static propididmap_t g_thru_name_map;
 static uint8_t g_splice;
 static uint64_t g_anchor_folder; /* GCV */
-static unsigned int g_oexcl = 1, g_repeat_iter = 1;
+static unsigned int g_oexcl = 1, g_repeat_iter = 1, g_batch_size = 100;
+static unsigned int g_numthreads = 1;
 static unsigned int g_do_delivery, g_skip_notif, g_skip_rules, g_twostep;
 static unsigned int g_continuous_mode, g_mrautoproc;
+/* protects g_src_name_map and g_thru_name_map */
+static std::shared_mutex g_name_lock;
+static uint64_t g_stat_msgs; /* messages handed to the server */
 
 static constexpr static_module g_dfl_svc_plugins[] = {
 	{"libgxs_mysql_adaptor.so", SVC_mysql_adaptor},
@@ -61,11 +115,13 @@ static constexpr HXoption g_options_table[] = {
 	{nullptr, 'B', HXTYPE_STRING, &g_anchor_folder_str, nullptr, nullptr, 0, "Placement position for unanchored messages", "NAME"},
 	{nullptr, 'D', HXTYPE_NONE, &g_do_delivery, nullptr, nullptr, 0, "Use delivery mode"},
 	{nullptr, 'c', HXTYPE_NONE, &g_continuous_mode, {}, {}, 0, "Continuous operation mode (do not stop on errors)"},
+	{nullptr, 'j', HXTYPE_UINT, &g_numthreads, {}, {}, 0, "Number of threads for decoding messages (0: autosize)", "INTEGER"},
 	{nullptr, 'p', HXTYPE_NONE | HXOPT_INC, &g_show_props, nullptr, nullptr, 0, "Show properties in detail (if -t)"},
 	{nullptr, 't', HXTYPE_NONE, &g_show_tree, nullptr, nullptr, 0, "Show tree-based analysis of the archive"},
 	{nullptr, 'u', HXTYPE_STRING, &g_username, nullptr, nullptr, 0, "Username of store to import to", "EMAILADDR"},
 	{nullptr, 'v', HXTYPE_NONE | HXOPT_INC, &g_verbose_create, nullptr, nullptr, 0, "Be more verbose"},
 	{nullptr, 'x', HXTYPE_VAL, &g_oexcl, nullptr, nullptr, 0, "Disable O_EXCL like behavior for non-spliced folders"},
+	{"batch", 0, HXTYPE_UINT, &g_batch_size, {}, {}, 0, "Write up to N messages per RPC (0: one at a time, old protocol)", "N"},
 	{"repeat", 0, HXTYPE_UINT, &g_repeat_iter, {}, {}, 0, "For testing purposes, import each message N times", "N"},
 	{"skip-notif", 0, HXTYPE_NONE, &g_skip_notif, nullptr, nullptr, 0, "Skip emission of notifications (if -D)"},
 	{"skip-rules", 0, HXTYPE_NONE, &g_skip_rules, nullptr, nullptr, 0, "Skip execution of rules (if -D)"},
@@ -169,6 +225,7 @@ static void exm_adjust_namedprops(TPROPVAL_ARRAY &props)
 		auto old_tag = props.ppropval[i].proptag;
 		if (!is_nameprop_id(PROP_ID(old_tag)))
 			continue;
+		std::shared_lock rd_hold(g_name_lock);
 		auto thru_iter = g_thru_name_map.find(PROP_ID(old_tag));
 		if (thru_iter != g_thru_name_map.end()) {
 			props.ppropval[i].proptag = PROP_TAG(PROP_TYPE(old_tag), thru_iter->second);
@@ -181,8 +238,11 @@ static void exm_adjust_namedprops(TPROPVAL_ARRAY &props)
 			fprintf(stderr, "mt2exm: proptag %xh from input stream has no named property info.\n", old_tag);
 			continue;
 		}
-		auto new_id = gi_resolve_namedprop(name_iter->second);
+		PROPERTY_XNAME name = name_iter->second;
+		rd_hold.unlock();
+		auto new_id = gi_resolve_namedprop(name);
 		props.ppropval[i].proptag = PROP_TAG(PROP_TYPE(old_tag), new_id);
+		std::unique_lock wr_hold(g_name_lock);
 		g_thru_name_map.emplace(PROP_ID(old_tag), new_id);
 	}
 }
@@ -299,33 +359,42 @@ static int exm_folder(const ob_desc &obd, TPROPVAL_ARRAY &props,
 	return 0;
 }
 
-static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
+/* Second half of exm_message, for a message with adjusted propids */
+static int exm_message_write(const ob_desc &obd, MESSAGE_CONTENT &ctnt, size_t size)
 {
-	if (g_show_tree)
-		printf("exm: Message %lxh (parent=%llxh)\n",
-			static_cast<unsigned long>(obd.nid),
-			static_cast<unsigned long long>(obd.parent.folder_id));
-	if (g_show_tree && g_show_props)
-		gi_print(0, ctnt, ee_get_propname);
 	auto folder_it = g_folder_map.find(obd.parent.folder_id);
 	if (!g_do_delivery && folder_it == g_folder_map.end()) {
 		fprintf(stderr, "PF-1123: unknown parent folder %llxh\n",
 		        static_cast<unsigned long long>(obd.parent.folder_id));
 		return 0;
 	}
-	exm_adjust_propids(ctnt);
-	if (g_show_tree && g_show_props) {
-		tree(0);
-		tlog("adjusted properties:\n");
-		gi_print(0, ctnt, ee_get_propname);
-	}
 	if (!g_do_delivery) {
 		for (auto i = 0U; i < g_repeat_iter; ++i) {
 			if (i > 0 && i % 1024 == 0)
 				fprintf(stderr, "mt2exm repeat %u/%u\n", i, g_repeat_iter);
-			auto ret = exm_create_msg(folder_it->second.fid_to, &ctnt);
+			auto ret = g_batch_size > 0 ?
+			           exm_queue_msg(folder_it->second.fid_to, ctnt, size, g_batch_size) :
+			           exm_create_msg(folder_it->second.fid_to, &ctnt);
 			if (ret != EXIT_SUCCESS)
 				return ret;
+			++g_stat_msgs;
+		}
+		return EXIT_SUCCESS;
+	}
+	/*
+	 * write_messages neither runs rules nor notifies, so it can only stand
+	 * in for deliver_message when neither is wanted.
+	 */
+	if (g_batch_size > 0 && g_skip_rules && g_skip_notif && !g_twostep &&
+	    !g_mrautoproc && !g_public_folder) {
+		for (auto i = 0U; i < g_repeat_iter; ++i) {
+			if (i > 0 && i % 1024 == 0)
+				fprintf(stderr, "mt2exm repeat %u/%u\n", i, g_repeat_iter);
+			auto ret = exm_queue_msg(rop_util_make_eid_ex(1, PRIVATE_FID_INBOX),
+			           ctnt, size, g_batch_size, EXMDB_WRITE_DELIVERY);
+			if (ret != EXIT_SUCCESS)
+				return ret;
+			++g_stat_msgs;
 		}
 		return EXIT_SUCCESS;
 	}
@@ -344,15 +413,33 @@ static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt)
 		auto ret = exm_deliver_msg(g_username, &ctnt, mode);
 		if (ret != EXIT_SUCCESS)
 			return ret;
+		++g_stat_msgs;
 	}
 	return EXIT_SUCCESS;
 }
 
-static int exm_packet(const void *buf, size_t bufsize)
+static int exm_message(const ob_desc &obd, MESSAGE_CONTENT &ctnt, size_t size)
+{
+	if (g_show_tree)
+		printf("exm: Message %lxh (parent=%llxh)\n",
+			static_cast<unsigned long>(obd.nid),
+			static_cast<unsigned long long>(obd.parent.folder_id));
+	if (g_show_tree && g_show_props)
+		gi_print(0, ctnt, ee_get_propname);
+	exm_adjust_propids(ctnt);
+	if (g_show_tree && g_show_props) {
+		tree(0);
+		tlog("adjusted properties:\n");
+		gi_print(0, ctnt, ee_get_propname);
+	}
+	return exm_message_write(obd, ctnt, size);
+}
+
+/* Decodes the packet header and returns the type; the payload is left in @ep. */
+static uint32_t exm_packet_header(EXT_PULL &ep, const void *buf,
+    size_t bufsize, ob_desc &obd)
 {
-	EXT_PULL ep;
 	ep.init(buf, bufsize, zalloc, EXT_FLAG_WCOUNT);
-	ob_desc obd;
 	uint32_t type = 0, parent_type = 0;
 	if (ep.g_uint32(&type) != EXT_ERR_SUCCESS ||
 	    ep.g_uint32(&obd.nid) != EXT_ERR_SUCCESS)
@@ -360,21 +447,36 @@ static int exm_packet(const void *buf, size_t bufsize)
 	if (ep.g_uint32(&parent_type) != pack_result::success ||
 	    ep.g_uint64(&obd.parent.folder_id) != EXT_ERR_SUCCESS)
 		throw YError("PG-1116");
-	if (type == GXMT_NAMEDPROP) {
-		PROPERTY_NAME propname{};
-		if (ep.g_propname(&propname) != pack_result::success)
-			throw YError("PG-1138");
-		try {
-			g_src_name_map.insert_or_assign(obd.nid, propname);
-		} catch (const std::bad_alloc &) {
-			free(propname.pname);
-			throw;
-		}
+	if (type == GXMT_NAMEDPROP)
+		return type;
+	obd.mapitype = static_cast<enum mapi_object_type>(type);
+	obd.parent.type = static_cast<enum mapi_object_type>(parent_type);
+	return type;
+}
+
+static void exm_namedprop(EXT_PULL &ep, const ob_desc &obd)
+{
+	PROPERTY_NAME propname{};
+	if (ep.g_propname(&propname) != pack_result::success)
+		throw YError("PG-1138");
+	try {
+		std::unique_lock hold(g_name_lock);
+		g_src_name_map.insert_or_assign(obd.nid, propname);
+	} catch (const std::bad_alloc &) {
 		free(propname.pname);
+		throw;
+	}
+	free(propname.pname);
+}
+
+static int exm_packet(const void *buf, size_t bufsize)
+{
+	EXT_PULL ep;
+	ob_desc obd;
+	if (exm_packet_header(ep, buf, bufsize, obd) == GXMT_NAMEDPROP) {
+		exm_namedprop(ep, obd);
 		return 0;
 	}
-	obd.mapitype = static_cast<enum mapi_object_type>(type);
-	obd.parent.type = static_cast<enum mapi_object_type>(parent_type);
 	if (obd.mapitype == MAPI_FOLDER && g_do_delivery) {
 		return 0;
 	} else if (obd.mapitype == MAPI_FOLDER) {
@@ -404,11 +506,150 @@ static int exm_packet(const void *buf, size_t bufsize)
 		auto cl_0 = make_scope_exit([&]() { message_content_free_internal(&ctnt); });
 		if (ep.g_msgctnt(&ctnt) != EXT_ERR_SUCCESS)
 			throw YError("PG-1119");
-		return exm_message(obd, ctnt);
+		return exm_message(obd, ctnt, bufsize);
 	}
 	throw YError("PG-1117: unknown obd.mapitype %u", static_cast<unsigned int>(obd.mapitype));
 }
 
+/**
+ * Reads the next packet from stdin. Returns nullptr at the end of the
+ * stream.
+ */
+static std::unique_ptr<char[]> exm_read_packet(size_t &size)
+{
+	uint64_t xsize = 0;
+	errno = 0;
+	auto ret = HXio_fullread(STDIN_FILENO, &xsize, sizeof(xsize));
+	if (ret == 0)
+		return nullptr;
+	else if (ret < 0 || static_cast<size_t>(ret) != sizeof(xsize))
+		throw YError("PG-1005: %s", strerror_eof(errno));
+	xsize = le64_to_cpu(xsize);
+	auto buf = std::make_unique<char[]>(xsize);
+	errno = 0;
+	ret = HXio_fullread(STDIN_FILENO, buf.get(), xsize);
+	if (ret < 0 || static_cast<size_t>(ret) != xsize)
+		throw YError("PG-1006: %s", strerror_eof(errno));
+	size = xsize;
+	return buf;
+}
+
+mt_pipeline::mt_pipeline(unsigned int nworkers) :
+	m_max_inflight(4 * nworkers)
+{
+	m_threads.emplace_back(&mt_pipeline::reader, this);
+	for (unsigned int i = 0; i < nworkers; ++i)
+		m_threads.emplace_back(&mt_pipeline::worker, this);
+}
+
+mt_pipeline::~mt_pipeline()
+{
+	{
+		std::lock_guard hold(m_lock);
+		m_stop = true;
+	}
+	m_space_cv.notify_all();
+	m_work_cv.notify_all();
+	/* The reader finishes the packet it is reading, if any. */
+	for (auto &t : m_threads)
+		t.join();
+}
+
+void mt_pipeline::reader()
+{
+	try {
+		while (true) {
+			auto item = std::make_unique<mt_item>();
+			item->buf = exm_read_packet(item->size);
+			if (item->buf == nullptr)
+				break;
+			EXT_PULL ep;
+			auto type = exm_packet_header(ep, item->buf.get(),
+			            item->size, item->obd);
+			if (type == GXMT_NAMEDPROP) {
+				/*
+				 * Applied right away, so that the messages
+				 * behind it see the name when being adjusted.
+				 */
+				exm_namedprop(ep, item->obd);
+				continue;
+			}
+			std::unique_lock hold(m_lock);
+			m_space_cv.wait(hold, [&]() { return m_stop || m_order.size() < m_max_inflight; });
+			if (m_stop)
+				return;
+			if (type == GXMT_MESSAGE) {
+				m_work.push_back(item.get());
+				m_work_cv.notify_one();
+			} else {
+				item->ready = true;
+			}
+			m_order.push_back(std::move(item));
+			m_ready_cv.notify_one();
+		}
+	} catch (...) {
+		std::lock_guard hold(m_lock);
+		m_read_err = std::current_exception();
+	}
+	std::lock_guard hold(m_lock);
+	m_eof = true;
+	m_work_cv.notify_all();
+	m_ready_cv.notify_all();
+}
+
+void mt_pipeline::worker()
+{
+	std::unique_lock hold(m_lock);
+	while (true) {
+		m_work_cv.wait(hold, [&]() { return m_stop || m_eof || !m_work.empty(); });
+		if (m_work.empty())
+			return;
+		auto item = m_work.front();
+		m_work.pop_front();
+		hold.unlock();
+		try {
+			EXT_PULL ep;
+			exm_packet_header(ep, item->buf.get(), item->size, item->obd);
+			item->msg.reset(message_content_init());
+			if (item->msg == nullptr)
+				throw std::bad_alloc();
+			if (ep.g_msgctnt(item->msg.get()) != EXT_ERR_SUCCESS)
+				throw YError("PG-1119");
+			exm_adjust_propids(*item->msg);
+			item->buf.reset();
+		} catch (...) {
+			item->err = std::current_exception();
+		}
+		hold.lock();
+		item->ready = true;
+		m_ready_cv.notify_all();
+	}
+}
+
+/**
+ * Returns the next packet in stream order once it has been transformed, or
+ * nullptr at the end of the stream.
+ */
+std::unique_ptr<mt_item> mt_pipeline::next()
+{
+	std::unique_lock hold(m_lock);
+	m_ready_cv.wait(hold, [&]() {
+		return (!m_order.empty() && m_order.front()->ready) ||
+		       (m_order.empty() && m_eof);
+	});
+	if (m_order.empty()) {
+		if (m_read_err != nullptr)
+			std::rethrow_exception(m_read_err);
+		return nullptr;
+	}
+	auto item = std::move(m_order.front());
+	m_order.pop_front();
+	m_space_cv.notify_one();
+	if (item->err != nullptr)
+		std::rethrow_exception(item->err);
+	return item;
+}
+
 static void gi_dump_thru_map(const propididmap_t &map)
 {
 	if (!g_show_props)
@@ -452,7 +693,13 @@ int main(int argc, char **argv) try
 	textmaps_init(PKGDATADIR);
 	if (gi_setup_from_user(g_username) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
-	if (gi_startup_client() != EXIT_SUCCESS)
+	if (g_numthreads == 0)
+		g_numthreads = gx_concurrency();
+	if (g_numthreads > 1 && g_show_tree) {
+		fprintf(stderr, "mt2exm: -t implies -j 1\n");
+		g_numthreads = 1;
+	}
+	if (gi_startup_client(g_numthreads + 1) != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 	auto cl_0 = make_scope_exit(gi_shutdown);
 	if (g_anchor_folder_str == nullptr) {
@@ -467,26 +714,38 @@ int main(int argc, char **argv) try
 	if (exm_read_base_maps() == 0)
 		return EXIT_SUCCESS;
 	int iret = EXIT_SUCCESS;
-	while (true) {
-		uint64_t xsize = 0;
-		errno = 0;
-		auto ret = HXio_fullread(STDIN_FILENO, &xsize, sizeof(xsize));
-		if (ret == 0)
-			break;
-		else if (ret < 0 || static_cast<size_t>(ret) != sizeof(xsize))
-			throw YError("PG-1005: %s", strerror_eof(errno));
-		xsize = le64_to_cpu(xsize);
-		auto buf = std::make_unique<char[]>(xsize);
-		errno = 0;
-		ret = HXio_fullread(STDIN_FILENO, buf.get(), xsize);
-		if (ret < 0 || static_cast<size_t>(ret) != xsize)
-			throw YError("PG-1006: %s", strerror_eof(errno));
-		auto pkret = exm_packet(buf.get(), xsize);
-		if (pkret != EXIT_SUCCESS && !g_continuous_mode) {
-			iret = pkret;
-			break;
+	uint64_t n_bytes = 0;
+	auto t_start = tp_now();
+	if (g_numthreads <= 1) {
+		size_t xsize = 0;
+		while (auto buf = exm_read_packet(xsize)) {
+			auto pkret = exm_packet(buf.get(), xsize);
+			n_bytes += xsize;
+			if (pkret != EXIT_SUCCESS && !g_continuous_mode) {
+				iret = pkret;
+				break;
+			}
+		}
+	} else {
+		mt_pipeline pipe(g_numthreads);
+		while (auto item = pipe.next()) {
+			n_bytes += item->size;
+			auto pkret = item->msg != nullptr ?
+			             exm_message_write(item->obd, *item->msg, item->size) :
+			             exm_packet(item->buf.get(), item->size);
+			if (pkret != EXIT_SUCCESS && !g_continuous_mode) {
+				iret = pkret;
+				break;
+			}
 		}
 	}
+	auto fret = exm_flush_msgs();
+	if (iret == EXIT_SUCCESS && fret != 0)
+		iret = EXIT_FAILURE;
+	auto secs = std::max(std::chrono::duration<double>(tp_now() - t_start).count(), 1e-3);
+	fprintf(stderr, "mt2exm: %llu messages, %.1f MB in %.1f s (%.1f messages/s, %.2f MB/s)\n",
+	        static_cast<unsigned long long>(g_stat_msgs), n_bytes / 1048576.0,
+	        secs, g_stat_msgs / secs, n_bytes / 1048576.0 / secs);
 	gi_dump_thru_map(g_thru_name_map);
 	return iret;
 } catch (const std::exception &e) {